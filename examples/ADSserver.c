@@ -24,271 +24,121 @@
  along with libads.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/*
+ * A simulated device on the server library, see ads_server.c: the PLC
+ * memory (%M, 0x4020) and the process images (%I, 0xF020, %Q, 0xF030)
+ * are 64 kB each, read, written and readWritten by any number of clients.
+ * Usage: ADSserver [host:]port [workers]
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <string.h>
-
+#include <signal.h>
 #include <pthread.h>
 
-#include <sys/time.h>
-#include <sys/socket.h>
-
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <errno.h>
-#include <byteswap.h>
-#include <unistd.h>
-#include <sys/time.h>
-#include <fcntl.h>
-
-#define ThisModule "ADSserver : "
-
 #include "AdsDEF.h"
 #include "ads.h"
-#include "ads_io.h" //TODO: call this from ads.h
-#include "debugprint.h"
-#include "accepter.h"
+#include "ads_server.h"
 
-AmsNetId me;
+#define AREA_SIZE	65536
 
-AmsNetId partner;
+typedef struct {
+	const char		*name;
+	uint32_t		indexGroup;
+	pthread_rwlock_t lock;
+	unsigned char	mem[AREA_SIZE];
+} Area;
 
-/*
-    many bytes. hopefully enough to serve any read request.
-*/
-unsigned char dummyRes[] =
-	{ 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16
+static Area areas[] = {
+	{ "%M", 0x4020, PTHREAD_RWLOCK_INITIALIZER },
+	{ "%I", 0xF020, PTHREAD_RWLOCK_INITIALIZER },
+	{ "%Q", 0xF030, PTHREAD_RWLOCK_INITIALIZER },
 };
 
-void ranalyze(ADSConnection * dc)
-{
-	ADSpacket *p = (ADSpacket *) (dc->msgIn);
-	ads_debug(ADSDebug, "ADS_TCP.header.reserved: %d\n",
-		  p->adsHeader.reserved);
-	ads_debug(ADSDebug, "ADS_TCPheader.length: %d\n", p->adsHeader.length);
-	_msgAnalyzeHeader(__FILE__, __LINE__, MSG_PACKET, &(p->amsHeader));
-	ADSreadRequest *rrq;
-	ADSreadResponse *rrs;
-	ADSreadWriteRequest *rwrq;
-	ADSreadWriteResponse *rwrs;
-	ADSwriteRequest *wrq;
-	ADSwriteResponse *wrs;
-	ADSdeviceInfo *di;
-	ADSstateResponse *asr;
-	int nErr;
-	
-	memset(dc->msgOut, 0, 500);
-	ADSpacket *pr = (ADSpacket *) (dc->msgOut);
+static ADSServer *server;
 
-	switch (p->amsHeader.commandId) {
-	case cmdADSreadDevInfo:
-		di = (ADSdeviceInfo *) pr->data;
-		di->Version.version = 185;
-		di->Version.revision = 0;
-		di->Version.build = 0;
-		di->name[0] = 'P';
-		di->name[1] = 'L';
-		di->name[2] = 'C';
-		di->name[3] = ' ';
-		di->name[4] = 'C';
-		di->name[5] = 'O';
-		di->name[6] = 'U';
-		di->name[7] = 'P';
-		di->name[8] = 'L';
-		di->name[9] = 'E';
-		di->name[10] = 'R';
-		pr->amsHeader.dataLength = sizeof(ADSdeviceInfo);
-		break;
-	case cmdADSreadState:
-		asr = (ADSstateResponse *) pr->data;
-		asr->result = 0x0000;
-		asr->ADSstate = ADSSTATE_RUN;
-		asr->devState = 0xA;
-		pr->amsHeader.dataLength = sizeof(ADSstateResponse);
-		break;
-
-	case cmdADSwrite:
-		wrq = (ADSwriteRequest *) p->data;
-		ads_debug(ADSDebug, "Index Group:   %04x\n", wrq->indexGroup);
-		ads_debug(ADSDebug, "Index Offset:  %d\n", wrq->indexOffset);
-		ads_debug(ADSDebug, "Data length:  %d\n", wrq->length);
-		//_ADSDump("Data: ", wrq->data, wrq->length);
-		wrs = (ADSwriteResponse *) (pr->data);
-		wrs->result = 0;
-		pr->amsHeader.dataLength = 4;
-		break;
-	case cmdADSreadWrite:
-		rwrq = (ADSreadWriteRequest *) (p->data);
-		ads_debug(ADSDebug, "Index Group:   %04x\n", rwrq->indexGroup);
-		ads_debug(ADSDebug, "Index Offset:  %d\n", rwrq->indexOffset);
-		ads_debug(ADSDebug, "Read data length:  %d\n",
-			  rwrq->readLength);
-		ads_debug(ADSDebug, "Write data length: %d\n",
-			  rwrq->writeLength);
-		//_ADSDump("WriteData: ", rwrq->data, rwrq->writeLength);
-
-		rwrs = (ADSreadWriteResponse *) (pr->data);
-		rwrs->result = 0;
-		rwrs->length = rwrq->readLength;
-
-		pr->amsHeader.dataLength = 8 + rwrq->readLength;
-		*(int *)(rwrs->data + 0) = p->amsHeader.invokeId;
-		ads_debug(ADSDebug, "Response data length: %d\n",
-			  pr->amsHeader.dataLength);
-		//_ADSDump("Response ", rwrs->data, rwrq->writeLength);
-		break;
-
-	case cmdADSread:
-		rrq = (ADSreadRequest *) (p->data);
-		rrs = (ADSreadResponse *) (pr->data);
-		rrs->result = 0;
-		rrs->length = rrq->length;
-		pr->amsHeader.dataLength = 8 + rrq->length;
-		*(int *)(rrs->data + 0) = p->amsHeader.invokeId;
-		memcpy(rrs->data + 4, dummyRes + rrq->indexOffset, sizeof(dummyRes));
-		break;
-		
-		
-	default:
-		printf("Unhandeled command: %s\n", _ADSCommandName(p->amsHeader.commandId));
-		pr->amsHeader.dataLength = 4;
+/* reads, writes, and readWrites: first the write, then the read */
+static int memory(ADSServerRequest *rq, void *user)
+{
+	Area *a = (Area *) user;
+
+	if (rq->indexOffset > AREA_SIZE
+		|| rq->length > AREA_SIZE - rq->indexOffset
+		|| rq->outLength > AREA_SIZE - rq->indexOffset)
+		return 0x703;				// ADSERR_DEVICE_INVALIDOFFSET
+	if (rq->length > 0) {
+		pthread_rwlock_wrlock(&a->lock);
+		memcpy(a->mem + rq->indexOffset, rq->data, rq->length);
+		pthread_rwlock_unlock(&a->lock);
 	}
-	pr->adsHeader.length = pr->amsHeader.dataLength + 32;
-	ads_debug(ADSDebug, "Response data length: %d\n",
-		  pr->amsHeader.dataLength);
-	ads_debug(ADSDebug, "Response packet length: %d\n",
-		  pr->adsHeader.length);
-
-	pr->amsHeader.targetId = p->amsHeader.sourceId;
-	pr->amsHeader.targetPort = p->amsHeader.sourcePort;
-	pr->amsHeader.sourceId = p->amsHeader.targetId;
-	pr->amsHeader.sourcePort = p->amsHeader.targetPort;
-
-	pr->amsHeader.commandId = p->amsHeader.commandId;
-	pr->amsHeader.stateFlags = 0x5;
-	pr->amsHeader.errorCode = 0;
-	pr->amsHeader.invokeId = p->amsHeader.invokeId;
-
-	ADSwriteResponse *rp = (ADSwriteResponse *) pr->data;
-	rp->result = 0;
-	ads_debug(ADSDebug, "ADS_TCP.header.reserved: %d\n",
-		  pr->adsHeader.reserved);
-	ads_debug(ADSDebug, "ADS_TCPheader.length: %d total:%d\n",
-		  pr->adsHeader.length,
-		  sizeof(AMS_TCPheader) + sizeof(AMSheader) + 4);
-	_msgAnalyzeHeader(__FILE__, __LINE__, MSG_PACKET, &(pr->amsHeader));
-	_ADSWritePacket(dc->iface, pr, &nErr);
-};
+	if (rq->outLength > 0) {
+		pthread_rwlock_rdlock(&a->lock);
+		memcpy(rq->out, a->mem + rq->indexOffset, rq->outLength);
+		pthread_rwlock_unlock(&a->lock);
+	}
+	return 0;
+}
 
-void *portServer(void *arg)
+static int devInfo(ADSServerRequest *rq, void *user)
 {
-	int *fd = (int *)arg;
-	int nErr;
-	ads_debug(ADSDebug, "portMy fd is:%d\n", fd);
-	int waitCount = 0;
-	int pcount = 0;
-	ADSInterface *di = _ADSNewInterface(*fd, me, AMSPORT_R0_PLC_RTS1, "IF");
-	di->timeout = 900000;
-	ADSConnection *dc = _ADSNewConnection(di, partner, AMSPORT_R0_PLC_RTS1);
-	while (waitCount < 1000) {
-		dc->AnswLen = _ADSReadPacket(dc->iface, dc->msgIn, &nErr);
-		if (dc->AnswLen > 0) {
-			ads_debug(ADSDebug, "%d ", pcount);
-			//_ADSDump("packet", dc->msgIn, dc->AnswLen);
-			waitCount = 0;
-			ranalyze(dc);
+	AdsVersion v = { 185, 0, 0 };
 
-			pcount++;
-		} else {
-			waitCount++;
-		}
-	}
-	ads_debug(ADSDebug, "portserver: I closed my fd.\n");
-	;
-	return NULL;
+	memcpy(rq->out, &v, sizeof(v));
+	memset(rq->out + sizeof(v), 0, 16);
+	strcpy((char *) rq->out + sizeof(v), "PLC COUPLER");
+	rq->outLength = sizeof(v) + 16;
+	return 0;
 }
 
-/*
-    This waits in select for a file descriptor from accepter and starts a new child server
-    with this file descriptor.
-*/
+static void onSignal(int sig)
+{
+	ADSserverStop(server);
+}
 
 int main(int argc, char **argv)
 {
+	char address[64];
+	ADSServerStats st;
+	struct sigaction sa;
+	int i, workers;
+
 	if (argc <= 1) {
-		printf("Usage: ADSserver port\n");
-		printf("Example: ADSserver 48898\n");
+		printf("Usage: ADSserver [host:]port [workers]\n");
+		printf("Example: ADSserver 48898 4\n");
 		return -1;
 	}
-
-	ADSGetLocalAMSId(&me);
-	ADSGetLocalAMSId(&partner);
-
-	int filedes[2], res, newfd = 0;
-	char *s;
-	s = argv[1];
-	ads_debug(ADSDebug, "Main serv: %s\n", s);
-
-	int fd;
-
-	fd_set FDS;
-	pipe(filedes);
-	pthread_attr_t attr;
-	pthread_t ac, ps;
-	accepter_info ai;
-	ai.port = atol(s);
-	ads_debug(ADSDebug, "Main serv: %d\n", ai.port);
-	ads_debug(ADSDebug, "Main serv: Accepter pipe fd: %d\n", ai.fd);
-	ai.fd = filedes[1];
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	res = pthread_create(&ac, &attr, accepter, &ai /*&filedes[1] */ );
-	do {
-		FD_ZERO(&FDS);
-		FD_SET(filedes[0], &FDS);
-
-		ads_debug(ADSDebug, "Main serv: about to select on %d\n",
-			  filedes[0]);
-		;
-		if (select(filedes[0] + 1, &FDS, NULL, &FDS, NULL) > 0) {
-			ads_debug(ADSDebug, "Main serv: about to read\n");
-			res = read(filedes[0], &fd, sizeof(fd));
-			ps = 0;
-			pthread_attr_init(&attr);
-			pthread_attr_setdetachstate(&attr,
-						    PTHREAD_CREATE_DETACHED);
-			res = pthread_create(&ps, &attr, portServer, &fd);
-			if (res) {
-				ads_debug(ADSDebug,
-					  "Main serv: create error:%s\n",
-					  strerror(res));
-				close(newfd);
-				usleep(100000);
-			}
-		}
+	if (strchr(argv[1], ':') != NULL)
+		snprintf(address, sizeof(address), "%s", argv[1]);
+	else
+		snprintf(address, sizeof(address), "0.0.0.0:%s", argv[1]);
+	workers = argc > 2 ? atoi(argv[2]) : 4;
+
+	server = ADSserverNew(address, workers);
+	if (server == NULL) {
+		fprintf(stderr, "ADSserver: cannot listen on %s\n", address);
+		return 1;
 	}
-	while (1);
-	return 0;
+	ADSserverOn(server, cmdADSreadDevInfo, devInfo, NULL);
+	for (i = 0; i < sizeof(areas) / sizeof(areas[0]); i++)
+		ADSserverOnGroups(server, areas[i].indexGroup, areas[i].indexGroup,
+						  memory, &areas[i]);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	i = ADSserverRun(server);
+
+	ADSserverGetStats(server, &st);
+	printf("clients %llu, requests %llu, responses %llu, errors %llu "
+		   "(%llu unhandled), paused %llu\n",
+		   (unsigned long long) st.accepted,
+		   (unsigned long long) st.requests,
+		   (unsigned long long) st.responses,
+		   (unsigned long long) st.errors,
+		   (unsigned long long) st.unhandled,
+		   (unsigned long long) st.paused);
+	ADSserverFree(server);
+	return i == 0 ? 0 : 1;
 }
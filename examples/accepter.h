@@ -1,27 +0,0 @@
-/*
-    libads is an implementation of the Beckhoff's ADS protocol.
-
-    libads is free software: you can redistribute it and/or modify
-    it under the terms of the Lesser GNU General Public License as published by
-    the Free Software Foundation, either version 3 of the License, or
-    (at your option) any later version.
-
-    libads is distributed in the hope that it will be useful,
-    but WITHOUT ANY WARRANTY; without even the implied warranty of
-    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-    Lesser GNU General Public License for more details.
-
-    You should have received a copy of the Lesser GNU General Public License
-    along with libads.  If not, see <http://www.gnu.org/licenses/>.
-*/
-
-#ifndef __ACCEPTER_H__
-#define __ACCEPTER_H__
-
-typedef struct {
-	int fd;
-	int port;
-} accepter_info;
-void *accepter(void *arg);
-
-#endif
@@ -0,0 +1,2278 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * The router holds one TCP connection per device and multiplexes the
+ * requests of the local clients onto it. Going out, a request gets the
+ * router's NetId and the client's router port as source, and an invokeId
+ * of the link; the pending slot remembers whose it was, so the answer
+ * goes back to the client as if it came straight from the device.
+ * Notifications the router asks for itself, see the hub, one handle at
+ * the device for all clients asking for the same; every sample goes out
+ * to each of them.
+ * Clients connect over TCP or, see ADSrouterListenShm(), through shared
+ * memory, or over a unix SOCK_SEQPACKET socket, ADSrouterListenUnix(),
+ * one packet per message; what goes over any of them is AMS/TCP.
+ * Every thread runs an event loop around epoll, a shard, all sockets non
+ * blocking. The clients are on the thread of ADSrouterRun(), the devices
+ * on it as well or, see ADSrouterThreads(), shared out among I/O threads,
+ * each device on the same one for good. Requests and answers go between
+ * them through queues without locks, an eventfd wakes the one taking.
+ */
+
+#define _GNU_SOURCE				// sendmmsg()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_io.h"
+#include "ads_shm.h"
+#include "ads_route.h"
+#include "ads_router.h"
+#include "debugprint.h"
+
+#define ADS_ROUTER_EVENTS	64		// epoll events per round
+#define ADS_ROUTER_IOV		16		// frames per writev
+
+static ADSRouterFrame *_ADSrouterFrameNew(const void *data, uint32_t len)
+{
+	ADSRouterFrame *f;
+
+	f = (ADSRouterFrame *) malloc(sizeof(ADSRouterFrame) + len);
+	if (f == NULL)
+		return NULL;
+	f->next = NULL;
+	f->len = len;
+	f->off = 0;
+	f->cost = 0;
+	f->finish = 0;
+	if (data != NULL)
+		memcpy(f->data, data, len);
+	return f;
+}
+
+/* a new packet with header h, its length set from len bytes of data */
+static ADSRouterFrame *_ADSrouterFrameMake(const AMSheader *h,
+										   const void *data, uint32_t len)
+{
+	ADSRouterFrame *f;
+
+	f = _ADSrouterFrameNew(NULL, sizeof(AMS_TCPheader) + sizeof(AMSheader)
+						   + len);
+	if (f == NULL)
+		return NULL;
+	FRAME_TCP(f)->reserved = 0;
+	FRAME_TCP(f)->length = sizeof(AMSheader) + len;
+	*FRAME_AMS(f) = *h;
+	FRAME_AMS(f)->dataLength = len;
+	if (len > 0)
+		memcpy(FRAME_DATA(f), data, len);
+	return f;
+}
+
+static void _ADSrouterWatch(ADSRouterShard *sh, ADSRouterIO *io,
+							uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (io->events == events || io->fd < 0)
+		return;
+	ev.events = events;
+	ev.data.ptr = io;
+	if (epoll_ctl(sh->epfd, io->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+				  io->fd, &ev) != 0)
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADS router: epoll_ctl() failed: %s\n", strerror(errno)));
+	io->events = events;
+}
+
+/* closed once the events of this round are handled */
+static void _ADSrouterKill(ADSRouterShard *sh, ADSRouterIO *io)
+{
+	if (io->dead)
+		return;
+	io->dead = 1;
+	io->deadNext = sh->dead;
+	sh->dead = io;
+}
+
+static void _ADSrouterDropTx(ADSRouterIO *io)
+{
+	ADSRouterFrame *f;
+
+	while ((f = io->txFirst) != NULL) {
+		io->txFirst = f->next;
+		free(f);
+	}
+	io->txLast = NULL;
+	io->txFrames = 0;
+	io->txBytes = 0;
+}
+
+/* puts as much of the queue into the ring as fits, the client wakes us
+   when it made room */
+static void _ADSrouterFlushShm(ADSRouterShard *sh, ADSRouterIO *io)
+{
+	ADSRouterFrame *f;
+	int rc;
+
+	while ((f = io->txFirst) != NULL) {
+		rc = ADSshmPut(io->shm, f->data, f->len);
+		if (rc == 0)
+			return;
+		if (rc < 0) {
+			MsgOut(MSG_ERROR, "ADS router: frame does not fit the ring\n");
+			_ADSrouterKill(sh, io);
+			return;
+		}
+		io->txFirst = f->next;
+		io->txFrames--;
+		io->txBytes -= f->len;
+		free(f);
+	}
+	io->txLast = NULL;
+}
+
+/* sends the queue one frame per message, a batch per system call */
+static void _ADSrouterFlushPackets(ADSRouterShard *sh, ADSRouterIO *io)
+{
+	struct mmsghdr msgs[ADS_ROUTER_IOV];
+	struct iovec iov[ADS_ROUTER_IOV];
+	ADSRouterFrame *f;
+	int i, n;
+
+	while (io->txFirst != NULL) {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0, f = io->txFirst; f != NULL && i < ADS_ROUTER_IOV;
+			 f = f->next, i++) {
+			iov[i].iov_base = f->data;
+			iov[i].iov_len = f->len;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		n = sendmmsg(io->fd, msgs, i, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			MsgOut(MSG_ERROR,
+				   MsgStr("ADS router: sendmmsg() failed: %s\n", strerror(errno)));
+			_ADSrouterKill(sh, io);
+			return;
+		}
+		while (n-- > 0) {
+			f = io->txFirst;
+			io->txFirst = f->next;
+			io->txFrames--;
+			io->txBytes -= f->len;
+			free(f);
+		}
+		if (io->txFirst == NULL)
+			io->txLast = NULL;
+	}
+	_ADSrouterWatch(sh, io, EPOLLIN | (io->txFirst != NULL ? EPOLLOUT : 0));
+}
+
+/* writes as much of the queue as the socket takes */
+static void _ADSrouterFlush(ADSRouterShard *sh, ADSRouterIO *io)
+{
+	struct iovec iov[ADS_ROUTER_IOV];
+	struct msghdr msg;
+	ADSRouterFrame *f;
+	ssize_t n;
+	int i;
+
+	if (io->shm != NULL) {
+		_ADSrouterFlushShm(sh, io);
+		return;
+	}
+	if (io->packets) {
+		_ADSrouterFlushPackets(sh, io);
+		return;
+	}
+	while (io->txFirst != NULL) {
+		for (i = 0, f = io->txFirst; f != NULL && i < ADS_ROUTER_IOV;
+			 f = f->next, i++) {
+			iov[i].iov_base = f->data + f->off;
+			iov[i].iov_len = f->len - f->off;
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = i;
+		n = sendmsg(io->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			MsgOut(MSG_ERROR,
+				   MsgStr("ADS router: send() failed: %s\n", strerror(errno)));
+			_ADSrouterKill(sh, io);
+			return;
+		}
+		while (n > 0) {
+			f = io->txFirst;
+			if (n < f->len - f->off) {
+				f->off += n;
+				break;
+			}
+			n -= f->len - f->off;
+			io->txFirst = f->next;
+			io->txFrames--;
+			io->txBytes -= f->len;
+			free(f);
+		}
+		if (io->txFirst == NULL)
+			io->txLast = NULL;
+	}
+	_ADSrouterWatch(sh, io, EPOLLIN | (io->txFirst != NULL ? EPOLLOUT : 0));
+}
+
+/* queues f on io and sends what it can; f belongs to io now */
+static void _ADSrouterSend(ADSRouterShard *sh, ADSRouterIO *io,
+						   ADSRouterFrame *f)
+{
+	if (io->dead) {
+		free(f);
+		return;
+	}
+	f->next = NULL;
+	if (io->txLast != NULL)
+		io->txLast->next = f;
+	else
+		io->txFirst = f;
+	io->txLast = f;
+	io->txFrames++;
+	io->txBytes += f->len;
+	if (io->type != ADS_ROUTER_LINK
+		|| ((ADSRouterLink *) io)->state == ADS_LINK_UP)
+		_ADSrouterFlush(sh, io);
+}
+
+static ADSRouterClient *_ADSrouterClientByPort(ADSRouter *r, uint16_t port)
+{
+	if (port < ADS_ROUTER_PORTBASE
+		|| port >= ADS_ROUTER_PORTBASE + ADS_ROUTER_CLIENTS)
+		return NULL;
+	return r->clients[port - ADS_ROUTER_PORTBASE];
+}
+
+/* whether there is a client at port, from any shard */
+static int _ADSrouterClientThere(ADSRouter *r, uint16_t port)
+{
+	if (port < ADS_ROUTER_PORTBASE
+		|| port >= ADS_ROUTER_PORTBASE + ADS_ROUTER_CLIENTS)
+		return 0;
+	return __atomic_load_n(&r->clients[port - ADS_ROUTER_PORTBASE],
+						   __ATOMIC_RELAXED) != NULL;
+}
+
+static int _ADSrouterQueueInit(ADSRouterQueue *q, uint32_t size)
+{
+	q->slots = (ADSRouterFrame **) calloc(size, sizeof(ADSRouterFrame *));
+	q->mask = size - 1;
+	q->head = q->tail = 0;
+	return q->slots != NULL ? 0 : 0x70A;
+}
+
+/*
+ * Puts f into q. Returns -1 if q is full, 1 if the taker may have seen it
+ * empty and has to be woken, else 0.
+ */
+static int _ADSrouterPut(ADSRouterQueue *q, ADSRouterFrame *f)
+{
+	uint32_t tail = q->tail;
+
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) > q->mask)
+		return -1;
+	q->slots[tail & q->mask] = f;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == tail;
+}
+
+static ADSRouterFrame *_ADSrouterTake(ADSRouterQueue *q)
+{
+	uint32_t head = q->head;
+	ADSRouterFrame *f;
+
+	if (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == head)
+		return NULL;
+	f = q->slots[head & q->mask];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_SEQ_CST);
+	return f;
+}
+
+static void _ADSrouterWake(ADSRouterShard *sh)
+{
+	uint64_t one = 1;
+
+	if (write(sh->wake.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADS router: cannot wake shard %d: %s\n", sh->index,
+					  strerror(errno)));
+}
+
+/*
+ * On shard 0: an answer or notification f for the client at f->port.
+ * Answers carry their client's address already, notifications get it.
+ * A frame of cmdADSinvalid closes the client it is addressed to, see
+ * _ADSrouterDropSubs().
+ */
+static void _ADSrouterDeliver(ADSRouter *r, ADSRouterFrame *f)
+{
+	ADSRouterClient *c = _ADSrouterClientByPort(r, f->port);
+	AMSheader *h = FRAME_AMS(f);
+
+	if (c == NULL) {
+		r->shards[0].stats.strays++;	// gone on the way
+		free(f);
+		return;
+	}
+	if (h->commandId == cmdADSinvalid) {
+		if (memcmp(&h->targetId, &c->addr.netId, sizeof(AmsNetId)) == 0
+			&& h->targetPort == c->addr.port)	// not a new one on the port
+			_ADSrouterKill(&r->shards[0], &c->io);
+		free(f);
+		return;
+	}
+	if (h->stateFlags & sfAMSresponse) {
+		if (c->pending > 0)
+			c->pending--;
+	}
+	else if (c->io.txBytes + f->len > r->limits.clientTx) {
+		r->shards[0].stats.dropped++;	// it does not keep up, the
+		free(f);						// answers still go
+		return;
+	}
+	else {
+		h->targetId = c->addr.netId;
+		h->targetPort = c->addr.port;
+	}
+	_ADSrouterSend(&r->shards[0], &c->io, f);
+}
+
+/* f from the links of sh to its client, through shard 0 */
+static void _ADSrouterToClient(ADSRouterShard *sh, ADSRouterFrame *f)
+{
+	if (sh->index == 0) {
+		_ADSrouterDeliver(sh->router, f);
+		return;
+	}
+	// shard 0 never waits for us, so we may wait for it
+	for (;;) {
+		switch (_ADSrouterPut(&sh->out, f)) {
+		case 1:
+			_ADSrouterWake(&sh->router->shards[0]);
+		case 0:
+			return;
+		}
+		if (sh->router->stop) {
+			free(f);
+			return;
+		}
+		_ADSrouterWake(&sh->router->shards[0]);
+		sched_yield();
+	}
+}
+
+/*
+ * The router answers a request itself, with an error: the answer comes
+ * from the target, to the source, with the invokeId of the request.
+ */
+static ADSRouterFrame *_ADSrouterFailFrame(AMSheader *rq, int err)
+{
+	AMSheader h;
+
+	h.targetId = rq->sourceId;
+	h.targetPort = rq->sourcePort;
+	h.sourceId = rq->targetId;
+	h.sourcePort = rq->targetPort;
+	h.commandId = rq->commandId;
+	h.stateFlags = sfAMSresponse | sfAMScommand;
+	h.errorCode = err;
+	h.invokeId = rq->invokeId;
+	return _ADSrouterFrameMake(&h, NULL, 0);
+}
+
+/* fails the request rq of the client at port with err, on a link shard */
+static void _ADSrouterFail(ADSRouterShard *sh, uint16_t port, AMSheader *rq,
+						   int err)
+{
+	ADSRouterFrame *f = _ADSrouterFailFrame(rq, err);
+
+	sh->stats.failed++;
+	if (f == NULL)
+		return;
+	f->port = port;
+	_ADSrouterToClient(sh, f);
+}
+
+/* on shard 0, fails the request rq of c before it went anywhere */
+static void _ADSrouterRefuse(ADSRouter *r, ADSRouterClient *c, AMSheader *rq,
+							 int err)
+{
+	ADSRouterFrame *f = _ADSrouterFailFrame(rq, err);
+
+	r->shards[0].stats.failed++;
+	if (f != NULL)
+		_ADSrouterSend(&r->shards[0], &c->io, f);
+}
+
+static unsigned _ADSrouterReadHash(uint16_t port, uint32_t group,
+									uint32_t offset, uint32_t length)
+{
+	return (port * 31 + group * 17 + offset * 7 + length)
+		% ADS_ROUTER_READHASH;
+}
+
+/* frees slot s of l, its waiters are served already */
+static void _ADSrouterPendingFree(ADSRouterLink *l, ADSRouterPending *s)
+{
+	ADSRouterPending **p;
+
+	if (s->shared) {
+		p = &l->reads[_ADSrouterReadHash(s->targetPort, s->indexGroup,
+										 s->indexOffset, s->length)];
+		while (*p != s)
+			p = &(*p)->readNext;
+		*p = s->readNext;
+		s->shared = 0;
+	}
+	l->window -= s->cost;
+	s->cost = 0;
+	s->invokeId = 0;
+	l->pending--;
+}
+
+/* fails the request invoke of the client at port, sent from source */
+static void _ADSrouterFailClient(ADSRouterShard *sh, ADSRouterLink *l,
+								 ADSRouterPending *s, uint16_t port,
+								 uint32_t invoke, const AmsAddr *source,
+								 int err)
+{
+	AMSheader h;
+
+	if (!_ADSrouterClientThere(sh->router, port))
+		return;
+	memset(&h, 0, sizeof(h));
+	h.targetId = l->netId;
+	h.targetPort = s->targetPort;
+	h.sourceId = source->netId;
+	h.sourcePort = source->port;
+	h.commandId = s->commandId;
+	h.invokeId = invoke;
+	_ADSrouterFail(sh, port, &h, err);
+}
+
+static void _ADSrouterSubFailed(ADSRouterShard *sh, ADSRouterLink *l,
+								ADSRouterPending *s, int err);
+static void _ADSrouterDropSubs(ADSRouterShard *sh, ADSRouterLink *l);
+
+/* fails the pending request of slot s with err, towards its clients */
+static void _ADSrouterFailPending(ADSRouterShard *sh, ADSRouterLink *l,
+								  ADSRouterPending *s, int err)
+{
+	ADSRouterWaiter *w;
+
+	if (s->sub != NULL)
+		_ADSrouterSubFailed(sh, l, s, err);
+
+	_ADSrouterFailClient(sh, l, s, s->clientPort, s->clientInvoke,
+						 &s->source, err);
+	while ((w = s->waiters) != NULL) {
+		s->waiters = w->next;
+		_ADSrouterFailClient(sh, l, s, w->clientPort, w->clientInvoke,
+							 &w->source, err);
+		free(w);
+	}
+	_ADSrouterPendingFree(l, s);
+}
+
+/*
+ * Lanes: requests to a device wait in one of three lanes until they fit
+ * its window, ADS_ROUTER_WINDOW bytes of requests and answers on the way.
+ * Which one is sent next is weighted fair queuing: every request gets a
+ * finish time, its cost divided by the weight of its lane after the one
+ * queued before it, the earliest goes first. An urgent write thus passes
+ * a queue of bulk reads instead of waiting for all of them.
+ */
+static const uint32_t laneWeight[ADS_ROUTER_LANES] = { 16, 4, 1 };
+
+/* the requests of the client of f waiting in the lanes of l, by lane */
+#define QUEUED(l, f)	((l)->queued[(f)->port - ADS_ROUTER_PORTBASE])
+
+/* bytes of request f and its answer */
+static uint32_t _ADSrouterCost(ADSRouterFrame *f)
+{
+	AMSheader *h = FRAME_AMS(f);
+	uint32_t len = FRAME_TCP(f)->length - sizeof(AMSheader), answer = 0;
+
+	if ((h->commandId == cmdADSread && len >= sizeof(ADSreadRequest))
+		|| (h->commandId == cmdADSreadWrite && len >= 16))
+		memcpy(&answer, FRAME_DATA(f) + 8, sizeof(answer));
+	if (answer > ADS_ROUTER_MAXFRAME)
+		answer = ADS_ROUTER_MAXFRAME;
+	return f->len + answer;
+}
+
+static int _ADSrouterLane(ADSRouterFrame *f)
+{
+	AMSheader *h = FRAME_AMS(f);
+	uint32_t len = FRAME_TCP(f)->length - sizeof(AMSheader), group = 0;
+
+	if (len >= sizeof(group))
+		memcpy(&group, FRAME_DATA(f), sizeof(group));
+	if (h->commandId == cmdADSwriteControl
+		|| (h->commandId == cmdADSwrite && len <= 12 + ADS_ROUTER_SMALL))
+		return ADS_LANE_HIGH;
+	if (h->commandId == cmdADSreadWrite
+		&& (group == ADSIGRP_SYM_UPLOAD || group == ADSIGRP_SYM_UPLOADINFO
+			|| group == ADSIGRP_SYM_DT_UPLOAD
+			|| group == ADSIGRP_SYM_UPLOADINFO2))
+		return ADS_LANE_LOW;
+	return f->cost > ADS_ROUTER_BULK ? ADS_LANE_LOW : ADS_LANE_NORMAL;
+}
+
+/* sends what waits in the lanes of l while its window has room */
+static void _ADSrouterDispatch(ADSRouterShard *sh, ADSRouterLink *l)
+{
+	ADSRouterPending *s;
+	ADSRouterFrame *f;
+	int lane, i;
+
+	while (l->state == ADS_LINK_UP) {
+		lane = -1;
+		for (i = 0; i < ADS_ROUTER_LANES; i++) {
+			f = l->laneFirst[i];
+			// urgent ones are small, they do not wait for the window
+			if (f != NULL
+				&& (i == ADS_LANE_HIGH || l->window < ADS_ROUTER_WINDOW)
+				&& (lane < 0 || f->finish < l->laneFirst[lane]->finish))
+				lane = i;
+		}
+		if (lane < 0)
+			return;
+		f = l->laneFirst[lane];
+		l->laneFirst[lane] = f->next;
+		if (f->next == NULL)
+			l->laneLast[lane] = NULL;
+		l->laneBytes -= f->len;
+		sh->stats.laneBytes -= f->len;
+		l->vtime = f->finish;
+		QUEUED(l, f)[lane]--;
+		s = &l->slots[FRAME_AMS(f)->invokeId % ADS_ROUTER_PENDING];
+		if (s->invokeId != FRAME_AMS(f)->invokeId) {
+			free(f);			// expired while it waited
+			continue;
+		}
+		s->cost = f->cost;
+		l->window += f->cost;
+		sh->stats.lanes[lane]++;
+		_ADSrouterSend(sh, &l->io, f);
+	}
+}
+
+/* puts the request f into its lane of l and sends what it can */
+static void _ADSrouterQueue(ADSRouterShard *sh, ADSRouterLink *l,
+							ADSRouterFrame *f)
+{
+	uint64_t start;
+	int lane, i;
+
+	f->cost = _ADSrouterCost(f);
+	lane = _ADSrouterLane(f);
+	// never past requests of the same client waiting in a slower lane
+	for (i = lane + 1; i < ADS_ROUTER_LANES; i++)
+		if (QUEUED(l, f)[i] > 0)
+			lane = i;
+	QUEUED(l, f)[lane]++;
+	start = l->laneFinish[lane] > l->vtime ? l->laneFinish[lane] : l->vtime;
+	f->finish = start + (uint64_t) f->cost * laneWeight[ADS_LANE_HIGH]
+		/ laneWeight[lane];
+	l->laneFinish[lane] = f->finish;
+	f->next = NULL;
+	if (l->laneLast[lane] != NULL)
+		l->laneLast[lane]->next = f;
+	else
+		l->laneFirst[lane] = f;
+	l->laneLast[lane] = f;
+	l->laneBytes += f->len;
+	sh->stats.laneBytes += f->len;
+	_ADSrouterDispatch(sh, l);
+}
+
+/* drops what waits in the lanes of l, its requests are failed already */
+static void _ADSrouterDropLanes(ADSRouterShard *sh, ADSRouterLink *l)
+{
+	ADSRouterFrame *f;
+	int i;
+
+	for (i = 0; i < ADS_ROUTER_LANES; i++) {
+		while ((f = l->laneFirst[i]) != NULL) {
+			l->laneFirst[i] = f->next;
+			QUEUED(l, f)[i]--;
+			free(f);
+		}
+		l->laneLast[i] = NULL;
+		l->laneFinish[i] = 0;
+	}
+	sh->stats.laneBytes -= l->laneBytes;
+	l->laneBytes = 0;
+	l->vtime = 0;
+}
+
+static int _ADSrouterNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * The link failed or is closed: every request on the way fails with err,
+ * it may connect again after ADS_ROUTER_RETRY.
+ */
+static void _ADSrouterLinkDown(ADSRouterShard *sh, ADSRouterLink *l, int err)
+{
+	int i;
+
+	if (l->state == ADS_LINK_UP)
+		sh->stats.links--;
+	MsgOut(MSG_ROUTING,
+		   MsgStr("ADS router: link to %d.%d.%d.%d.%d.%d down, %d pending\n",
+				  l->netId.b[0], l->netId.b[1], l->netId.b[2], l->netId.b[3],
+				  l->netId.b[4], l->netId.b[5], l->pending));
+	for (i = 0; i < ADS_ROUTER_PENDING && l->pending > 0; i++)
+		if (l->slots[i].invokeId != 0)
+			_ADSrouterFailPending(sh, l, &l->slots[i], err);
+	_ADSrouterDropSubs(sh, l);
+	_ADSrouterDropLanes(sh, l);
+	_ADSrouterDropTx(&l->io);
+	if (l->io.fd >= 0) {
+		close(l->io.fd);		// leaves the epoll set as well
+		l->io.fd = -1;
+	}
+	l->io.events = 0;
+	l->io.rxLen = 0;
+	l->io.dead = 0;
+	l->state = ADS_LINK_DOWN;
+	l->failed = time(NULL);
+}
+
+/* starts connecting to the device of l */
+static int _ADSrouterLinkConnect(ADSRouterShard *sh, ADSRouterLink *l)
+{
+	struct sockaddr_in addr;
+	char peer[INET_ADDRSTRLEN];
+	int opt = 1;
+
+	ADSrouteAddress(&l->netId, &addr);
+	inet_ntop(AF_INET, &addr.sin_addr, peer, sizeof(peer));	// for the log
+
+	l->io.fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (l->io.fd < 0 || _ADSrouterNonBlocking(l->io.fd) != 0) {
+		_ADSrouterLinkDown(sh, l, 0x1B);
+		return -1;
+	}
+	setsockopt(l->io.fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	setsockopt(l->io.fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+	sh->stats.connects++;
+	if (connect(l->io.fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+		&& errno != EINPROGRESS) {
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADS router: connect() to %s failed: %s\n", peer,
+					  strerror(errno)));
+		_ADSrouterLinkDown(sh, l, 0x1B);
+		return -1;
+	}
+	MsgOut(MSG_ROUTING, MsgStr("ADS router: connecting to %s\n", peer));
+	l->state = ADS_LINK_CONNECTING;
+	_ADSrouterWatch(sh, &l->io, EPOLLIN | EPOLLOUT);
+	return 0;
+}
+
+static unsigned _ADSrouterNetIdHash(const AmsNetId *netId)
+{
+	unsigned h = 0;
+	int i;
+
+	for (i = 0; i < sizeof(AmsNetId); i++)
+		h = h * 31 + netId->b[i];
+	return h;
+}
+
+/* the shard with the link to netId, it stays there */
+static ADSRouterShard *_ADSrouterShardOf(ADSRouter *r, const AmsNetId *netId)
+{
+	if (r->threads == 0)
+		return &r->shards[0];
+	return &r->shards[1 + _ADSrouterNetIdHash(netId) % r->threads];
+}
+
+/* the link to netId, connecting it if it is down; NULL if it cannot */
+static ADSRouterLink *_ADSrouterLink(ADSRouterShard *sh,
+									 const AmsNetId *netId)
+{
+	ADSRouterLink *l, **head;
+	unsigned h = _ADSrouterNetIdHash(netId);
+
+	if (sh->router->threads > 0)
+		h /= sh->router->threads;	// the rest chose the shard
+	head = &sh->links[h % ADS_ROUTER_LINKHASH];
+	for (l = *head; l != NULL; l = l->next)
+		if (memcmp(&l->netId, netId, sizeof(AmsNetId)) == 0)
+			break;
+	if (l == NULL) {
+		l = (ADSRouterLink *) calloc(1, sizeof(ADSRouterLink));
+		if (l == NULL)
+			return NULL;
+		l->io.rx = (unsigned char *) malloc(ADS_ROUTER_MAXFRAME);
+		if (l->io.rx == NULL) {
+			free(l);
+			return NULL;
+		}
+		l->io.type = ADS_ROUTER_LINK;
+		l->io.fd = -1;
+		l->netId = *netId;
+		l->state = ADS_LINK_DOWN;
+		l->next = *head;
+		*head = l;
+	}
+	if (l->state == ADS_LINK_DOWN) {
+		if (l->failed != 0 && time(NULL) - l->failed < ADS_ROUTER_RETRY)
+			return NULL;
+		if (_ADSrouterLinkConnect(sh, l) != 0)
+			return NULL;
+	}
+	return l;
+}
+
+/* a free pending slot of l with a fresh invokeId, or NULL */
+static ADSRouterPending *_ADSrouterPendingNew(ADSRouterLink *l)
+{
+	ADSRouterPending *s;
+	int i;
+
+	if (l->pending == ADS_ROUTER_PENDING)
+		return NULL;
+	for (i = 0; i < ADS_ROUTER_PENDING; i++) {
+		if (++l->nextInvoke == 0)
+			l->nextInvoke = 1;
+		s = &l->slots[l->nextInvoke % ADS_ROUTER_PENDING];
+		if (s->invokeId == 0) {
+			s->invokeId = l->nextInvoke;
+			l->pending++;
+			return s;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Coalescing: a read of the same as a read on the way to the device does
+ * not go out again, the client waits for the answer of that one. Only
+ * reads sent since the last request that was not a read qualify, that
+ * one may have changed what they read.
+ * Returns 1 if the client of f waits now, 0 if the read has to go out.
+ */
+static int _ADSrouterJoin(ADSRouterShard *sh, ADSRouterLink *l,
+						  ADSRouterFrame *f)
+{
+	AMSheader *h = FRAME_AMS(f);
+	ADSreadRequest *rq = (ADSreadRequest *) FRAME_DATA(f);
+	ADSRouterPending *s;
+	ADSRouterWaiter *w;
+
+	s = l->reads[_ADSrouterReadHash(h->targetPort, rq->indexGroup,
+									rq->indexOffset, rq->length)];
+	for (; s != NULL; s = s->readNext)
+		if (s->epoch == l->epoch && s->targetPort == h->targetPort
+			&& s->indexGroup == rq->indexGroup
+			&& s->indexOffset == rq->indexOffset && s->length == rq->length)
+			break;
+	if (s == NULL)
+		return 0;
+	w = (ADSRouterWaiter *) malloc(sizeof(ADSRouterWaiter));
+	if (w == NULL)
+		return 0;
+	w->clientPort = f->port;
+	w->clientInvoke = h->invokeId;
+	w->source.netId = h->sourceId;
+	w->source.port = h->sourcePort;
+	w->next = s->waiters;
+	s->waiters = w;
+	sh->stats.coalesced++;
+	free(f);
+	return 1;
+}
+
+/* the answer f to the request invoke of the client at port, sent from to */
+static void _ADSrouterAnswer(ADSRouterShard *sh, uint16_t port,
+							 const AmsAddr *to, uint32_t invoke,
+							 ADSRouterFrame *f)
+{
+	AMSheader *h;
+
+	if (f == NULL)
+		return;
+	if (!_ADSrouterClientThere(sh->router, port)) {
+		if (port != 0)
+			sh->stats.strays++;
+		free(f);
+		return;
+	}
+	h = FRAME_AMS(f);
+	h->targetId = to->netId;
+	h->targetPort = to->port;
+	h->invokeId = invoke;
+	f->port = port;
+	sh->stats.responses++;
+	_ADSrouterToClient(sh, f);
+}
+
+/*
+ * The hub: the router holds the notification handles at the devices, from
+ * ADS_ROUTER_HUBPORT, one for all clients asking for the same. A client
+ * gets a handle of its own on it, a reader; every sample the device sends
+ * once goes out to all readers, with their handles.
+ */
+static unsigned _ADSrouterSubHash(uint16_t port,
+								  const ADSaddDeviceNotificationRequest *rq)
+{
+	return (port * 31 + rq->indexGroup * 17 + rq->indexOffset * 7
+			+ rq->length + rq->transmissionMode * 3 + rq->maxDelay
+			+ rq->cycleTime) % ADS_ROUTER_NOTEHASH;
+}
+
+/*
+ * Asks the device of l to delete its notification handle, sent from
+ * sourcePort; the answer goes to nobody. Returns -1 if it cannot.
+ */
+static int _ADSrouterDelHandle(ADSRouterShard *sh, ADSRouterLink *l,
+							   uint16_t targetPort, uint16_t sourcePort,
+							   uint32_t handle)
+{
+	ADSRouterPending *s;
+	ADSRouterFrame *f;
+	AMSheader h;
+
+	s = _ADSrouterPendingNew(l);
+	if (s == NULL)
+		return -1;
+	memset(&h, 0, sizeof(h));
+	h.targetId = l->netId;
+	h.targetPort = targetPort;
+	h.sourceId = sh->router->netId;
+	h.sourcePort = sourcePort;
+	h.commandId = cmdADSdeleteDeviceNotification;
+	h.stateFlags = sfAMScommand;
+	h.invokeId = s->invokeId;
+	s->clientPort = 0;
+	s->targetPort = targetPort;
+	s->commandId = h.commandId;
+	s->sent = time(NULL);
+	f = _ADSrouterFrameMake(&h, &handle, sizeof(handle));
+	if (f == NULL) {
+		_ADSrouterPendingFree(l, s);
+		return -1;
+	}
+	_ADSrouterSend(sh, &l->io, f);
+	return 0;
+}
+
+/* sub of l goes, tell: at the device as well */
+static void _ADSrouterSubFree(ADSRouterShard *sh, ADSRouterLink *l,
+							  ADSRouterSub *sub, int tell)
+{
+	ADSRouterSub **p;
+
+	p = &l->subs[_ADSrouterSubHash(sub->targetPort, &sub->rq)];
+	while (*p != sub)
+		p = &(*p)->next;
+	*p = sub->next;
+	if (sub->handle != 0) {
+		p = &l->subHandles[sub->handle % ADS_ROUTER_NOTEHASH];
+		while (*p != sub)
+			p = &(*p)->handleNext;
+		*p = sub->handleNext;
+		if (tell)
+			_ADSrouterDelHandle(sh, l, sub->targetPort, ADS_ROUTER_HUBPORT,
+								sub->handle);
+		sh->stats.subscriptions--;
+	}
+	free(sub->last);
+	free(sub);
+}
+
+/* takes r off its subscription, the caller sees to one without readers */
+static void _ADSrouterReaderFree(ADSRouterShard *sh, ADSRouterLink *l,
+								 ADSRouterReader *r)
+{
+	ADSRouterReader **p;
+
+	p = &r->sub->readers;
+	while (*p != r)
+		p = &(*p)->next;
+	*p = r->next;
+	p = &l->readers[r->handle % ADS_ROUTER_NOTEHASH];
+	while (*p != r)
+		p = &(*p)->hashNext;
+	*p = r->hashNext;
+	sh->stats.subscribers--;
+	free(r);
+}
+
+/*
+ * Drops the readers of sub whose clients are gone, and sub if it has
+ * none left. Returns 1 if sub is gone.
+ */
+static int _ADSrouterSubPrune(ADSRouterShard *sh, ADSRouterLink *l,
+							  ADSRouterSub *sub)
+{
+	ADSRouterReader *r, *next;
+
+	for (r = sub->readers; r != NULL; r = next) {
+		next = r->next;
+		if (!_ADSrouterClientThere(sh->router, r->clientPort))
+			_ADSrouterReaderFree(sh, l, r);
+	}
+	if (sub->readers != NULL || sub->handle == 0)
+		return 0;				// one adding goes with its answer
+	_ADSrouterSubFree(sh, l, sub, 1);
+	return 1;
+}
+
+/* answers the request invoke of the client at port, from the device of l */
+static void _ADSrouterReply(ADSRouterShard *sh, ADSRouterLink *l,
+							uint16_t port, const AmsAddr *to, uint32_t invoke,
+							uint16_t targetPort, uint16_t commandId,
+							const void *data, uint32_t len)
+{
+	AMSheader h;
+
+	memset(&h, 0, sizeof(h));
+	h.sourceId = l->netId;
+	h.sourcePort = targetPort;
+	h.commandId = commandId;
+	h.stateFlags = sfAMSresponse | sfAMScommand;
+	_ADSrouterAnswer(sh, port, to, invoke, _ADSrouterFrameMake(&h, data, len));
+}
+
+/* the last sample of its subscription for r, that came later */
+static void _ADSrouterLastSample(ADSRouterShard *sh, ADSRouterLink *l,
+								 ADSRouterReader *r)
+{
+	ADSRouterSub *sub = r->sub;
+	uint32_t len = 28 + sub->size, n = len - 4, one = 1;
+	ADSRouterFrame *f;
+	unsigned char *d;
+	AMSheader h;
+
+	memset(&h, 0, sizeof(h));
+	h.sourceId = l->netId;
+	h.sourcePort = sub->targetPort;
+	h.commandId = cmdADSdevNotify;
+	h.stateFlags = sfAMScommand;
+	d = (unsigned char *) malloc(len);
+	if (d == NULL)
+		return;
+	memcpy(d, &n, 4);
+	memcpy(d + 4, &one, 4);
+	memcpy(d + 8, &sub->stamp, 8);
+	memcpy(d + 16, &one, 4);
+	memcpy(d + 20, &r->handle, 4);
+	memcpy(d + 24, &sub->size, 4);
+	memcpy(d + 28, sub->last, sub->size);
+	f = _ADSrouterFrameMake(&h, d, len);
+	free(d);
+	if (f == NULL)
+		return;
+	f->port = r->clientPort;
+	sh->stats.fanout++;
+	_ADSrouterToClient(sh, f);
+}
+
+/*
+ * The add f of the client at f->port: a handle of its own on the
+ * subscription for the same, a new one at the device if there is none.
+ * Returns 0 if f goes to the device as it is.
+ */
+static int _ADSrouterSubscribe(ADSRouterShard *sh, ADSRouterLink *l,
+							   ADSRouterFrame *f)
+{
+	AMSheader *h = FRAME_AMS(f);
+	ADSaddDeviceNotificationRequest rq;
+	ADSaddDeviceNotificationResponse an;
+	ADSRouterPending *s = NULL;
+	ADSRouterReader *r;
+	ADSRouterSub *sub;
+	unsigned k;
+
+	if (FRAME_TCP(f)->length < sizeof(AMSheader) + sizeof(rq))
+		return 0;
+	memcpy(&rq, FRAME_DATA(f), sizeof(rq));
+	memset(rq.reserved, 0, sizeof(rq.reserved));
+	k = _ADSrouterSubHash(h->targetPort, &rq);
+	for (sub = l->subs[k]; sub != NULL; sub = sub->next)
+		if (sub->targetPort == h->targetPort
+			&& memcmp(&sub->rq, &rq, sizeof(rq)) == 0)
+			break;
+	r = (ADSRouterReader *) calloc(1, sizeof(ADSRouterReader));
+	if (r != NULL && sub == NULL) {
+		sub = (ADSRouterSub *) calloc(1, sizeof(ADSRouterSub));
+		if (sub != NULL && (s = _ADSrouterPendingNew(l)) == NULL) {
+			free(sub);
+			free(r);
+			_ADSrouterFail(sh, f->port, h, 0x502);
+			free(f);
+			return 1;
+		}
+		if (sub != NULL) {
+			sub->targetPort = h->targetPort;
+			sub->rq = rq;
+			sub->next = l->subs[k];
+			l->subs[k] = sub;
+		}
+	}
+	if (r == NULL || sub == NULL) {
+		free(r);
+		_ADSrouterFail(sh, f->port, h, 0x70A);
+		free(f);
+		return 1;
+	}
+	if (++l->nextHandle == 0)
+		l->nextHandle = 1;
+	r->handle = l->nextHandle;
+	r->sub = sub;
+	r->clientPort = f->port;
+	r->waiting = sub->handle == 0;
+	r->clientInvoke = h->invokeId;
+	r->source.netId = h->sourceId;
+	r->source.port = h->sourcePort;
+	r->next = sub->readers;
+	sub->readers = r;
+	r->hashNext = l->readers[r->handle % ADS_ROUTER_NOTEHASH];
+	l->readers[r->handle % ADS_ROUTER_NOTEHASH] = r;
+	sh->stats.subscribers++;
+
+	if (s != NULL) {
+		// the one add at the device, its answer is for all waiting then
+		s->clientPort = 0;
+		s->targetPort = h->targetPort;
+		s->commandId = h->commandId;
+		s->sent = time(NULL);
+		s->sub = sub;
+		h->sourceId = sh->router->netId;
+		h->sourcePort = ADS_ROUTER_HUBPORT;
+		h->invokeId = s->invokeId;
+		_ADSrouterQueue(sh, l, f);
+		return 1;
+	}
+	if (!r->waiting) {
+		an.result = 0;
+		an.notificationHandle = r->handle;
+		_ADSrouterReply(sh, l, r->clientPort, &r->source, r->clientInvoke,
+						h->targetPort, h->commandId, &an, sizeof(an));
+		if (sub->last != NULL)
+			_ADSrouterLastSample(sh, l, r);
+	}
+	free(f);
+	return 1;
+}
+
+/* the add of the subscription of slot s failed with err, for all */
+static void _ADSrouterSubFailed(ADSRouterShard *sh, ADSRouterLink *l,
+								ADSRouterPending *s, int err)
+{
+	ADSRouterSub *sub = s->sub;
+	ADSRouterReader *r;
+
+	s->sub = NULL;
+	while ((r = sub->readers) != NULL) {
+		_ADSrouterFailClient(sh, l, s, r->clientPort, r->clientInvoke,
+							 &r->source, err);
+		_ADSrouterReaderFree(sh, l, r);
+	}
+	_ADSrouterSubFree(sh, l, sub, 0);
+}
+
+/*
+ * The subscriptions of l are gone with its connection. Their clients are
+ * closed, as their own connection to the device would be without the
+ * router: they see their notifications end and subscribe again.
+ */
+static void _ADSrouterDropSubs(ADSRouterShard *sh, ADSRouterLink *l)
+{
+	ADSRouterSub *sub;
+	ADSRouterReader *r;
+	ADSRouterFrame *f;
+	AMSheader h;
+	int i;
+
+	memset(&h, 0, sizeof(h));
+	h.commandId = cmdADSinvalid;
+	for (i = 0; i < ADS_ROUTER_NOTEHASH; i++)
+		while ((sub = l->subs[i]) != NULL) {
+			while ((r = sub->readers) != NULL) {
+				if (_ADSrouterClientThere(sh->router, r->clientPort)
+					&& (f = _ADSrouterFrameMake(&h, NULL, 0)) != NULL) {
+					FRAME_AMS(f)->targetId = r->source.netId;
+					FRAME_AMS(f)->targetPort = r->source.port;
+					f->port = r->clientPort;
+					_ADSrouterToClient(sh, f);
+				}
+				_ADSrouterReaderFree(sh, l, r);
+			}
+			_ADSrouterSubFree(sh, l, sub, 0);
+		}
+}
+
+/*
+ * The delete f of the client at f->port. Returns 0 if the handle is not
+ * one of the router's, f goes to the device as it is.
+ */
+static int _ADSrouterUnsubscribe(ADSRouterShard *sh, ADSRouterLink *l,
+								 ADSRouterFrame *f)
+{
+	AMSheader *h = FRAME_AMS(f);
+	ADSRouterReader *r;
+	ADSRouterSub *sub;
+	uint32_t handle, result = 0;
+	AmsAddr to;
+
+	if (FRAME_TCP(f)->length < sizeof(AMSheader) + sizeof(handle))
+		return 0;
+	memcpy(&handle, FRAME_DATA(f), sizeof(handle));
+	for (r = l->readers[handle % ADS_ROUTER_NOTEHASH]; r != NULL;
+		 r = r->hashNext)
+		if (r->handle == handle && r->clientPort == f->port && !r->waiting)
+			break;
+	if (r == NULL)
+		return 0;
+	sub = r->sub;
+	_ADSrouterReaderFree(sh, l, r);
+	if (sub->readers == NULL && sub->handle != 0)
+		_ADSrouterSubFree(sh, l, sub, 1);
+	to.netId = h->sourceId;
+	to.port = h->sourcePort;
+	_ADSrouterReply(sh, l, f->port, &to, h->invokeId, h->targetPort,
+					h->commandId, &result, sizeof(result));
+	free(f);
+	return 1;
+}
+
+/* the device answered the add of the subscription of slot s with f */
+static void _ADSrouterSubAdded(ADSRouterShard *sh, ADSRouterLink *l,
+							   ADSRouterPending *s, ADSRouterFrame *f)
+{
+	AMSheader *h = FRAME_AMS(f);
+	ADSaddDeviceNotificationResponse an;
+	ADSRouterSub *sub = s->sub, **p;
+	ADSRouterReader *r, *next;
+	ADSRouterFrame *copy;
+	int ok;
+
+	s->sub = NULL;
+	ok = h->errorCode == 0 && h->dataLength >= sizeof(an)
+		&& FRAME_TCP(f)->length >= sizeof(AMSheader) + sizeof(an);
+	if (ok) {
+		memcpy(&an, FRAME_DATA(f), sizeof(an));
+		ok = an.result == 0 && an.notificationHandle != 0;
+	}
+	if (ok) {
+		sub->handle = an.notificationHandle;
+		p = &l->subHandles[sub->handle % ADS_ROUTER_NOTEHASH];
+		sub->handleNext = *p;
+		*p = sub;
+		sh->stats.subscriptions++;
+	}
+	// all its readers wait, each gets the answer with its handle
+	for (r = sub->readers; r != NULL; r = next) {
+		next = r->next;
+		copy = _ADSrouterFrameNew(f->data, f->len);
+		if (copy != NULL && ok)
+			memcpy(FRAME_DATA(copy) + 4, &r->handle, 4);
+		_ADSrouterAnswer(sh, r->clientPort, &r->source, r->clientInvoke,
+						 copy);
+		r->waiting = 0;
+		if (!ok)
+			_ADSrouterReaderFree(sh, l, r);
+	}
+	if (!ok)
+		_ADSrouterSubFree(sh, l, sub, 0);
+	else
+		_ADSrouterSubPrune(sh, l, sub);
+	free(f);
+}
+
+/* the notification for client c, ready in fan, to it */
+static void _ADSrouterFanSend(ADSRouterShard *sh, int c)
+{
+	ADSRouterFrame *f = sh->fan[c].f;
+	uint32_t used = sh->fan[c].used, n = used - 4;
+
+	if (f == NULL)
+		return;
+	sh->fan[c].f = NULL;
+	memcpy(FRAME_DATA(f), &n, 4);
+	FRAME_TCP(f)->length = sizeof(AMSheader) + used;
+	FRAME_AMS(f)->dataLength = used;
+	f->len = FRAME_HEAD + used;
+	f->port = ADS_ROUTER_PORTBASE + c;
+	sh->stats.fanout++;
+	_ADSrouterToClient(sh, f);
+}
+
+/*
+ * Adds a sample of the notification n for reader r to the one for its
+ * client: stamp is which time stamp of n, at its 8 bytes in n.
+ */
+static void _ADSrouterFanAdd(ADSRouterShard *sh, ADSRouterFrame *n,
+							 ADSRouterReader *r, int stamp,
+							 const unsigned char *at,
+							 const unsigned char *data, uint32_t size)
+{
+	int c = r->clientPort - ADS_ROUTER_PORTBASE;
+	uint32_t need, count;
+	ADSRouterFrame *f;
+	unsigned char *d;
+
+	need = FRAME_HEAD + sh->fan[c].used + 20 + size;
+	if (sh->fan[c].f != NULL && need > ADS_ROUTER_MAXFRAME)
+		_ADSrouterFanSend(sh, c);		// full, the rest in another one
+	if (sh->fan[c].f == NULL) {
+		f = _ADSrouterFrameNew(NULL, n->len);
+		if (f == NULL)
+			return;
+		memcpy(f->data, n->data, FRAME_HEAD);
+		memset(FRAME_DATA(f), 0, 8);
+		sh->fan[c].f = f;
+		sh->fan[c].used = 8;
+		sh->fan[c].cap = n->len;
+		sh->fan[c].stamp = -1;
+		if (!sh->fan[c].listed) {
+			sh->fan[c].listed = 1;
+			sh->fanClients[sh->fanCount++] = c;
+		}
+		need = FRAME_HEAD + 8 + 20 + size;
+	}
+	if (need > sh->fan[c].cap) {
+		// more samples than n for a client with several readers
+		need = need > sh->fan[c].cap * 2 ? need : sh->fan[c].cap * 2;
+		if (need > ADS_ROUTER_MAXFRAME)
+			need = ADS_ROUTER_MAXFRAME;
+		f = (ADSRouterFrame *) realloc(sh->fan[c].f,
+									   sizeof(ADSRouterFrame) + need);
+		if (f == NULL)
+			return;
+		sh->fan[c].f = f;
+		sh->fan[c].cap = need;
+	}
+	d = FRAME_DATA(sh->fan[c].f);
+	if (sh->fan[c].stamp != stamp) {
+		memcpy(&count, d + 4, 4);
+		count++;
+		memcpy(d + 4, &count, 4);
+		memcpy(d + sh->fan[c].used, at, 8);
+		memset(d + sh->fan[c].used + 8, 0, 4);
+		sh->fan[c].stampAt = sh->fan[c].used + 8;
+		sh->fan[c].used += 12;
+		sh->fan[c].stamp = stamp;
+	}
+	memcpy(&count, d + sh->fan[c].stampAt, 4);
+	count++;
+	memcpy(d + sh->fan[c].stampAt, &count, 4);
+	d += sh->fan[c].used;
+	memcpy(d, &r->handle, 4);
+	memcpy(d + 4, &size, 4);
+	memcpy(d + 8, data, size);
+	sh->fan[c].used += 8 + size;
+}
+
+/*
+ * A notification n of the device of l for the hub: every sample to the
+ * readers of its subscription, one notification per client with all of
+ * its samples. Handles of no subscription are deleted at the device.
+ */
+static void _ADSrouterFanOut(ADSRouterShard *sh, ADSRouterLink *l,
+							 ADSRouterFrame *n)
+{
+	AMSheader *p = FRAME_AMS(n);
+	unsigned char *d = FRAME_DATA(n), *end, *at, *data;
+	uint32_t stamps, samples, handle, size, avail = p->dataLength;
+	ADSRouterSub *sub;
+	ADSRouterReader *r;
+	unsigned char *last;
+	int i, c;
+
+	if (avail < 8 || avail > FRAME_TCP(n)->length - sizeof(AMSheader))
+		return;
+	end = d + avail;
+	memcpy(&stamps, d + 4, 4);
+	d += 8;
+	for (i = 0; i < stamps && end - d >= 12; i++) {
+		at = d;
+		memcpy(&samples, d + 8, 4);
+		d += 12;
+		while (samples-- > 0 && end - d >= 8) {
+			memcpy(&handle, d, 4);
+			memcpy(&size, d + 4, 4);
+			d += 8;
+			if (size > end - d)
+				break;
+			data = d;
+			d += size;
+			for (sub = l->subHandles[handle % ADS_ROUTER_NOTEHASH];
+				 sub != NULL && sub->handle != handle; sub = sub->handleNext)
+				;
+			if (sub == NULL) {
+				_ADSrouterDelHandle(sh, l, p->sourcePort, ADS_ROUTER_HUBPORT,
+									handle);
+				continue;
+			}
+			if (_ADSrouterSubPrune(sh, l, sub))
+				continue;
+			// kept for readers coming later
+			last = sub->size == size && sub->last != NULL ? sub->last
+				: (unsigned char *) realloc(sub->last, size ? size : 1);
+			if (last != NULL) {
+				memcpy(last, data, size);
+				memcpy(&sub->stamp, at, 8);
+				sub->last = last;
+				sub->size = size;
+			}
+			for (r = sub->readers; r != NULL; r = r->next)
+				_ADSrouterFanAdd(sh, n, r, i, at, data, size);
+		}
+	}
+	for (i = 0; i < sh->fanCount; i++) {
+		c = sh->fanClients[i];
+		_ADSrouterFanSend(sh, c);
+		sh->fan[c].listed = 0;
+	}
+	sh->fanCount = 0;
+}
+
+/*
+ * On the shard of its link, the request f of the client at f->port:
+ * rewrite its source and invokeId, off to the device.
+ */
+static void _ADSrouterRequest(ADSRouterShard *sh, ADSRouterFrame *f)
+{
+	AMSheader *h = FRAME_AMS(f);
+	ADSreadRequest *rq = (ADSreadRequest *) FRAME_DATA(f);
+	ADSRouterPending *s, **reads;
+	ADSRouterLink *l;
+	int read;
+
+	l = _ADSrouterLink(sh, &h->targetId);
+	if (l == NULL) {
+		_ADSrouterFail(sh, f->port, h, 0x1B);
+		free(f);
+		return;
+	}
+	read = h->commandId == cmdADSread
+		&& FRAME_TCP(f)->length >= sizeof(AMSheader) + sizeof(ADSreadRequest);
+	if (!read)
+		l->epoch++;
+	else if (_ADSrouterJoin(sh, l, f))
+		return;
+	if (l->laneBytes + f->len > sh->router->limits.linkQueue) {
+		sh->stats.rejected++;		// the device does not keep up
+		_ADSrouterFail(sh, f->port, h, 0x502);
+		free(f);
+		return;
+	}
+	if ((h->commandId == cmdADSaddDeviceNotification
+		 && _ADSrouterSubscribe(sh, l, f))
+		|| (h->commandId == cmdADSdeleteDeviceNotification
+			&& _ADSrouterUnsubscribe(sh, l, f)))
+		return;
+	s = _ADSrouterPendingNew(l);
+	if (s == NULL) {
+		_ADSrouterFail(sh, f->port, h, 0x502);
+		free(f);
+		return;
+	}
+	s->clientPort = f->port;
+	s->targetPort = h->targetPort;
+	s->commandId = h->commandId;
+	s->clientInvoke = h->invokeId;
+	s->source.netId = h->sourceId;
+	s->source.port = h->sourcePort;
+	s->sent = time(NULL);
+	if (read) {
+		s->shared = 1;
+		s->indexGroup = rq->indexGroup;
+		s->indexOffset = rq->indexOffset;
+		s->length = rq->length;
+		s->epoch = l->epoch;
+		reads = &l->reads[_ADSrouterReadHash(s->targetPort, s->indexGroup,
+											 s->indexOffset, s->length)];
+		s->readNext = *reads;
+		*reads = s;
+	}
+
+	h->sourceId = sh->router->netId;
+	h->sourcePort = f->port;
+	h->invokeId = s->invokeId;
+	_ADSrouterQueue(sh, l, f);
+}
+
+/* a request of a client, on shard 0: to the shard of its device */
+static void _ADSrouterFromClient(ADSRouter *r, ADSRouterClient *c,
+								 ADSRouterFrame *f)
+{
+	AMSheader *h = FRAME_AMS(f);
+	ADSRouterShard *sh;
+
+	c->addr.netId = h->sourceId;
+	c->addr.port = h->sourcePort;
+	if (h->stateFlags & sfAMSresponse) {
+		// devices do not ask clients anything but notifications
+		free(f);
+		return;
+	}
+	r->shards[0].stats.requests++;
+	f->port = c->port;
+	if (memcmp(&h->targetId, &r->netId, sizeof(AmsNetId)) == 0) {
+		_ADSrouterRefuse(r, c, h, 0x6);		// no ports of our own yet
+		free(f);
+		return;
+	}
+	if (c->pending >= r->limits.clientPending) {
+		r->shards[0].stats.rejected++;
+		_ADSrouterRefuse(r, c, h, 0x502);
+		free(f);
+		return;
+	}
+	c->pending++;					// till its answer passes _ADSrouterDeliver()
+	sh = _ADSrouterShardOf(r, &h->targetId);
+	if (sh->index == 0) {
+		_ADSrouterRequest(sh, f);
+		return;
+	}
+	switch (_ADSrouterPut(&sh->in, f)) {
+	case 1:
+		_ADSrouterWake(sh);
+		break;
+	case -1:
+		c->pending--;
+		r->shards[0].stats.rejected++;	// the shard does not keep up
+		_ADSrouterRefuse(r, c, h, 0x502);
+		free(f);
+		break;
+	}
+}
+
+/*
+ * Notifications for a client that is gone: ask the device to stop
+ * sending them, the answers go to nobody.
+ */
+static void _ADSrouterOrphans(ADSRouterShard *sh, ADSRouterLink *l,
+							  ADSRouterFrame *n)
+{
+	AMSheader *p = FRAME_AMS(n);
+	unsigned char *d = FRAME_DATA(n), *end;
+	uint32_t stamps, samples, handle, size, avail = p->dataLength;
+
+	if (avail < 8 || avail > FRAME_TCP(n)->length - sizeof(AMSheader))
+		return;
+	end = d + avail;
+	memcpy(&stamps, d + 4, 4);
+	d += 8;
+	while (stamps-- > 0 && end - d >= 12) {
+		memcpy(&samples, d + 8, 4);
+		d += 12;
+		while (samples-- > 0 && end - d >= 8) {
+			memcpy(&handle, d, 4);
+			memcpy(&size, d + 4, 4);
+			d += 8;
+			if (size > end - d)
+				return;
+			d += size;
+			if (_ADSrouterDelHandle(sh, l, p->sourcePort, p->targetPort,
+									handle) != 0)
+				return;
+		}
+	}
+}
+
+/*
+ * From a device: answers go back by invokeId, notifications by port, or
+ * out to the readers of a subscription of the hub.
+ */
+static void _ADSrouterFromLink(ADSRouterShard *sh, ADSRouterLink *l,
+							   ADSRouterFrame *f)
+{
+	AMSheader *h = FRAME_AMS(f);
+	ADSRouterPending *s;
+	ADSRouterWaiter *w;
+
+	if (h->stateFlags & sfAMSresponse) {
+		s = &l->slots[h->invokeId % ADS_ROUTER_PENDING];
+		if (h->invokeId == 0 || s->invokeId != h->invokeId) {
+			sh->stats.strays++;
+			free(f);
+			return;
+		}
+		while ((w = s->waiters) != NULL) {
+			s->waiters = w->next;
+			_ADSrouterAnswer(sh, w->clientPort, &w->source, w->clientInvoke,
+							 _ADSrouterFrameNew(f->data, f->len));
+			free(w);
+		}
+		if (s->sub != NULL)
+			_ADSrouterSubAdded(sh, l, s, f);
+		else
+			_ADSrouterAnswer(sh, s->clientPort, &s->source, s->clientInvoke,
+							 f);
+		_ADSrouterPendingFree(l, s);
+		_ADSrouterDispatch(sh, l);
+		return;
+	}
+
+	if (h->targetPort == ADS_ROUTER_HUBPORT
+		&& h->commandId == cmdADSdevNotify) {
+		sh->stats.notifications++;
+		_ADSrouterFanOut(sh, l, f);
+		free(f);
+		return;
+	}
+	if (!_ADSrouterClientThere(sh->router, h->targetPort)) {
+		sh->stats.strays++;
+		if (h->commandId == cmdADSdevNotify)
+			_ADSrouterOrphans(sh, l, f);
+		free(f);
+		return;
+	}
+	sh->stats.notifications++;
+	f->port = h->targetPort;
+	_ADSrouterToClient(sh, f);
+}
+
+/*
+ * Hands every complete packet in the receive buffer on.
+ * Returns -1 if io is to be closed.
+ */
+static int _ADSrouterParse(ADSRouterShard *sh, ADSRouterIO *io)
+{
+	AMS_TCPheader *h;
+	ADSRouterFrame *f;
+	uint32_t off = 0, len;
+
+	while (io->rxLen - off >= sizeof(AMS_TCPheader)) {
+		h = (AMS_TCPheader *)(io->rx + off);
+		if (h->length < sizeof(AMSheader)
+			|| h->length > ADS_ROUTER_MAXFRAME - sizeof(AMS_TCPheader)) {
+			MsgOut(MSG_ERROR, "ADS router: invalid AMS length\n");
+			return -1;
+		}
+		len = sizeof(AMS_TCPheader) + h->length;
+		if (io->rxLen - off < len)
+			break;
+		f = _ADSrouterFrameNew(io->rx + off, len);
+		if (f == NULL)
+			return -1;
+		if (io->type == ADS_ROUTER_CLIENT)
+			_ADSrouterFromClient(sh->router, (ADSRouterClient *) io, f);
+		else
+			_ADSrouterFromLink(sh, (ADSRouterLink *) io, f);
+		off += len;
+	}
+	memmove(io->rx, io->rx + off, io->rxLen - off);
+	io->rxLen -= off;
+	return 0;
+}
+
+/*
+ * A client on a unix SOCK_SEQPACKET socket: every message is one packet,
+ * read a few of them. Returns -1 if io is to be closed.
+ */
+static int _ADSrouterReadPackets(ADSRouterShard *sh, ADSRouterIO *io)
+{
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < ADS_ROUTER_IOV; i++) {
+		n = recv(io->fd, io->rx, ADS_ROUTER_MAXFRAME, MSG_TRUNC);
+		if (n == 0)
+			return -1;
+		if (n < 0)
+			return errno == EINTR || errno == EAGAIN ? 0 : -1;
+		io->rxLen = n;
+		if (n > ADS_ROUTER_MAXFRAME || _ADSrouterParse(sh, io) != 0
+			|| io->rxLen != 0) {
+			MsgOut(MSG_ERROR, "ADS router: message is not one packet\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Reads what the socket has and hands every complete packet on.
+ * Returns -1 if io is to be closed.
+ */
+static int _ADSrouterRead(ADSRouterShard *sh, ADSRouterIO *io)
+{
+	ssize_t n;
+
+	if (io->packets)
+		return _ADSrouterReadPackets(sh, io);
+	if (io->shm != NULL)
+		n = ADSshmRecv(io->shm, io->rx + io->rxLen,
+					   ADS_ROUTER_MAXFRAME - io->rxLen);
+	else
+		n = recv(io->fd, io->rx + io->rxLen, ADS_ROUTER_MAXFRAME - io->rxLen,
+				 0);
+	if (n == 0)
+		return -1;
+	if (n < 0)
+		return errno == EINTR || errno == EAGAIN ? 0 : -1;
+	io->rxLen += n;
+	return _ADSrouterParse(sh, io);
+}
+
+/*
+ * New clients on from; the ones on the unix socket say hello with their
+ * shared memory before they are clients, see _ADSrouterHello().
+ */
+static void _ADSrouterAccept(ADSRouter *r, ADSRouterIO *from)
+{
+	ADSRouterShard *sh = &r->shards[0];
+	ADSRouterClient *c;
+	int fd, i, opt = 1;
+
+	while ((fd = accept(from->fd, NULL, NULL)) >= 0) {
+		for (i = 0; i < ADS_ROUTER_CLIENTS; i++)
+			if (r->clients[(r->nextClient + i) % ADS_ROUTER_CLIENTS] == NULL)
+				break;
+		c = NULL;
+		if (i < ADS_ROUTER_CLIENTS
+			&& (c = (ADSRouterClient *) calloc(1, sizeof(*c))) != NULL
+			&& (c->io.rx = (unsigned char *) malloc(ADS_ROUTER_MAXFRAME))
+			   == NULL) {
+			free(c);
+			c = NULL;
+		}
+		if (c == NULL || _ADSrouterNonBlocking(fd) != 0) {
+			MsgOut(MSG_ERROR, "ADS router: no room for another client\n");
+			if (c != NULL) {
+				free(c->io.rx);
+				free(c);
+			}
+			close(fd);
+			continue;
+		}
+		if (from->type == ADS_ROUTER_LISTEN)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+		i = (r->nextClient + i) % ADS_ROUTER_CLIENTS;
+		r->nextClient = i + 1;		// ports are not reused at once
+		c->io.type = from->type == ADS_ROUTER_SHMLISTEN ? ADS_ROUTER_HELLO
+														: ADS_ROUTER_CLIENT;
+		c->io.packets = from->type == ADS_ROUTER_UNIXLISTEN;
+		c->io.fd = fd;
+		c->port = ADS_ROUTER_PORTBASE + i;
+		__atomic_store_n(&r->clients[i], c, __ATOMIC_RELAXED);
+		sh->stats.accepted++;
+		sh->stats.clients++;
+		_ADSrouterWatch(sh, &c->io, EPOLLIN);
+		MsgOut(MSG_ROUTING,
+			   MsgStr("ADS router: client on port %d\n", c->port));
+	}
+}
+
+/* the shared memory of a client came, from now on it talks through that */
+static void _ADSrouterHello(ADSRouter *r, ADSRouterClient *c)
+{
+	ADSRouterShard *sh = &r->shards[0];
+	ADSShmLink *l = ADSshmAccept(c->io.fd);
+
+	if (l == NULL) {
+		if (errno != EAGAIN) {
+			MsgOut(MSG_ERROR,
+				   MsgStr("ADS router: no shared memory from the client on "
+						  "port %d: %s\n", c->port, strerror(errno)));
+			_ADSrouterKill(sh, &c->io);
+		}
+		return;
+	}
+	// the socket stays open, inside the epoll set of the link
+	epoll_ctl(sh->epfd, EPOLL_CTL_DEL, c->io.fd, NULL);
+	c->io.fd = l->fd;
+	c->io.events = 0;
+	c->io.shm = l;
+	c->io.type = ADS_ROUTER_CLIENT;
+	_ADSrouterWatch(sh, &c->io, EPOLLIN);
+	MsgOut(MSG_ROUTING,
+		   MsgStr("ADS router: client on port %d in shared memory\n", c->port));
+}
+
+/* on a wake up: what the other shards put into the queues for us */
+static void _ADSrouterWoken(ADSRouterShard *sh)
+{
+	ADSRouter *r = sh->router;
+	ADSRouterFrame *f;
+	uint64_t n;
+	int i;
+
+	if (read(sh->wake.fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		return;
+	if (sh->index != 0) {
+		while ((f = _ADSrouterTake(&sh->in)) != NULL)
+			_ADSrouterRequest(sh, f);
+		return;
+	}
+	for (i = 1; i <= r->threads; i++)
+		while ((f = _ADSrouterTake(&r->shards[i].out)) != NULL)
+			_ADSrouterDeliver(r, f);
+}
+
+static void _ADSrouterClientFree(ADSRouter *r, ADSRouterClient *c)
+{
+	MsgOut(MSG_ROUTING, MsgStr("ADS router: client on port %d gone\n", c->port));
+	__atomic_store_n(&r->clients[c->port - ADS_ROUTER_PORTBASE], NULL,
+					 __ATOMIC_RELAXED);
+	r->shards[0].stats.clients--;
+	if (c->io.shm != NULL)
+		ADSshmClose(c->io.shm);		// fd is the link's
+	else
+		close(c->io.fd);
+	_ADSrouterDropTx(&c->io);
+	free(c->io.rx);
+	free(c);
+}
+
+static void _ADSrouterEvent(ADSRouterShard *sh, ADSRouterIO *io,
+							uint32_t events)
+{
+	ADSRouterLink *l = (ADSRouterLink *) io;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (io->dead)
+		return;
+	if (io->type == ADS_ROUTER_WAKE) {
+		_ADSrouterWoken(sh);
+		return;
+	}
+	if (io->type == ADS_ROUTER_LISTEN || io->type == ADS_ROUTER_SHMLISTEN
+		|| io->type == ADS_ROUTER_UNIXLISTEN) {
+		_ADSrouterAccept(sh->router, io);
+		return;
+	}
+	if (io->type == ADS_ROUTER_HELLO) {
+		_ADSrouterHello(sh->router, (ADSRouterClient *) io);
+		return;
+	}
+	if (io->type == ADS_ROUTER_LINK && l->state == ADS_LINK_CONNECTING) {
+		if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			return;
+		getsockopt(io->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0) {
+			MsgOut(MSG_ERROR,
+				   MsgStr("ADS router: connect() failed: %s\n", strerror(err)));
+			_ADSrouterLinkDown(sh, l, 0x1B);
+			return;
+		}
+		l->state = ADS_LINK_UP;
+		sh->stats.links++;
+		_ADSrouterDispatch(sh, l);
+		_ADSrouterFlush(sh, io);
+		return;
+	}
+	if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		&& _ADSrouterRead(sh, io) != 0) {
+		_ADSrouterKill(sh, io);
+		return;
+	}
+	if ((events & EPOLLOUT) || io->shm != NULL)	// woken for room as well
+		_ADSrouterFlush(sh, io);
+}
+
+/*
+ * Gives up requests the devices did not answer in time, and subscriptions
+ * of clients that are gone.
+ */
+static void _ADSrouterSweep(ADSRouterShard *sh, time_t now)
+{
+	ADSRouterSub *sub, *next;
+	ADSRouterLink *l;
+	int i, k;
+
+	sh->lastSweep = now;
+	for (k = 0; k < ADS_ROUTER_LINKHASH; k++)
+		for (l = sh->links[k]; l != NULL; l = l->next) {
+			for (i = 0; i < ADS_ROUTER_PENDING && l->pending > 0; i++)
+				if (l->slots[i].invokeId != 0
+					&& now - l->slots[i].sent > ADS_ROUTER_TIMEOUT) {
+					sh->stats.expired++;
+					_ADSrouterFailPending(sh, l, &l->slots[i], 0x745);
+				}
+			for (i = 0; i < ADS_ROUTER_NOTEHASH; i++)
+				for (sub = l->subs[i]; sub != NULL; sub = next) {
+					next = sub->next;
+					_ADSrouterSubPrune(sh, l, sub);
+				}
+			_ADSrouterDispatch(sh, l);
+		}
+}
+
+/* sets up shard index of r, 0 or an ADS error code */
+static int _ADSrouterShardInit(ADSRouter *r, int index)
+{
+	ADSRouterShard *sh = &r->shards[index];
+
+	sh->router = r;
+	sh->index = index;
+	sh->wake.type = ADS_ROUTER_WAKE;
+	sh->epfd = epoll_create1(EPOLL_CLOEXEC);
+	sh->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sh->epfd < 0 || sh->wake.fd < 0)
+		return 0x1;
+	_ADSrouterWatch(sh, &sh->wake, EPOLLIN);
+	if (index == 0)
+		return 0;				// takes from the out queues of the others
+	if (_ADSrouterQueueInit(&sh->in, ADS_ROUTER_QUEUE) != 0
+		|| _ADSrouterQueueInit(&sh->out, ADS_ROUTER_QUEUE) != 0)
+		return 0x70A;
+	return 0;
+}
+
+static void _ADSrouterQueueFree(ADSRouterQueue *q)
+{
+	ADSRouterFrame *f;
+
+	if (q->slots == NULL)
+		return;
+	while ((f = _ADSrouterTake(q)) != NULL)
+		free(f);
+	free(q->slots);
+}
+
+/* closes the links of sh, its clients are gone already */
+static void _ADSrouterShardFree(ADSRouterShard *sh)
+{
+	ADSRouterLink *l;
+	int i;
+
+	if (sh->router == NULL)
+		return;					// never set up
+	for (i = 0; i < ADS_ROUTER_LINKHASH; i++)
+		while ((l = sh->links[i]) != NULL) {
+			sh->links[i] = l->next;
+			_ADSrouterLinkDown(sh, l, 0x1A);
+			free(l->io.rx);
+			free(l);
+		}
+	_ADSrouterQueueFree(&sh->in);
+	_ADSrouterQueueFree(&sh->out);
+	if (sh->wake.fd >= 0)
+		close(sh->wake.fd);
+	if (sh->epfd >= 0)
+		close(sh->epfd);
+}
+
+/**
+ * @brief Creates a router listening on address, "host[:port]", for local
+ * clients. netId is the router's own, the source of what it forwards.
+ * @return the router or NULL
+ */
+ADSRouter *ADSrouterNew(const char *address, AmsNetId *netId)
+{
+	struct sockaddr_in addr;
+	ADSRouter *r;
+	int opt = 1;
+
+	if (ADSparseAddress(address, ROUTER_PORT, &addr) != 0) {
+		MsgOut(MSG_ERROR, MsgStr("ADS router: bad address %s\n", address));
+		return NULL;
+	}
+	// aligned, the queues keep their ends on cache lines of their own
+	r = (ADSRouter *) aligned_alloc(ADS_ROUTER_LINE, sizeof(ADSRouter));
+	if (r == NULL)
+		return NULL;
+	memset(r, 0, sizeof(ADSRouter));
+	r->netId = *netId;
+	r->limits.clientPending = ADS_ROUTER_CLIENTPENDING;
+	r->limits.linkQueue = ADS_ROUTER_LINKQUEUE;
+	r->limits.clientTx = ADS_ROUTER_CLIENTTX;
+	r->shmListen.type = ADS_ROUTER_SHMLISTEN;
+	r->shmListen.fd = -1;
+	r->unixListen.type = ADS_ROUTER_UNIXLISTEN;
+	r->unixListen.fd = -1;
+	r->listen.type = ADS_ROUTER_LISTEN;
+	r->listen.fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (_ADSrouterShardInit(r, 0) != 0 || r->listen.fd < 0) {
+		ADSrouterFree(r);
+		return NULL;
+	}
+	setsockopt(r->listen.fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	if (bind(r->listen.fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+		|| listen(r->listen.fd, 64) != 0
+		|| _ADSrouterNonBlocking(r->listen.fd) != 0) {
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADS router: cannot listen on %s: %s\n", address,
+					  strerror(errno)));
+		ADSrouterFree(r);
+		return NULL;
+	}
+	_ADSrouterWatch(&r->shards[0], &r->listen, EPOLLIN);
+	ADSrouteLoadEnv();		// now, a lookup in the loop must not read files
+	return r;
+}
+
+/* listens on the unix socket path with io, of type ADS_ROUTER_...LISTEN */
+static int _ADSrouterListenPath(ADSRouter *r, ADSRouterIO *io, char **saved,
+								const char *path, int sockType)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+
+	if (io->fd >= 0 || strlen(path) >= sizeof(addr.sun_path))
+		return 0x741;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	*saved = strdup(path);
+	if (*saved == NULL)
+		return 0x70A;
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);				// left behind by a router before us
+	io->fd = socket(AF_UNIX, sockType | SOCK_CLOEXEC, 0);
+	if (io->fd < 0
+		|| bind(io->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+		|| listen(io->fd, 64) != 0
+		|| _ADSrouterNonBlocking(io->fd) != 0) {
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADS router: cannot listen on %s: %s\n", path,
+					  strerror(errno)));
+		return 0x1;
+	}
+	_ADSrouterWatch(&r->shards[0], io, EPOLLIN);
+	return 0;
+}
+
+/**
+ * @brief Lets local clients in through shared memory as well, see
+ * ads_shm.c; they hand it over on the unix socket path.
+ * @return 0 or an ADS error code
+ */
+int ADSrouterListenShm(ADSRouter *r, const char *path)
+{
+	return _ADSrouterListenPath(r, &r->shmListen, &r->shmPath, path,
+								SOCK_STREAM);
+}
+
+/**
+ * @brief Lets local clients in over the unix SOCK_SEQPACKET socket path as
+ * well, a packet per message.
+ * @return 0 or an ADS error code
+ */
+int ADSrouterListenUnix(ADSRouter *r, const char *path)
+{
+	return _ADSrouterListenPath(r, &r->unixListen, &r->unixPath, path,
+								SOCK_SEQPACKET);
+}
+
+/**
+ * @brief Lets threads I/O threads of their own handle the devices, each
+ * with a share of them, before ADSrouterRun(). Without, the one thread of
+ * ADSrouterRun() does everything.
+ * @return 0 or an ADS error code
+ */
+int ADSrouterThreads(ADSRouter *r, int threads)
+{
+	int i, rc;
+
+	if (threads < 0 || threads > ADS_ROUTER_THREADS || r->threads != 0)
+		return 0x741;
+	for (i = 1; i <= threads; i++)
+		if ((rc = _ADSrouterShardInit(r, i)) != 0)
+			return rc;
+	r->threads = threads;
+	return 0;
+}
+
+/**
+ * @brief Sets what r lets pile up, see ADSRouterLimits, before
+ * ADSrouterRun(). clientTx only holds back notifications; the answers
+ * of a client are bounded by clientPending, it never gets more.
+ * @return 0 or an ADS error code
+ */
+int ADSrouterSetLimits(ADSRouter *r, const ADSRouterLimits *limits)
+{
+	if (limits->clientPending <= 0 || limits->linkQueue == 0
+		|| limits->clientTx == 0)
+		return 0x741;
+	r->limits = *limits;
+	return 0;
+}
+
+/**
+ * @brief Closes all clients and links and frees r.
+ */
+void ADSrouterFree(ADSRouter *r)
+{
+	int i;
+
+	for (i = 0; i < ADS_ROUTER_CLIENTS; i++)
+		if (r->clients[i] != NULL)
+			_ADSrouterClientFree(r, r->clients[i]);
+	for (i = 0; i <= ADS_ROUTER_THREADS; i++)
+		_ADSrouterShardFree(&r->shards[i]);
+	if (r->listen.fd >= 0)
+		close(r->listen.fd);
+	if (r->shmListen.fd >= 0)
+		close(r->shmListen.fd);
+	if (r->shmPath != NULL) {
+		unlink(r->shmPath);
+		free(r->shmPath);
+	}
+	if (r->unixListen.fd >= 0)
+		close(r->unixListen.fd);
+	if (r->unixPath != NULL) {
+		unlink(r->unixPath);
+		free(r->unixPath);
+	}
+	free(r);
+}
+
+static void *_ADSrouterReloader(void *arg)
+{
+	ADSRouter *r = (ADSRouter *) arg;
+
+	ADSrouteReload();		// links up stay, new ones use the new routes
+	__atomic_store_n(&r->reloading, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* reloads the routes on a thread of its own, not to hold up the loop */
+static void _ADSrouterReload(ADSRouter *r)
+{
+	r->reload = 0;
+	if (r->reloaderRuns)
+		pthread_join(r->reloader, NULL);	// done, see reloading
+	__atomic_store_n(&r->reloading, 1, __ATOMIC_RELAXED);
+	r->reloaderRuns = pthread_create(&r->reloader, NULL, _ADSrouterReloader,
+									 r) == 0;
+	if (!r->reloaderRuns) {
+		MsgOut(MSG_ERROR, "ADS router: cannot start to reload the routes\n");
+		r->reloading = 0;
+	}
+}
+
+/* the event loop of sh, until ADSrouterStop() */
+static int _ADSrouterLoop(ADSRouterShard *sh)
+{
+	struct epoll_event ev[ADS_ROUTER_EVENTS];
+	ADSRouter *r = sh->router;
+	ADSRouterIO *io;
+	time_t now;
+	int i, n;
+
+	while (!r->stop) {
+		n = epoll_wait(sh->epfd, ev, ADS_ROUTER_EVENTS, 1000);
+		if (n < 0 && errno != EINTR) {
+			MsgOut(MSG_ERROR,
+				   MsgStr("ADS router: epoll_wait() failed: %s\n",
+						  strerror(errno)));
+			r->stop = 1;
+			return 0x1;
+		}
+		for (i = 0; i < n; i++)
+			_ADSrouterEvent(sh, (ADSRouterIO *) ev[i].data.ptr, ev[i].events);
+
+		while ((io = sh->dead) != NULL) {
+			sh->dead = io->deadNext;
+			if (io->type == ADS_ROUTER_LINK)
+				_ADSrouterLinkDown(sh, (ADSRouterLink *) io, 0x1A);
+			else
+				_ADSrouterClientFree(r, (ADSRouterClient *) io);
+		}
+		now = time(NULL);
+		if (now != sh->lastSweep)
+			_ADSrouterSweep(sh, now);
+		if (sh->index != 0)
+			continue;
+		if (r->dump) {
+			r->dump = 0;
+			ADSrouterPrintStats(r, stderr);
+		}
+		if (r->reload && !__atomic_load_n(&r->reloading, __ATOMIC_ACQUIRE))
+			_ADSrouterReload(r);
+	}
+	return 0;
+}
+
+static void *_ADSrouterThread(void *arg)
+{
+	_ADSrouterLoop((ADSRouterShard *) arg);
+	return NULL;
+}
+
+/**
+ * @brief Runs the router until ADSrouterStop(), the clients on this
+ * thread, the devices on the threads of ADSrouterThreads(), if any.
+ * @return 0 or an ADS error code
+ */
+int ADSrouterRun(ADSRouter *r)
+{
+	sigset_t all, old;
+	int i, started, rc = 0;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);	// signals are for this one
+	for (started = 0; started < r->threads; started++)
+		if (pthread_create(&r->shards[started + 1].thread, NULL,
+						   _ADSrouterThread, &r->shards[started + 1]) != 0) {
+			MsgOut(MSG_ERROR, "ADS router: cannot start the I/O threads\n");
+			r->stop = 1;
+			rc = 0x1;
+			break;
+		}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc == 0)
+		rc = _ADSrouterLoop(&r->shards[0]);
+	r->stop = 1;
+	for (i = 1; i <= started; i++) {
+		_ADSrouterWake(&r->shards[i]);
+		pthread_join(r->shards[i].thread, NULL);
+	}
+	if (r->reloaderRuns) {
+		pthread_join(r->reloader, NULL);
+		r->reloaderRuns = 0;
+	}
+	return rc;
+}
+
+/**
+ * @brief Makes ADSrouterRun() return, may be called from a signal handler.
+ */
+void ADSrouterStop(ADSRouter *r)
+{
+	r->stop = 1;
+}
+
+/**
+ * @brief The statistics of all shards together; those of the I/O threads
+ * are read while they run, a snapshot. Call it on the thread of
+ * ADSrouterRun(), or while that does not run.
+ */
+void ADSrouterGetStats(ADSRouter *r, ADSRouterStats *st)
+{
+	ADSRouterStats *s;
+	int i, k;
+
+	memset(st, 0, sizeof(*st));
+	st->limits = r->limits;
+	for (i = 0; i < ADS_ROUTER_CLIENTS; i++)
+		if (r->clients[i] != NULL)
+			st->txBytes += r->clients[i]->io.txBytes;
+	for (i = 0; i <= r->threads; i++) {
+		s = &r->shards[i].stats;
+		st->accepted += s->accepted;
+		st->requests += s->requests;
+		st->responses += s->responses;
+		st->notifications += s->notifications;
+		st->failed += s->failed;
+		st->expired += s->expired;
+		st->strays += s->strays;
+		st->coalesced += s->coalesced;
+		st->rejected += s->rejected;
+		st->dropped += s->dropped;
+		st->fanout += s->fanout;
+		st->subscriptions += s->subscriptions;
+		st->subscribers += s->subscribers;
+		st->laneBytes += s->laneBytes;
+		for (k = 0; k < ADS_ROUTER_LANES; k++)
+			st->lanes[k] += s->lanes[k];
+		st->connects += s->connects;
+		st->clients += s->clients;
+		st->links += s->links;
+	}
+}
+
+void ADSrouterPrintStats(ADSRouter *r, FILE *f)
+{
+	ADSRouterStats st, *s = &st;
+	ADSRouteStats rs;
+
+	ADSrouterGetStats(r, &st);
+	fprintf(f, "clients %d (%llu accepted), links %d (%llu connects) on "
+			"%d I/O threads\n", s->clients, (unsigned long long) s->accepted,
+			s->links, (unsigned long long) s->connects, r->threads);
+	fprintf(f, "requests %llu, responses %llu, notifications %llu\n",
+			(unsigned long long) s->requests,
+			(unsigned long long) s->responses,
+			(unsigned long long) s->notifications);
+	fprintf(f, "subscriptions %d for %d of the clients, %llu notifications "
+			"to them\n", s->subscriptions, s->subscribers,
+			(unsigned long long) s->fanout);
+	fprintf(f, "failed %llu, expired %llu, strays %llu, coalesced %llu\n",
+			(unsigned long long) s->failed, (unsigned long long) s->expired,
+			(unsigned long long) s->strays,
+			(unsigned long long) s->coalesced);
+	fprintf(f, "lanes: high %llu, normal %llu, low %llu\n",
+			(unsigned long long) s->lanes[ADS_LANE_HIGH],
+			(unsigned long long) s->lanes[ADS_LANE_NORMAL],
+			(unsigned long long) s->lanes[ADS_LANE_LOW]);
+	fprintf(f, "rejected %llu, dropped %llu, waiting %llu bytes for devices, "
+			"%llu for clients\n", (unsigned long long) s->rejected,
+			(unsigned long long) s->dropped,
+			(unsigned long long) s->laneBytes,
+			(unsigned long long) s->txBytes);
+	fprintf(f, "limits: %d requests per client, %u bytes per device, "
+			"%u per client\n", s->limits.clientPending, s->limits.linkQueue,
+			s->limits.clientTx);
+	ADSrouteGetStats(&rs);
+	fprintf(f, "routes %d (%llu loads, %llu refused), hits %llu, misses %llu\n",
+			rs.routes, (unsigned long long) rs.loads,
+			(unsigned long long) rs.errors, (unsigned long long) rs.hits,
+			(unsigned long long) rs.misses);
+}
@@ -0,0 +1,329 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __ADS_ROUTER_H__
+#define __ADS_ROUTER_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define ADS_ROUTER_CLIENTS	1024			// local clients at the same time
+#define ADS_ROUTER_PORTBASE	30000			// AMS port of the first client
+#define ADS_ROUTER_PENDING	4096			// requests on the way per device
+#define ADS_ROUTER_TIMEOUT	30				// s, then a request is given up
+#define ADS_ROUTER_RETRY	1				// s between connects to a device
+#define ADS_ROUTER_LINKHASH	64
+#define ADS_ROUTER_READHASH	64				// buckets of reads on the way, per
+											// device, see coalescing
+#define ADS_ROUTER_MAXFRAME	(8 * MAXDATALEN)	// biggest packet accepted
+#define ADS_ROUTER_WINDOW	16384			// bytes on the way per device,
+											// requests and answers, see lanes
+#define ADS_ROUTER_SMALL	1024			// writes up to this are urgent
+#define ADS_ROUTER_BULK		4096			// bytes, requests above are bulk
+#define ADS_ROUTER_THREADS	16				// most I/O threads for the devices
+#define ADS_ROUTER_CLIENTPENDING 256		// requests of a client on the way
+#define ADS_ROUTER_LINKQUEUE (1024 * 1024)	// bytes waiting for a device
+#define ADS_ROUTER_CLIENTTX	(1024 * 1024)	// bytes queued for a client, then
+											// its notifications are dropped
+#define ADS_ROUTER_HUBPORT	(ADS_ROUTER_PORTBASE - 1)	// AMS port of the
+											// router's own notifications
+#define ADS_ROUTER_NOTEHASH	64				// buckets of them per device
+#define ADS_ROUTER_QUEUE	4096			// frames in a handoff queue
+#define ADS_ROUTER_LINE		64				// cache line
+
+enum { ADS_ROUTER_LISTEN, ADS_ROUTER_CLIENT, ADS_ROUTER_LINK,
+	   ADS_ROUTER_SHMLISTEN,		// unix socket for shared memory clients
+	   ADS_ROUTER_HELLO,			// such a client before its memory came
+	   ADS_ROUTER_UNIXLISTEN,		// unix SOCK_SEQPACKET socket
+	   ADS_ROUTER_WAKE };			// eventfd, frames in a handoff queue
+enum { ADS_LINK_DOWN, ADS_LINK_CONNECTING, ADS_LINK_UP };
+enum { ADS_LANE_HIGH,				// writeControl, small writes
+	   ADS_LANE_NORMAL,
+	   ADS_LANE_LOW,				// symbol uploads, bulk transfers
+	   ADS_ROUTER_LANES };
+
+/**
+ * One packet as it goes over the wire: AMS/TCP header, AMS header, data.
+ */
+typedef struct _ADSRouterFrame {
+	struct _ADSRouterFrame *next;
+	uint32_t		len;			// bytes in data
+	uint32_t		off;			// bytes of it sent already
+	uint16_t		port;			// of the client it is from or for
+	uint32_t		cost;			// bytes of a request and its answer
+	uint64_t		finish;			// virtual finish time in its lane
+	unsigned char	data[];
+} ADSRouterFrame;
+
+#define FRAME_TCP(f)	((AMS_TCPheader *)(f)->data)
+#define FRAME_AMS(f)	((AMSheader *)((f)->data + sizeof(AMS_TCPheader)))
+#define FRAME_DATA(f)	((f)->data + sizeof(AMS_TCPheader) + sizeof(AMSheader))
+#define FRAME_HEAD		(sizeof(AMS_TCPheader) + sizeof(AMSheader))
+
+/**
+ * What clients and device links have in common: a non blocking socket,
+ * its receive buffer and the frames waiting to be sent. Clients in shared
+ * memory have shm instead, and fd is the one of the link.
+ */
+typedef struct _ADSRouterIO {
+	int				type;			// ADS_ROUTER_...
+	int				fd;
+	struct _ADSShmLink *shm;		// see ads_shm.h
+	int				packets;		// SOCK_SEQPACKET, one packet per message
+	uint32_t		events;			// registered with epoll
+	int				dead;			// to be closed after this round
+	struct _ADSRouterIO *deadNext;
+	unsigned char	*rx;
+	uint32_t		rxLen;
+	ADSRouterFrame	*txFirst, *txLast;
+	int				txFrames;
+	size_t			txBytes;
+} ADSRouterIO;
+
+/**
+ * A client waiting for the answer to a read another client sent already.
+ */
+typedef struct _ADSRouterWaiter {
+	struct _ADSRouterWaiter *next;
+	uint16_t		clientPort;
+	uint32_t		clientInvoke;
+	AmsAddr			source;
+} ADSRouterWaiter;
+
+struct _ADSRouterSub;
+
+/**
+ * A client's notification handle, one of those sharing a subscription.
+ */
+typedef struct _ADSRouterReader {
+	struct _ADSRouterReader *next;		// of its subscription
+	struct _ADSRouterReader *hashNext;	// by handle
+	struct _ADSRouterSub *sub;
+	uint16_t		clientPort;
+	uint32_t		handle;			// the client's, of the router
+	int				waiting;		// for the device to answer the add
+	uint32_t		clientInvoke;	// of the add while waiting
+	AmsAddr			source;			// the client's address
+} ADSRouterReader;
+
+/**
+ * One notification handle of a device, for all clients asking for the
+ * same, see _ADSrouterSubscribe(). It keeps the last sample for those
+ * coming later.
+ */
+typedef struct _ADSRouterSub {
+	struct _ADSRouterSub *next;		// hash chain by what it is for
+	struct _ADSRouterSub *handleNext;	// by the device's handle
+	uint16_t		targetPort;
+	ADSaddDeviceNotificationRequest rq;	// what, reserved zeroed
+	uint32_t		handle;			// the device's, 0 while adding
+	ADSRouterReader	*readers;
+	uint64_t		stamp;			// of the last sample
+	uint32_t		size;			// bytes in last
+	unsigned char	*last;
+} ADSRouterSub;
+
+/**
+ * A request of a client on the way to a device, found by our invokeId.
+ * Reads are found by what they read as well, a client asking for the same
+ * while one is on the way gets its answer too, see _ADSrouterJoin().
+ */
+typedef struct _ADSRouterPending {
+	uint32_t		invokeId;		// ours towards the device, 0 if free
+	uint16_t		clientPort;		// 0 for requests of the router itself
+	uint16_t		targetPort;
+	uint16_t		commandId;
+	uint32_t		clientInvoke;	// the client's invokeId
+	AmsAddr			source;			// the client's address
+	time_t			sent;
+	int				shared;			// a read in the link's reads
+	uint32_t		indexGroup;		// what it reads
+	uint32_t		indexOffset;
+	uint32_t		length;
+	uint32_t		epoch;			// of the link when it was sent
+	uint32_t		cost;			// in the window of the link, 0 while
+									// it waits in its lane
+	ADSRouterWaiter	*waiters;		// for the same answer
+	struct _ADSRouterPending *readNext;	// hash chain
+	ADSRouterSub	*sub;			// the add of this subscription
+} ADSRouterPending;
+
+/**
+ * The one connection to a device, shared by all clients.
+ */
+typedef struct _ADSRouterLink {
+	ADSRouterIO		io;				// first, see ADSRouterIO
+	AmsNetId		netId;
+	int				state;			// ADS_LINK_...
+	time_t			failed;			// last failed connect, see ADS_ROUTER_RETRY
+	uint32_t		nextInvoke;
+	int				pending;		// slots in use
+	uint32_t		epoch;			// counts what is not a read, reads sent
+									// before may be out of date
+	ADSRouterPending *reads[ADS_ROUTER_READHASH];	// shared ones
+	ADSRouterFrame	*laneFirst[ADS_ROUTER_LANES];	// waiting for the window
+	ADSRouterFrame	*laneLast[ADS_ROUTER_LANES];
+	uint64_t		laneFinish[ADS_ROUTER_LANES];	// of the last one queued
+	uint64_t		vtime;			// finish time of the last one sent
+	uint32_t		window;			// bytes on the way
+	uint32_t		laneBytes;		// waiting in the lanes
+	uint16_t		queued[ADS_ROUTER_CLIENTS][ADS_ROUTER_LANES];	// by client
+	ADSRouterSub	*subs[ADS_ROUTER_NOTEHASH];		// by what
+	ADSRouterSub	*subHandles[ADS_ROUTER_NOTEHASH];	// by the device's handle
+	ADSRouterReader	*readers[ADS_ROUTER_NOTEHASH];	// by the client's handle
+	uint32_t		nextHandle;		// for the clients
+	ADSRouterPending slots[ADS_ROUTER_PENDING];
+	struct _ADSRouterLink *next;	// hash chain
+} ADSRouterLink;
+
+/**
+ * A local process. Towards the devices it has an AMS port of the router,
+ * answers and notifications for that port go back to it.
+ */
+typedef struct _ADSRouterClient {
+	ADSRouterIO		io;				// first, see ADSRouterIO
+	uint16_t		port;			// ours, ADS_ROUTER_PORTBASE + index
+	AmsAddr			addr;			// its own, as it sends from
+	int				pending;		// its requests not answered yet
+} ADSRouterClient;
+
+/**
+ * What the router lets pile up before it refuses requests with 0x502,
+ * at once, or drops notifications, instead of growing without bound.
+ */
+typedef struct {
+	int				clientPending;	// requests of a client on the way
+	uint32_t		linkQueue;		// bytes of requests waiting for a device
+	uint32_t		clientTx;		// bytes queued for a client, beyond its
+									// notifications are dropped; answers
+									// are bounded by clientPending only
+} ADSRouterLimits;
+
+typedef struct {
+	uint64_t		accepted;		// clients
+	uint64_t		requests;		// from clients to devices
+	uint64_t		responses;		// from devices to clients
+	uint64_t		notifications;	// from devices to clients
+	uint64_t		failed;			// requests answered by the router with
+									// an error
+	uint64_t		expired;		// requests the device did not answer
+	uint64_t		strays;			// answers and notifications for nobody
+	uint64_t		coalesced;		// reads answered by the same one of
+									// another client
+	uint64_t		lanes[ADS_ROUTER_LANES];	// requests sent per lane
+	uint64_t		rejected;		// requests failed at once, over a limit
+	uint64_t		dropped;		// notifications for clients that did not
+									// take what was queued for them
+	uint64_t		fanout;			// notifications from subscriptions
+									// of the router to clients
+	int				subscriptions;	// notification handles at the devices
+	int				subscribers;	// and those of the clients on them
+	uint64_t		laneBytes;		// waiting for the devices now
+	uint64_t		txBytes;		// waiting for the clients now
+	ADSRouterLimits	limits;
+	uint64_t		connects;		// to devices
+	int				clients;		// now
+	int				links;			// devices connected now
+} ADSRouterStats;
+
+/**
+ * Frames from one thread to another, one puts, the other takes, no locks.
+ */
+typedef struct {
+	ADSRouterFrame	**slots;
+	uint32_t		mask;			// slots - 1
+	uint32_t		head __attribute__((aligned(ADS_ROUTER_LINE)));	// taker's
+	uint32_t		tail __attribute__((aligned(ADS_ROUTER_LINE)));	// putter's
+} ADSRouterQueue;
+
+/**
+ * An event loop with its own epoll set. Shard 0 runs in ADSrouterRun()
+ * with the clients, each of the others on its own thread with a share of
+ * the links; a link stays on its shard for good. Requests go to a shard
+ * through in, answers and notifications come back through out.
+ * Without threads shard 0 has the links as well.
+ */
+typedef struct _ADSRouterShard {
+	struct _ADSRouter *router;
+	int				index;
+	int				epfd;
+	ADSRouterIO		wake;			// eventfd, something in a queue for us
+	pthread_t		thread;
+	ADSRouterQueue	in;				// requests, from shard 0
+	ADSRouterQueue	out;			// for the clients, to shard 0
+	ADSRouterLink	*links[ADS_ROUTER_LINKHASH];
+	struct {						// notifications on their way to each
+		ADSRouterFrame *f;			// client, see _ADSrouterFanOut()
+		uint32_t	used;			// bytes of data
+		uint32_t	cap;			// bytes f has room for
+		int			listed;			// in fanClients
+		uint32_t	stampAt;		// where the samples of the stamp count
+		int			stamp;			// the one of the device's notification
+	} fan[ADS_ROUTER_CLIENTS];
+	uint16_t		fanClients[ADS_ROUTER_CLIENTS];	// with a frame in fan
+	int				fanCount;
+	ADSRouterIO		*dead;			// to be closed after this round
+	time_t			lastSweep;
+	ADSRouterStats	stats;			// what happened here
+} ADSRouterShard;
+
+typedef struct _ADSRouter {
+	ADSRouterIO		listen;
+	ADSRouterIO		shmListen;		// fd -1 unless ADSrouterListenShm()
+	char			*shmPath;
+	ADSRouterIO		unixListen;		// fd -1 unless ADSrouterListenUnix()
+	char			*unixPath;
+	AmsNetId		netId;			// ours, the source of what we forward
+	ADSRouterClient	*clients[ADS_ROUTER_CLIENTS];	// of shard 0, the others
+									// only look whether one is there
+	int				nextClient;		// where the search for a free one starts
+	int				threads;		// shards with links of their own
+	ADSRouterLimits	limits;
+	ADSRouterShard	shards[1 + ADS_ROUTER_THREADS];
+	volatile sig_atomic_t stop;
+	volatile sig_atomic_t dump;		// print the stats, e.g. on SIGUSR1
+	volatile sig_atomic_t reload;	// reload the routes, e.g. on SIGHUP
+	pthread_t		reloader;		// does it, names may take a while
+	int				reloaderRuns;	// started, not joined yet
+	int				reloading;		// atomic, reloader not done yet
+} ADSRouter;
+
+ADSRouter *ADSrouterNew(const char *address, AmsNetId *netId);
+int ADSrouterListenShm(ADSRouter *r, const char *path);
+int ADSrouterListenUnix(ADSRouter *r, const char *path);
+int ADSrouterThreads(ADSRouter *r, int threads);
+int ADSrouterSetLimits(ADSRouter *r, const ADSRouterLimits *limits);
+void ADSrouterFree(ADSRouter *r);
+int ADSrouterRun(ADSRouter *r);
+void ADSrouterStop(ADSRouter *r);
+void ADSrouterGetStats(ADSRouter *r, ADSRouterStats *stats);
+void ADSrouterPrintStats(ADSRouter *r, FILE *f);
+
+#endif //__ADS_ROUTER_H__
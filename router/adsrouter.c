@@ -0,0 +1,201 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * adsrouter: shares one connection per device among the local processes.
+ * Usage: adsrouter [-l host[:port]] [-s path] [-u path] [-r routes]
+ *                  [-t threads] [-q requests[,device KB[,client KB]]]
+ *                  [-n netId] [-d debug mask]
+ * -d is only there in a build with DEBUGPRINT.
+ * Clients connect with AdsSetRouter() or ADS_ROUTER=host[:port], with -s
+ * through shared memory as well: ADS_ROUTER=shm:path, with -u over a unix
+ * socket: ADS_ROUTER=unix:path.
+ * -r takes the addresses of the devices from a route file, see
+ * ads_route.c, instead of the IP address in their NetId.
+ * -t shares the devices out among that many I/O threads.
+ * -q bounds the requests a client has open, the bytes waiting for a device
+ * and those waiting for a client beyond which its notifications are
+ * dropped, see ADSrouterSetLimits().
+ * SIGUSR1 prints the statistics, SIGHUP reloads the routes, SIGINT and
+ * SIGTERM stop it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_route.h"
+#include "ads_router.h"
+#include "debugprint.h"
+
+#ifdef DEBUGPRINT
+extern int _ADSDebug;				// see debugprint.c
+#define DEBUGOPT "d:"
+#define DEBUGUSAGE " [-d debug mask]"
+#else
+#define DEBUGOPT ""
+#define DEBUGUSAGE ""
+#endif
+
+static ADSRouter *router;
+
+static void onSignal(int sig)
+{
+	if (sig == SIGUSR1)
+		router->dump = 1;
+	else if (sig == SIGHUP)
+		router->reload = 1;
+	else
+		ADSrouterStop(router);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: adsrouter [-l host[:port]] [-s path] [-u path] "
+			"[-r routes] [-t threads]\n"
+			"                 [-q requests[,device KB[,client KB]]] "
+			"[-n a.b.c.d.e.f]" DEBUGUSAGE "\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *address = "127.0.0.1";
+	const char *shmPath = NULL;
+	const char *unixPath = NULL;
+	const char *routePath = NULL;
+	int threads = 0;
+	const char *limitSpec = NULL;
+	ADSRouterLimits limits;
+	unsigned int kb[2];
+	struct sigaction sa;
+	AmsAddr me;
+	AmsNetId netId;
+	int opt, rc, b[6];
+
+	if (AdsGetMeAddress(&me, ROUTER_PORT) != 0)
+		memset(&me, 0, sizeof(me));
+	netId = me.netId;
+	while ((opt = getopt(argc, argv, "l:s:u:r:t:q:n:" DEBUGOPT)) != -1) {
+		switch (opt) {
+		case 'l':
+			address = optarg;
+			break;
+		case 's':
+			shmPath = optarg;
+			break;
+		case 'u':
+			unixPath = optarg;
+			break;
+		case 'r':
+			routePath = optarg;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'q':
+			limitSpec = optarg;
+			break;
+		case 'n':
+			if (sscanf(optarg, "%d.%d.%d.%d.%d.%d", &b[0], &b[1], &b[2],
+					   &b[3], &b[4], &b[5]) != 6)
+				usage();
+			for (rc = 0; rc < 6; rc++)
+				netId.b[rc] = b[rc];
+			break;
+#ifdef DEBUGPRINT
+		case 'd':
+			_ADSDebug = strtol(optarg, NULL, 0);
+			break;
+#endif
+		default:
+			usage();
+		}
+	}
+
+	if (routePath != NULL && (rc = ADSrouteLoad(routePath)) != 0) {
+		fprintf(stderr, "adsrouter: cannot load the routes from %s: 0x%x\n",
+				routePath, rc);
+		return 1;
+	}
+	router = ADSrouterNew(address, &netId);
+	if (router == NULL) {
+		fprintf(stderr, "adsrouter: cannot listen on %s\n", address);
+		return 1;
+	}
+	if (ADSrouterThreads(router, threads) != 0) {
+		fprintf(stderr, "adsrouter: cannot start %d I/O threads\n", threads);
+		ADSrouterFree(router);
+		return 1;
+	}
+	if (limitSpec != NULL) {
+		kb[0] = router->limits.linkQueue / 1024;
+		kb[1] = router->limits.clientTx / 1024;
+		rc = sscanf(limitSpec, "%d,%u,%u", &limits.clientPending, &kb[0],
+					&kb[1]);
+		limits.linkQueue = kb[0] * 1024;
+		limits.clientTx = kb[1] * 1024;
+		if (rc < 1 || ADSrouterSetLimits(router, &limits) != 0) {
+			fprintf(stderr, "adsrouter: bad limits %s\n", limitSpec);
+			ADSrouterFree(router);
+			return 1;
+		}
+	}
+	if (shmPath != NULL && ADSrouterListenShm(router, shmPath) != 0) {
+		fprintf(stderr, "adsrouter: cannot listen on %s\n", shmPath);
+		ADSrouterFree(router);
+		return 1;
+	}
+	if (unixPath != NULL && ADSrouterListenUnix(router, unixPath) != 0) {
+		fprintf(stderr, "adsrouter: cannot listen on %s\n", unixPath);
+		ADSrouterFree(router);
+		return 1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "adsrouter: NetId %d.%d.%d.%d.%d.%d, clients on %s\n",
+			netId.b[0], netId.b[1], netId.b[2], netId.b[3], netId.b[4],
+			netId.b[5], address);
+	if (shmPath != NULL)
+		fprintf(stderr, "adsrouter: shared memory clients on %s\n", shmPath);
+	if (unixPath != NULL)
+		fprintf(stderr, "adsrouter: unix socket clients on %s\n", unixPath);
+	rc = ADSrouterRun(router);
+	ADSrouterPrintStats(router, stderr);
+	ADSrouterFree(router);
+	return rc;
+}
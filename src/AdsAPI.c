@@ -32,11 +32,12 @@
 #include "AdsDEF.h"
 #include "ads.h"
 #include "ads_connect.h"
+#include "ads_clock.h"
+#include "ads_route.h"
 #include "AdsAPI.h"
+#include "ads_notify.h"
 #include "debugprint.h"
 
-extern ADSConnection 	**pADSConnectionList;
-extern int				nADSConnectionCnt;
 int defaultPort = 0;	//port used by "not extended" functions,
 						//set to 1 by AdsPortOpen()
 
@@ -62,7 +63,8 @@ int32_t AdsGetDllVersion( void )
 /**
  * @brief Establishes a connection (communication port) to the TwinCAT
  * @brief message router. (Beckhoff says)
- * As we dont use a message router, we do nothing here...
+ * Unless AdsSetRouter() or ADS_ROUTER name a local adsrouter, we dont use
+ * a message router, we do nothing here...
  * Hint: the opening of a connection takes place at the first read or write
  * operation to/from a PLC. ADSsocketConnect() does it.
  * @return 0x0 (ADS Success)
@@ -73,6 +75,30 @@ int32_t AdsPortOpen(void)
 	return defaultPort;
 }
 
+/**
+ * @brief Makes the connections opened from now on go through the local
+ * adsrouter at address, "host[:port]", which shares one connection per
+ * PLC among all processes; NULL connects to the PLCs straight again.
+ * Without a call the environment variable ADS_ROUTER is used, if set.
+ * @return Returns the function's error status.
+ */
+int32_t AdsSetRouter(const char *address)
+{
+	return ADSsetRouter(address);
+}
+
+/**
+ * @brief Finds the PLCs through the route file path, lines of
+ * "NetId host[:port]", instead of by the IP address in their NetId;
+ * call it again to reload the file. NULL drops the routes.
+ * Without a call the environment variable ADS_ROUTES is used, if set.
+ * @return Returns the function's error status.
+ */
+int32_t AdsLoadRoutes(const char *path)
+{
+	return ADSrouteLoad(path);
+}
+
 /**
  * @brief The connection (communication port) to the TwinCAT message router
  * is closed. (Beckhoff says)
@@ -82,14 +108,7 @@ int32_t AdsPortOpen(void)
  */
 int32_t AdsPortClose(void)
 {
-	int i;
-
-	for(i = 0; i < nADSConnectionCnt; i++){
-		ADSsocketDisconnect(pADSConnectionList[i]);
-		ADSFreeConnection(pADSConnectionList[i]);
-	}
-	free(pADSConnectionList);
-	nADSConnectionCnt = 0;
+	ADSsocketCloseAll();
 	return 0;
 }
 
@@ -428,6 +447,91 @@ int32_t AdsSyncReadWriteReq(PAmsAddr pAddr,
 								 NULL);
 }
 
+/**
+ * @brief Defines a notification within an ADS server (e.g. PLC). When a
+ * @brief certain event occurs a function (the callback function) is
+ * @brief invoked in the ADS client.
+ * The callback runs on the receive thread of the connection, it must not
+ * call the synchronous functions of this library for the same device.
+ * @param port  port number of an Ads port that had previously been opened with
+ *				AdsPortOpenEx or AdsPortOpen..
+ * @param pAddr Structure with NetId and port number of the ADS server.
+ * @param nIndexGroup Index Group.
+ * @param nIndexOffset Index Offset.
+ * @param pNoteAttrib Pointer to the structure that contains further
+ *					  information.
+ * @param pNoteFunc Name of the callback function.
+ * @param hUser 32-bit value that is passed to the callback function.
+ * @param pNotification Address of the variable that will receive the handle
+ *						of the notification.
+ * @return Returns the function's error status.
+ */
+int32_t AdsSyncAddDeviceNotificationReqEx(int32_t port, PAmsAddr pAddr,
+                         uint32_t nIndexGroup, uint32_t nIndexOffset,
+                         PAdsNotificationAttrib pNoteAttrib,
+                         PAdsNotificationFunc pNoteFunc,
+                         uint32_t hUser, uint32_t *pNotification)
+{
+	ADSConnection *dc;
+	int adsError;
+
+	dc = ADSsocketGet(port, pAddr, &adsError);
+	if(!dc)
+		return adsError;
+
+	return _ADSnotifyAddApi(dc, nIndexGroup, nIndexOffset, pNoteAttrib,
+							pNoteFunc, hUser, pNotification);
+}
+
+/**
+ * @brief A frontend to AdsSyncAddDeviceNotificationReqEx() with port = defaultPort
+ */
+int32_t AdsSyncAddDeviceNotificationReq(PAmsAddr pAddr,
+                         uint32_t nIndexGroup, uint32_t nIndexOffset,
+                         PAdsNotificationAttrib pNoteAttrib,
+                         PAdsNotificationFunc pNoteFunc,
+                         uint32_t hUser, uint32_t *pNotification)
+{
+	return AdsSyncAddDeviceNotificationReqEx(defaultPort, pAddr,
+											 nIndexGroup, nIndexOffset,
+											 pNoteAttrib, pNoteFunc,
+											 hUser, pNotification);
+}
+
+/**
+ * @brief A notification defined previously is deleted from an ADS server.
+ * @param port  port number of an Ads port that had previously been opened with
+ *				AdsPortOpenEx or AdsPortOpen..
+ * @param pAddr Structure with NetId and port number of the ADS server.
+ * @param hNotification Address of the variable that contains the handle
+ *						of the notification.
+ * @return Returns the function's error status.
+ */
+int32_t AdsSyncDelDeviceNotificationReqEx(int32_t port, PAmsAddr pAddr,
+                         uint32_t hNotification)
+{
+	ADSConnection *dc;
+	ADSNotification *n;
+	int adsError;
+
+	dc = ADSsocketGet(port, pAddr, &adsError);
+	if(!dc)
+		return adsError;
+
+	n = ADSnotifyFind(dc, hNotification);
+	if(!n)
+		return 0x714;	// notification handle is invalid
+	return ADSnotifyDel(n);
+}
+
+/**
+ * @brief A frontend to AdsSyncDelDeviceNotificationReqEx() with port = defaultPort
+ */
+int32_t AdsSyncDelDeviceNotificationReq(PAmsAddr pAddr, uint32_t hNotification)
+{
+	return AdsSyncDelDeviceNotificationReqEx(defaultPort, pAddr, hNotification);
+}
+
 /**
  * @brief Alters the timeout for the ADS functions. The standard value is 5000 ms.
  * @param port port number of an Ads port that had previously been opened with
@@ -450,19 +554,44 @@ int32_t AdsSyncSetTimeout(int32_t nMs)
 
 /**
  * A helper function to convert a Windows Filetime (64 bit)
- * to an UNIX time
+ * to UNIX time in nanoseconds.
  * @param winTime Windows Filetime
- * @return Returns the equivalent UNIX time.
+ * @return Returns the equivalent UNIX time in ns.
  */
-#define EPOCH_DIFF 116444736000000000LL
+int64_t FileTime2ns(int64_t winTime)
+{
+	return ADSfileTimeToNs(winTime);
+}
 
-time_t FileTime2tt(int64_t winTime)
+/**
+ * @brief Converts a time stamp of the device at pAddr, e.g. nTimeStamp of
+ * an AdsNotificationHeader, to our UNIX time in ns, corrected by the
+ * offset and drift of the device's clock measured from its notifications.
+ * It never connects to the device.
+ * @param port port number of an Ads port that had previously been opened with
+ *			   AdsPortOpenEx or AdsPortOpen.
+ * @param pAddr Structure with NetId and port number of the ADS server.
+ * @param nTimeStamp Windows Filetime of the device.
+ * @return Returns the time in ns, uncorrected if there is no connection
+ *		   to the device or nothing was measured yet.
+ */
+int64_t AdsTimeStamp2nsEx(int32_t port, PAmsAddr pAddr, int64_t nTimeStamp)
 {
-	time_t tt;
+	ADSConnection *dc;
 
-	winTime -= EPOCH_DIFF;
-	winTime /= 10000000LL;
-	tt = (time_t)winTime;
+	dc = ADSsocketFind(pAddr);
+	if(!dc)
+		return FileTime2ns(nTimeStamp);
+	return ADSclockToNs(dc, nTimeStamp);
+}
 
-	return tt;
+/**
+ * A helper function to convert a Windows Filetime (64 bit)
+ * to an UNIX time, in whole seconds; see FileTime2ns().
+ * @param winTime Windows Filetime
+ * @return Returns the equivalent UNIX time.
+ */
+time_t FileTime2tt(int64_t winTime)
+{
+	return (time_t)(FileTime2ns(winTime) / 1000000000LL);
 }
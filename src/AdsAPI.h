@@ -153,6 +153,13 @@ int32_t AdsSyncSetTimeoutEx(int32_t port, int32_t nMs);
 int32_t AdsSyncGetTimeoutEx(int32_t port, int32_t *pnMs);
 int32_t AdsAmsPortEnabledEx(int32_t nPort, char *pbEnabled);
 
+int32_t AdsSetRouter(const char *address);		// local adsrouter or NULL
+int32_t AdsLoadRoutes(const char *path);		// NetId -> address file or NULL
+int64_t FileTime2ns(int64_t winTime);
+int64_t AdsTimeStamp2nsEx(int32_t port,					// Ams port of ADS client
+						PAmsAddr pAddr,
+						int64_t nTimeStamp);			// of the device at pAddr
+
 
 #endif	/* __ADSAPI_H__ */
 
@@ -34,10 +34,15 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <ifaddrs.h>
+#include <pthread.h>
 
 #include "AdsDEF.h"
 #include "ads.h"
 #include "ads_io.h"
+#include "ads_async.h"
+#include "ads_cache.h"
+#include "ads_clock.h"
+#include "ads_notify.h"
 #include "debugprint.h"
 
 AmsAddr 		meAddr = {{"\0"}, 0};		// filled in by AdsGetMeAddress()
@@ -240,6 +245,7 @@ ADSInterface *_ADSNewInterface(int sd,
 	ADSInterface *di = (ADSInterface *) calloc(1, sizeof(ADSInterface));
 	if (di) {
 		di->sd = sd;
+		di->transport = &ADStcpTransport;
 		di->name = nname;
 		di->me = me;
 		di->AMSport = port;
@@ -267,6 +273,10 @@ ADSConnection *_ADSNewConnection(ADSInterface * di, AmsNetId partner, int port)
 		dc->iface = di;
 		dc->partner = partner;
 		dc->AMSport = port;
+		pthread_mutex_init(&dc->lock, NULL);
+		pthread_mutex_init(&dc->flightLock, NULL);
+		pthread_mutex_init(&dc->noteLock, NULL);
+		dc->clock = (ADSClock *) calloc(1, sizeof(ADSClock));	// may be NULL
 	}
 	return dc;
 }
@@ -276,7 +286,13 @@ ADSConnection *_ADSNewConnection(ADSInterface * di, AmsNetId partner, int port)
  */
 void ADSFreeConnection(ADSConnection *dc)
 {
+	ADSasyncStop(dc);
+	_ADSnotifyFree(dc);
 	_ADSFreeInterface(dc->iface);
+	free(dc->clock);
+	pthread_mutex_destroy(&dc->noteLock);
+	pthread_mutex_destroy(&dc->flightLock);
+	pthread_mutex_destroy(&dc->lock);
 	free(dc);
 }
 
@@ -291,7 +307,7 @@ void _ADSsetupAmsHeader(ADSConnection *dc, AMSheader *h)
 	h->sourcePort 	= dc->iface->AMSport;
 	h->stateFlags 	= 4;
 	h->errorCode 	= 0;
-	h->invokeId 	= ++dc->invokeId;
+	h->invokeId 	= __atomic_add_fetch(&dc->invokeId, 1, __ATOMIC_RELAXED);
 };
 
 /**
@@ -339,7 +355,7 @@ int32_t AdsGetMeAddress(PAmsAddr pAddr, int AmsPort)
  * This is an interface to AdsAPI.c.
  * Used by AdsSyncReadReqEx()
  */
-int ADSreadBytes(ADSConnection *dc,
+static int _ADSreadBytes(ADSConnection *dc,
                  uint32_t indexGroup, uint32_t offset,
                  uint32_t length, void *buffer,
                  uint32_t *pnRead)
@@ -377,7 +393,7 @@ int ADSreadBytes(ADSConnection *dc,
 
 	MsgAnalyzePacket("ADSreadBytes", p1);
 
-	rc = _ADSWritePacket(dc->iface, p1, &nErr);
+	rc = _ADSSendRequest(dc, p1, &nErr);
 	if(rc <= 0){
 #ifdef LOG_ALL_MESSAGES
 		syslog(LOG_USER | LOG_ERR, "ADSreadBytes() failed().");
@@ -386,11 +402,12 @@ int ADSreadBytes(ADSConnection *dc,
 		return( _ADStranslateWrError(rc, nErr));
 	}
 
-	dc->AnswLen = _ADSReadPacket(dc->iface, dc->msgIn, &nErr);
+	dc->AnswLen = _ADSReadAnswer(dc, &nErr);
 	if (dc->AnswLen > 0 && nErr == 0 ) {
 		p2 = (ADSpacket *) dc->msgIn;
-// 		if (p2->amsHeader.commandId == cmdADSread && p2->amsHeader.errorCode == 0) {
-		if (p2->amsHeader.commandId == cmdADSread) {
+		// an answer with an AMS error, e.g. of a router, has no data
+		if (p2->amsHeader.commandId == cmdADSread
+			&& p2->amsHeader.errorCode == 0) {
 			MsgDumpPacket("ADSreadBytes", dc->msgIn, dc->AnswLen);
 			MsgAnalyzePacket("ADSreadBytes", (ADSpacket *)dc->msgIn);
 
@@ -447,7 +464,7 @@ int ADSreadBytes(ADSConnection *dc,
  * This is an interface to AdsAPI.c.
  * Used by AdsSyncWriteReq().
  */
-int ADSwriteBytes(ADSConnection *dc,
+static int _ADSwriteBytes(ADSConnection *dc,
 				  int indexGroup, int offset,
 				  int length, void *data)
 {
@@ -484,17 +501,17 @@ int ADSwriteBytes(ADSConnection *dc,
 	MsgOut(MSG_PACKET_V, MsgStr("Data length:   %d\n", rq->length));
 
 	MsgAnalyzePacket("ADSwriteBytes()", p1);
-	rc = _ADSWritePacket(dc->iface, p1, &nErr);
+	rc = _ADSSendRequest(dc, p1, &nErr);
 	if(rc <= 0){
 		MsgOut(MSG_ERROR, "ADSwriteBytes() failed().\n");
 		return( _ADStranslateWrError(rc, nErr));
 	}
 
 	/*Reads the answer */
-	dc->AnswLen = _ADSReadPacket(dc->iface, dc->msgIn, &nErr);
+	dc->AnswLen = _ADSReadAnswer(dc, &nErr);
 	if (dc->AnswLen >= (sizeof(AMS_TCPheader) + sizeof(AMSheader))) {
 		p2 = (ADSpacket *) dc->msgIn;
-		if(nErr == 0 ) {
+		if(nErr == 0 && p2->amsHeader.errorCode == 0) {
 			MsgAnalyzePacket("ADSwriteBytes()", (ADSpacket*)dc->msgIn);
 			wr = (ADSwriteResponse *) (dc->msgIn + 38);
 			MsgOut(MSG_TRACE,
@@ -514,7 +531,7 @@ int ADSwriteBytes(ADSConnection *dc,
  * This is an interface to AdsAPI.c.
  * Used by ADSreadDeviceInfo().
  */
-int ADSreadDeviceInfo(ADSConnection * dc, char *pDevName, PAdsVersion pVersion)
+static int _ADSreadDeviceInfo(ADSConnection * dc, char *pDevName, PAdsVersion pVersion)
 {
 	AMSheader 		*h1;
 //	AMS_TCPheader 	*h2; not used
@@ -536,7 +553,7 @@ int ADSreadDeviceInfo(ADSConnection * dc, char *pDevName, PAdsVersion pVersion)
 	p1->adsHeader.reserved = 0;
 
 	MsgAnalyzePacket("ADSreadDeviceInfo()", p1);
-	rc = _ADSWritePacket(dc->iface, p1, &nErr);
+	rc = _ADSSendRequest(dc, p1, &nErr);
 	if(rc <= 0){
 #ifdef LOG_ALL_MESSAGES
 		syslog(LOG_USER | LOG_ERR, "ADSreadDeviceInfo() failed().");
@@ -546,10 +563,11 @@ int ADSreadDeviceInfo(ADSConnection * dc, char *pDevName, PAdsVersion pVersion)
 	}
 
 	/*Reads the answer */
-	dc->AnswLen = _ADSReadPacket(dc->iface, dc->msgIn, &nErr);
+	dc->AnswLen = _ADSReadAnswer(dc, &nErr);
 	if (dc->AnswLen > 0 && nErr == 0 ) {
 		p2 = (ADSpacket *) dc->msgIn;
-		if (p2->amsHeader.commandId == cmdADSreadDevInfo) {
+		if (p2->amsHeader.commandId == cmdADSreadDevInfo
+			&& p2->amsHeader.errorCode == 0) {
 			MsgAnalyzePacket("ADSreadDeviceInfo()", (ADSpacket*)dc->msgIn);
 			DeviceInfo = (ADSdeviceInfo *) (dc->msgIn + 38);
 			*pVersion = DeviceInfo->Version;
@@ -575,7 +593,7 @@ int ADSreadDeviceInfo(ADSConnection * dc, char *pDevName, PAdsVersion pVersion)
  * This is an interface to AdsAPI.c.
  * Used by AdsSyncReadWriteReqEx().
  */
-int ADSreadWriteBytes(ADSConnection * dc,
+static int _ADSreadWriteBytes(ADSConnection * dc,
                       uint32_t indexGroup, uint32_t offset,
                       uint32_t readLength, void *readBuffer,
                       uint32_t writeLength, void *writeBuffer,
@@ -616,17 +634,18 @@ int ADSreadWriteBytes(ADSConnection * dc,
 	MsgOut(MSG_PACKET_V, MsgStr("Data length:   %d\n", rq->writeLength));
 
 	MsgAnalyzePacket("ADSreadWriteBytes()", p1);
-	rc = _ADSWritePacket(dc->iface, p1, &nErr);
+	rc = _ADSSendRequest(dc, p1, &nErr);
 	if(rc <= 0){
 		MsgOut(MSG_ERROR, "ADSreadWriteBytes() failed().\n");
 		return( _ADStranslateWrError(rc, nErr));
 	}
 
 	/*Reads the answer */
-	dc->AnswLen = _ADSReadPacket(dc->iface, dc->msgIn, &nErr);
+	dc->AnswLen = _ADSReadAnswer(dc, &nErr);
 	if (dc->AnswLen > 0 && nErr == 0 ) {
 		p2 = (ADSpacket *) dc->msgIn;
-		if (p2->amsHeader.commandId == cmdADSreadWrite) {
+		if (p2->amsHeader.commandId == cmdADSreadWrite
+			&& p2->amsHeader.errorCode == 0) {
 
 			MsgAnalyzePacket("ADSreadWriteBytes()", p2);
 			rr = (ADSreadWriteResponse *) (dc->msgIn + 38);
@@ -662,7 +681,7 @@ int ADSreadWriteBytes(ADSConnection * dc,
  * \param devState Address of a variable that will receive the device status. 
  * \return Error code
  */
-int ADSreadState(ADSConnection * dc,
+static int _ADSreadState(ADSConnection * dc,
 				 unsigned short *ADSstate,
 				 unsigned short *devState)
 {
@@ -687,7 +706,7 @@ int ADSreadState(ADSConnection * dc,
 	MsgAnalyzePacket("ADSreadState()", p1);
 
 	/* sends the the packet */
-	rc = _ADSWritePacket(dc->iface, p1, &nErr);
+	rc = _ADSSendRequest(dc, p1, &nErr);
 	if(rc <= 0){
 #ifdef LOG_ALL_MESSAGES
 		syslog(LOG_USER | LOG_ERR, "ADSreadState() failed().");
@@ -697,12 +716,13 @@ int ADSreadState(ADSConnection * dc,
 	}
 
 	/*Read the answer */
-	dc->AnswLen = _ADSReadPacket(dc->iface, dc->msgIn, &nErr);
+	dc->AnswLen = _ADSReadAnswer(dc, &nErr);
 	MsgDumpPacket("ADSreadState()", dc->msgIn, dc->AnswLen);
 	MsgAnalyzePacket("ADSreadState()", (ADSpacket*)dc->msgIn);
 	if (dc->AnswLen > 0 && nErr == 0 ) {
 		p2 = (ADSpacket *) dc->msgIn;
-		if (p2->amsHeader.commandId == cmdADSreadState) {
+		if (p2->amsHeader.commandId == cmdADSreadState
+			&& p2->amsHeader.errorCode == 0) {
 			MsgAnalyzePacket("ADSreadState()", p2);
 			StateResponse = (ADSstateResponse *) (dc->msgIn + 38);
 			*ADSstate = StateResponse->ADSstate;;
@@ -727,7 +747,7 @@ int ADSreadState(ADSConnection * dc,
  * This is an interface to AdsAPI.c.
  * Used by AdsSyncReadStateReq().
  */
-int ADSwriteControl(ADSConnection *dc,
+static int _ADSwriteControl(ADSConnection *dc,
 					int ADSstate,
 					int devState,
 					void *data, int length)
@@ -764,7 +784,7 @@ int ADSwriteControl(ADSConnection *dc,
 	}
 
 	MsgAnalyzePacket("ADSwriteControl()", p1);
-	rc = _ADSWritePacket(dc->iface, p1, &nErr);
+	rc = _ADSSendRequest(dc, p1, &nErr);
 	if(rc <= 0){
 #ifdef LOG_ALL_MESSAGES
 		syslog(LOG_USER | LOG_ERR, "ADSwriteControl() failed().");
@@ -774,9 +794,9 @@ int ADSwriteControl(ADSConnection *dc,
 	}
 
 
-	dc->AnswLen = _ADSReadPacket(dc->iface, dc->msgIn, &nErr);
+	dc->AnswLen = _ADSReadAnswer(dc, &nErr);
 	p2 = (ADSpacket *) dc->msgIn;
-	if (dc->AnswLen > 0 && nErr == 0 ) {
+	if (dc->AnswLen > 0 && nErr == 0 && p2->amsHeader.errorCode == 0) {
 		MsgAnalyzePacket("ADSwriteControl()", p2);
 		wr = (ADSwriteResponse *) (dc->msgIn + 38);
 		MsgOut(MSG_TRACE,
@@ -794,6 +814,227 @@ int ADSwriteControl(ADSConnection *dc,
 	return(_ADStranslateRdError(dc->AnswLen, nErr));
 }
 
+/*
+ * The functions above share dc->msgIn and dc->msgOut, so only one request
+ * may be on the way per connection. The public entry points below hold
+ * dc->lock for the whole request/response cycle, this allows a connection
+ * to be used from more than one thread (e.g. a process image mirror polling
+ * in the background while the application reads and writes).
+ */
+static void _ADSflightPut(ADSConnection *dc, ADSFlight *f)
+{
+	if (--f->refs > 0)
+		return;
+	pthread_cond_destroy(&f->cond);
+	free(f->data);
+	free(f);
+}
+
+/*
+ * A write makes the reads on the way older than the device: reads that
+ * start after it must not wait for them.
+ */
+static void _ADSflightEpoch(ADSConnection *dc)
+{
+	pthread_mutex_lock(&dc->flightLock);
+	dc->epoch++;
+	pthread_mutex_unlock(&dc->flightLock);
+}
+
+/*
+ * Identical reads that overlap in time share one request: the first caller
+ * reads, the others wait for its answer and get a copy. Reads sent before
+ * the last write are not shared. Reads of index groups with a cache
+ * policy are answered from the cache while fresh, see ads_cache.c. Reads
+ * into a NULL buffer use dc->dataPointer and always go to the wire.
+ */
+int ADSreadBytes(ADSConnection *dc,
+                 uint32_t indexGroup, uint32_t offset,
+                 uint32_t length, void *buffer,
+                 uint32_t *pnRead)
+{
+	ADSFlight *f, **pp;
+	uint32_t nRead = 0;
+	uint64_t gen;
+	int rc;
+
+	if (buffer == NULL) {
+		pthread_mutex_lock(&dc->lock);
+		rc = _ADSreadBytes(dc, indexGroup, offset, length, buffer, pnRead);
+		pthread_mutex_unlock(&dc->lock);
+		return rc;
+	}
+
+	if (_ADScacheGet(dc, ADS_CACHE_READ, indexGroup, offset, length, buffer,
+					 &nRead, &gen)) {
+		if (pnRead != NULL)
+			*pnRead = nRead;
+		return 0;
+	}
+
+	pthread_mutex_lock(&dc->flightLock);
+	for (f = dc->flights; f != NULL; f = f->next)
+		if (f->indexGroup == indexGroup && f->indexOffset == offset
+			&& f->length == length && f->epoch == dc->epoch)
+			break;
+	if (f != NULL) {
+		f->refs++;
+		while (!f->done)
+			pthread_cond_wait(&f->cond, &dc->flightLock);
+		rc = f->result;
+		if (f->data != NULL) {
+			memcpy(buffer, f->data, f->nRead);
+			if (pnRead != NULL)
+				*pnRead = f->nRead;
+		}
+		else if (rc == 0)
+			rc = 0x70A;
+		_ADSflightPut(dc, f);
+		pthread_mutex_unlock(&dc->flightLock);
+		MsgOut(MSG_DEVEL, "ADSreadBytes(): shared a read on the way\n");
+		return rc;
+	}
+
+	f = (ADSFlight *) calloc(1, sizeof(ADSFlight));
+	if (f != NULL) {
+		f->indexGroup = indexGroup;
+		f->indexOffset = offset;
+		f->length = length;
+		f->epoch = dc->epoch;
+		f->refs = 1;
+		pthread_cond_init(&f->cond, NULL);
+		f->next = dc->flights;
+		dc->flights = f;
+	}
+	pthread_mutex_unlock(&dc->flightLock);
+
+	pthread_mutex_lock(&dc->lock);
+	rc = _ADSreadBytes(dc, indexGroup, offset, length, buffer, &nRead);
+	pthread_mutex_unlock(&dc->lock);
+	if (pnRead != NULL)
+		*pnRead = nRead;
+	if (rc == 0)
+		_ADScachePut(dc, ADS_CACHE_READ, indexGroup, offset, length, buffer,
+					 nRead, gen);
+	if (f == NULL)
+		return rc;
+
+	pthread_mutex_lock(&dc->flightLock);
+	f->nRead = nRead;
+	for (pp = &dc->flights; *pp != f; pp = &(*pp)->next)
+		;
+	*pp = f->next;
+	f->result = rc;
+	f->done = 1;
+	if (f->refs > 1) {
+		f->data = malloc(f->nRead ? f->nRead : 1);
+		if (f->data != NULL)
+			memcpy(f->data, buffer, f->nRead);
+		pthread_cond_broadcast(&f->cond);
+	}
+	_ADSflightPut(dc, f);
+	pthread_mutex_unlock(&dc->flightLock);
+	return rc;
+}
+
+int ADSwriteBytes(ADSConnection *dc,
+				  int indexGroup, int offset,
+				  int length, void *data)
+{
+	int rc;
+
+	pthread_mutex_lock(&dc->lock);
+	rc = _ADSwriteBytes(dc, indexGroup, offset, length, data);
+	pthread_mutex_unlock(&dc->lock);
+	_ADSflightEpoch(dc);
+	_ADScacheInvalidate(dc, ADS_CACHE_READ, indexGroup, offset, length);
+	return rc;
+}
+
+int ADSreadDeviceInfo(ADSConnection *dc, char *pDevName, PAdsVersion pVersion)
+{
+	unsigned char info[16 + sizeof(AdsVersion)];
+	uint32_t size;
+	uint64_t gen;
+	int rc;
+
+	if (_ADScacheGet(dc, ADS_CACHE_DEVINFO, 0, 0, 0, info, &size, &gen)) {
+		memcpy(pDevName, info, 16);
+		memcpy(pVersion, info + 16, sizeof(AdsVersion));
+		return 0;
+	}
+	pthread_mutex_lock(&dc->lock);
+	rc = _ADSreadDeviceInfo(dc, pDevName, pVersion);
+	pthread_mutex_unlock(&dc->lock);
+	if (rc == 0) {
+		memcpy(info, pDevName, 16);
+		memcpy(info + 16, pVersion, sizeof(AdsVersion));
+		_ADScachePut(dc, ADS_CACHE_DEVINFO, 0, 0, 0, info, sizeof(info), gen);
+	}
+	return rc;
+}
+
+int ADSreadWriteBytes(ADSConnection *dc,
+                      uint32_t indexGroup, uint32_t offset,
+                      uint32_t readLength, void *readBuffer,
+                      uint32_t writeLength, void *writeBuffer,
+                      uint32_t *pnRead)
+{
+	int rc;
+
+	pthread_mutex_lock(&dc->lock);
+	rc = _ADSreadWriteBytes(dc, indexGroup, offset,
+							readLength, readBuffer,
+							writeLength, writeBuffer, pnRead);
+	pthread_mutex_unlock(&dc->lock);
+	if (writeLength > 0) {
+		_ADSflightEpoch(dc);
+		_ADScacheInvalidate(dc, ADS_CACHE_READ, indexGroup, offset,
+							writeLength);
+	}
+	return rc;
+}
+
+int ADSreadState(ADSConnection *dc,
+				 unsigned short *ADSstate,
+				 unsigned short *devState)
+{
+	unsigned short state[2];
+	uint32_t size;
+	uint64_t gen;
+	int rc;
+
+	if (_ADScacheGet(dc, ADS_CACHE_STATE, 0, 0, 0, state, &size, &gen)) {
+		*ADSstate = state[0];
+		*devState = state[1];
+		return 0;
+	}
+	pthread_mutex_lock(&dc->lock);
+	rc = _ADSreadState(dc, ADSstate, devState);
+	pthread_mutex_unlock(&dc->lock);
+	if (rc == 0) {
+		state[0] = *ADSstate;
+		state[1] = *devState;
+		_ADScachePut(dc, ADS_CACHE_STATE, 0, 0, 0, state, sizeof(state), gen);
+	}
+	return rc;
+}
+
+int ADSwriteControl(ADSConnection *dc,
+					int ADSstate,
+					int devState,
+					void *data, int length)
+{
+	int rc;
+
+	pthread_mutex_lock(&dc->lock);
+	rc = _ADSwriteControl(dc, ADSstate, devState, data, length);
+	pthread_mutex_unlock(&dc->lock);
+	_ADSflightEpoch(dc);
+	_ADScacheInvalidate(dc, ADS_CACHE_STATE, 0, 0, 0);
+	return rc;
+}
+
 /**
  * This is an internal function
  * Input: netIDstring, something like "127.0.0.1.1.1"
@@ -873,9 +1114,13 @@ int _ADStranslateWrError(int rc, int nErr)
 	switch(rc){
 		case 0:		// system error
 			return 0x1a; //TODO translate nErr (=errno) int ADS return code
+		case -2:	// link failed, see _ADSSendRequest()
+			return 0x50a;
 		case -3:	// internal error
 		case -4:	// error flag set in ADSinterface
 			return 0x1;
+		case -5:	// over budget, see ads_shape.c
+			return 0x502;
 	}
 	//NOT REACHED
 	return 0;
@@ -34,6 +34,7 @@ extern "C" {
 #define __ADS_H__
 
 #include <stdint.h>
+#include <pthread.h>
 
 #pragma pack (push)
 #pragma pack (1)
@@ -226,10 +227,35 @@ typedef struct {
 							// identify the interface
 	AmsNetId	me;			// local netID (NOT the one open on  sd!!!)
 	int			AMSport;	// local port (NOT the one open on  sd!!!)
+	const struct _ADSTransport *transport;	// how packets go over sd, TCP
+							// unless set otherwise, see ads_io.h
+	void		*link;		// state of the transport
 } ADSInterface;
 
 
+/**
+ * A read on the way that other callers of ADSreadBytes() with the same
+ * address and length wait for instead of sending their own.
+ */
+typedef struct _ADSFlight {
+	pthread_cond_t	cond;			// first, see ADSConnection.lock
+	uint32_t		indexGroup;
+	uint32_t		indexOffset;
+	uint32_t		length;
+	uint32_t		epoch;			// of the connection when it was sent
+	int				refs;			// the reader and its followers
+	int				done;
+	int				result;
+	uint32_t		nRead;
+	void			*data;			// copy of the answer for the followers
+	struct _ADSFlight *next;
+} ADSFlight;
+
 typedef struct {
+	pthread_mutex_t lock;			// held while a request is on the way,
+									// first member to keep it aligned
+	pthread_mutex_t flightLock;		// guards flights, aligned as well
+	pthread_mutex_t noteLock;		// guards feeds, see ads_notify.c
 	ADSInterface  *iface;			// pointer to used interface
 	int			  AnswLen;			// length of last message
  	int			  invokeId;			// packetNumber in transport layer
@@ -238,6 +264,11 @@ typedef struct {
 	unsigned char msgOut[MAXDATALEN];
 	AmsNetId	  partner;			// netID of the device open on iface->sd
 	int			  AMSport;			// port of the device open on iface->sd
+	struct _ADSEngine *engine;		// asynchronous request engine, or NULL
+	ADSFlight	  *flights;			// reads on the way, see ADSreadBytes()
+	uint32_t	  epoch;			// counts writes, guarded by flightLock
+	struct _ADSNotifyFeed *feeds;	// subscriptions, see ads_notify.c
+	struct _ADSClock *clock;		// the device's clock, see ads_clock.c
 } ADSConnection;
 
 #pragma pack (pop)
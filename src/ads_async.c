@@ -0,0 +1,720 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_io.h"
+#include "ads_async.h"
+#include "ads_clock.h"
+#include "ads_notify.h"
+#include "ads_shape.h"
+#include "debugprint.h"
+
+static int64_t _nowNs(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static long long _tsDiffNs(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+#define ADS_RQ_ANSWERED		0
+#define ADS_RQ_TIMEDOUT		1
+#define ADS_RQ_FAILED		2
+
+/*
+ * Pending table: a hash on invokeId to find the request of an answer, and
+ * a list in order of sending to find the expired ones. All called with
+ * e->lock held.
+ */
+static void _ADSengineLink(ADSEngine *e, ADSRequest *rq)
+{
+	int b = rq->invokeId & (ADS_ENGINE_HASH - 1);
+
+	rq->hnext = e->hash[b];
+	e->hash[b] = rq;
+	rq->next = NULL;
+	rq->prev = e->last;
+	if (e->last)
+		e->last->next = rq;
+	else
+		e->first = rq;
+	e->last = rq;
+	e->stats.pending++;
+}
+
+static void _ADSengineUnlink(ADSEngine *e, ADSRequest *rq, int outcome)
+{
+	ADSRequest **pp = &e->hash[rq->invokeId & (ADS_ENGINE_HASH - 1)];
+	struct timespec now;
+	int64_t rtt = 0;
+
+	while (*pp != rq)
+		pp = &(*pp)->hnext;
+	*pp = rq->hnext;
+	if (rq->prev)
+		rq->prev->next = rq->next;
+	else
+		e->first = rq->next;
+	if (rq->next)
+		rq->next->prev = rq->prev;
+	else
+		e->last = rq->prev;
+	e->stats.pending--;
+
+	// give the slot back, answers and time outs tell the limit something
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (outcome == ADS_RQ_ANSWERED) {
+		rtt = _tsDiffNs(&now, &rq->sent);
+		if (e->dc->clock != NULL)
+			_ADSclockRtt(e->dc->clock, rtt);
+	}
+	ADSlimitRelease(&e->limit, now.tv_sec * 1000000000LL + now.tv_nsec,
+					rtt, outcome == ADS_RQ_TIMEDOUT);
+}
+
+static ADSRequest *_ADSengineFind(ADSEngine *e, unsigned int invokeId)
+{
+	ADSRequest *rq = e->hash[invokeId & (ADS_ENGINE_HASH - 1)];
+
+	while (rq != NULL && rq->invokeId != invokeId)
+		rq = rq->hnext;
+	return rq;
+}
+
+/*
+ * Fails the requests whose deadline passed, counted in *expired.
+ * Returns the milliseconds until the next deadline, -1 if there is none.
+ */
+static int _ADSengineExpire(ADSEngine *e, int *expired)
+{
+	struct timespec now;
+	ADSRequest *rq;
+	long long left;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (;;) {
+		pthread_mutex_lock(&e->lock);
+		rq = e->first;
+		if (rq == NULL || rq->deadline.tv_sec == 0) {
+			pthread_mutex_unlock(&e->lock);
+			return -1;
+		}
+		left = _tsDiffNs(&rq->deadline, &now);
+		if (left > 0) {
+			pthread_mutex_unlock(&e->lock);
+			return (int)(left / 1000000) + 1;
+		}
+		_ADSengineUnlink(e, rq, ADS_RQ_TIMEDOUT);
+		e->stats.timeouts++;
+		(*expired)++;
+		pthread_mutex_unlock(&e->lock);
+
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADS engine: request %u timed out\n", rq->invokeId));
+		rq->result = _ADStranslateRdError(-1, 0);
+		rq->done(rq, NULL);
+	}
+}
+
+static void _ADSengineDispatch(ADSEngine *e, ADSpacket *p)
+{
+	ADSRequest *rq;
+
+	if (!(p->amsHeader.stateFlags & sfAMSresponse)) {
+		if (p->amsHeader.commandId == cmdADSdevNotify) {
+			_ADSnotifyDispatch(e->dc, p, e->rxBuf);
+			return;
+		}
+		MsgOut(MSG_PACKET,
+			   MsgStr("ADS engine: ignoring request, command %d\n",
+					  p->amsHeader.commandId));
+		return;
+	}
+
+	pthread_mutex_lock(&e->lock);
+	rq = _ADSengineFind(e, p->amsHeader.invokeId);
+	if (rq == NULL) {
+		e->stats.strays++;
+		pthread_mutex_unlock(&e->lock);
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADS engine: nobody waits for invokeId %u\n",
+					  p->amsHeader.invokeId));
+		return;
+	}
+	_ADSengineUnlink(e, rq, ADS_RQ_ANSWERED);
+	e->stats.answers++;
+	pthread_mutex_unlock(&e->lock);
+
+	rq->result = p->amsHeader.errorCode;
+	rq->done(rq, p);
+}
+
+/*
+ * Hands every complete packet in the receive buffer to
+ * _ADSengineDispatch(). Returns -1 if the stream is garbage, -2 if there
+ * is no memory for a fresh buffer.
+ */
+static int _ADSengineParse(ADSEngine *e)
+{
+	AMS_TCPheader *h;
+	ADSRxBuffer *b;
+	int off = 0, len;
+
+	while (e->rxLen - off >= sizeof(AMS_TCPheader)) {
+		h = (AMS_TCPheader *)(e->rxBuf->data + off);
+		if (h->length < sizeof(AMSheader)
+			|| h->length > ADS_RXBUFSIZE - sizeof(AMS_TCPheader))
+			return -1;
+		len = sizeof(AMS_TCPheader) + h->length;
+		if (e->rxLen - off < len)
+			break;
+		_ADSengineDispatch(e, (ADSpacket *)(e->rxBuf->data + off));
+		off += len;
+	}
+	if (off == 0)
+		return 0;
+	if (__atomic_load_n(&e->rxBuf->refs, __ATOMIC_ACQUIRE) > 1) {
+		// samples in it are held, leave it to them
+		b = (ADSRxBuffer *) malloc(sizeof(ADSRxBuffer) + ADS_RXBUFSIZE);
+		if (b == NULL)
+			return -2;
+		b->refs = 1;
+		memcpy(b->data, e->rxBuf->data + off, e->rxLen - off);
+		ADSrxRelease(e->rxBuf);
+		e->rxBuf = b;
+	}
+	else
+		memmove(e->rxBuf->data, e->rxBuf->data + off, e->rxLen - off);
+	e->rxLen -= off;
+	return 0;
+}
+
+/*
+ * Marks the engine dead and fails every pending and waiting request
+ * with err.
+ */
+static void _ADSengineFail(ADSEngine *e, int err)
+{
+	ADSRequest *rq;
+
+	pthread_mutex_lock(&e->lock);
+	e->dead = err;
+	for (;;) {
+		if ((rq = e->first) != NULL)
+			_ADSengineUnlink(e, rq, ADS_RQ_FAILED);
+		else if ((rq = e->qFirst) != NULL) {
+			e->qFirst = rq->next;
+			e->stats.backlog--;
+		}
+		else
+			break;
+		pthread_mutex_unlock(&e->lock);
+		rq->result = err;
+		rq->done(rq, NULL);
+		pthread_mutex_lock(&e->lock);
+	}
+	pthread_mutex_unlock(&e->lock);
+}
+
+/*
+ * Puts a request that got a slot on the wire.
+ * Returns 0 or an ADS error code; then the request is not pending and
+ * its slot is given back.
+ */
+static int _ADSengineSend(ADSEngine *e, ADSRequest *rq)
+{
+	int rc, nErr, timeout, wake;
+	char c = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &rq->sent);
+	timeout = e->dc->iface->timeout;
+	if (timeout > 0) {
+		rq->deadline.tv_sec = rq->sent.tv_sec + timeout / 1000;
+		rq->deadline.tv_nsec = rq->sent.tv_nsec + (timeout % 1000) * 1000000L;
+		if (rq->deadline.tv_nsec >= 1000000000L) {
+			rq->deadline.tv_sec++;
+			rq->deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	else
+		rq->deadline.tv_sec = 0;	// never
+
+	pthread_mutex_lock(&e->lock);
+	if (e->dead) {
+		ADSlimitRelease(&e->limit, 0, 0, 0);
+		pthread_mutex_unlock(&e->lock);
+		return e->dead;
+	}
+	// the first deadline, the receive thread may sleep without one
+	wake = e->first == NULL && rq->deadline.tv_sec != 0;
+	// registered before sending, the answer may come back at once
+	_ADSengineLink(e, rq);
+	e->stats.requests++;
+	pthread_mutex_unlock(&e->lock);
+	if (wake && write(e->wake[1], &c, 1) != 1)
+		MsgOut(MSG_ERROR, "ADS engine: cannot wake the receive thread\n");
+
+	pthread_mutex_lock(&e->txLock);
+	rc = _ADSWritePacket(e->dc->iface, rq->packet, &nErr);
+	pthread_mutex_unlock(&e->txLock);
+	if (rc <= 0) {
+		pthread_mutex_lock(&e->lock);
+		if (_ADSengineFind(e, rq->invokeId) != rq) {
+			// the receive thread failed it meanwhile and called done()
+			pthread_mutex_unlock(&e->lock);
+			return 0;
+		}
+		_ADSengineUnlink(e, rq, ADS_RQ_FAILED);
+		pthread_mutex_unlock(&e->lock);
+		MsgOut(MSG_ERROR, "ADS engine: _ADSWritePacket() failed\n");
+		return _ADStranslateWrError(rc, nErr);
+	}
+	return 0;
+}
+
+/*
+ * Sends waiting requests as long as the limit and the shaper allow.
+ * Returns the milliseconds until the shaper lets the next one go, -1 if
+ * no request waits for it.
+ */
+static int _ADSenginePump(ADSEngine *e)
+{
+	ADSRequest *rq;
+	int64_t wait;
+	int rc;
+
+	for (;;) {
+		pthread_mutex_lock(&e->lock);
+		rq = e->qFirst;
+		if (rq != NULL && rq->notBefore != 0
+			&& (wait = rq->notBefore - _nowNs()) > 0) {
+			pthread_mutex_unlock(&e->lock);
+			return (int)(wait / 1000000) + 1;
+		}
+		if (rq == NULL || !ADSlimitAcquire(&e->limit)) {
+			pthread_mutex_unlock(&e->lock);
+			return -1;
+		}
+		e->qFirst = rq->next;
+		e->stats.backlog--;
+		pthread_mutex_unlock(&e->lock);
+
+		rc = _ADSengineSend(e, rq);
+		if (rc != 0) {
+			rq->result = rc;
+			rq->done(rq, NULL);
+		}
+	}
+}
+
+static void *_ADSengineThread(void *arg)
+{
+	ADSEngine *e = (ADSEngine *) arg;
+	ADSInterface *di = e->dc->iface;
+	struct pollfd fds[2];
+	int n, timeout, held, expired, pending, err = 0;
+	char c;
+
+	fds[0].fd = di->sd;
+	fds[0].events = POLLIN;
+	fds[1].fd = e->wake[0];
+	fds[1].events = POLLIN;
+
+	while (err == 0) {
+		do {
+			held = _ADSenginePump(e);
+			expired = 0;
+			timeout = _ADSengineExpire(e, &expired);
+		} while (expired > 0);
+		if (held >= 0 && (timeout < 0 || held < timeout))
+			timeout = held;
+		pending = di->transport->pending != NULL && di->transport->pending(di);
+		if (pending)
+			timeout = 0;
+		n = poll(fds, 2, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			MsgOut(MSG_ERROR,
+				   MsgStr("ADS engine: poll() failed: %s\n", strerror(errno)));
+			err = 0x1;
+		}
+		else if (fds[1].revents) {
+			if (read(e->wake[0], &c, 1) != 1 || e->stopping)
+				err = _ADStranslateRdError(-2, 0);	// shut down
+			else
+				_ADSnotifyReplay(e->dc);
+		}
+		else if (fds[0].revents || pending) {
+			n = di->transport->recv(di, e->rxBuf->data + e->rxLen,
+									ADS_RXBUFSIZE - e->rxLen);
+			if (n == 0) {
+				MsgOut(MSG_ERROR, "ADS engine: peer shut down\n");
+				err = _ADStranslateRdError(-2, 0);
+			}
+			else if (n < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				MsgOut(MSG_ERROR,
+					   MsgStr("ADS engine: recv() failed: %s\n", strerror(errno)));
+				err = _ADStranslateRdError(0, errno);
+			}
+			else {
+				e->rxLen += n;
+				n = _ADSengineParse(e);
+				if (n == -1) {
+					MsgOut(MSG_ERROR, "ADS engine: invalid AMS length\n");
+					err = 0xE;	// invalid AMS length
+				}
+				else if (n < 0) {
+					MsgOut(MSG_ERROR, "ADS engine: out of memory\n");
+					err = 0x70A;
+				}
+			}
+		}
+	}
+	_ADSengineFail(e, err);
+	_ADSnotifyEnd(e->dc, err);
+	return NULL;
+}
+
+/**
+ * @brief Starts the asynchronous request engine of a connection.
+ * From now on a receive thread reads all packets of the connection; the
+ * synchronous functions keep working, they pass their packets through the
+ * engine. Done callbacks run on the receive thread, they must not call
+ * the synchronous functions of the same connection.
+ * @return 0 (also if it is already running) or an ADS error code
+ */
+int ADSasyncStart(ADSConnection *dc)
+{
+	ADSEngine *e;
+
+	pthread_mutex_lock(&dc->lock);		// no synchronous request on the way
+	if (dc->engine != NULL) {
+		pthread_mutex_unlock(&dc->lock);
+		return 0;
+	}
+
+	e = (ADSEngine *) calloc(1, sizeof(ADSEngine));
+	if (e == NULL) {
+		pthread_mutex_unlock(&dc->lock);
+		return 0x70A;
+	}
+	e->rxBuf = (ADSRxBuffer *) malloc(sizeof(ADSRxBuffer) + ADS_RXBUFSIZE);
+	if (e->rxBuf == NULL) {
+		free(e);
+		pthread_mutex_unlock(&dc->lock);
+		return 0x70A;
+	}
+	e->rxBuf->refs = 1;
+	e->dc = dc;
+	ADSlimitInit(&e->limit, ADS_LIMIT_INITIAL, ADS_LIMIT_MAX);
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_mutex_init(&e->txLock, NULL);
+	pthread_cond_init(&e->syncCond, NULL);
+	if (pipe(e->wake) != 0) {
+		free(e->rxBuf);
+		free(e);
+		pthread_mutex_unlock(&dc->lock);
+		return 0x1;
+	}
+	if (pthread_create(&e->rx, NULL, _ADSengineThread, e) != 0) {
+		close(e->wake[0]);
+		close(e->wake[1]);
+		free(e->rxBuf);
+		free(e);
+		pthread_mutex_unlock(&dc->lock);
+		MsgOut(MSG_ERROR, "ADSasyncStart(): pthread_create() failed\n");
+		return 0x1;
+	}
+	dc->engine = e;
+	pthread_mutex_unlock(&dc->lock);
+
+	MsgOut(MSG_TRACE, "ADSasyncStart(): engine running\n");
+	return 0;
+}
+
+/**
+ * @brief Stops the engine, pending requests fail with 0x50a.
+ * Called by ADSsocketDisconnect(), the connection is not closed here.
+ */
+int ADSasyncStop(ADSConnection *dc)
+{
+	ADSEngine *e;
+	char c = 0;
+
+	pthread_mutex_lock(&dc->lock);
+	e = dc->engine;
+	if (e == NULL) {
+		pthread_mutex_unlock(&dc->lock);
+		return 0;
+	}
+	pthread_mutex_lock(&e->lock);
+	e->stopping = 1;
+	pthread_mutex_unlock(&e->lock);
+	if (write(e->wake[1], &c, 1) != 1)
+		MsgOut(MSG_ERROR, "ADSasyncStop(): cannot wake the engine\n");
+	pthread_join(e->rx, NULL);
+	dc->engine = NULL;
+	pthread_mutex_unlock(&dc->lock);
+
+	close(e->wake[0]);
+	close(e->wake[1]);
+	pthread_cond_destroy(&e->syncCond);
+	pthread_mutex_destroy(&e->txLock);
+	pthread_mutex_destroy(&e->lock);
+	ADSrxRelease(e->rxBuf);
+	free(e);
+	return 0;
+}
+
+/**
+ * @brief Sends a request without waiting for the answer.
+ * If the adaptive limit of the device is reached it waits in the backlog
+ * and is sent when an answer frees a slot. rq->done() is called from the
+ * receive thread with the answer, when the timeout of the interface
+ * (dc->iface->timeout, 0 means none) expires or when the connection fails.
+ * @return 0, or an ADS error code; then rq->done() will not be called.
+ */
+int ADSasyncSubmit(ADSConnection *dc, ADSRequest *rq)
+{
+	ADSEngine *e = dc->engine;
+	int rc, wake;
+	char c = 0;
+
+	if (e == NULL)
+		return 0x50a;	// not (yet) active
+
+	rq->invokeId = rq->packet->amsHeader.invokeId;
+	rq->result = 0;
+	rc = _ADSshapeAdmit(&dc->partner, dc->AMSport, rq->packet, _nowNs(),
+						&rq->notBefore);
+	if (rc != 0)
+		return rc;
+
+	pthread_mutex_lock(&e->lock);
+	if (e->dead) {
+		pthread_mutex_unlock(&e->lock);
+		return e->dead;
+	}
+	if (rq->notBefore != 0 || e->qFirst != NULL
+		|| !ADSlimitAcquire(&e->limit)) {
+		// the receive thread sends it when an answer frees a slot or the
+		// shaper lets it go; it may sleep without a deadline, wake it
+		wake = rq->notBefore != 0 && e->qFirst == NULL;
+		rq->next = NULL;
+		if (e->qFirst == NULL)
+			e->qFirst = rq;
+		else
+			e->qLast->next = rq;
+		e->qLast = rq;
+		e->stats.queued++;
+		e->stats.backlog++;
+		pthread_mutex_unlock(&e->lock);
+		if (wake && write(e->wake[1], &c, 1) != 1)
+			MsgOut(MSG_ERROR, "ADSasyncSubmit(): cannot wake the engine\n");
+		return 0;
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return _ADSengineSend(e, rq);
+}
+
+/* wakes the receive thread, which then replays, see _ADSnotifyReplay() */
+void _ADSasyncWake(ADSConnection *dc)
+{
+	ADSEngine *e = dc->engine;
+	char c = 0;
+
+	if (e != NULL && write(e->wake[1], &c, 1) != 1)
+		MsgOut(MSG_ERROR, "_ADSasyncWake(): cannot wake the engine\n");
+}
+
+/**
+ * @brief Sets the bounds of the adaptive limit of requests on the way.
+ * maxLimit 1 turns pipelining off.
+ */
+int ADSasyncSetLimit(ADSConnection *dc, int initial, int maxLimit)
+{
+	ADSEngine *e = dc->engine;
+	int inflight;
+
+	if (e == NULL)
+		return 0x50a;
+	if (initial < 1 || maxLimit < initial)
+		return 0x741;
+	pthread_mutex_lock(&e->lock);
+	inflight = e->limit.inflight;
+	ADSlimitInit(&e->limit, initial, maxLimit);
+	e->limit.inflight = inflight;
+	pthread_mutex_unlock(&e->lock);
+	return 0;
+}
+
+void ADSasyncGetStats(ADSConnection *dc, ADSEngineStats *stats)
+{
+	ADSEngine *e = dc->engine;
+
+	memset(stats, 0, sizeof(ADSEngineStats));
+	if (e == NULL)
+		return;
+	pthread_mutex_lock(&e->lock);
+	*stats = e->stats;
+	stats->limit = (int) e->limit.limit;
+	stats->limitStats = e->limit.stats;
+	pthread_mutex_unlock(&e->lock);
+}
+
+/**
+ * @brief Keeps a receive buffer, and the samples pointing into it, valid.
+ */
+void ADSrxRetain(ADSRxBuffer *b)
+{
+	__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Gives back a receive buffer, the last one frees it.
+ */
+void ADSrxRelease(ADSRxBuffer *b)
+{
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(b);
+}
+
+/*
+ * The synchronous functions of ads.c send with _ADSSendRequest() and read
+ * with _ADSReadAnswer(), which return like _ADSWritePacket() and
+ * _ADSReadPacket(). Without an engine they are just these; with an engine
+ * the answer comes from the receive thread. dc->lock is held by the caller,
+ * so there is at most one synchronous request per connection.
+ */
+static void _ADSsyncDone(ADSRequest *rq, ADSpacket *answer)
+{
+	ADSEngine *e = (ADSEngine *) rq->user;
+	ADSConnection *dc = e->dc;
+	int len;
+
+	if (answer != NULL) {
+		len = sizeof(AMS_TCPheader) + answer->adsHeader.length;
+		if (len > MAXDATALEN) {
+			MsgOut(MSG_ERROR,
+				   MsgStr("ADS engine: packet to long: %d bytes (max is %d)\n",
+						  len, MAXDATALEN));
+			len = MAXDATALEN;
+		}
+		memcpy(dc->msgIn, answer, len);
+		e->syncLen = len;
+	}
+	pthread_mutex_lock(&e->lock);
+	e->syncDone = 1;
+	pthread_cond_signal(&e->syncCond);
+	pthread_mutex_unlock(&e->lock);
+}
+
+int _ADSSendRequest(ADSConnection *dc, ADSpacket *p, int *error)
+{
+	ADSEngine *e = dc->engine;
+	struct timespec t;
+	int64_t notBefore;
+	int rc;
+
+	if (e == NULL) {
+		rc = _ADSshapeAdmit(&dc->partner, dc->AMSport, p, _nowNs(), &notBefore);
+		if (rc != 0) {
+			if (error)
+				*error = 0;
+			return -5;	// over budget
+		}
+		if (notBefore != 0) {
+			t.tv_sec = notBefore / 1000000000LL;
+			t.tv_nsec = notBefore % 1000000000LL;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL)
+				   == EINTR)
+				;
+		}
+		return _ADSWritePacket(dc->iface, p, error);
+	}
+
+	e->syncRq.packet = p;
+	e->syncRq.done = _ADSsyncDone;
+	e->syncRq.user = e;
+	e->syncDone = 0;
+	e->syncLen = 0;
+	rc = ADSasyncSubmit(dc, &e->syncRq);
+	if (error)
+		*error = 0;
+	if (rc != 0)
+		return rc == 0x1A ? 0 : rc == ADS_SHAPE_ERROR ? -5
+			: rc == _ADStranslateRdError(-2, 0) ? -2 : -4;
+	return 1;
+}
+
+int _ADSReadAnswer(ADSConnection *dc, int *error)
+{
+	ADSEngine *e = dc->engine;
+	AMS_TCPheader *h;
+
+	if (e == NULL)
+		return _ADSReadPacket(dc->iface, dc->msgIn, error);
+
+	pthread_mutex_lock(&e->lock);
+	while (!e->syncDone)
+		pthread_cond_wait(&e->syncCond, &e->lock);
+	pthread_mutex_unlock(&e->lock);
+
+	if (error)
+		*error = 0;
+	if (e->syncLen == 0) {
+		if (e->syncRq.result == _ADStranslateRdError(-1, 0))
+			return -1;	// time out
+		return -2;		// link failed or engine stopped
+	}
+
+	h = (AMS_TCPheader *) dc->msgIn;
+	if (sizeof(AMS_TCPheader) + h->length > MAXDATALEN) {
+		h->length = MAXDATALEN - sizeof(AMS_TCPheader);
+		if (error)
+			*error = 0xe;
+	}
+	return e->syncLen;
+}
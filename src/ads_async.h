@@ -0,0 +1,137 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_ASYNC_H__
+#define __ADS_ASYNC_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ads_limit.h"
+
+#define ADS_ENGINE_HASH		64				// buckets of the pending table
+#define ADS_RXBUFSIZE		(8 * MAXDATALEN)	// biggest packet accepted
+
+typedef struct _ADSRequest ADSRequest;
+
+/**
+ * A receive buffer of the engine. Notification samples handed out by
+ * ADSnotifyAddRef() point into it; to keep one beyond the callback,
+ * retain the buffer with ADSrxRetain() and release it when done. While
+ * a buffer is held the engine receives into a fresh one.
+ */
+typedef struct _ADSRxBuffer {
+	int				refs;			// the engine holds one while it uses it
+	unsigned char	data[];			// ADS_RXBUFSIZE bytes for the engine
+} ADSRxBuffer;
+
+/**
+ * Called from the receive thread when a request is answered or failed.
+ * answer is the complete response packet, valid only during the call,
+ * or NULL if rq->result is set.
+ */
+typedef void (*ADSRequestDone)(ADSRequest *rq, ADSpacket *answer);
+
+struct _ADSRequest {
+	ADSpacket		*packet;	// complete request, the AMS header set up
+								// with _ADSsetupAmsHeader(); must stay valid
+								// until done() is called
+	ADSRequestDone	done;
+	void			*user;
+	int				result;		// 0 or ADS error code, set before done()
+
+	// engine private
+	unsigned int	invokeId;
+	int64_t			notBefore;	// ns, held back by the shaper until then
+	struct timespec	deadline;
+	struct timespec	sent;
+	ADSRequest		*hnext;		// hash chain
+	ADSRequest		*prev;		// pending list, in order of sending,
+	ADSRequest		*next;		// which is the order of the deadlines;
+								// or the backlog
+};
+
+typedef struct {
+	uint64_t	requests;		// submitted requests
+	uint64_t	answers;		// answered requests
+	uint64_t	timeouts;
+	uint64_t	strays;			// answers nobody waited for
+	uint64_t	queued;			// requests that waited for the limit
+	int			pending;		// requests on the way now
+	int			backlog;		// requests waiting for the limit now
+	int			limit;			// requests allowed on the way now
+	ADSLimitStats limitStats;
+} ADSEngineStats;
+
+/**
+ * The asynchronous request engine of one connection.
+ * A receive thread reads all packets of the connection and matches the
+ * answers to the pending requests by invokeId, so any number of requests
+ * can be on the way at the same time, as many as the adaptive limit
+ * allows; the others wait in the backlog, as do the ones the shaper of
+ * the device holds back.
+ */
+typedef struct _ADSEngine {
+	ADSConnection	*dc;
+	pthread_t		rx;
+	int				wake[2];		// pipe, wakes the receive thread
+	pthread_mutex_t	lock;			// guards everything below
+	pthread_mutex_t	txLock;			// one packet at a time on the socket
+	int				stopping;
+	int				dead;			// ADS error code once the link failed
+
+	ADSRequest		*hash[ADS_ENGINE_HASH];
+	ADSRequest		*first, *last;	// pending list
+	ADSLimit		limit;
+	ADSRequest		*qFirst, *qLast;	// backlog, waiting for the limit
+	ADSEngineStats	stats;
+
+	// the synchronous functions of ads.c use this one
+	ADSRequest		syncRq;
+	pthread_cond_t	syncCond;
+	int				syncDone;
+	int				syncLen;		// length of the answer in dc->msgIn
+
+	ADSRxBuffer		*rxBuf;
+	int				rxLen;			// bytes received into rxBuf->data
+} ADSEngine;
+
+int ADSasyncStart(ADSConnection *dc);
+int ADSasyncStop(ADSConnection *dc);
+int ADSasyncSubmit(ADSConnection *dc, ADSRequest *rq);
+int ADSasyncSetLimit(ADSConnection *dc, int initial, int maxLimit);
+void ADSasyncGetStats(ADSConnection *dc, ADSEngineStats *stats);
+void ADSrxRetain(ADSRxBuffer *b);
+void ADSrxRelease(ADSRxBuffer *b);
+
+/**
+	Prototypes, used by ads.c and ads_notify.c
+ */
+int _ADSSendRequest(ADSConnection *dc, ADSpacket *p, int *error);
+int _ADSReadAnswer(ADSConnection *dc, int *error);
+void _ADSasyncWake(ADSConnection *dc);
+
+#endif //__ADS_ASYNC_H__
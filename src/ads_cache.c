@@ -0,0 +1,627 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_cache.h"
+#include "ads_notify.h"
+#include "debugprint.h"
+
+/*
+ * One cache for the process: answers of rarely changing data, e.g. device
+ * info, state and parameters, are shared by all connections to a device.
+ * Off (maxBytes 0) until ADScacheConfigure() is called.
+ * Variables subscribed with ADScacheSubscribe() are kept current by device
+ * notifications instead; they do not count against maxBytes and are
+ * answered from the latest sample while the subscription lasts.
+ */
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static ADSCacheEntry *hash[ADS_CACHE_HASH];
+static ADSCacheEntry *lruFirst, *lruLast;
+static size_t maxBytes;
+static int devInfoTTL, stateTTL;
+static ADSCachePolicy policies[ADS_CACHE_MAX_POLICIES];
+static int nPolicies;
+static uint64_t generation;		// counts invalidations, see _ADScachePut()
+static ADSCacheStats stats;
+static ADSCacheSub *subs[ADS_CACHE_SUBHASH];
+static int nSubs;
+
+static int64_t _nowNs(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/*
+ * Whether there is anything to look at: the callers peek without the
+ * lock, maxBytes, nSubs and generation are written with atomic stores.
+ */
+static int _ADScacheUsed(void)
+{
+	return __atomic_load_n(&maxBytes, __ATOMIC_ACQUIRE) != 0
+		|| __atomic_load_n(&nSubs, __ATOMIC_ACQUIRE) != 0;
+}
+
+static unsigned int _ADScacheHash(AmsNetId *netId, int port, int kind,
+								  uint32_t indexGroup, uint32_t indexOffset,
+								  uint32_t length)
+{
+	unsigned int h = kind;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		h = h * 31 + netId->b[i];
+	h = h * 31 + port;
+	h = h * 31 + indexGroup;
+	h = h * 31 + indexOffset;
+	h = h * 31 + length;
+	return h & (ADS_CACHE_HASH - 1);
+}
+
+static unsigned int _ADScacheSubHash(int port, uint32_t indexGroup)
+{
+	return (indexGroup * 31 + port) & (ADS_CACHE_SUBHASH - 1);
+}
+
+/* the subscription holding indexOffset .. indexOffset+length-1, or NULL */
+static ADSCacheSub *_ADScacheFindSub(AmsNetId *netId, int port,
+									 uint32_t indexGroup, uint32_t indexOffset,
+									 uint32_t length)
+{
+	ADSCacheSub *s = subs[_ADScacheSubHash(port, indexGroup)];
+
+	for (; s != NULL; s = s->hnext)
+		if (s->port == port && s->indexGroup == indexGroup
+			&& indexOffset >= s->indexOffset
+			&& (uint64_t) indexOffset + length
+			   <= (uint64_t) s->indexOffset + s->length
+			&& memcmp(&s->netId, netId, sizeof(AmsNetId)) == 0)
+			break;
+	return s;
+}
+
+static int _ADScacheSize(ADSCacheEntry *e)
+{
+	return sizeof(ADSCacheEntry) + e->size;
+}
+
+/* all called with cacheLock held */
+static void _ADScacheRemove(ADSCacheEntry *e)
+{
+	ADSCacheEntry **pp = &hash[_ADScacheHash(&e->netId, e->port, e->kind,
+											 e->indexGroup, e->indexOffset,
+											 e->length)];
+
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		lruFirst = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		lruLast = e->prev;
+	stats.entries--;
+	stats.bytes -= _ADScacheSize(e);
+	free(e);
+}
+
+static void _ADScacheToFront(ADSCacheEntry *e)
+{
+	if (lruFirst == e)
+		return;
+	e->prev->next = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		lruLast = e->prev;
+	e->prev = NULL;
+	e->next = lruFirst;
+	lruFirst->prev = e;
+	lruFirst = e;
+}
+
+static ADSCacheEntry *_ADScacheFind(AmsNetId *netId, int port, int kind,
+									uint32_t indexGroup, uint32_t indexOffset,
+									uint32_t length)
+{
+	ADSCacheEntry *e = hash[_ADScacheHash(netId, port, kind, indexGroup,
+										  indexOffset, length)];
+
+	for (; e != NULL; e = e->hnext)
+		if (e->kind == kind && e->port == port
+			&& e->indexGroup == indexGroup && e->indexOffset == indexOffset
+			&& e->length == length
+			&& memcmp(&e->netId, netId, sizeof(AmsNetId)) == 0)
+			break;
+	return e;
+}
+
+static int _ADScacheTTL(int kind, uint32_t indexGroup)
+{
+	int i;
+
+	if (kind == ADS_CACHE_DEVINFO)
+		return devInfoTTL;
+	if (kind == ADS_CACHE_STATE)
+		return stateTTL;
+	for (i = 0; i < nPolicies; i++)
+		if (indexGroup >= policies[i].first && indexGroup <= policies[i].last)
+			return policies[i].ttl;
+	return 0;
+}
+
+/**
+ * @brief Turns the cache on with a memory budget, or off with 0.
+ * Entries over budget are evicted, least recently used first.
+ */
+int ADScacheConfigure(size_t bytes)
+{
+	pthread_mutex_lock(&cacheLock);
+	__atomic_store_n(&maxBytes, bytes, __ATOMIC_RELEASE);
+	while (lruLast != NULL && stats.bytes > maxBytes) {
+		_ADScacheRemove(lruLast);
+		stats.evictions++;
+	}
+	pthread_mutex_unlock(&cacheLock);
+	return 0;
+}
+
+/**
+ * @brief Sets how long device info (ADS_CACHE_DEVINFO) or state
+ * (ADS_CACHE_STATE) answers are used; 0 does not cache them.
+ */
+int ADScacheSetTTL(int kind, int ttlMs)
+{
+	if (ttlMs < 0)
+		return 0x741;
+	pthread_mutex_lock(&cacheLock);
+	if (kind == ADS_CACHE_DEVINFO)
+		devInfoTTL = ttlMs;
+	else if (kind == ADS_CACHE_STATE)
+		stateTTL = ttlMs;
+	else {
+		pthread_mutex_unlock(&cacheLock);
+		return 0x741;
+	}
+	pthread_mutex_unlock(&cacheLock);
+	return 0;
+}
+
+/**
+ * @brief Sets how long reads of index groups first .. last are used.
+ * The first matching policy wins; ttlMs 0 removes the policy.
+ * Reads of index groups without policy are not cached.
+ */
+int ADScacheSetGroupTTL(uint32_t first, uint32_t last, int ttlMs)
+{
+	int i;
+
+	if (ttlMs < 0 || last < first)
+		return 0x741;
+	pthread_mutex_lock(&cacheLock);
+	for (i = 0; i < nPolicies; i++)
+		if (policies[i].first == first && policies[i].last == last)
+			break;
+	if (ttlMs == 0) {
+		if (i < nPolicies) {
+			nPolicies--;
+			memmove(policies + i, policies + i + 1,
+					(nPolicies - i) * sizeof(ADSCachePolicy));
+		}
+	}
+	else if (i < nPolicies)
+		policies[i].ttl = ttlMs;
+	else if (nPolicies < ADS_CACHE_MAX_POLICIES) {
+		policies[i].first = first;
+		policies[i].last = last;
+		policies[i].ttl = ttlMs;
+		nPolicies++;
+	}
+	else {
+		pthread_mutex_unlock(&cacheLock);
+		return 0x70A;
+	}
+	pthread_mutex_unlock(&cacheLock);
+	return 0;
+}
+
+/*
+ * Drops the entries of kind for netId:port (all devices if netId is NULL);
+ * for reads only the ones overlapping indexGroup, indexOffset, length,
+ * length 0 meaning the whole index group.
+ */
+static void _ADScacheDrop(AmsNetId *netId, int port, int kind,
+						  uint32_t indexGroup, uint32_t indexOffset,
+						  uint32_t length)
+{
+	ADSCacheEntry *e, *next;
+	ADSCacheSub *s;
+	int i;
+
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+	// subscribed variables are read from the device until the next sample
+	for (i = 0; nSubs > 0 && i < ADS_CACHE_SUBHASH
+		 && (kind == 0 || kind == ADS_CACHE_READ); i++)
+		for (s = subs[i]; s != NULL; s = s->hnext) {
+			if (!s->valid || (netId != NULL && (s->port != port
+				|| memcmp(&s->netId, netId, sizeof(AmsNetId)) != 0)))
+				continue;
+			if (kind == ADS_CACHE_READ && (s->indexGroup != indexGroup
+				|| (length != 0
+					&& (s->indexOffset >= indexOffset + length
+						|| s->indexOffset + s->length <= indexOffset))))
+				continue;
+			s->valid = 0;
+			stats.invalidations++;
+		}
+	for (e = lruFirst; e != NULL; e = next) {
+		next = e->next;
+		if (netId != NULL && (e->port != port
+			|| memcmp(&e->netId, netId, sizeof(AmsNetId)) != 0))
+			continue;
+		if (kind != 0 && e->kind != kind)
+			continue;
+		if (kind == ADS_CACHE_READ && (e->indexGroup != indexGroup
+			|| (length != 0
+				&& (e->indexOffset >= indexOffset + length
+					|| e->indexOffset + e->length <= indexOffset))))
+			continue;
+		_ADScacheRemove(e);
+		stats.invalidations++;
+	}
+}
+
+/**
+ * @brief Drops cached reads of a device overlapping the given area.
+ * length 0 drops the whole index group.
+ */
+void ADScacheInvalidate(AmsAddr *addr, uint32_t indexGroup,
+						uint32_t indexOffset, uint32_t length)
+{
+	pthread_mutex_lock(&cacheLock);
+	_ADScacheDrop(&addr->netId, addr->port, ADS_CACHE_READ, indexGroup,
+				  indexOffset, length);
+	pthread_mutex_unlock(&cacheLock);
+}
+
+/**
+ * @brief Drops everything cached for a device, or for all if addr is NULL.
+ */
+void ADScacheInvalidateTarget(AmsAddr *addr)
+{
+	pthread_mutex_lock(&cacheLock);
+	if (addr != NULL)
+		_ADScacheDrop(&addr->netId, addr->port, 0, 0, 0, 0);
+	else
+		_ADScacheDrop(NULL, 0, 0, 0, 0, 0);
+	pthread_mutex_unlock(&cacheLock);
+}
+
+void ADScacheGetStats(ADSCacheStats *st)
+{
+	pthread_mutex_lock(&cacheLock);
+	*st = stats;
+	pthread_mutex_unlock(&cacheLock);
+}
+
+/*
+ * Returns 1 and the cached answer in data and *size, or 0; then *gen is
+ * the ticket for _ADScachePut().
+ */
+int _ADScacheGet(ADSConnection *dc, int kind, uint32_t indexGroup,
+				 uint32_t indexOffset, uint32_t length, void *data,
+				 uint32_t *size, uint64_t *gen)
+{
+	ADSCacheEntry *e;
+	ADSCacheSub *s;
+
+	*gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+	if (!_ADScacheUsed())
+		return 0;
+	pthread_mutex_lock(&cacheLock);
+	if (kind == ADS_CACHE_READ && nSubs > 0
+		&& (s = _ADScacheFindSub(&dc->partner, dc->AMSport, indexGroup,
+								 indexOffset, length)) != NULL
+		&& s->valid) {
+		memcpy(data, s->data + (indexOffset - s->indexOffset), length);
+		*size = length;
+		stats.hits++;
+		stats.pushHits++;
+		pthread_mutex_unlock(&cacheLock);
+		return 1;
+	}
+	if (maxBytes == 0) {
+		pthread_mutex_unlock(&cacheLock);
+		return 0;
+	}
+	e = _ADScacheFind(&dc->partner, dc->AMSport, kind, indexGroup,
+					  indexOffset, length);
+	if (e != NULL && e->expires <= _nowNs()) {
+		_ADScacheRemove(e);
+		stats.expired++;
+		e = NULL;
+	}
+	if (e == NULL) {
+		stats.misses++;
+		pthread_mutex_unlock(&cacheLock);
+		return 0;
+	}
+	_ADScacheToFront(e);
+	memcpy(data, e->data, e->size);
+	*size = e->size;
+	stats.hits++;
+	pthread_mutex_unlock(&cacheLock);
+	return 1;
+}
+
+/*
+ * Stores an answer, unless its kind or index group is not cached or the
+ * cache was invalidated since the _ADScacheGet() that handed out gen:
+ * then the answer may predate a write.
+ */
+void _ADScachePut(ADSConnection *dc, int kind, uint32_t indexGroup,
+				  uint32_t indexOffset, uint32_t length, const void *data,
+				  uint32_t size, uint64_t gen)
+{
+	ADSCacheEntry *e;
+	ADSCacheSub *s;
+	int ttl;
+
+	if (!_ADScacheUsed())
+		return;
+	pthread_mutex_lock(&cacheLock);
+	if (gen != __atomic_load_n(&generation, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&cacheLock);	// may predate a write
+		return;
+	}
+	// a read of a whole subscribed variable is as good as a sample
+	if (kind == ADS_CACHE_READ && nSubs > 0
+		&& (s = _ADScacheFindSub(&dc->partner, dc->AMSport, indexGroup,
+								 indexOffset, length)) != NULL
+		&& s->n != NULL && s->indexOffset == indexOffset
+		&& s->length == size) {
+		memcpy(s->data, data, size);
+		s->valid = 1;
+	}
+	ttl = _ADScacheTTL(kind, indexGroup);
+	if (ttl == 0 || maxBytes == 0
+		|| sizeof(ADSCacheEntry) + size > maxBytes) {
+		pthread_mutex_unlock(&cacheLock);
+		return;
+	}
+	e = _ADScacheFind(&dc->partner, dc->AMSport, kind, indexGroup,
+					  indexOffset, length);
+	if (e != NULL)
+		_ADScacheRemove(e);
+	while (lruLast != NULL && stats.bytes + sizeof(ADSCacheEntry) + size
+		   > maxBytes) {
+		_ADScacheRemove(lruLast);
+		stats.evictions++;
+	}
+
+	e = (ADSCacheEntry *) malloc(sizeof(ADSCacheEntry) + size);
+	if (e == NULL) {
+		pthread_mutex_unlock(&cacheLock);
+		return;
+	}
+	e->netId = dc->partner;
+	e->port = dc->AMSport;
+	e->kind = kind;
+	e->indexGroup = indexGroup;
+	e->indexOffset = indexOffset;
+	e->length = length;
+	e->size = size;
+	e->expires = _nowNs() + ttl * 1000000LL;
+	memcpy(e->data, data, size);
+
+	e->hnext = hash[_ADScacheHash(&e->netId, e->port, kind, indexGroup,
+								  indexOffset, length)];
+	hash[_ADScacheHash(&e->netId, e->port, kind, indexGroup, indexOffset,
+					   length)] = e;
+	e->prev = NULL;
+	e->next = lruFirst;
+	if (lruFirst)
+		lruFirst->prev = e;
+	else
+		lruLast = e;
+	lruFirst = e;
+	stats.entries++;
+	stats.bytes += _ADScacheSize(e);
+	pthread_mutex_unlock(&cacheLock);
+}
+
+/*
+ * A request of dc may have changed what is cached: drops the entries of
+ * kind (reads: overlapping the area) of its device.
+ */
+void _ADScacheInvalidate(ADSConnection *dc, int kind, uint32_t indexGroup,
+						 uint32_t indexOffset, uint32_t length)
+{
+	if (!_ADScacheUsed()) {
+		// still counts: a read on the way must not be stored if the cache
+		// is turned on meanwhile
+		__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+		return;
+	}
+	pthread_mutex_lock(&cacheLock);
+	_ADScacheDrop(&dc->partner, dc->AMSport, kind, indexGroup, indexOffset,
+				  length);
+	pthread_mutex_unlock(&cacheLock);
+}
+
+/* notification callbacks, on the receive thread of the connection */
+static void _ADScacheSample(ADSNotification *n, uint64_t timeStamp,
+							const void *data, uint32_t size)
+{
+	ADSCacheSub *s = (ADSCacheSub *) n->user;
+
+	pthread_mutex_lock(&cacheLock);
+	if (size >= s->length) {
+		memcpy(s->data, data, s->length);
+		s->valid = 1;
+		stats.samples++;
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+static void _ADScacheSubEnd(ADSNotification *n, int err)
+{
+	ADSCacheSub *s = (ADSCacheSub *) n->user;
+
+	MsgOut(MSG_NOTIFICATION,
+		   MsgStr("ADScache: subscription of 0x%x:0x%x dropped (0x%x), "
+				  "reading from the device again\n",
+				  s->indexGroup, s->indexOffset, err));
+	pthread_mutex_lock(&cacheLock);
+	s->valid = 0;
+	s->n = NULL;	// freed with the connection
+	pthread_mutex_unlock(&cacheLock);
+}
+
+/* the link to the subscription of exactly this area, or to the NULL */
+static ADSCacheSub **_ADScacheSubLink(ADSConnection *dc, uint32_t indexGroup,
+									  uint32_t indexOffset, uint32_t length)
+{
+	ADSCacheSub **pp = &subs[_ADScacheSubHash(dc->AMSport, indexGroup)];
+
+	for (; *pp != NULL; pp = &(*pp)->hnext)
+		if ((*pp)->port == dc->AMSport && (*pp)->indexGroup == indexGroup
+			&& (*pp)->indexOffset == indexOffset && (*pp)->length == length
+			&& memcmp(&(*pp)->netId, &dc->partner, sizeof(AmsNetId)) == 0)
+			break;
+	return pp;
+}
+
+static ADSCacheSub *_ADScacheUnlinkSub(ADSCacheSub **pp)
+{
+	ADSCacheSub *s = *pp;
+
+	if (s != NULL) {
+		*pp = s->hnext;
+		__atomic_sub_fetch(&nSubs, 1, __ATOMIC_RELEASE);
+		stats.subscriptions--;
+	}
+	return s;
+}
+
+/**
+ * @brief Keeps indexGroup, indexOffset, length of the device of dc current
+ * with notifications sent on change, checked every cycleTime ms.
+ * Reads of this area or parts of it are answered from the latest sample;
+ * after writes to it, and once the subscription dropped, they go to the
+ * device again.
+ * @return 0 or an ADS error code
+ */
+int ADScacheSubscribe(ADSConnection *dc, uint32_t indexGroup,
+					  uint32_t indexOffset, uint32_t length, int cycleTime)
+{
+	AdsNotificationAttrib attrib;
+	ADSNotification *n;
+	ADSCacheSub *s, *old, **pp;
+	unsigned int h;
+	int rc;
+
+	if (length == 0 || length > MAXDATALEN || cycleTime < 0)
+		return 0x741;
+	s = (ADSCacheSub *) calloc(1, sizeof(ADSCacheSub) + length);
+	if (s == NULL)
+		return 0x70A;
+	s->netId = dc->partner;
+	s->port = dc->AMSport;
+	s->indexGroup = indexGroup;
+	s->indexOffset = indexOffset;
+	s->length = length;
+
+	pthread_mutex_lock(&cacheLock);
+	pp = _ADScacheSubLink(dc, indexGroup, indexOffset, length);
+	if (*pp != NULL && (*pp)->n != NULL) {
+		pthread_mutex_unlock(&cacheLock);	// still alive, keep it
+		free(s);
+		return 0;
+	}
+	old = _ADScacheUnlinkSub(pp);			// dropped, subscribe again
+	pthread_mutex_unlock(&cacheLock);
+	free(old);
+
+	memset(&attrib, 0, sizeof(attrib));
+	attrib.cbLength = length;
+	attrib.nTransMode = ADSTRANS_SERVERONCHA;
+	attrib.nMaxDelay = 0;
+	attrib.nCycleTime = cycleTime * 10000;	// 100ns
+	rc = ADSnotifyAdd(dc, indexGroup, indexOffset, &attrib, _ADScacheSample,
+					  _ADScacheSubEnd, s, &n);
+	if (rc != 0) {
+		free(s);
+		return rc;
+	}
+
+	pthread_mutex_lock(&cacheLock);
+	if (!n->dead)
+		s->n = n;
+	h = _ADScacheSubHash(s->port, indexGroup);
+	s->hnext = subs[h];
+	subs[h] = s;
+	__atomic_add_fetch(&nSubs, 1, __ATOMIC_RELEASE);
+	stats.subscriptions++;
+	pthread_mutex_unlock(&cacheLock);
+	return 0;
+}
+
+/**
+ * @brief Ends a subscription of ADScacheSubscribe().
+ * @return 0, 0x741 if there is none or the ADS error code of the device
+ */
+int ADScacheUnsubscribe(ADSConnection *dc, uint32_t indexGroup,
+						uint32_t indexOffset, uint32_t length)
+{
+	ADSNotification *n = NULL;
+	ADSCacheSub *s;
+	int rc = 0;
+
+	pthread_mutex_lock(&cacheLock);
+	s = _ADScacheUnlinkSub(_ADScacheSubLink(dc, indexGroup, indexOffset,
+											length));
+	if (s != NULL)
+		n = s->n;
+	pthread_mutex_unlock(&cacheLock);
+	if (s == NULL)
+		return 0x741;
+	if (n != NULL)
+		rc = ADSnotifyDel(n);		// no callback after this
+	free(s);
+	return rc;
+}
@@ -0,0 +1,121 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_CACHE_H__
+#define __ADS_CACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * What is cached, see ADScacheSetTTL()
+ */
+#define ADS_CACHE_DEVINFO	1	// ADSreadDeviceInfo()
+#define ADS_CACHE_STATE		2	// ADSreadState()
+#define ADS_CACHE_READ		3	// ADSreadBytes(), TTL per index group
+
+#define ADS_CACHE_HASH			1024
+#define ADS_CACHE_MAX_POLICIES	32
+#define ADS_CACHE_SUBHASH		64
+
+typedef struct {
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	expired;		// misses because the entry was too old
+	uint64_t	evictions;		// entries dropped to stay within maxBytes
+	uint64_t	invalidations;	// entries dropped by writes and
+								// ADScacheInvalidate()
+	uint64_t	pushHits;		// hits answered by a subscription
+	uint64_t	samples;		// notifications that refreshed one
+	int			entries;
+	size_t		bytes;
+	int			subscriptions;
+} ADSCacheStats;
+
+/**
+ * A cached answer, keyed by the device and the request.
+ */
+typedef struct _ADSCacheEntry {
+	AmsNetId		netId;
+	unsigned short	port;
+	int				kind;
+	uint32_t		indexGroup;
+	uint32_t		indexOffset;
+	uint32_t		length;			// asked for
+	uint32_t		size;			// got, bytes in data
+	int64_t			expires;		// CLOCK_MONOTONIC ns
+	struct _ADSCacheEntry *hnext;
+	struct _ADSCacheEntry *prev;	// LRU list, most recent first
+	struct _ADSCacheEntry *next;
+	unsigned char	data[];
+} ADSCacheEntry;
+
+typedef struct {
+	uint32_t	first;			// index groups first .. last
+	uint32_t	last;
+	int			ttl;			// ms
+} ADSCachePolicy;
+
+/**
+ * A variable the device keeps current with notifications, see
+ * ADScacheSubscribe().
+ */
+typedef struct _ADSCacheSub {
+	struct _ADSNotification *n;		// NULL once the subscription dropped
+	AmsNetId		netId;
+	unsigned short	port;
+	uint32_t		indexGroup;
+	uint32_t		indexOffset;
+	uint32_t		length;
+	int				valid;			// data is the device's current value
+	struct _ADSCacheSub *hnext;
+	unsigned char	data[];
+} ADSCacheSub;
+
+int ADScacheConfigure(size_t maxBytes);
+int ADScacheSetTTL(int kind, int ttlMs);
+int ADScacheSetGroupTTL(uint32_t first, uint32_t last, int ttlMs);
+void ADScacheInvalidate(AmsAddr *addr, uint32_t indexGroup,
+						uint32_t indexOffset, uint32_t length);
+void ADScacheInvalidateTarget(AmsAddr *addr);
+void ADScacheGetStats(ADSCacheStats *stats);
+int ADScacheSubscribe(ADSConnection *dc, uint32_t indexGroup,
+					  uint32_t indexOffset, uint32_t length, int cycleTime);
+int ADScacheUnsubscribe(ADSConnection *dc, uint32_t indexGroup,
+						uint32_t indexOffset, uint32_t length);
+
+/**
+	Prototypes, used by ads.c
+ */
+int _ADScacheGet(ADSConnection *dc, int kind, uint32_t indexGroup,
+				 uint32_t indexOffset, uint32_t length, void *data,
+				 uint32_t *size, uint64_t *gen);
+void _ADScachePut(ADSConnection *dc, int kind, uint32_t indexGroup,
+				  uint32_t indexOffset, uint32_t length, const void *data,
+				  uint32_t size, uint64_t gen);
+void _ADScacheInvalidate(ADSConnection *dc, int kind, uint32_t indexGroup,
+						 uint32_t indexOffset, uint32_t length);
+
+#endif //__ADS_CACHE_H__
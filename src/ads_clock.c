@@ -0,0 +1,206 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_clock.h"
+#include "debugprint.h"
+
+/**
+ * @brief Converts a Windows file time, 100 ns since 1601, to ns since 1970.
+ */
+int64_t ADSfileTimeToNs(uint64_t fileTime)
+{
+	return ((int64_t) fileTime - ADS_FILETIME_EPOCH) * 100;
+}
+
+static void _ADSclockPublish(ADSClock *c, int64_t base, int64_t offset,
+							 double drift, int64_t minRtt)
+{
+	__atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&c->base, base, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->offset, offset, __ATOMIC_RELAXED);
+	__atomic_store(&c->drift, &drift, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->minRtt, minRtt, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->fitted, c->count, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->valid, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* a consistent copy of the published model */
+static void _ADSclockRead(ADSClock *c, ADSClock *m)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		m->valid = __atomic_load_n(&c->valid, __ATOMIC_RELAXED);
+		m->base = __atomic_load_n(&c->base, __ATOMIC_RELAXED);
+		m->offset = __atomic_load_n(&c->offset, __ATOMIC_RELAXED);
+		__atomic_load(&c->drift, &m->drift, __ATOMIC_RELAXED);
+		m->minRtt = __atomic_load_n(&c->minRtt, __ATOMIC_RELAXED);
+		m->fitted = __atomic_load_n(&c->fitted, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || __atomic_load_n(&c->seq, __ATOMIC_RELAXED) != seq);
+}
+
+/*
+ * Least squares line through the points, relative to the newest one so
+ * doubles keep the ns. The line gives the drift and, at the newest point,
+ * the offset plus the delay on the way.
+ */
+static void _ADSclockFit(ADSClock *c)
+{
+	ADSClockPoint *p, *last;
+	double sx = 0, sy = 0, sxx = 0, sxy = 0, x, y, n = c->count, var;
+	double drift = 0, at;
+	int64_t minRtt = 0;
+	int i;
+
+	last = &c->points[(c->next + ADS_CLOCK_POINTS - 1) % ADS_CLOCK_POINTS];
+	for (i = 0; i < c->count; i++) {
+		p = &c->points[i];
+		x = p->local - last->local;
+		y = p->delta - last->delta;
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+		if (p->rtt > 0 && (minRtt == 0 || p->rtt < minRtt))
+			minRtt = p->rtt;
+	}
+	var = sxx - sx * sx / n;
+	if (c->count >= 2 && var > 0) {
+		drift = (sxy - sx * sy / n) / var;
+		if (drift > ADS_CLOCK_MAXDRIFT)
+			drift = ADS_CLOCK_MAXDRIFT;
+		else if (drift < -ADS_CLOCK_MAXDRIFT)
+			drift = -ADS_CLOCK_MAXDRIFT;
+	}
+	at = (sy - drift * sx) / n;		// the line at the newest point
+	_ADSclockPublish(c, last->local, last->delta + (int64_t) at - minRtt / 2,
+					 drift, minRtt);
+}
+
+/*
+ * The receive thread got a sample stamped fileTime by the device at our
+ * time local, ns since 1970.
+ */
+void _ADSclockSample(ADSClock *c, int64_t local, uint64_t fileTime)
+{
+	int64_t delta = local - ADSfileTimeToNs(fileTime), expect;
+
+	__atomic_add_fetch(&c->samples, 1, __ATOMIC_RELAXED);
+	if (c->valid) {
+		expect = c->offset + (int64_t)(c->drift * (local - c->base))
+				 + c->minRtt / 2;
+		if (delta - expect > ADS_CLOCK_STEP || expect - delta > ADS_CLOCK_STEP) {
+			MsgOut(MSG_NOTIFICATION,
+				   MsgStr("ADS clock: device clock jumped by %lld ns\n",
+						  (long long)(expect - delta)));
+			__atomic_add_fetch(&c->steps, 1, __ATOMIC_RELAXED);
+			c->count = c->next = 0;
+			c->winCount = 0;
+		}
+	}
+	if (c->winCount == 0)
+		c->winStart = local;
+	if (c->winCount == 0 || delta < c->winDelta) {
+		c->winDelta = delta;
+		c->winLocal = local;
+	}
+	c->winCount++;
+
+	if (local - c->winStart >= ADS_CLOCK_WINDOW) {
+		c->points[c->next].local = c->winLocal;
+		c->points[c->next].delta = c->winDelta;
+		c->points[c->next].rtt = c->winRtt;
+		c->next = (c->next + 1) % ADS_CLOCK_POINTS;
+		if (c->count < ADS_CLOCK_POINTS)
+			c->count++;
+		c->winCount = 0;
+		c->winRtt = 0;
+		_ADSclockFit(c);
+	}
+	else if (c->count == 0 && c->winLocal == local)
+		// no window done yet, the best sample so far has to do
+		_ADSclockPublish(c, local, delta - c->winRtt / 2, 0, c->winRtt);
+}
+
+/* the receive thread got an answer rtt ns after the request went out */
+void _ADSclockRtt(ADSClock *c, int64_t rtt)
+{
+	if (rtt > 0 && (c->winRtt == 0 || rtt < c->winRtt))
+		c->winRtt = rtt;
+}
+
+/**
+ * @brief Converts a time stamp of the device of dc, e.g. of a notification
+ * sample, to our time in ns since 1970, corrected by the offset and drift
+ * of the device's clock measured so far. Callable from any thread.
+ */
+int64_t ADSclockToNs(ADSConnection *dc, uint64_t fileTime)
+{
+	ADSClock m;
+	int64_t t = ADSfileTimeToNs(fileTime), local;
+
+	if (dc->clock == NULL)
+		return t;
+	_ADSclockRead(dc->clock, &m);
+	if (!m.valid)
+		return t;
+	local = t + m.offset;
+	return local + (int64_t)(m.drift * (local - m.base));
+}
+
+/**
+ * @brief Tells how the clock of the device of dc is off ours now.
+ */
+void ADSclockGetInfo(ADSConnection *dc, ADSClockInfo *info)
+{
+	ADSClock m;
+	struct timespec now;
+
+	memset(info, 0, sizeof(*info));
+	if (dc->clock == NULL)
+		return;
+	_ADSclockRead(dc->clock, &m);
+	clock_gettime(CLOCK_REALTIME, &now);
+	info->valid = m.valid;
+	info->offset = m.offset + (int64_t)(m.drift
+		* (now.tv_sec * 1000000000LL + now.tv_nsec - m.base));
+	info->drift = m.drift * 1e6;
+	info->minRtt = m.minRtt;
+	info->points = m.fitted;
+	info->samples = __atomic_load_n(&dc->clock->samples, __ATOMIC_RELAXED);
+	info->steps = __atomic_load_n(&dc->clock->steps, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,98 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __ADS_CLOCK_H__
+#define __ADS_CLOCK_H__
+
+#include <stdint.h>
+
+#define ADS_CLOCK_WINDOW	2000000000LL	// ns, one point per window
+#define ADS_CLOCK_POINTS	32				// points the drift is fit over
+#define ADS_CLOCK_STEP		1000000000LL	// ns, a jump this big resets
+#define ADS_CLOCK_MAXDRIFT	500e-6			// more is measuring noise
+
+#define ADS_FILETIME_EPOCH	116444736000000000LL	// 1970 in file time
+
+typedef struct {
+	int			valid;			// a sample came in, offset is known
+	int64_t		offset;			// ns, our clock minus the device's, now
+	double		drift;			// ppm, how much faster ours runs
+	int64_t		minRtt;			// ns, best round trip seen, 0 if none
+	uint64_t	samples;		// time stamps measured
+	int			points;			// windows the drift is fit over
+	uint64_t	steps;			// times the device clock jumped
+} ADSClockInfo;
+
+typedef struct {
+	int64_t		local;			// ns, when the best sample came in
+	int64_t		delta;			// ns, our time minus the device's then
+	int64_t		rtt;			// ns, best round trip of the window, or 0
+} ADSClockPoint;
+
+/**
+ * Estimates the offset and drift of a device's clock against ours, from
+ * the time stamps of its notification samples and the time they come
+ * in, without asking the device. The smallest difference of a window is
+ * the one least delayed on the way; a line fit through the last windows
+ * gives the drift. Half the best round trip of the requests is taken off
+ * as the delay left on the way.
+ * Only the receive thread measures; the model it publishes is read
+ * through a sequence lock, from any thread, callbacks included.
+ */
+typedef struct _ADSClock {
+	// the receive thread
+	int64_t		winStart;
+	int64_t		winLocal;
+	int64_t		winDelta;
+	int64_t		winRtt;
+	int			winCount;
+	ADSClockPoint points[ADS_CLOCK_POINTS];
+	int			count;
+	int			next;
+
+	// published
+	uint32_t	seq;			// odd while the model changes
+	int			valid;
+	int64_t		base;			// ns, our time the model starts at
+	int64_t		offset;			// ns, our clock minus the device's at base
+	double		drift;			// per ns since base
+	int64_t		minRtt;
+	uint64_t	samples;
+	uint64_t	steps;
+	int			fitted;			// points in the fit
+} ADSClock;
+
+int64_t ADSfileTimeToNs(uint64_t fileTime);
+int64_t ADSclockToNs(ADSConnection *dc, uint64_t fileTime);
+void ADSclockGetInfo(ADSConnection *dc, ADSClockInfo *info);
+
+/**
+	Prototypes, used by ads_async.c and ads_notify.c
+ */
+void _ADSclockSample(ADSClock *c, int64_t local, uint64_t fileTime);
+void _ADSclockRtt(ADSClock *c, int64_t rtt);
+
+#endif //__ADS_CLOCK_H__
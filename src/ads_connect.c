@@ -31,7 +31,9 @@
 #include <stdbool.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <ifaddrs.h>
 #include <net/if.h>
 #include <errno.h>
@@ -39,42 +41,170 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "AdsDEF.h"
 #include "ads.h"
 #include "ads_connect.h"
+#include "ads_async.h"
+#include "ads_io.h"
+#include "ads_shm.h"
+#include "ads_route.h"
 #include "debugprint.h"
 
 
 ADSConnection 	**pADSConnectionList = NULL;// filled by ADSsocketGet()
 int				nADSConnectionCnt = 0;		// number of currently allocated
 											// elements in pADSConnectionList
+static pthread_mutex_t listLock = PTHREAD_MUTEX_INITIALIZER;	// guards both
+
+static char		*routerAddress = NULL;		// see ADSsetRouter()
+static int		routerSet = 0;				// ADS_ROUTER was looked at
+static pthread_mutex_t routerLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \brief Parses "host[:port]" into sa, port defaults to defaultPort.
+ * \return 0 or -1 if address is no valid IPv4 host
+ */
+int ADSparseAddress(const char *address, int defaultPort,
+					struct sockaddr_in *sa)
+{
+	struct addrinfo hints, *res;
+	char host[256], *colon;
+	int port = defaultPort;
+
+	if (address == NULL || strlen(address) >= sizeof(host))
+		return -1;
+	strcpy(host, address);
+	colon = strrchr(host, ':');
+	if (colon != NULL) {
+		*colon = 0;
+		port = atoi(colon + 1);
+		if (port <= 0 || port > 65535)
+			return -1;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host[0] ? host : "127.0.0.1", NULL, &hints, &res) != 0)
+		return -1;
+	memcpy(sa, res->ai_addr, sizeof(*sa));
+	sa->sin_port = htons(port);
+	freeaddrinfo(res);
+	return 0;
+}
+
+/**
+ * \brief Sends the packets of all connections opened from now on through
+ * the local ADS router at address, "host[:port]", instead of straight to
+ * the devices; NULL connects straight again. "shm:[path]" talks to the
+ * router through shared memory, set up over its unix socket path
+ * (default ADS_SHM_PATH), see ads_shm.c; "unix:[path]" over its unix
+ * SOCK_SEQPACKET socket path (default ADS_UNIX_PATH).
+ * Without a call the environment variable ADS_ROUTER is used, if set.
+ * \return 0 or 0x741 if address is no valid address
+ */
+int ADSsetRouter(const char *address)
+{
+	struct sockaddr_in sa;
+	char *copy = NULL;
+
+	if (address != NULL) {
+		if (strncmp(address, ADS_SHM_PREFIX, strlen(ADS_SHM_PREFIX)) != 0
+			&& strncmp(address, ADS_UNIX_PREFIX, strlen(ADS_UNIX_PREFIX)) != 0
+			&& ADSparseAddress(address, ROUTER_PORT, &sa) != 0)
+			return 0x741;
+		copy = strdup(address);
+		if (copy == NULL)
+			return 0x70A;
+	}
+	pthread_mutex_lock(&routerLock);
+	free(routerAddress);
+	routerAddress = copy;
+	routerSet = 1;
+	pthread_mutex_unlock(&routerLock);
+	return 0;
+}
+
+/* a copy of the address of the router, NULL if there is none */
+static char *_ADSrouter(void)
+{
+	const char *env;
+	char *router = NULL;
+
+	pthread_mutex_lock(&routerLock);
+	if (!routerSet) {
+		env = getenv("ADS_ROUTER");
+		if (env != NULL && *env)
+			routerAddress = strdup(env);
+		routerSet = 1;
+	}
+	if (routerAddress != NULL)
+		router = strdup(routerAddress);
+	pthread_mutex_unlock(&routerLock);
+	return router;
+}
+
+/* where to connect for pAddr: the router if there is one, else the device */
+static void _ADSpeerAddress(PAmsAddr pAddr, const char *router,
+							struct sockaddr_in *addr)
+{
+	if (router != NULL && ADSparseAddress(router, ROUTER_PORT, addr) == 0) {
+		MsgOut(MSG_ROUTING, "ADSsocketConnect(): through the router\n");
+		return;
+	}
+	ADSrouteAddress(&pAddr->netId, addr);
+}
+/* listLock held: the open connection to pAddr, or NULL */
+static ADSConnection *_ADSsocketFindLocked(PAmsAddr pAddr)
+{
+	int i;
+
+	for(i = 0; i < nADSConnectionCnt; i++){
+		if(memcmp((void *)&(pADSConnectionList[i]->partner),
+		   (void *)pAddr, sizeof(AmsAddr)) == 0){
+			   MsgOut(MSG_SOCKET,
+					  MsgStr("ADSsocketGet(): re-using ADSConnection %d\n", i));
+			   return pADSConnectionList[i];
+		   }
+	}
+	return NULL;
+}
+
+/**
+ * Returns the connection to the PLC if one is open, NULL if not;
+ * unlike ADSsocketGet() it never connects.
+ */
+ADSConnection *ADSsocketFind(PAmsAddr pAddr)
+{
+	ADSConnection *dc;
+
+	pthread_mutex_lock(&listLock);
+	dc = _ADSsocketFindLocked(pAddr);
+	pthread_mutex_unlock(&listLock);
+	return dc;
+}
+
 /**
  * Checks if a connection (socket) to the PLC is already open.
  * If yes, uses the ADSConnection stored in pADSConnectionList,
  * if not, opens a new connection and stores it in pADSConnectionList
  * pADSConnectionList grows dynamically!
+ * The list is only locked to look and to add, not while connecting;
+ * of two threads connecting to the same PLC the one adding first wins,
+ * the other drops its connection and uses that one.
  *
  * Returns:	the ADSConnection,
  */
 ADSConnection *ADSsocketGet(int dummy, PAmsAddr pAddr, int *adsError)
 {
-	ADSConnection *dc;
-	int i;
+	ADSConnection *dc, *won, **grown;
 
 	MsgOut(MSG_TRACE, "ADSsocketGet() called\n");
-	if(nADSConnectionCnt > 0){
-		for(i = 0; i < nADSConnectionCnt; i++){
-			if(memcmp((void *)&(pADSConnectionList[i]->partner),
-			   (void *)pAddr, sizeof(AmsAddr)) == 0){
-				   MsgOut(MSG_SOCKET,
-						  MsgStr("ADSsocketGet(): re-using ADSConnection %d\n", i));
-				   dc = pADSConnectionList[i];
-				   *adsError = 0;
-				   MsgOut(MSG_TRACE, "ADSsocketGet() returns a valid ADSConnection\n");
-				   return dc;
-			   }
-		}
+	if((dc = ADSsocketFind(pAddr)) != NULL){
+		*adsError = 0;
+		MsgOut(MSG_TRACE, "ADSsocketGet() returns a valid ADSConnection\n");
+		return dc;
 	}
 
 	dc = ADSsocketConnect(pAddr, adsError);
@@ -84,28 +214,102 @@ ADSConnection *ADSsocketGet(int dummy, PAmsAddr pAddr, int *adsError)
 		return(NULL);
 	}
 
-	if(nADSConnectionCnt == 0){
-		pADSConnectionList = (ADSConnection **)malloc(sizeof(ADSConnection *));
-		nADSConnectionCnt = 1;
-		MsgOut(MSG_SOCKET,
-			   MsgStr("ADSsocketGet(): initiated ADSConnection to %d entries.\n",
-					  nADSConnectionCnt));
+	pthread_mutex_lock(&listLock);
+	if((won = _ADSsocketFindLocked(pAddr)) != NULL){
+		pthread_mutex_unlock(&listLock);
+		ADSsocketDisconnect(dc);
+		ADSFreeConnection(dc);
+		*adsError = 0;
+		return won;
 	}
-	else{
-		nADSConnectionCnt++;
-		pADSConnectionList = (ADSConnection **)realloc((void *)pADSConnectionList,
-		sizeof(ADSConnection *)*nADSConnectionCnt);
-		MsgOut(MSG_SOCKET,
-			   MsgStr("ADSsocketGet(): growing ADSConnection to %d entries\n",
-					  nADSConnectionCnt));
+	grown = (ADSConnection **)realloc((void *)(nADSConnectionCnt ?
+		pADSConnectionList : NULL), sizeof(ADSConnection *)*(nADSConnectionCnt + 1));
+	if(grown == NULL){
+		pthread_mutex_unlock(&listLock);
+		ADSsocketDisconnect(dc);
+		ADSFreeConnection(dc);
+		*adsError = 0x70A;
+		return NULL;
 	}
-	pADSConnectionList[nADSConnectionCnt-1] = dc;
+	pADSConnectionList = grown;
+	pADSConnectionList[nADSConnectionCnt++] = dc;
+	MsgOut(MSG_SOCKET,
+		   MsgStr("ADSsocketGet(): growing ADSConnection to %d entries\n",
+				  nADSConnectionCnt));
+	pthread_mutex_unlock(&listLock);
 
 	*adsError = 0;
 	MsgOut(MSG_TRACE, "ADSsocketGet() returns a valid ADSConnection\n");
 	return dc;
 }
 
+/* the connection to pAddr through the router's shared memory at path */
+static ADSConnection *_ADSshmConnect(PAmsAddr pAddr, const char *path,
+									 int *adsError)
+{
+	ADSShmLink		*l;
+	ADSInterface	*di;
+	AmsAddr 		localAmsAddr;
+
+	if((*adsError = AdsGetMeAddress(&localAmsAddr, AMSPORT_R0_PLC_RTS1)) != 0)
+		return NULL;
+	l = ADSshmConnect(*path ? path : ADS_SHM_PATH, ADS_SHM_RINGSIZE, adsError);
+	if (l == NULL)
+		return NULL;
+	di = _ADSNewInterface(l->fd, localAmsAddr.netId, pAddr->port, "LinuxADS");
+	if (di == NULL) {
+		ADSshmClose(l);
+		*adsError = 0x70A;
+		return NULL;
+	}
+	di->transport = &ADSshmTransport;
+	di->link = l;
+	MsgOut(MSG_ROUTING, "ADSsocketConnect(): through the router's shared memory\n");
+	return _ADSNewConnection(di, pAddr->netId, pAddr->port);
+}
+
+/* the connection to pAddr through the router's unix socket at path */
+static ADSConnection *_ADSunixConnect(PAmsAddr pAddr, const char *path,
+									  int *adsError)
+{
+	struct sockaddr_un	addr;
+	ADSInterface		*di;
+	AmsAddr 			localAmsAddr;
+	int					fd;
+
+	if((*adsError = AdsGetMeAddress(&localAmsAddr, AMSPORT_R0_PLC_RTS1)) != 0)
+		return NULL;
+	if (!*path)
+		path = ADS_UNIX_PATH;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		*adsError = 0x741;
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADSsocketConnect(): cannot connect to %s: %s\n", path,
+					  strerror(errno)));
+		if (fd >= 0)
+			close(fd);
+		*adsError = 0x1;
+		return NULL;
+	}
+	di = _ADSNewInterface(fd, localAmsAddr.netId, pAddr->port, "LinuxADS");
+	if (di == NULL || (di->link = calloc(1, sizeof(ADSUnixLink))) == NULL) {
+		free(di);
+		close(fd);
+		*adsError = 0x70A;
+		return NULL;
+	}
+	di->transport = &ADSunixTransport;
+	MsgOut(MSG_ROUTING, "ADSsocketConnect(): through the router's unix socket\n");
+	return _ADSNewConnection(di, pAddr->netId, pAddr->port);
+}
+
 /**
  * \brief Opens a new connection to the PLC identified by pAddr parameter.
  * \param dummy just to have the same parameter list as the router version.
@@ -119,24 +323,37 @@ ADSConnection *ADSsocketConnect(PAmsAddr pAddr, int *adsError)
 	socklen_t 			addrlen;
 	int 				socket_fd = 0;
 
-	char 				peer[16];
+	char 				peer[INET_ADDRSTRLEN];
 	int 				opt;
 	ADSInterface 		*di;
 	ADSConnection 		*dc;
 	AmsAddr 			localAmsAddr;
 	int					nerr;
 
+	char				*router;
+
 	MsgOut(MSG_TRACE, "ADSsocketConnect() called\n");
 
+	router = _ADSrouter();
+	if (router != NULL
+		&& strncmp(router, ADS_SHM_PREFIX, strlen(ADS_SHM_PREFIX)) == 0) {
+		dc = _ADSshmConnect(pAddr, router + strlen(ADS_SHM_PREFIX), adsError);
+		free(router);
+		return dc;
+	}
+	if (router != NULL
+		&& strncmp(router, ADS_UNIX_PREFIX, strlen(ADS_UNIX_PREFIX)) == 0) {
+		dc = _ADSunixConnect(pAddr, router + strlen(ADS_UNIX_PREFIX), adsError);
+		free(router);
+		return dc;
+	}
+
 	socket_fd = socket(AF_INET, SOCK_STREAM, 0);
 
 	/* Build socket address */
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(0xBF02);	/* ADS port 48898 */
-	/* lazy convertion from byte array to socket adress format */
-	sprintf(peer, "%d.%d.%d.%d", pAddr->netId.b[0], pAddr->netId.b[1],
-			pAddr->netId.b[2], pAddr->netId.b[3]);
-	inet_aton(peer, &addr.sin_addr);
+	_ADSpeerAddress(pAddr, router, &addr);
+	free(router);
+	inet_ntop(AF_INET, &addr.sin_addr, peer, sizeof(peer));
 
 	/* connect to plc */
 	addrlen = sizeof(addr);
@@ -193,13 +410,39 @@ int ADSsocketDisconnect(ADSConnection *dc)
 					   "returns 0xd (error).\n");
 		return 0xD;		/* Port not connected */
 	}
-	close(*fd);
+	ADSasyncStop(dc);	// its receive thread polls the socket
+	dc->iface->transport->close(dc->iface);
 	*fd = 0;
 
 	MsgOut(MSG_TRACE, "ADSsocketDisconnect() returns 0 (OK)\n");
 	return 0;
 }
 
+/**
+ * Closes and frees the connections ADSsocketGet() opened and empties the
+ * list. They are taken off the list under its lock and closed after, so a
+ * thread looking for one meanwhile connects anew.
+ * Used by AdsPortClose()
+ */
+void ADSsocketCloseAll(void)
+{
+	ADSConnection **list;
+	int i, n;
+
+	pthread_mutex_lock(&listLock);
+	list = pADSConnectionList;
+	n = nADSConnectionCnt;
+	pADSConnectionList = NULL;
+	nADSConnectionCnt = 0;
+	pthread_mutex_unlock(&listLock);
+
+	for(i = 0; i < n; i++){
+		ADSsocketDisconnect(list[i]);
+		ADSFreeConnection(list[i]);
+	}
+	free(list);
+}
+
 /**
  * This is an interface to AdsAPI.c.
  * Used by AdsSyncSetTimeoutEx()
@@ -215,8 +458,10 @@ long AdsSetTimeout(long port, long nMs){
 	}
 	{
 		int i;
+		pthread_mutex_lock(&listLock);
 		for(i = 0; i < nADSConnectionCnt; i++)
 			pADSConnectionList[i]->iface->timeout = nMs;
+		pthread_mutex_unlock(&listLock);
 	}
 
 	MsgOut(MSG_TRACE, "AdsSetTimeout() returns\n");
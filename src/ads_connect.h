@@ -31,9 +31,16 @@
 #define ROUTER_PORT 48898 					/* same as the Beckhoff port */
 #define CLIENT_PORT AMSPORT_R0_PLC_RTS1
 
+#include <netinet/in.h>
+
+int ADSparseAddress(const char *address, int defaultPort,
+					struct sockaddr_in *sa);
+int ADSsetRouter(const char *address);
 ADSConnection *ADSsocketGet(int dummy, PAmsAddr pAddr, int *adsError);
+ADSConnection *ADSsocketFind(PAmsAddr pAddr);
 ADSConnection *ADSsocketConnect(PAmsAddr pAddr, int *adsError);
 int ADSsocketDisconnect(ADSConnection *dc);
+void ADSsocketCloseAll(void);
 
 int	ADScloseConection(int port);
 long AdsSetTimeout(long port, long nMs);
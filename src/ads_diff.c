@@ -0,0 +1,399 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Change detection between two process image snapshots.
+ * Unchanged data is skipped 64 bytes at a time (SSE2: 4x16, AVX2: 2x32),
+ * the byte exact borders of a change are then found with movemask and
+ * count-trailing-zeros. The scalar kernel does the same with 64 bit words.
+ * The kernel is selected once by cpu detection, see ADSdiffSelect().
+ */
+
+#include <string.h>
+
+#include "ads_diff.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ADS_DIFF_X86
+#include <immintrin.h>
+#endif
+
+typedef struct {
+	// first index >= pos where a and b differ, end if none
+	size_t (*findDiff)(const unsigned char *a, const unsigned char *b,
+					   size_t pos, size_t end);
+	// first index >= pos where a and b are equal, end if none
+	size_t (*findSame)(const unsigned char *a, const unsigned char *b,
+					   size_t pos, size_t end);
+	// one bit per ADS_DIFF_BLOCK bytes for the full blocks in [0, end)
+	void (*mask)(const unsigned char *a, const unsigned char *b,
+				 size_t end, uint64_t *mask);
+} ADSDiffKernel;
+
+/*
+ * scalar kernel, also handles the tails of the vector kernels
+ */
+
+static inline uint64_t _load64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+// index of the first byte in memory order that is != 0 in x (x != 0)
+static inline int _firstByteSet(uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_clzll(x) >> 3;
+#else
+	return __builtin_ctzll(x) >> 3;
+#endif
+}
+
+// marks the zero bytes of x with 0x80; exact for the first one in memory
+// order on little endian, only used to locate that first one
+static inline uint64_t _zeroBytes(uint64_t x)
+{
+	return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+}
+
+static size_t _findDiffScalar(const unsigned char *a, const unsigned char *b,
+							  size_t pos, size_t end)
+{
+	uint64_t x;
+
+	for (; pos + 8 <= end; pos += 8) {
+		x = _load64(a + pos) ^ _load64(b + pos);
+		if (x)
+			return pos + _firstByteSet(x);
+	}
+	for (; pos < end; pos++)
+		if (a[pos] != b[pos])
+			return pos;
+	return end;
+}
+
+static size_t _findSameScalar(const unsigned char *a, const unsigned char *b,
+							  size_t pos, size_t end)
+{
+#if __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+	uint64_t z;
+
+	for (; pos + 8 <= end; pos += 8) {
+		z = _zeroBytes(_load64(a + pos) ^ _load64(b + pos));
+		if (z)
+			return pos + (__builtin_ctzll(z) >> 3);
+	}
+#endif
+	for (; pos < end; pos++)
+		if (a[pos] == b[pos])
+			return pos;
+	return end;
+}
+
+static void _maskScalar(const unsigned char *a, const unsigned char *b,
+						size_t end, uint64_t *mask)
+{
+	size_t pos, blk;
+
+	for (pos = 0, blk = 0; pos + ADS_DIFF_BLOCK <= end;
+		 pos += ADS_DIFF_BLOCK, blk++) {
+		if ((_load64(a + pos) ^ _load64(b + pos))
+			| (_load64(a + pos + 8) ^ _load64(b + pos + 8)))
+			mask[blk >> 6] |= 1ULL << (blk & 63);
+	}
+}
+
+static const ADSDiffKernel scalarKernel = {
+	_findDiffScalar, _findSameScalar, _maskScalar
+};
+
+#ifdef ADS_DIFF_X86
+
+/*
+ * SSE2 kernel
+ */
+
+__attribute__((target("sse2")))
+static size_t _findDiffSSE2(const unsigned char *a, const unsigned char *b,
+							size_t pos, size_t end)
+{
+	__m128i e0, e1, e2, e3;
+	int m;
+
+	for (; pos + 64 <= end; pos += 64) {
+		e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + pos)),
+							_mm_loadu_si128((const __m128i *)(b + pos)));
+		e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + pos + 16)),
+							_mm_loadu_si128((const __m128i *)(b + pos + 16)));
+		e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + pos + 32)),
+							_mm_loadu_si128((const __m128i *)(b + pos + 32)));
+		e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + pos + 48)),
+							_mm_loadu_si128((const __m128i *)(b + pos + 48)));
+		if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(e0, e1),
+											_mm_and_si128(e2, e3))) != 0xFFFF)
+			break;
+	}
+	for (; pos + 16 <= end; pos += 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)(a + pos)),
+				_mm_loadu_si128((const __m128i *)(b + pos))));
+		if (m != 0xFFFF)
+			return pos + __builtin_ctz(~m);
+	}
+	return _findDiffScalar(a, b, pos, end);
+}
+
+__attribute__((target("sse2")))
+static size_t _findSameSSE2(const unsigned char *a, const unsigned char *b,
+							size_t pos, size_t end)
+{
+	int m;
+
+	for (; pos + 16 <= end; pos += 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)(a + pos)),
+				_mm_loadu_si128((const __m128i *)(b + pos))));
+		if (m)
+			return pos + __builtin_ctz(m);
+	}
+	return _findSameScalar(a, b, pos, end);
+}
+
+__attribute__((target("sse2")))
+static void _maskSSE2(const unsigned char *a, const unsigned char *b,
+					  size_t end, uint64_t *mask)
+{
+	size_t pos, blk;
+
+	for (pos = 0, blk = 0; pos + 16 <= end; pos += 16, blk++) {
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)(a + pos)),
+				_mm_loadu_si128((const __m128i *)(b + pos)))) != 0xFFFF)
+			mask[blk >> 6] |= 1ULL << (blk & 63);
+	}
+}
+
+static const ADSDiffKernel sse2Kernel = {
+	_findDiffSSE2, _findSameSSE2, _maskSSE2
+};
+
+/*
+ * AVX2 kernel
+ */
+
+__attribute__((target("avx2")))
+static size_t _findDiffAVX2(const unsigned char *a, const unsigned char *b,
+							size_t pos, size_t end)
+{
+	__m256i e0, e1;
+	unsigned int m;
+
+	for (; pos + 64 <= end; pos += 64) {
+		e0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + pos)),
+							   _mm256_loadu_si256((const __m256i *)(b + pos)));
+		e1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + pos + 32)),
+							   _mm256_loadu_si256((const __m256i *)(b + pos + 32)));
+		if ((unsigned int)_mm256_movemask_epi8(_mm256_and_si256(e0, e1))
+			!= 0xFFFFFFFFU)
+			break;
+	}
+	for (; pos + 32 <= end; pos += 32) {
+		m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+				_mm256_loadu_si256((const __m256i *)(a + pos)),
+				_mm256_loadu_si256((const __m256i *)(b + pos))));
+		if (m != 0xFFFFFFFFU)
+			return pos + __builtin_ctz(~m);
+	}
+	return _findDiffSSE2(a, b, pos, end);
+}
+
+__attribute__((target("avx2")))
+static size_t _findSameAVX2(const unsigned char *a, const unsigned char *b,
+							size_t pos, size_t end)
+{
+	unsigned int m;
+
+	for (; pos + 32 <= end; pos += 32) {
+		m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+				_mm256_loadu_si256((const __m256i *)(a + pos)),
+				_mm256_loadu_si256((const __m256i *)(b + pos))));
+		if (m)
+			return pos + __builtin_ctz(m);
+	}
+	return _findSameSSE2(a, b, pos, end);
+}
+
+__attribute__((target("avx2")))
+static void _maskAVX2(const unsigned char *a, const unsigned char *b,
+					  size_t end, uint64_t *mask)
+{
+	size_t pos, blk;
+	unsigned int m;
+
+	// two blocks per 32 byte compare, blk is always even here
+	for (pos = 0, blk = 0; pos + 32 <= end; pos += 32, blk += 2) {
+		m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+				_mm256_loadu_si256((const __m256i *)(a + pos)),
+				_mm256_loadu_si256((const __m256i *)(b + pos))));
+		if ((m & 0xFFFF) != 0xFFFF)
+			mask[blk >> 6] |= 1ULL << (blk & 63);
+		if ((m >> 16) != 0xFFFF)
+			mask[(blk + 1) >> 6] |= 1ULL << ((blk + 1) & 63);
+	}
+	if (pos + 16 <= end
+		&& _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)(a + pos)),
+				_mm_loadu_si128((const __m128i *)(b + pos)))) != 0xFFFF)
+		mask[blk >> 6] |= 1ULL << (blk & 63);
+}
+
+static const ADSDiffKernel avx2Kernel = {
+	_findDiffAVX2, _findSameAVX2, _maskAVX2
+};
+
+#endif /* ADS_DIFF_X86 */
+
+static const ADSDiffKernel *kernel = NULL;
+
+/**
+ * @brief Selects the kernel used by ADSdiffRanges() and ADSdiffMask().
+ * There is no need to call this, the best kernel is chosen on first use.
+ * Meant for benchmarks and tests.
+ * @param kind ADS_DIFF_AUTO, ADS_DIFF_SCALAR, ADS_DIFF_SSE2 or ADS_DIFF_AVX2
+ * @return the kernel that is used now; it falls back to a simpler one if
+ * the cpu does not support the requested one.
+ */
+int ADSdiffSelect(int kind)
+{
+	int sel = ADS_DIFF_SCALAR;
+
+#ifdef ADS_DIFF_X86
+	__builtin_cpu_init();
+	if ((kind == ADS_DIFF_AUTO || kind == ADS_DIFF_AVX2)
+		&& __builtin_cpu_supports("avx2"))
+		sel = ADS_DIFF_AVX2;
+	else if (kind != ADS_DIFF_SCALAR && __builtin_cpu_supports("sse2"))
+		sel = ADS_DIFF_SSE2;
+#endif
+
+	switch (sel) {
+#ifdef ADS_DIFF_X86
+		case ADS_DIFF_AVX2:
+			__atomic_store_n(&kernel, &avx2Kernel, __ATOMIC_RELEASE);
+			break;
+		case ADS_DIFF_SSE2:
+			__atomic_store_n(&kernel, &sse2Kernel, __ATOMIC_RELEASE);
+			break;
+#endif
+		default:
+			__atomic_store_n(&kernel, &scalarKernel, __ATOMIC_RELEASE);
+	}
+	return sel;
+}
+
+static inline const ADSDiffKernel *_kernel(void)
+{
+	const ADSDiffKernel *k = __atomic_load_n(&kernel, __ATOMIC_ACQUIRE);
+
+	if (k == NULL) {
+		ADSdiffSelect(ADS_DIFF_AUTO);
+		k = __atomic_load_n(&kernel, __ATOMIC_ACQUIRE);
+	}
+	return k;
+}
+
+/**
+ * @brief Lists the runs of bytes that differ between two buffers.
+ * Runs separated by no more than gap unchanged bytes are merged, so
+ * a changed 4 byte variable with one equal byte inside is still one run.
+ * If there are more runs than maxOut, the last run is extended to the
+ * last changed byte; the result then covers more than what changed, but
+ * never less.
+ * @param prev, cur the buffers to compare, both size bytes long
+ * @param gap number of equal bytes that do not split a run
+ * @param out where to store the runs
+ * @param maxOut size of out (at least 1)
+ * @return number of runs stored in out, 0 if the buffers are equal
+ */
+int ADSdiffRanges(const void *prev, const void *cur, uint32_t size,
+				  uint32_t gap, ADSChange *out, int maxOut)
+{
+	const ADSDiffKernel *k = _kernel();
+	const unsigned char *a = (const unsigned char *) prev;
+	const unsigned char *b = (const unsigned char *) cur;
+	size_t pos = 0, start, stop;
+	int n = 0;
+
+	if (maxOut <= 0)
+		return 0;
+
+	while (pos < size) {
+		start = k->findDiff(a, b, pos, size);
+		if (start >= size)
+			break;
+		stop = k->findSame(a, b, start + 1, size);
+
+		if (n > 0 && (start - (out[n - 1].offset + out[n - 1].length) <= gap
+					  || n == maxOut)) {
+			out[n - 1].length = stop - out[n - 1].offset;
+		}
+		else {
+			out[n].offset = start;
+			out[n].length = stop - start;
+			n++;
+		}
+		pos = stop;
+	}
+	return n;
+}
+
+/**
+ * @brief Sets one bit per ADS_DIFF_BLOCK bytes that differ.
+ * Bit i of the mask (mask[i / 64] bit i % 64) covers bytes
+ * [i * ADS_DIFF_BLOCK, (i + 1) * ADS_DIFF_BLOCK).
+ * @param mask ADS_DIFF_MASK_WORDS(size) words, cleared here
+ * @return number of changed blocks
+ */
+int ADSdiffMask(const void *prev, const void *cur, uint32_t size,
+				uint64_t *mask)
+{
+	const unsigned char *a = (const unsigned char *) prev;
+	const unsigned char *b = (const unsigned char *) cur;
+	size_t full = size - size % ADS_DIFF_BLOCK;
+	size_t i, words = ADS_DIFF_MASK_WORDS(size);
+	int n = 0;
+
+	memset(mask, 0, words * sizeof(uint64_t));
+	_kernel()->mask(a, b, full, mask);
+	if (full < size && memcmp(a + full, b + full, size - full) != 0)
+		mask[(full / ADS_DIFF_BLOCK) >> 6] |=
+			1ULL << ((full / ADS_DIFF_BLOCK) & 63);
+
+	for (i = 0; i < words; i++)
+		n += __builtin_popcountll(mask[i]);
+	return n;
+}
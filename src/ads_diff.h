@@ -0,0 +1,59 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_DIFF_H__
+#define __ADS_DIFF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Kernels for ADSdiffSelect()
+ */
+#define ADS_DIFF_AUTO		0	// best one the cpu supports
+#define ADS_DIFF_SCALAR		1
+#define ADS_DIFF_SSE2		2
+#define ADS_DIFF_AVX2		3
+
+// ADSdiffMask() sets one bit per block of this many bytes
+#define ADS_DIFF_BLOCK		16
+#define ADS_DIFF_MASK_WORDS(size) \
+	((((size) + ADS_DIFF_BLOCK - 1) / ADS_DIFF_BLOCK + 63) / 64)
+
+/**
+ * A run of changed bytes.
+ */
+typedef struct {
+	uint32_t	offset;
+	uint32_t	length;
+} ADSChange;
+
+int ADSdiffSelect(int kernel);
+int ADSdiffRanges(const void *prev, const void *cur, uint32_t size,
+				  uint32_t gap, ADSChange *out, int maxOut);
+int ADSdiffMask(const void *prev, const void *cur, uint32_t size,
+				uint64_t *mask);
+
+#endif //__ADS_DIFF_H__
@@ -0,0 +1,436 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_image.h"
+#include "debugprint.h"
+
+/**
+ * @brief Creates a process image mirror for an open connection.
+ * Ranges are added with ADSimageAddRange(), then the mirror is either
+ * polled by the application with ADSimagePoll() or in the background
+ * after ADSimageStart().
+ * @param dc connection to the PLC
+ * @param cycleTime poll period in milliseconds, used by ADSimageStart()
+ * @return the new mirror or NULL if out of memory
+ */
+ADSImage *ADSimageNew(ADSConnection *dc, int cycleTime)
+{
+	ADSImage *img = (ADSImage *) calloc(1, sizeof(ADSImage));
+
+	if (img) {
+		img->dc = dc;
+		img->cycleTime = cycleTime > 0 ? cycleTime : 1;
+		img->front = -1;
+		pthread_mutex_init(&img->lock, NULL);
+	}
+	return img;
+}
+
+/**
+ * Stops the poller (if running) and frees the mirror.
+ * The connection is not closed.
+ */
+void ADSimageFree(ADSImage *img)
+{
+	if (img == NULL)
+		return;
+	ADSimageStop(img);
+	free(img->snap[0].data);
+	free(img->snap[1].data);
+	free(img->snap[0].changes);
+	free(img->snap[1].changes);
+	free(img->ranges);
+	pthread_mutex_destroy(&img->lock);
+	free(img);
+}
+
+/**
+ * @brief Adds an area of the PLC to the mirror.
+ * Typical index groups are ADSIGRP_IOIMAGE_RWIB, ADSIGRP_IOIMAGE_RWOB,
+ * ADSIGRP_IOIMAGE_FLAGS and ADSIGRP_IOIMAGE_DATA. Ranges longer than one
+ * packet are read in several pieces. Must not be called while the poller
+ * runs or while snapshots are acquired.
+ * @return 0 or an ADS error code
+ */
+int ADSimageAddRange(ADSImage *img, uint32_t indexGroup,
+					 uint32_t indexOffset, uint32_t length)
+{
+	ADSImageRange *r;
+	unsigned char *b0, *b1;
+
+	if (img->running || length == 0) {
+		MsgOut(MSG_ERROR, "ADSimageAddRange(): mirror running or length 0\n");
+		return 0x741;	// invalid parameter at service
+	}
+
+	r = (ADSImageRange *) realloc(img->ranges,
+								  (img->nRanges + 1) * sizeof(ADSImageRange));
+	if (r == NULL)
+		return 0x70A;
+	img->ranges = r;
+
+	b0 = (unsigned char *) realloc(img->snap[0].data, img->size + length);
+	if (b0 == NULL)
+		return 0x70A;
+	img->snap[0].data = b0;
+	b1 = (unsigned char *) realloc(img->snap[1].data, img->size + length);
+	if (b1 == NULL)
+		return 0x70A;
+	img->snap[1].data = b1;
+	memset(b0 + img->size, 0, length);
+	memset(b1 + img->size, 0, length);
+
+	r = &img->ranges[img->nRanges++];
+	r->indexGroup = indexGroup;
+	r->indexOffset = indexOffset;
+	r->length = length;
+	r->imageOffset = img->size;
+	img->size += length;
+	img->snap[0].size = img->size;
+	img->snap[1].size = img->size;
+	// the image layout changed, old snapshots are meaningless
+	img->front = -1;
+
+	MsgOut(MSG_TRACE,
+		   MsgStr("ADSimageAddRange(): 0x%x:%u, %u bytes at image offset %u\n",
+				  indexGroup, indexOffset, length, r->imageOffset));
+	return 0;
+}
+
+/**
+ * @brief Makes every snapshot carry a list of what changed since the one
+ * before.
+ * The lists are computed by the poller with ADSdiffRanges(), a change
+ * never spans two mirrored ranges, except the last one of a full list: if
+ * more changed than maxChanges entries hold, the last entry is extended
+ * to the end of the image. The list then covers more than what changed,
+ * across ranges, but never less. The first snapshot reports every range
+ * as changed. Must not be called while the poller runs.
+ * @param maxChanges size of the change list, 0 switches tracking off
+ * @param gap unchanged bytes that do not split a change, see ADSdiffRanges()
+ * @return 0 or an ADS error code
+ */
+int ADSimageTrackChanges(ADSImage *img, int maxChanges, uint32_t gap)
+{
+	ADSChange *c0 = NULL, *c1 = NULL;
+
+	if (img->running || maxChanges < 0)
+		return 0x741;	// invalid parameter at service
+
+	if (maxChanges > 0) {
+		c0 = (ADSChange *) calloc(maxChanges, sizeof(ADSChange));
+		c1 = (ADSChange *) calloc(maxChanges, sizeof(ADSChange));
+		if (c0 == NULL || c1 == NULL) {
+			free(c0);
+			free(c1);
+			return 0x70A;
+		}
+	}
+	free(img->snap[0].changes);
+	free(img->snap[1].changes);
+	img->snap[0].changes = c0;
+	img->snap[1].changes = c1;
+	img->snap[0].nChanges = img->snap[1].nChanges = 0;
+	img->maxChanges = maxChanges;
+	img->changeGap = gap;
+	return 0;
+}
+
+/*
+ * Fills s->changes by comparing s with prev (NULL for the first snapshot).
+ */
+static void _ADSimageDiff(ADSImage *img, ADSImageSnapshot *s,
+						  const ADSImageSnapshot *prev)
+{
+	ADSImageRange *r;
+	int i, j, n = 0, got;
+
+	for (i = 0; i < img->nRanges && n < img->maxChanges; i++) {
+		r = &img->ranges[i];
+		if (prev == NULL) {
+			s->changes[n].offset = r->imageOffset;
+			s->changes[n].length = r->length;
+			n++;
+			continue;
+		}
+		got = ADSdiffRanges(prev->data + r->imageOffset,
+							s->data + r->imageOffset, r->length,
+							img->changeGap, s->changes + n,
+							img->maxChanges - n);
+		for (j = n; j < n + got; j++)
+			s->changes[j].offset += r->imageOffset;
+		n += got;
+	}
+
+	// list is full: if anything changed in the ranges that were not
+	// looked at, let the last entry cover them all, see
+	// ADSimageTrackChanges()
+	if (i < img->nRanges && n > 0) {
+		r = &img->ranges[i];
+		if (prev == NULL
+			|| memcmp(prev->data + r->imageOffset, s->data + r->imageOffset,
+					  img->size - r->imageOffset) != 0)
+			s->changes[n - 1].length = img->size - s->changes[n - 1].offset;
+	}
+	s->nChanges = n;
+}
+
+/**
+ * @brief Reads all ranges once and publishes them as the new snapshot.
+ * Only one thread may poll a mirror; ADSimageStart() does it in the
+ * background. If a read fails, the previous snapshot stays visible.
+ * @return 0 or the ADS error code of the failed read
+ */
+int ADSimagePoll(ADSImage *img)
+{
+	ADSImageSnapshot *s;
+	ADSImageRange *r;
+	int back, i, rc = 0;
+	uint32_t done, chunk, nRead;
+
+	back = img->front < 0 ? 0 : 1 - img->front;
+
+	// readers that got the buffer as front before the last swap may
+	// still be copying from it
+	if (__atomic_load_n(&img->readers[back], __ATOMIC_SEQ_CST) != 0) {
+		pthread_mutex_lock(&img->lock);
+		img->stats.stalls++;
+		pthread_mutex_unlock(&img->lock);
+		while (__atomic_load_n(&img->readers[back], __ATOMIC_SEQ_CST) != 0)
+			sched_yield();
+	}
+
+	s = &img->snap[back];
+	for (i = 0; i < img->nRanges && rc == 0; i++) {
+		r = &img->ranges[i];
+		for (done = 0; done < r->length && rc == 0; done += chunk) {
+			chunk = r->length - done;
+			if (chunk > ADS_MAX_READ_CHUNK)
+				chunk = ADS_MAX_READ_CHUNK;
+			rc = ADSreadBytes(img->dc, r->indexGroup, r->indexOffset + done,
+							  chunk, s->data + r->imageOffset + done, &nRead);
+			if (rc == 0 && nRead != chunk)
+				rc = 0x705;	// parameter size not correct
+		}
+	}
+
+	pthread_mutex_lock(&img->lock);
+	if (rc != 0) {
+		img->stats.errors++;
+		img->stats.lastError = rc;
+		pthread_mutex_unlock(&img->lock);
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADSimagePoll(): range %d failed with 0x%x\n", i - 1, rc));
+		return rc;
+	}
+	s->cycle = ++img->stats.cycles;
+	pthread_mutex_unlock(&img->lock);
+	clock_gettime(CLOCK_REALTIME, &s->stamp);
+
+	// only this thread writes snapshots, so the front one is stable here
+	if (img->maxChanges > 0)
+		_ADSimageDiff(img, s, img->front < 0 ? NULL : &img->snap[img->front]);
+
+	__atomic_store_n(&img->front, back, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static void _tsAddNs(struct timespec *t, long long ns)
+{
+	ns += t->tv_nsec;
+	t->tv_sec += ns / 1000000000LL;
+	t->tv_nsec = ns % 1000000000LL;
+}
+
+static long long _tsDiffNs(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+/*
+ * Polls with absolute deadlines, so the period does not drift with the
+ * time spent in ADSimagePoll(). A cycle that ends after its deadline is an
+ * overrun; the missed deadlines are skipped instead of being caught up in
+ * a burst.
+ */
+static void *_ADSimageThread(void *arg)
+{
+	ADSImage *img = (ADSImage *) arg;
+	struct timespec next, now;
+	long long period = img->cycleTime * 1000000LL;
+	long long late, missed;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (__atomic_load_n(&img->running, __ATOMIC_SEQ_CST)) {
+		ADSimagePoll(img);
+
+		_tsAddNs(&next, period);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		late = _tsDiffNs(&now, &next);
+		if (late >= 0) {
+			missed = late / period + 1;
+			_tsAddNs(&next, missed * period);
+			pthread_mutex_lock(&img->lock);
+			img->stats.overruns++;
+			img->stats.skipped += missed;
+			pthread_mutex_unlock(&img->lock);
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Starts polling the mirror every cycleTime milliseconds.
+ * @return 0 or an ADS error code
+ */
+int ADSimageStart(ADSImage *img)
+{
+	if (img->running)
+		return 0;
+	if (img->nRanges == 0)
+		return 0x742;	// polling list is empty
+
+	img->running = 1;
+	if (pthread_create(&img->thread, NULL, _ADSimageThread, img) != 0) {
+		img->running = 0;
+		MsgOut(MSG_ERROR, "ADSimageStart(): pthread_create() failed\n");
+		return 0x1;
+	}
+	return 0;
+}
+
+/**
+ * Stops the background poller, the last snapshot stays readable.
+ */
+int ADSimageStop(ADSImage *img)
+{
+	if (!img->running)
+		return 0;
+	__atomic_store_n(&img->running, 0, __ATOMIC_SEQ_CST);
+	pthread_join(img->thread, NULL);
+	return 0;
+}
+
+/**
+ * @brief Pins the newest snapshot for reading without copying it.
+ * The poller cannot overwrite a pinned snapshot, so release it quickly
+ * with ADSimageRelease().
+ * @return the snapshot or NULL if no poll cycle succeeded yet
+ */
+const ADSImageSnapshot *ADSimageAcquire(ADSImage *img)
+{
+	int i;
+
+	for (;;) {
+		i = __atomic_load_n(&img->front, __ATOMIC_SEQ_CST);
+		if (i < 0)
+			return NULL;
+		__atomic_add_fetch(&img->readers[i], 1, __ATOMIC_SEQ_CST);
+		// the poller may have swapped in between, then it could already
+		// be writing to snap[i]: back off and take the new front
+		if (__atomic_load_n(&img->front, __ATOMIC_SEQ_CST) == i)
+			return &img->snap[i];
+		__atomic_sub_fetch(&img->readers[i], 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void ADSimageRelease(ADSImage *img, const ADSImageSnapshot *snap)
+{
+	if (snap != NULL)
+		__atomic_sub_fetch(&img->readers[snap - img->snap], 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Reads a variable from the mirror, without network traffic.
+ * The requested bytes must lie completely within one range.
+ * @return 0, 0x702 if indexGroup is not mirrored, 0x703 if the bytes are
+ * not mirrored, 0x707 if there is no snapshot yet.
+ */
+int ADSimageRead(ADSImage *img, uint32_t indexGroup, uint32_t indexOffset,
+				 uint32_t length, void *data)
+{
+	const ADSImageSnapshot *s;
+	ADSImageRange *r;
+	int i, rc = 0x702;	// invalid index group
+
+	for (i = 0; i < img->nRanges; i++) {
+		r = &img->ranges[i];
+		if (r->indexGroup != indexGroup)
+			continue;
+		rc = 0x703;		// invalid index offset
+		if (indexOffset < r->indexOffset
+			|| indexOffset + length > r->indexOffset + r->length)
+			continue;
+
+		s = ADSimageAcquire(img);
+		if (s == NULL)
+			return 0x707;	// device is not in a ready state
+		memcpy(data, s->data + r->imageOffset + (indexOffset - r->indexOffset),
+			   length);
+		ADSimageRelease(img, s);
+		return 0;
+	}
+	return rc;
+}
+
+/**
+ * @brief Translates an offset in the shadow image (e.g. from a change list)
+ * back to the PLC address it was read from.
+ * @return 0 or 0x703 if imageOffset is beyond the image
+ */
+int ADSimageLocate(ADSImage *img, uint32_t imageOffset,
+				   uint32_t *indexGroup, uint32_t *indexOffset)
+{
+	ADSImageRange *r;
+	int i;
+
+	for (i = 0; i < img->nRanges; i++) {
+		r = &img->ranges[i];
+		if (imageOffset >= r->imageOffset
+			&& imageOffset < r->imageOffset + r->length) {
+			*indexGroup = r->indexGroup;
+			*indexOffset = r->indexOffset + (imageOffset - r->imageOffset);
+			return 0;
+		}
+	}
+	return 0x703;	// invalid index offset
+}
+
+void ADSimageGetStats(ADSImage *img, ADSImageStats *stats)
+{
+	pthread_mutex_lock(&img->lock);
+	*stats = img->stats;
+	pthread_mutex_unlock(&img->lock);
+}
@@ -0,0 +1,114 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_IMAGE_H__
+#define __ADS_IMAGE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ads_diff.h"
+
+// biggest piece of data one read request can bring back: a packet is
+// limited to MAXDATALEN, minus the headers and the read response header.
+#define ADS_MAX_READ_CHUNK	(MAXDATALEN - sizeof(AMS_TCPheader) \
+							 - sizeof(AMSheader) - 8)
+
+/**
+ * One mirrored area of the PLC, e.g. 64 bytes of ADSIGRP_IOIMAGE_RWIB
+ * starting at offset 0.
+ */
+typedef struct {
+	uint32_t	indexGroup;
+	uint32_t	indexOffset;
+	uint32_t	length;
+	uint32_t	imageOffset;	// where this range starts in the shadow image
+} ADSImageRange;
+
+/**
+ * A complete, consistent copy of all ranges, as read in one poll cycle.
+ */
+typedef struct {
+	unsigned char	*data;		// all ranges, one after the other
+	uint32_t		size;
+	uint64_t		cycle;		// poll cycle that produced this snapshot
+	struct timespec	stamp;		// CLOCK_REALTIME when the cycle finished
+	ADSChange		*changes;	// image offsets that differ from the
+	int				nChanges;	// previous snapshot, see ADSimageTrackChanges()
+} ADSImageSnapshot;
+
+typedef struct {
+	uint64_t	cycles;			// completed poll cycles
+	uint64_t	errors;			// failed poll cycles
+	uint64_t	overruns;		// cycles that took longer than cycleTime
+	uint64_t	skipped;		// cycles skipped because of overruns
+	uint64_t	stalls;			// times the poller had to wait for readers
+	int			lastError;		// ADS error code of the last failed cycle
+} ADSImageStats;
+
+/**
+ * The process image mirror.
+ * A poller reads all ranges into the back buffer, then makes it the front
+ * buffer with one atomic store. Readers pin the front buffer while copying
+ * from it, so the poller never overwrites a buffer that is still read.
+ */
+typedef struct {
+	ADSConnection	*dc;
+	ADSImageRange	*ranges;
+	int				nRanges;
+	uint32_t		size;			// sum of all range lengths
+	int				cycleTime;		// poll period in milliseconds
+	int				maxChanges;		// 0: no change tracking
+	uint32_t		changeGap;
+
+	ADSImageSnapshot snap[2];
+	int				front;			// index of the readable snapshot, -1 = none
+	int				readers[2];		// readers pinning snap[i]
+
+	pthread_t		thread;
+	int				running;
+	pthread_mutex_t	lock;			// guards stats
+	ADSImageStats	stats;
+} ADSImage;
+
+ADSImage *ADSimageNew(ADSConnection *dc, int cycleTime);
+void ADSimageFree(ADSImage *img);
+int ADSimageAddRange(ADSImage *img, uint32_t indexGroup,
+					 uint32_t indexOffset, uint32_t length);
+int ADSimageTrackChanges(ADSImage *img, int maxChanges, uint32_t gap);
+int ADSimagePoll(ADSImage *img);
+int ADSimageStart(ADSImage *img);
+int ADSimageStop(ADSImage *img);
+
+const ADSImageSnapshot *ADSimageAcquire(ADSImage *img);
+void ADSimageRelease(ADSImage *img, const ADSImageSnapshot *snap);
+int ADSimageRead(ADSImage *img, uint32_t indexGroup, uint32_t indexOffset,
+				 uint32_t length, void *data);
+int ADSimageLocate(ADSImage *img, uint32_t imageOffset,
+				   uint32_t *indexGroup, uint32_t *indexOffset);
+void ADSimageGetStats(ADSImage *img, ADSImageStats *stats);
+
+#endif //__ADS_IMAGE_H__
@@ -39,6 +39,103 @@
 #include "ads_io.h"
 #include "debugprint.h"
 
+static int _ADStcpSend(ADSInterface *di, const void *buffer, int len)
+{
+	const char *b = (const char *) buffer;
+	int rc, sent = 0;
+
+	while (sent < len) {
+		rc = send(di->sd, b + sent, len - sent, MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		sent += rc;
+	}
+	return sent;
+}
+
+static int _ADStcpRecv(ADSInterface *di, void *buffer, int len)
+{
+	return recv(di->sd, buffer, len, 0);
+}
+
+static void _ADStcpClose(ADSInterface *di)
+{
+	close(di->sd);
+}
+
+/**
+ * The transport of all interfaces unless set otherwise: the socket sd.
+ */
+const ADSTransport ADStcpTransport = {
+	"tcp", _ADStcpSend, _ADStcpRecv, _ADStcpClose, NULL
+};
+
+static int _ADSunixSend(ADSInterface *di, const void *buffer, int len)
+{
+	int rc;
+
+	do
+		rc = send(di->sd, buffer, len, MSG_NOSIGNAL);	// all or nothing
+	while (rc < 0 && errno == EINTR);
+	return rc;
+}
+
+static int _ADSunixRecv(ADSInterface *di, void *buffer, int len)
+{
+	ADSUnixLink *l = (ADSUnixLink *) di->link;
+	int n;
+
+	if (l->off == l->len) {
+		if (len >= ADS_UNIX_FRAME) {
+			// room for any packet, straight into the caller's buffer
+			n = recv(di->sd, buffer, len, MSG_TRUNC);
+			if (n > len) {
+				errno = EMSGSIZE;
+				return -1;
+			}
+			return n;
+		}
+		n = recv(di->sd, l->buf, sizeof(l->buf), MSG_TRUNC);
+		if (n <= 0)
+			return n;
+		if (n > sizeof(l->buf)) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		l->off = 0;
+		l->len = n;
+	}
+	n = l->len - l->off < len ? l->len - l->off : len;
+	memcpy(buffer, l->buf + l->off, n);
+	l->off += n;
+	return n;
+}
+
+static int _ADSunixPending(ADSInterface *di)
+{
+	ADSUnixLink *l = (ADSUnixLink *) di->link;
+
+	return l->len - l->off;
+}
+
+static void _ADSunixClose(ADSInterface *di)
+{
+	close(di->sd);
+	free(di->link);
+	di->link = NULL;
+}
+
+/**
+ * Interfaces to the local router over a unix SOCK_SEQPACKET socket sd,
+ * link an ADSUnixLink.
+ */
+const ADSTransport ADSunixTransport = {
+	"unix", _ADSunixSend, _ADSunixRecv, _ADSunixClose, _ADSunixPending
+};
+
 /**
  * @brief Send a packet to a peer (router or client)
  * @param di	interface to use for reading
@@ -80,10 +177,8 @@ int	_ADSWritePacket(ADSInterface *di, ADSpacket *p, int *error)
 		return -4;
 	}
 
-	rc = send(di->sd,
-			  (void *)p,
-			  sizeof(AMS_TCPheader) + p->adsHeader.length,
-			  MSG_NOSIGNAL);
+	rc = di->transport->send(di, p,
+							 sizeof(AMS_TCPheader) + p->adsHeader.length);
 	// TODO: return ADS error code instead of linux errno
 	if(rc == -1){
 #ifdef LOG_ALL_MESSAGES
@@ -117,7 +212,7 @@ int	_ADSWritePacket(ADSInterface *di, ADSpacket *p, int *error)
 /**
  * @brief Read one byte, may run into timeout
  *
- * @param rfd	file descriptor to use for reading
+ * @param di	interface to use for reading
  * @param b 	where to store retrieved byte
  * @param pt 	pointer to timeval with time left bevore timeout occures
  * @param error see return values
@@ -126,11 +221,15 @@ int	_ADSWritePacket(ADSInterface *di, ADSpacket *p, int *error)
  * @return	   -1: time out, error param = 0
  * @return	   -2: peer shut down, error param = 0
  */
-int _ADSReadByte(int rfd, unsigned char *b, struct timeval *pt, int *error)
+int _ADSReadByte(ADSInterface *di, unsigned char *b, struct timeval *pt,
+				 int *error)
 {
 	fd_set FDS;
-	int rc;
+	int rc, rfd = di->sd;
 
+again:
+	if (di->transport->pending != NULL && di->transport->pending(di) > 0)
+		goto read;
 	FD_ZERO(&FDS);
 	FD_SET(rfd, &FDS);
 
@@ -160,7 +259,10 @@ int _ADSReadByte(int rfd, unsigned char *b, struct timeval *pt, int *error)
 		return (-1);
 	}
 
-	rc = recv(rfd, b, 1, 0);
+read:
+	rc = di->transport->recv(di, b, 1);
+	if (rc == -1 && (errno == EAGAIN || errno == EINTR))
+		goto again;		// woken, but nothing for us after all
 	if (rc == 0){
 #ifdef LOG_ALL_MESSAGES
 		syslog(LOG_USER | LOG_ERR,
@@ -249,7 +351,7 @@ int _ADSReadPacket(ADSInterface *di, unsigned char *b, int *error)
 		pt = NULL;
 
 	while (res < sizeof(AMS_TCPheader)) {
-			rc = _ADSReadByte(di->sd, b + res, pt, error);
+			rc = _ADSReadByte(di, b + res, pt, error);
 		if(rc == 1)
 			res++;
 		else{
@@ -267,7 +369,7 @@ int _ADSReadPacket(ADSInterface *di, unsigned char *b, int *error)
 		   MsgStr("_ADSReadPacket(): AMS_TCPheader.length= %d\n", h->length));
 
 	while (res < sizeof(AMS_TCPheader) + h->length) {
-		rc = _ADSReadByte(di->sd, b + (res < MAXDATALEN ? res : MAXDATALEN - 1), pt, error);
+		rc = _ADSReadByte(di, b + (res < MAXDATALEN ? res : MAXDATALEN - 1), pt, error);
 		if(rc == 1){
 			res++;
 		}
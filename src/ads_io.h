@@ -28,6 +28,41 @@
 #ifndef __ADS_IO_H__
 #define __ADS_IO_H__
 
+/**
+ * How the packets of an interface go over the wire. sd is what the
+ * receive side polls for POLLIN; whatever the transport, the byte stream
+ * is the one of AMS/TCP, so the packets keep their AMS/TCP header.
+ */
+typedef struct _ADSTransport {
+	const char	*name;
+	// the whole of len bytes or -1, errno set
+	int (*send)(ADSInterface *di, const void *buffer, int len);
+	// like recv(): bytes read, 0 if the peer shut down, -1 with errno set,
+	// EAGAIN if there is nothing after all
+	int (*recv)(ADSInterface *di, void *buffer, int len);
+	void (*close)(ADSInterface *di);
+	// bytes received already, to be read without polling sd; may be NULL
+	int (*pending)(ADSInterface *di);
+} ADSTransport;
+
+extern const ADSTransport ADStcpTransport;
+
+#define ADS_UNIX_PREFIX		"unix:"					// router address prefix
+#define ADS_UNIX_PATH		"/tmp/adsrouter.sock"	// default socket of the router
+#define ADS_UNIX_FRAME		(8 * MAXDATALEN)		// biggest packet from it
+
+/**
+ * A unix SOCK_SEQPACKET socket to the local router, one packet per
+ * message. Readers that ask for less than a packet get it from buf.
+ */
+typedef struct {
+	int				off;			// bytes of buf handed out
+	int				len;			// bytes of buf received
+	unsigned char	buf[ADS_UNIX_FRAME];
+} ADSUnixLink;
+
+extern const ADSTransport ADSunixTransport;
+
 int _ADSWrite(ADSInterface *di, void *buffer, int len);
 int	_ADSWritePacket(ADSInterface *di, ADSpacket *p1, int *error);
 int _ADSRead(ADSInterface *di, unsigned char *b);
@@ -0,0 +1,129 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_latest.h"
+#include "debugprint.h"
+
+/**
+ * @brief Creates an empty slot for samples of up to capacity bytes.
+ * @return the slot or NULL
+ */
+ADSLatest *ADSlatestNew(uint32_t capacity)
+{
+	ADSLatest *l;
+
+	if (capacity > 8 * MAXDATALEN)
+		return NULL;
+	l = (ADSLatest *) calloc(1, sizeof(ADSLatest) + capacity);
+	if (l != NULL)
+		l->capacity = capacity;
+	return l;
+}
+
+void ADSlatestFree(ADSLatest *l)
+{
+	free(l);
+}
+
+/**
+ * @brief Replaces the sample, never waits. Only one thread may write.
+ * @return 0 or 0x705 if the sample exceeds the capacity
+ */
+int ADSlatestPut(ADSLatest *l, uint64_t timeStamp, const void *data,
+				 uint32_t size)
+{
+	uint32_t seq = l->seq;
+
+	if (size > l->capacity)
+		return 0x705;
+
+	__atomic_store_n(&l->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);	// odd before the data
+	l->timeStamp = timeStamp;
+	l->size = size;
+	memcpy(l->data, data, size);
+	__atomic_store_n(&l->updates, l->updates + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&l->seq, seq + 2, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * @brief Copies the newest sample to buffer.
+ * @param size receives the bytes copied, may be NULL
+ * @param timeStamp receives the device's time stamp, may be NULL
+ * @param fresh receives the number of samples that came in since the
+ * previous ADSlatestGet(), 0 if the value is the same; may be NULL
+ * @return 0, 0x705 if buffer is too small or 0x1 if there is no sample yet
+ */
+int ADSlatestGet(ADSLatest *l, void *buffer, uint32_t length,
+				 uint32_t *size, uint64_t *timeStamp, uint64_t *fresh)
+{
+	uint32_t seq, n;
+	uint64_t ts, updates, seen;
+
+	for (;;) {
+		seq = __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;		// the writer is busy, it does not take long
+		updates = __atomic_load_n(&l->updates, __ATOMIC_RELAXED);
+		if (updates == 0)
+			return 0x1;
+		n = __atomic_load_n(&l->size, __ATOMIC_RELAXED);
+		ts = __atomic_load_n(&l->timeStamp, __ATOMIC_RELAXED);
+		if (n <= length)
+			memcpy(buffer, l->data, n);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);	// data before seq
+		if (__atomic_load_n(&l->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+	if (n > length)
+		return 0x705;
+
+	// the samples between the one read before and this one were dropped
+	seen = __atomic_exchange_n(&l->seen, updates, __ATOMIC_RELAXED);
+	if (updates > seen + 1)
+		__atomic_add_fetch(&l->dropped, updates - seen - 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&l->reads, 1, __ATOMIC_RELAXED);
+	if (size != NULL)
+		*size = n;
+	if (timeStamp != NULL)
+		*timeStamp = ts;
+	if (fresh != NULL)
+		*fresh = updates > seen ? updates - seen : 0;
+	return 0;
+}
+
+void ADSlatestGetStats(ADSLatest *l, ADSLatestStats *st)
+{
+	st->updates = __atomic_load_n(&l->updates, __ATOMIC_RELAXED);
+	st->dropped = __atomic_load_n(&l->dropped, __ATOMIC_RELAXED);
+	st->reads = __atomic_load_n(&l->reads, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,66 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_LATEST_H__
+#define __ADS_LATEST_H__
+
+#include <stdint.h>
+
+typedef struct {
+	uint64_t	updates;		// samples written
+	uint64_t	dropped;		// samples overwritten before anyone read them,
+								// counted when the next one is read
+	uint64_t	reads;
+} ADSLatestStats;
+
+/**
+ * Only the newest sample of a subscription, for consumers that care about
+ * the current value and not about every change: memory stays bounded
+ * however far they fall behind. One writer, the receive thread, replaces
+ * the sample under a sequence lock; readers copy it without locking and
+ * retry if a write came in between.
+ */
+typedef struct {
+	uint32_t		seq;			// odd while the writer is busy
+	uint32_t		capacity;		// bytes data can hold
+	uint32_t		size;			// bytes of the sample in data
+	uint64_t		timeStamp;
+	uint64_t		updates;
+	uint64_t		seen;			// updates when it was read last, readers
+									// count the dropped ones from it
+	uint64_t		dropped;
+	uint64_t		reads;
+	unsigned char	data[];
+} ADSLatest;
+
+ADSLatest *ADSlatestNew(uint32_t capacity);
+void ADSlatestFree(ADSLatest *l);
+int ADSlatestPut(ADSLatest *l, uint64_t timeStamp, const void *data,
+				 uint32_t size);
+int ADSlatestGet(ADSLatest *l, void *buffer, uint32_t length,
+				 uint32_t *size, uint64_t *timeStamp, uint64_t *fresh);
+void ADSlatestGetStats(ADSLatest *l, ADSLatestStats *stats);
+
+#endif //__ADS_LATEST_H__
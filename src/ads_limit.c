@@ -0,0 +1,105 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+#include "ads_limit.h"
+
+void ADSlimitInit(ADSLimit *l, int initial, int maxLimit)
+{
+	memset(l, 0, sizeof(ADSLimit));
+	l->minLimit = 1;
+	l->maxLimit = maxLimit < 1 ? 1 : maxLimit;
+	l->limit = initial < 1 ? 1 : (initial > l->maxLimit ? l->maxLimit : initial);
+	l->tolerance = 2.0;
+	l->backoff = 0.8;
+	l->dropBackoff = 0.5;
+}
+
+/**
+ * @brief Takes a slot for a request.
+ * @return 1 if the request may be sent now, 0 if it has to wait.
+ */
+int ADSlimitAcquire(ADSLimit *l)
+{
+	if (l->inflight >= (int) l->limit)
+		return 0;
+	l->inflight++;
+	return 1;
+}
+
+static void _ADSlimitDecrease(ADSLimit *l, int64_t now, double factor)
+{
+	if (l->lastDecrease != 0 && now - l->lastDecrease < l->srtt)
+		return;		// same overload
+	l->lastDecrease = now;
+	l->stats.decreases++;
+	l->limit *= factor;
+	if (l->limit < l->minLimit)
+		l->limit = l->minLimit;
+}
+
+/**
+ * @brief Gives a slot back.
+ * @param now CLOCK_MONOTONIC in ns
+ * @param rtt ns from sending to the answer, 0 if the request never got
+ * an answer for other reasons than a time out (no sample then)
+ * @param dropped the request timed out
+ */
+void ADSlimitRelease(ADSLimit *l, int64_t now, int64_t rtt, int dropped)
+{
+	l->inflight--;
+	if (dropped) {
+		l->stats.drops++;
+		_ADSlimitDecrease(l, now, l->dropBackoff);
+		return;
+	}
+	if (rtt <= 0)
+		return;
+
+	l->stats.samples++;
+	// best latency of this and the last window, so a device that got
+	// slower for good is not taken as overloaded forever
+	if (now - l->windowStart > ADS_LIMIT_WINDOW) {
+		l->windowStart = now;
+		l->prevMinRtt = l->curMinRtt;
+		l->curMinRtt = 0;
+	}
+	if (l->curMinRtt == 0 || rtt < l->curMinRtt)
+		l->curMinRtt = rtt;
+	l->minRtt = l->prevMinRtt != 0 && l->prevMinRtt < l->curMinRtt
+		? l->prevMinRtt : l->curMinRtt;
+	l->srtt = l->srtt == 0 ? rtt : l->srtt + (rtt - l->srtt) / 8;
+
+	if (rtt > l->minRtt * l->tolerance)
+		_ADSlimitDecrease(l, now, l->backoff);
+	else if (l->inflight + 1 >= (int) l->limit && l->limit < l->maxLimit) {
+		// only grow a limit that is actually used
+		l->limit += 1.0 / l->limit;
+		if (l->limit > l->maxLimit)
+			l->limit = l->maxLimit;
+		l->stats.increases++;
+	}
+}
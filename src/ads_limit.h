@@ -0,0 +1,70 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_LIMIT_H__
+#define __ADS_LIMIT_H__
+
+#include <stdint.h>
+
+#define ADS_LIMIT_INITIAL	1		// requests on the way to a new device
+#define ADS_LIMIT_MAX		32
+#define ADS_LIMIT_WINDOW	10000000000LL	// ns, see ADSLimit.minRtt
+
+typedef struct {
+	uint64_t	samples;		// answers measured
+	uint64_t	increases;
+	uint64_t	decreases;
+	uint64_t	drops;			// requests timed out
+} ADSLimitStats;
+
+/**
+ * Adaptive limit of the requests on the way to one device.
+ * Additive increase: one more request per round trip while the latency
+ * stays near the best one seen. Multiplicative decrease when the latency
+ * grows beyond tolerance times that, or a request times out; at most once
+ * per round trip, the answers of one overload come back together.
+ */
+typedef struct {
+	double		limit;
+	int			minLimit;
+	int			maxLimit;
+	int			inflight;
+	double		tolerance;		// latency/minRtt that counts as overload
+	double		backoff;		// limit *= backoff on overload
+	double		dropBackoff;	// limit *= dropBackoff on time out
+	int64_t		minRtt;			// ns, best latency of the last two windows
+	int64_t		curMinRtt;
+	int64_t		prevMinRtt;
+	int64_t		windowStart;
+	int64_t		srtt;			// ns, smoothed latency
+	int64_t		lastDecrease;	// ns
+	ADSLimitStats stats;
+} ADSLimit;
+
+void ADSlimitInit(ADSLimit *l, int initial, int maxLimit);
+int ADSlimitAcquire(ADSLimit *l);
+void ADSlimitRelease(ADSLimit *l, int64_t now, int64_t rtt, int dropped);
+
+#endif //__ADS_LIMIT_H__
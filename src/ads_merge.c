@@ -0,0 +1,284 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_merge.h"
+#include "debugprint.h"
+
+#define FILETIME_PER_MS	10000
+
+/* is input a before input b? ties go by index, so the order is stable */
+static int _ADSmergeBefore(ADSMerge *m, int a, int b)
+{
+	if (m->in[a].head != m->in[b].head)
+		return m->in[a].head < m->in[b].head;
+	return a < b;
+}
+
+static void _ADSmergeUp(ADSMerge *m, int i)
+{
+	int p, x = m->heap[i];
+
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (!_ADSmergeBefore(m, x, m->heap[p]))
+			break;
+		m->heap[i] = m->heap[p];
+		i = p;
+	}
+	m->heap[i] = x;
+}
+
+static void _ADSmergeDown(ADSMerge *m, int i)
+{
+	int c, x = m->heap[i];
+
+	for (;;) {
+		c = 2 * i + 1;
+		if (c >= m->ready)
+			break;
+		if (c + 1 < m->ready && _ADSmergeBefore(m, m->heap[c + 1], m->heap[c]))
+			c++;
+		if (!_ADSmergeBefore(m, m->heap[c], x))
+			break;
+		m->heap[i] = m->heap[c];
+		i = c;
+	}
+	m->heap[i] = x;
+}
+
+/* puts input i into the heap if its ring has a sample */
+static int _ADSmergeLoad(ADSMerge *m, int i)
+{
+	ADSMergeInput *in = &m->in[i];
+	const ADSSample *s;
+
+	s = ADSringPeek(in->ring);
+	if (s == NULL)
+		return 0;
+	in->head = s->timeStamp;
+	in->ready = 1;
+	if (in->head > m->watermark)
+		m->watermark = in->head;
+	m->heap[m->ready] = i;
+	_ADSmergeUp(m, m->ready++);
+	return 1;
+}
+
+/* picks up rings that got samples, and the newest time stamps */
+static void _ADSmergeScan(ADSMerge *m)
+{
+	const ADSSample *newest;
+	int i;
+
+	for (i = 0; i < m->count; i++) {
+		if (!m->in[i].ready && !_ADSmergeLoad(m, i))
+			continue;
+		newest = ADSringNewest(m->in[i].ring);
+		if (newest != NULL && newest->timeStamp > m->watermark)
+			m->watermark = newest->timeStamp;
+	}
+}
+
+/*
+ * Hands out the oldest samples while they may go: all if force, else as
+ * long as every input has one or the oldest is behind the window.
+ */
+static int _ADSmergeRun(ADSMerge *m, ADSMergeFunc func, void *user, int max,
+						int force)
+{
+	ADSMergeInput *in;
+	const ADSSample *s;
+	int i, n = 0;
+
+	_ADSmergeScan(m);
+	while (m->ready > 0 && (max <= 0 || n < max)) {
+		i = m->heap[0];
+		in = &m->in[i];
+		if (!force && m->ready < m->count
+			&& in->head + m->lateness > m->watermark)
+			break;
+		s = ADSringPeek(in->ring);
+		if (s->timeStamp < m->lastOut)
+			m->late++;
+		else {
+			func(s, i, user);
+			m->lastOut = s->timeStamp;
+			m->merged++;
+			n++;
+		}
+		ADSringPop(in->ring);
+
+		s = ADSringPeek(in->ring);
+		if (s != NULL) {
+			in->head = s->timeStamp;
+			if (in->head > m->watermark)
+				m->watermark = in->head;
+			_ADSmergeDown(m, 0);
+		}
+		else {
+			in->ready = 0;
+			m->heap[0] = m->heap[--m->ready];
+			if (m->ready > 0)
+				_ADSmergeDown(m, 0);
+			// it may have filled meanwhile
+			_ADSmergeLoad(m, i);
+		}
+	}
+	return n;
+}
+
+/**
+ * @brief Creates a merge of up to maxInputs rings; samples wait for the
+ * other rings up to latenessMs.
+ * @return the merge or NULL
+ */
+ADSMerge *ADSmergeNew(int maxInputs, uint32_t latenessMs)
+{
+	ADSMerge *m;
+
+	if (maxInputs <= 0)
+		return NULL;
+	m = (ADSMerge *) calloc(1, sizeof(ADSMerge));
+	if (m == NULL)
+		return NULL;
+	m->max = maxInputs;
+	m->lateness = (uint64_t) latenessMs * FILETIME_PER_MS;
+	m->in = (ADSMergeInput *) calloc(maxInputs, sizeof(ADSMergeInput));
+	m->heap = (int *) calloc(maxInputs, sizeof(int));
+	if (m->in == NULL || m->heap == NULL) {
+		MsgOut(MSG_ERROR, "ADSmergeNew(): out of memory\n");
+		ADSmergeFree(m);
+		return NULL;
+	}
+	return m;
+}
+
+/* frees the merge, not the rings */
+void ADSmergeFree(ADSMerge *m)
+{
+	if (m == NULL)
+		return;
+	free(m->in);
+	free(m->heap);
+	free(m);
+}
+
+/**
+ * @brief Adds ring as the next input; the merge is its consumer from now
+ * on, nobody else may drain it.
+ * @return 0, 0x741 without a ring or 0x502 if the merge is full
+ */
+int ADSmergeAddInput(ADSMerge *m, ADSRing *ring)
+{
+	if (ring == NULL)
+		return 0x741;
+	if (m->count == m->max)
+		return 0x502;
+	m->in[m->count].ring = ring;
+	m->in[m->count].ready = 0;
+	m->count++;
+	return 0;
+}
+
+/**
+ * @brief Tells the merge that time went on to timeStamp even if no sample
+ * says so, e.g. from a clock, so quiet times do not hold samples back.
+ */
+void ADSmergeAdvance(ADSMerge *m, uint64_t timeStamp)
+{
+	if (timeStamp > m->watermark)
+		m->watermark = timeStamp;
+}
+
+/**
+ * @brief Hands up to max samples (all that may go if max <= 0) to func,
+ * in order of their time stamps.
+ * @return the number of samples
+ */
+int ADSmergeDrain(ADSMerge *m, ADSMergeFunc func, void *user, int max)
+{
+	return _ADSmergeRun(m, func, user, max, 0);
+}
+
+/**
+ * @brief Hands out all samples waiting, without waiting for the window,
+ * e.g. when the inputs stop.
+ * @return the number of samples
+ */
+int ADSmergeFlush(ADSMerge *m, ADSMergeFunc func, void *user)
+{
+	return _ADSmergeRun(m, func, user, 0, 1);
+}
+
+/**
+ * @brief Waits up to timeout ms (-1 for ever) until a ring has samples,
+ * as ADSringWait() does for one ring.
+ * @return 1 if samples are ready, else 0
+ */
+int ADSmergeWait(ADSMerge *m, int timeout)
+{
+	struct pollfd pfd[m->count > 0 ? m->count : 1];
+	uint64_t v;
+	int i, ready = 0;
+
+	for (i = 0; i < m->count; i++)
+		__atomic_store_n(&m->in[i].ring->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < m->count && !ready; i++)
+		ready = ADSringReady(m->in[i].ring);
+	if (!ready) {
+		for (i = 0; i < m->count; i++) {
+			pfd[i].fd = m->in[i].ring->fd;
+			pfd[i].events = POLLIN;
+		}
+		poll(pfd, m->count, timeout);
+	}
+	for (i = 0; i < m->count; i++) {
+		__atomic_store_n(&m->in[i].ring->waiting, 0, __ATOMIC_RELAXED);
+		if (read(m->in[i].ring->fd, &v, sizeof(v)) != sizeof(v))
+			v = 0;		// nobody woke us
+	}
+	for (i = 0, ready = 0; i < m->count && !ready; i++)
+		ready = ADSringReady(m->in[i].ring);
+	return ready;
+}
+
+void ADSmergeGetStats(ADSMerge *m, ADSMergeStats *st)
+{
+	st->merged = m->merged;
+	st->late = m->late;
+	st->watermark = m->watermark;
+	st->inputs = m->count;
+	st->ready = m->ready;
+}
@@ -0,0 +1,87 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __ADS_MERGE_H__
+#define __ADS_MERGE_H__
+
+#include <stdint.h>
+
+#include "ads_ring.h"
+
+typedef struct {
+	uint64_t	merged;			// samples handed out in order
+	uint64_t	late;			// samples dropped, older than one handed out
+	uint64_t	watermark;		// newest time stamp seen, file time
+	int			inputs;
+	int			ready;			// inputs with a sample waiting now
+} ADSMergeStats;
+
+typedef struct {
+	ADSRing		*ring;
+	uint64_t	head;			// time stamp of the oldest sample, if ready
+	int			ready;			// in the heap
+} ADSMergeInput;
+
+/**
+ * Merges the samples of several rings, usually one per connection, into
+ * one stream ordered by time stamp. Each ring must be in order by itself,
+ * as the samples of one device are; the merge is a k-way merge over the
+ * oldest samples of the rings.
+ * A sample is handed out once every ring has one waiting, which proves
+ * nothing older can come, or once it is lateness older than the newest
+ * time stamp seen, so a quiet device does not hold back the others.
+ * Samples coming in older than one handed out already are dropped as late.
+ * All functions must be called from one consumer thread.
+ */
+typedef struct {
+	int				count;
+	int				max;
+	ADSMergeInput	*in;
+	int				*heap;			// inputs by head, the oldest first
+	int				ready;			// inputs in the heap
+	uint64_t		lateness;		// file time, 100 ns
+	uint64_t		watermark;		// newest time stamp seen
+	uint64_t		lastOut;		// time stamp of the last one handed out
+	uint64_t		merged;
+	uint64_t		late;
+} ADSMerge;
+
+/**
+ * Gets the samples in order, s is valid only during the call; input is
+ * the index of the ring in the order of ADSmergeAddInput().
+ */
+typedef void (*ADSMergeFunc)(const ADSSample *s, int input, void *user);
+
+ADSMerge *ADSmergeNew(int maxInputs, uint32_t latenessMs);
+void ADSmergeFree(ADSMerge *m);
+int ADSmergeAddInput(ADSMerge *m, ADSRing *ring);
+void ADSmergeAdvance(ADSMerge *m, uint64_t timeStamp);
+int ADSmergeDrain(ADSMerge *m, ADSMergeFunc func, void *user, int max);
+int ADSmergeFlush(ADSMerge *m, ADSMergeFunc func, void *user);
+int ADSmergeWait(ADSMerge *m, int timeout);
+void ADSmergeGetStats(ADSMerge *m, ADSMergeStats *stats);
+
+#endif //__ADS_MERGE_H__
@@ -0,0 +1,742 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_async.h"
+#include "ads_clock.h"
+#include "ads_notify.h"
+#include "debugprint.h"
+
+/*
+ * Device notifications: the device sends samples of the subscribed data
+ * on its own, as cmdADSdevNotify requests. They come in on the receive
+ * thread of the engine, which hands them to _ADSnotifyDispatch().
+ * Each handle on the device is a feed; local subscriptions it encloses
+ * attach to it instead of asking the device for another handle. A feed
+ * is linked while the device is still asked for it, pending, so one that
+ * fits waits for it instead of asking again.
+ * dc->noteLock guards dc->feeds and is held while the callbacks run, so
+ * once ADSnotifyDel() returns no callback runs any more. All callbacks
+ * run on the receive thread, the last sample a new subscription of an
+ * on change feed gets too, see _ADSnotifyReplay().
+ */
+
+static uint32_t lastHandle;		// local handles, see ADSNotification
+
+typedef struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	int				done;
+	ADSRequest		rq;
+	ADSNotifyFeed	*f;
+} ADSNotifyWait;
+
+static void _ADSnotifyDeliver(ADSNotification *n, uint64_t timeStamp,
+							  const unsigned char *data, uint32_t size,
+							  ADSRxBuffer *b);
+
+/* noteLock held: takes f out of dc->feeds */
+static void _ADSnotifyUnlink(ADSConnection *dc, ADSNotifyFeed *f)
+{
+	ADSNotifyFeed **fp;
+
+	for (fp = &dc->feeds; *fp != NULL && *fp != f; fp = &(*fp)->next)
+		;
+	if (*fp == f)
+		*fp = f->next;
+}
+
+/* noteLock held: the device answered for the pending feed f, with err */
+static void _ADSnotifyResolve(ADSConnection *dc, ADSNotifyFeed *f, int err)
+{
+	if (!f->pending)
+		return;
+	f->pending = 0;
+	if (err != 0) {
+		_ADSnotifyUnlink(dc, f);
+		f->dead = err;
+	}
+	pthread_cond_broadcast(&f->added);
+}
+
+/*
+ * Runs on the receive thread: the feed gets its handle before the packets
+ * following the answer are parsed, so no sample gets lost.
+ */
+static void _ADSnotifyAdded(ADSRequest *rq, ADSpacket *answer)
+{
+	ADSNotifyWait *w = (ADSNotifyWait *) rq->user;
+	ADSNotifyFeed *f = w->f;
+	ADSConnection *dc = f->subs->dc;
+	ADSaddDeviceNotificationResponse *r;
+
+	if (rq->result == 0 && answer == NULL)
+		rq->result = 0x1;
+	if (rq->result == 0) {
+		r = (ADSaddDeviceNotificationResponse *) answer->data;
+		if (answer->amsHeader.dataLength < sizeof(*r))
+			rq->result = 0x705;
+		else if (r->result != 0)
+			rq->result = r->result;
+		else
+			f->handle = r->notificationHandle;
+	}
+	pthread_mutex_lock(&dc->noteLock);
+	_ADSnotifyResolve(dc, f, rq->result);
+	pthread_mutex_unlock(&dc->noteLock);
+	pthread_mutex_lock(&w->lock);
+	w->done = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Can a subscription of indexGroup, indexOffset with attrib take its
+ * samples from f? On change feeds may check faster than asked for, the
+ * subscription only gets the samples where its slice changed; cyclic
+ * ones have to run at the same cycle.
+ */
+static int _ADSnotifyFits(ADSNotifyFeed *f, uint32_t indexGroup,
+						  uint32_t indexOffset, PAdsNotificationAttrib attrib)
+{
+	if (f->dead || f->indexGroup != indexGroup
+		|| indexOffset < f->indexOffset
+		|| (uint64_t) indexOffset + attrib->cbLength
+		   > (uint64_t) f->indexOffset + f->length
+		|| f->transMode != attrib->nTransMode
+		|| f->maxDelay > attrib->nMaxDelay)
+		return 0;
+	if (f->transMode == ADSTRANS_SERVERONCHA)
+		return f->cycleTime <= attrib->nCycleTime;
+	return f->cycleTime == attrib->nCycleTime;
+}
+
+/* noteLock held: frees f once no subscription waits for it any more */
+static void _ADSnotifyFeedFree(ADSConnection *dc, ADSNotifyFeed *f)
+{
+	while (f->waiters > 0)
+		pthread_cond_wait(&f->added, &dc->noteLock);
+	pthread_cond_destroy(&f->added);
+	free(f);
+}
+
+/*
+ * Attaches n, whose callbacks are set up, to a feed that fits, or sends
+ * a new subscription and waits for the answer. n is freed if it fails.
+ * A feed that fits but is pending is waited for, then the search starts
+ * over.
+ */
+static int _ADSnotifyAdd(ADSConnection *dc, uint32_t indexGroup,
+						 uint32_t indexOffset, PAdsNotificationAttrib attrib,
+						 ADSNotification *n)
+{
+	ADSaddDeviceNotificationRequest *a;
+	ADSNotifyFeed *f;
+	ADSNotifyWait w;
+	ADSpacket p;
+	int rc;
+
+	if ((rc = ADSasyncStart(dc)) != 0) {
+		free(n);
+		return rc;
+	}
+	n->dc = dc;
+	n->handle = __atomic_add_fetch(&lastHandle, 1, __ATOMIC_RELAXED);
+	n->indexGroup = indexGroup;
+	n->indexOffset = indexOffset;
+	n->length = attrib->cbLength;
+
+	pthread_mutex_lock(&dc->noteLock);
+again:
+	for (f = dc->feeds; f != NULL; f = f->next)
+		if (_ADSnotifyFits(f, indexGroup, indexOffset, attrib))
+			break;
+	if (f != NULL && f->pending) {
+		f->waiters++;
+		while (f->pending)
+			pthread_cond_wait(&f->added, &dc->noteLock);
+		if (--f->waiters == 0)
+			pthread_cond_broadcast(&f->added);	// it may be freed now
+		goto again;				// it may be refused or gone meanwhile
+	}
+	if (f != NULL) {
+		n->feed = f;
+		n->next = f->subs;
+		f->subs = n;
+		// the device will not send the unchanged value again, the receive
+		// thread hands n the last one
+		n->replay = f->haveLast;
+		pthread_mutex_unlock(&dc->noteLock);
+		if (n->replay)
+			_ADSasyncWake(dc);
+		MsgOut(MSG_NOTIFICATION,
+			   MsgStr("ADSnotifyAdd(): 0x%x:0x%x shares device handle %u\n",
+					  indexGroup, indexOffset, f->handle));
+		return 0;
+	}
+
+	f = (ADSNotifyFeed *) calloc(1, sizeof(ADSNotifyFeed)
+		+ (attrib->nTransMode == ADSTRANS_SERVERONCHA ? attrib->cbLength : 0));
+	if (f == NULL) {
+		pthread_mutex_unlock(&dc->noteLock);
+		free(n);
+		return 0x70A;
+	}
+	f->indexGroup = indexGroup;
+	f->indexOffset = indexOffset;
+	f->length = attrib->cbLength;
+	f->transMode = attrib->nTransMode;
+	f->maxDelay = attrib->nMaxDelay;
+	f->cycleTime = attrib->nCycleTime;
+	f->pending = 1;
+	pthread_cond_init(&f->added, NULL);
+	f->subs = n;
+	n->feed = f;
+	f->next = dc->feeds;
+	dc->feeds = f;
+	pthread_mutex_unlock(&dc->noteLock);
+
+	_ADSsetupAmsHeader(dc, &p.amsHeader);
+	p.amsHeader.commandId = cmdADSaddDeviceNotification;
+	p.amsHeader.dataLength = sizeof(ADSaddDeviceNotificationRequest);
+	p.adsHeader.length = sizeof(AMSheader) + p.amsHeader.dataLength;
+	p.adsHeader.reserved = 0;
+	a = (ADSaddDeviceNotificationRequest *) p.data;
+	memset(a, 0, sizeof(*a));
+	a->indexGroup = indexGroup;
+	a->indexOffset = indexOffset;
+	a->length = attrib->cbLength;
+	a->transmissionMode = attrib->nTransMode;
+	a->maxDelay = attrib->nMaxDelay;
+	a->cycleTime = attrib->nCycleTime;
+	MsgAnalyzePacket("ADSnotifyAdd()", &p);
+
+	memset(&w, 0, sizeof(w));
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	w.f = f;
+	w.rq.packet = &p;
+	w.rq.done = _ADSnotifyAdded;
+	w.rq.user = &w;
+	rc = ADSasyncSubmit(dc, &w.rq);
+	if (rc == 0) {
+		pthread_mutex_lock(&w.lock);
+		while (!w.done)
+			pthread_cond_wait(&w.cond, &w.lock);
+		pthread_mutex_unlock(&w.lock);
+		rc = w.rq.result;
+	}
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.lock);
+	if (rc != 0) {
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADSnotifyAdd(): failed with 0x%x\n", rc));
+		pthread_mutex_lock(&dc->noteLock);
+		_ADSnotifyResolve(dc, f, rc);	// if it was never sent
+		_ADSnotifyFeedFree(dc, f);
+		pthread_mutex_unlock(&dc->noteLock);
+		free(n);
+		return rc;
+	}
+	MsgOut(MSG_NOTIFICATION,
+		   MsgStr("ADSnotifyAdd(): device handle %u for 0x%x:0x%x, %u bytes\n",
+				  f->handle, indexGroup, indexOffset, n->length));
+	return 0;
+}
+
+/**
+ * @brief Subscribes to indexGroup, indexOffset with attrib->cbLength bytes.
+ * Starts the engine of dc, samples come in on its receive thread; one
+ * sharing an on change device handle gets its last sample there soon
+ * after this returns.
+ * func and end must not call ADSnotifyAdd(), ADSnotifyDel() or the
+ * synchronous functions of dc.
+ * @param pn receives the notification, to be given to ADSnotifyDel()
+ * @return 0 or an ADS error code
+ */
+int ADSnotifyAdd(ADSConnection *dc, uint32_t indexGroup, uint32_t indexOffset,
+				 PAdsNotificationAttrib attrib, ADSNotifyFunc func,
+				 ADSNotifyEndFunc end, void *user, ADSNotification **pn)
+{
+	ADSNotification *n;
+	int rc;
+
+	MsgOut(MSG_TRACE, "ADSnotifyAdd() called\n");
+	if (attrib == NULL || pn == NULL)
+		return 0x741;
+	n = (ADSNotification *) calloc(1, sizeof(ADSNotification));
+	if (n == NULL)
+		return 0x70A;
+	n->func = func;
+	n->end = end;
+	n->user = user;
+	rc = _ADSnotifyAdd(dc, indexGroup, indexOffset, attrib, n);
+	if (rc == 0)
+		*pn = n;
+	return rc;
+}
+
+/**
+ * @brief Subscribes like ADSnotifyAdd(), but the receive thread only puts
+ * the samples into ring, a consumer thread drains them with ADSringDrain().
+ * Samples are tagged with the handle of the notification, so one ring can
+ * take the samples of several; if these come from several connections it
+ * has to be an ADS_RING_MPSC ring. A full ring drops samples.
+ * @return 0 or an ADS error code
+ */
+int ADSnotifyAddRing(ADSConnection *dc, uint32_t indexGroup,
+					 uint32_t indexOffset, PAdsNotificationAttrib attrib,
+					 ADSRing *ring, ADSNotifyEndFunc end, void *user,
+					 ADSNotification **pn)
+{
+	ADSNotification *n;
+	int rc;
+
+	MsgOut(MSG_TRACE, "ADSnotifyAddRing() called\n");
+	if (attrib == NULL || ring == NULL || pn == NULL)
+		return 0x741;
+	n = (ADSNotification *) calloc(1, sizeof(ADSNotification));
+	if (n == NULL)
+		return 0x70A;
+	n->ring = ring;
+	n->end = end;
+	n->user = user;
+	rc = _ADSnotifyAdd(dc, indexGroup, indexOffset, attrib, n);
+	if (rc == 0)
+		*pn = n;
+	return rc;
+}
+
+/**
+ * @brief Subscribes like ADSnotifyAdd(), but the receive thread only
+ * replaces the sample in latest, readers get it with ADSlatestGet().
+ * Samples nobody read are overwritten and counted as dropped. latest
+ * takes the samples of this subscription only.
+ * @return 0 or an ADS error code
+ */
+int ADSnotifyAddLatest(ADSConnection *dc, uint32_t indexGroup,
+					   uint32_t indexOffset, PAdsNotificationAttrib attrib,
+					   ADSLatest *latest, ADSNotifyEndFunc end, void *user,
+					   ADSNotification **pn)
+{
+	ADSNotification *n;
+	int rc;
+
+	MsgOut(MSG_TRACE, "ADSnotifyAddLatest() called\n");
+	if (attrib == NULL || latest == NULL || pn == NULL)
+		return 0x741;
+	n = (ADSNotification *) calloc(1, sizeof(ADSNotification));
+	if (n == NULL)
+		return 0x70A;
+	n->latest = latest;
+	n->end = end;
+	n->user = user;
+	rc = _ADSnotifyAdd(dc, indexGroup, indexOffset, attrib, n);
+	if (rc == 0)
+		*pn = n;
+	return rc;
+}
+
+/**
+ * @brief Subscribes like ADSnotifyAdd(), but ref gets the samples as
+ * ADSSampleRef pointing into the receive buffer, which it can retain to
+ * work on them later on another thread without copying.
+ * @return 0 or an ADS error code
+ */
+int ADSnotifyAddRef(ADSConnection *dc, uint32_t indexGroup,
+					uint32_t indexOffset, PAdsNotificationAttrib attrib,
+					ADSNotifyRefFunc ref, ADSNotifyEndFunc end, void *user,
+					ADSNotification **pn)
+{
+	ADSNotification *n;
+	int rc;
+
+	MsgOut(MSG_TRACE, "ADSnotifyAddRef() called\n");
+	if (attrib == NULL || ref == NULL || pn == NULL)
+		return 0x741;
+	n = (ADSNotification *) calloc(1, sizeof(ADSNotification));
+	if (n == NULL)
+		return 0x70A;
+	n->ref = ref;
+	n->end = end;
+	n->user = user;
+	rc = _ADSnotifyAdd(dc, indexGroup, indexOffset, attrib, n);
+	if (rc == 0)
+		*pn = n;
+	return rc;
+}
+
+/*
+ * The same for AdsSyncAddDeviceNotificationReqEx(): func gets the samples
+ * with an AdsNotificationHeader, the local handle identifies it.
+ */
+int _ADSnotifyAddApi(ADSConnection *dc, uint32_t indexGroup,
+					 uint32_t indexOffset, PAdsNotificationAttrib attrib,
+					 PAdsNotificationFunc func, unsigned long hUser,
+					 uint32_t *pHandle)
+{
+	ADSNotification *n;
+	int rc;
+
+	MsgOut(MSG_TRACE, "_ADSnotifyAddApi() called\n");
+	if (attrib == NULL || func == NULL || pHandle == NULL)
+		return 0x741;
+	n = (ADSNotification *) calloc(1, sizeof(ADSNotification));
+	if (n == NULL)
+		return 0x70A;
+	n->apiFunc = func;
+	n->hUser = hUser;
+	rc = _ADSnotifyAdd(dc, indexGroup, indexOffset, attrib, n);
+	if (rc == 0)
+		*pHandle = n->handle;
+	return rc;
+}
+
+static int _ADSdelDeviceNotification(ADSConnection *dc, uint32_t handle)
+{
+	ADSpacket *p1, *p2;
+	int rc, nErr;
+
+	p1 = (ADSpacket *) dc->msgOut;
+	_ADSsetupAmsHeader(dc, &p1->amsHeader);
+	p1->amsHeader.commandId = cmdADSdeleteDeviceNotification;
+	p1->amsHeader.dataLength = sizeof(uint32_t);
+	p1->adsHeader.length = sizeof(AMSheader) + p1->amsHeader.dataLength;
+	p1->adsHeader.reserved = 0;
+	memcpy(p1->data, &handle, sizeof(uint32_t));
+	MsgAnalyzePacket("ADSnotifyDel()", p1);
+
+	rc = _ADSSendRequest(dc, p1, &nErr);
+	if (rc <= 0)
+		return _ADStranslateWrError(rc, nErr);
+	dc->AnswLen = _ADSReadAnswer(dc, &nErr);
+	if (dc->AnswLen <= 0 || nErr != 0)
+		return _ADStranslateRdError(dc->AnswLen, nErr);
+	p2 = (ADSpacket *) dc->msgIn;
+	if (p2->amsHeader.commandId != cmdADSdeleteDeviceNotification)
+		return 0x1;
+	if (p2->amsHeader.errorCode != 0)
+		return p2->amsHeader.errorCode;
+	return *(uint32_t *) p2->data;
+}
+
+/**
+ * @brief Ends a subscription and frees n.
+ * When it was the last one on its device handle, the device is told to
+ * stop sending, unless the subscription ended already because the
+ * connection failed.
+ * @return 0 or the ADS error code of the device, n is freed anyway
+ */
+int ADSnotifyDel(ADSNotification *n)
+{
+	ADSConnection *dc = n->dc;
+	ADSNotifyFeed *f = n->feed;
+	ADSNotification **pp;
+	int rc = 0, last;
+
+	MsgOut(MSG_TRACE, "ADSnotifyDel() called\n");
+	pthread_mutex_lock(&dc->noteLock);
+	for (pp = &f->subs; *pp != NULL && *pp != n; pp = &(*pp)->next)
+		;
+	if (*pp == n)
+		*pp = n->next;
+	last = f->subs == NULL;
+	if (last)
+		_ADSnotifyUnlink(dc, f);
+	pthread_mutex_unlock(&dc->noteLock);
+
+	if (last) {
+		if (!f->dead) {
+			pthread_mutex_lock(&dc->lock);
+			rc = _ADSdelDeviceNotification(dc, f->handle);
+			pthread_mutex_unlock(&dc->lock);
+			if (rc != 0)
+				MsgOut(MSG_ERROR,
+					   MsgStr("ADSnotifyDel(): handle %u: 0x%x\n",
+							  f->handle, rc));
+		}
+		pthread_mutex_lock(&dc->noteLock);
+		_ADSnotifyFeedFree(dc, f);
+		pthread_mutex_unlock(&dc->noteLock);
+	}
+	free(n);
+	return rc;
+}
+
+/**
+ * @brief Returns the notification of dc with the local handle, or NULL.
+ */
+ADSNotification *ADSnotifyFind(ADSConnection *dc, uint32_t handle)
+{
+	ADSNotifyFeed *f;
+	ADSNotification *n = NULL;
+
+	pthread_mutex_lock(&dc->noteLock);
+	for (f = dc->feeds; f != NULL && n == NULL; f = f->next)
+		for (n = f->pending ? NULL : f->subs; n != NULL; n = n->next)
+			if (n->handle == handle)
+				break;
+	pthread_mutex_unlock(&dc->noteLock);
+	return n;
+}
+
+/**
+ * @brief Counts the device handles, subscriptions and samples of dc.
+ */
+void ADSnotifyGetStats(ADSConnection *dc, ADSNotifyStats *stats)
+{
+	ADSNotifyFeed *f;
+	ADSNotification *n;
+
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_lock(&dc->noteLock);
+	for (f = dc->feeds; f != NULL; f = f->next) {
+		if (f->pending)
+			continue;
+		stats->feeds++;
+		for (n = f->subs; n != NULL; n = n->next) {
+			stats->subscriptions++;
+			stats->samples += n->samples;
+		}
+	}
+	pthread_mutex_unlock(&dc->noteLock);
+}
+
+/* the AdsAPI.c callback gets the sample with its AdsNotificationHeader */
+static void _ADSnotifyApi(ADSNotification *n, uint64_t timeStamp,
+						  const void *data, uint32_t size)
+{
+	unsigned char stackBuf[sizeof(AdsNotificationHeader) + 1024];
+	AdsNotificationHeader *h = (AdsNotificationHeader *) stackBuf;
+	AmsAddr addr;
+
+	if (size > 1024) {
+		h = (AdsNotificationHeader *)
+			malloc(offsetof(AdsNotificationHeader, data) + size);
+		if (h == NULL)
+			return;
+	}
+	h->hNotification = n->handle;
+	h->nTimeStamp = timeStamp;
+	h->cbSampleSize = size;
+	memcpy(h->data, data, size);
+	addr.netId = n->dc->partner;
+	addr.port = n->dc->AMSport;
+	n->apiFunc(&addr, h, n->hUser);
+	if ((unsigned char *) h != stackBuf)
+		free(h);
+}
+
+/* hands one sample, the slice of n, to whatever n was set up with */
+static void _ADSnotifyDeliver(ADSNotification *n, uint64_t timeStamp,
+							  const unsigned char *data, uint32_t size,
+							  ADSRxBuffer *b)
+{
+	ADSSampleRef ref;
+
+	n->samples++;
+	if (n->ring != NULL)
+		ADSringPut(n->ring, n->handle, timeStamp, data, size);
+	if (n->latest != NULL)
+		ADSlatestPut(n->latest, timeStamp, data, size);
+	if (n->ref != NULL) {
+		ref.handle = n->handle;
+		ref.size = size;
+		ref.timeStamp = timeStamp;
+		ref.data = data;
+		ref.buffer = b;
+		n->ref(n, &ref);
+	}
+	if (n->func != NULL)
+		n->func(n, timeStamp, data, size);
+	if (n->apiFunc != NULL)
+		_ADSnotifyApi(n, timeStamp, data, size);
+}
+
+/*
+ * One sample of a feed: every subscription gets its slice, on change
+ * ones only when their slice differs from the last sample.
+ */
+static void _ADSnotifyFeed(ADSNotifyFeed *f, uint64_t timeStamp,
+						   const unsigned char *d, uint32_t size,
+						   ADSRxBuffer *b)
+{
+	ADSNotification *n;
+	uint32_t off;
+	int onChange = f->transMode == ADSTRANS_SERVERONCHA;
+
+	for (n = f->subs; n != NULL; n = n->next) {
+		if (n->dead)
+			continue;
+		off = n->indexOffset - f->indexOffset;
+		if (size < off + n->length)
+			continue;
+		if (onChange && f->haveLast && !n->replay
+			&& memcmp(f->last + off, d + off, n->length) == 0)
+			continue;
+		n->replay = 0;			// this one is newer
+		_ADSnotifyDeliver(n, timeStamp, d + off, n->length, b);
+	}
+	if (onChange && size >= f->length) {
+		memcpy(f->last, d, f->length);
+		f->haveLast = 1;
+		f->lastTime = timeStamp;
+	}
+}
+
+/*
+ * Called by the receive thread with a cmdADSdevNotify request in b:
+ * length, stamps, then per stamp the time stamp, samples and the samples,
+ * each with handle, size and data.
+ */
+void _ADSnotifyDispatch(ADSConnection *dc, ADSpacket *p, ADSRxBuffer *b)
+{
+	unsigned char *d = (unsigned char *) p + sizeof(AMS_TCPheader)
+					   + sizeof(AMSheader);
+	unsigned char *end;
+	uint32_t avail, length, stamps, samples, handle, size;
+	uint64_t timeStamp;
+	ADSNotifyFeed *f;
+	struct timespec now;
+
+	avail = p->adsHeader.length - sizeof(AMSheader);
+	if (p->amsHeader.dataLength < avail)
+		avail = p->amsHeader.dataLength;
+	if (avail < 8)
+		return;
+	memcpy(&length, d, 4);
+	memcpy(&stamps, d + 4, 4);
+	end = d + 4 + (length < avail - 4 ? length : avail - 4);
+	d += 8;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	pthread_mutex_lock(&dc->noteLock);
+	while (stamps-- > 0 && end - d >= 12) {
+		memcpy(&timeStamp, d, 8);
+		memcpy(&samples, d + 8, 4);
+		d += 12;
+		if (dc->clock != NULL)
+			_ADSclockSample(dc->clock, now.tv_sec * 1000000000LL + now.tv_nsec,
+							timeStamp);
+		while (samples-- > 0 && end - d >= 8) {
+			memcpy(&handle, d, 4);
+			memcpy(&size, d + 4, 4);
+			d += 8;
+			if (size > end - d) {
+				MsgOut(MSG_ERROR, "ADS notification: sample exceeds packet\n");
+				goto out;
+			}
+			for (f = dc->feeds; f != NULL; f = f->next)
+				if (f->handle == handle && !f->pending)
+					break;
+			if (f == NULL)
+				MsgOut(MSG_NOTIFICATION,
+					   MsgStr("ADS notification: unknown handle %u\n", handle));
+			else if (!f->dead)
+				_ADSnotifyFeed(f, timeStamp, d, size, b);
+			d += size;
+		}
+	}
+out:
+	pthread_mutex_unlock(&dc->noteLock);
+}
+
+/*
+ * Called by the receive thread when woken: subscriptions that joined an
+ * on change feed get its last sample, the device will not send it again.
+ */
+void _ADSnotifyReplay(ADSConnection *dc)
+{
+	ADSNotifyFeed *f;
+	ADSNotification *n;
+	ADSRxBuffer *b;
+
+	pthread_mutex_lock(&dc->noteLock);
+	for (f = dc->feeds; f != NULL; f = f->next) {
+		if (f->pending || f->dead || !f->haveLast)
+			continue;
+		for (n = f->subs; n != NULL; n = n->next) {
+			if (!n->replay)
+				continue;
+			n->replay = 0;
+			b = (ADSRxBuffer *) malloc(sizeof(ADSRxBuffer) + n->length);
+			if (b == NULL)
+				continue;
+			b->refs = 1;
+			memcpy(b->data, f->last + (n->indexOffset - f->indexOffset),
+				   n->length);
+			_ADSnotifyDeliver(n, f->lastTime, b->data, n->length, b);
+			ADSrxRelease(b);
+		}
+	}
+	pthread_mutex_unlock(&dc->noteLock);
+}
+
+/*
+ * The receive thread stops: the device's samples can not reach us any more.
+ */
+void _ADSnotifyEnd(ADSConnection *dc, int err)
+{
+	ADSNotifyFeed *f;
+	ADSNotification *n;
+
+	pthread_mutex_lock(&dc->noteLock);
+	for (f = dc->feeds; f != NULL; f = f->next) {
+		if (f->dead || f->pending)
+			continue;
+		f->dead = err ? err : 0x1;
+		for (n = f->subs; n != NULL; n = n->next) {
+			n->dead = f->dead;
+			if (n->end != NULL)
+				n->end(n, n->dead);
+		}
+	}
+	pthread_mutex_unlock(&dc->noteLock);
+}
+
+/* frees the notifications left over, dc goes away */
+void _ADSnotifyFree(ADSConnection *dc)
+{
+	ADSNotifyFeed *f;
+	ADSNotification *n;
+
+	while ((f = dc->feeds) != NULL) {
+		dc->feeds = f->next;
+		while ((n = f->subs) != NULL) {
+			f->subs = n->next;
+			free(n);
+		}
+		pthread_cond_destroy(&f->added);
+		free(f);
+	}
+}
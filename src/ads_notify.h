@@ -0,0 +1,153 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_NOTIFY_H__
+#define __ADS_NOTIFY_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ads_ring.h"
+#include "ads_latest.h"
+
+typedef struct _ADSNotification ADSNotification;
+typedef struct _ADSNotifyFeed ADSNotifyFeed;
+
+/**
+ * Called from the receive thread for every sample of a notification.
+ * timeStamp is the Windows file time the device put on the sample, data
+ * is valid only during the call.
+ */
+typedef void (*ADSNotifyFunc)(ADSNotification *n, uint64_t timeStamp,
+							  const void *data, uint32_t size);
+
+/**
+ * A sample as ADSnotifyAddRef() hands it out: data points into the
+ * receive buffer, nothing is copied. It stays valid after the callback
+ * only if the buffer is retained with ADSrxRetain() and until
+ * ADSrxRelease(); copy the ADSSampleRef itself to keep it.
+ */
+typedef struct {
+	uint32_t			handle;
+	uint32_t			size;
+	uint64_t			timeStamp;
+	const unsigned char	*data;
+	struct _ADSRxBuffer	*buffer;
+} ADSSampleRef;
+
+typedef void (*ADSNotifyRefFunc)(ADSNotification *n, const ADSSampleRef *s);
+
+/**
+ * Called once when the device will send no more samples because the
+ * connection failed or was shut down; err tells why.
+ */
+typedef void (*ADSNotifyEndFunc)(ADSNotification *n, int err);
+
+/**
+ * A subscription on the device. Local subscriptions of the same index
+ * group, within its area and with compatible attributes share it, each
+ * gets its slice of the samples: the device hands out fewer handles and
+ * sends every sample once.
+ */
+struct _ADSNotifyFeed {
+	uint32_t			handle;			// given by the device
+	uint32_t			indexGroup;
+	uint32_t			indexOffset;
+	uint32_t			length;
+	uint32_t			transMode;
+	uint32_t			maxDelay;		// 100ns
+	uint32_t			cycleTime;		// 100ns
+	int					dead;			// 0 or why no samples come any more
+	int					pending;		// the device did not answer yet
+	int					waiters;		// subscriptions waiting for that
+	pthread_cond_t		added;			// pending ended, or waiters did
+	ADSNotification		*subs;
+	ADSNotifyFeed		*next;			// dc->feeds
+	int					haveLast;
+	uint64_t			lastTime;
+	unsigned char		last[];			// on change feeds: the previous
+										// sample, see _ADSnotifyDispatch()
+};
+
+struct _ADSNotification {
+	ADSConnection		*dc;
+	ADSNotifyFeed		*feed;
+	uint32_t			handle;			// ours, unique in the process
+	uint32_t			indexGroup;
+	uint32_t			indexOffset;
+	uint32_t			length;
+	ADSNotifyFunc		func;
+	ADSNotifyEndFunc	end;			// may be NULL
+	ADSRing				*ring;			// instead of func, see ADSnotifyAddRing()
+	ADSLatest			*latest;		// or ADSnotifyAddLatest()
+	ADSNotifyRefFunc	ref;			// or ADSnotifyAddRef()
+	void				*user;
+	PAdsNotificationFunc apiFunc;		// AdsSyncAddDeviceNotificationReq()
+	unsigned long		hUser;
+	int					dead;			// 0 or why no samples come any more
+	int					replay;			// the last sample of the feed is due
+	uint64_t			samples;
+	ADSNotification		*next;			// feed->subs
+};
+
+typedef struct {
+	int			feeds;				// handles on the device
+	int			subscriptions;		// local ones sharing them
+	uint64_t	samples;			// delivered to the local ones
+} ADSNotifyStats;
+
+int ADSnotifyAdd(ADSConnection *dc, uint32_t indexGroup, uint32_t indexOffset,
+				 PAdsNotificationAttrib attrib, ADSNotifyFunc func,
+				 ADSNotifyEndFunc end, void *user, ADSNotification **pn);
+int ADSnotifyAddRing(ADSConnection *dc, uint32_t indexGroup,
+					 uint32_t indexOffset, PAdsNotificationAttrib attrib,
+					 ADSRing *ring, ADSNotifyEndFunc end, void *user,
+					 ADSNotification **pn);
+int ADSnotifyAddLatest(ADSConnection *dc, uint32_t indexGroup,
+					   uint32_t indexOffset, PAdsNotificationAttrib attrib,
+					   ADSLatest *latest, ADSNotifyEndFunc end, void *user,
+					   ADSNotification **pn);
+int ADSnotifyAddRef(ADSConnection *dc, uint32_t indexGroup,
+					uint32_t indexOffset, PAdsNotificationAttrib attrib,
+					ADSNotifyRefFunc ref, ADSNotifyEndFunc end, void *user,
+					ADSNotification **pn);
+int ADSnotifyDel(ADSNotification *n);
+ADSNotification *ADSnotifyFind(ADSConnection *dc, uint32_t handle);
+void ADSnotifyGetStats(ADSConnection *dc, ADSNotifyStats *stats);
+
+/**
+	Prototypes, used by ads_async.c, ads.c and AdsAPI.c
+ */
+int _ADSnotifyAddApi(ADSConnection *dc, uint32_t indexGroup,
+					 uint32_t indexOffset, PAdsNotificationAttrib attrib,
+					 PAdsNotificationFunc func, unsigned long hUser,
+					 uint32_t *pHandle);
+void _ADSnotifyDispatch(ADSConnection *dc, ADSpacket *p,
+						struct _ADSRxBuffer *b);
+void _ADSnotifyReplay(ADSConnection *dc);
+void _ADSnotifyEnd(ADSConnection *dc, int err);
+void _ADSnotifyFree(ADSConnection *dc);
+
+#endif //__ADS_NOTIFY_H__
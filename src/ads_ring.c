@@ -0,0 +1,288 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_ring.h"
+#include "debugprint.h"
+
+/*
+ * Every slot starts with a sequence number. Single producer rings only
+ * use head and tail: the producer owns head, the consumer owns tail.
+ * Multi producer rings claim a slot by moving head with a CAS and
+ * publish it through its sequence number: slot i of lap n is free for
+ * position n*slots+i while seq is that position, and filled when seq is
+ * position + 1.
+ */
+typedef struct {
+	uint64_t	seq;
+	ADSSample	s;
+} ADSRingSlot;
+
+#define SLOT(r, pos) \
+	((ADSRingSlot *)((r)->slots + ((pos) & (r)->mask) * (r)->stride))
+
+/**
+ * @brief Creates a ring of at least slots slots, each holding a sample of
+ * up to slotSize bytes.
+ * @return the ring or NULL
+ */
+ADSRing *ADSringNew(int slots, uint32_t slotSize, int mode)
+{
+	ADSRing *r;
+	uint32_t n = 2;
+	uint64_t i;
+
+	if (slots <= 0 || slots > (1 << 24) || slotSize > 8 * MAXDATALEN
+		|| (mode != ADS_RING_SPSC && mode != ADS_RING_MPSC))
+		return NULL;
+	while (n < slots)
+		n <<= 1;
+	if (posix_memalign((void **) &r, ADS_RING_LINE, sizeof(ADSRing)) != 0)
+		return NULL;
+	memset(r, 0, sizeof(ADSRing));
+	r->mask = n - 1;
+	r->slotSize = slotSize;
+	r->stride = (sizeof(ADSRingSlot) + slotSize + 7) & ~7;
+	r->mode = mode;
+	r->slots = (unsigned char *) malloc((size_t) n * r->stride);
+	r->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (r->slots == NULL || r->fd < 0) {
+		MsgOut(MSG_ERROR, "ADSringNew(): out of memory or eventfd() failed\n");
+		ADSringFree(r);
+		return NULL;
+	}
+	for (i = 0; i < n; i++)
+		SLOT(r, i)->seq = i;
+	return r;
+}
+
+void ADSringFree(ADSRing *r)
+{
+	if (r == NULL)
+		return;
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r->slots);
+	free(r);
+}
+
+/**
+ * @brief Stores a sample, never waits.
+ * @return 0, 0x502 if the ring is full or 0x705 if the sample exceeds
+ * slotSize; then the sample is counted as lost
+ */
+int ADSringPut(ADSRing *r, uint32_t handle, uint64_t timeStamp,
+			   const void *data, uint32_t size)
+{
+	ADSRingSlot *slot;
+	uint64_t pos, seq;
+	int64_t dif;
+	uint64_t one = 1;
+
+	if (size > r->slotSize) {
+		__atomic_add_fetch(&r->oversized, 1, __ATOMIC_RELAXED);
+		return 0x705;
+	}
+
+	if (r->mode == ADS_RING_SPSC) {
+		pos = r->head;
+		if (pos - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->mask) {
+			__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+			return 0x502;
+		}
+		slot = SLOT(r, pos);
+	}
+	else {
+		pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		for (;;) {
+			slot = SLOT(r, pos);
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			dif = (int64_t)(seq - pos);
+			if (dif == 0) {
+				if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+												__ATOMIC_RELAXED,
+												__ATOMIC_RELAXED))
+					break;
+			}
+			else if (dif < 0) {
+				__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+				return 0x502;
+			}
+			else
+				pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->s.timeStamp = timeStamp;
+	slot->s.handle = handle;
+	slot->s.size = size;
+	memcpy(slot->s.data, data, size);
+	if (r->mode == ADS_RING_SPSC)
+		__atomic_store_n(&r->head, pos + 1, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&r->puts, 1, __ATOMIC_RELAXED);
+
+	// pairs with the fence in ADSringWait(): either it sees the sample or
+	// we see it waiting
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->waiting, __ATOMIC_RELAXED)
+		&& __atomic_exchange_n(&r->waiting, 0, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&r->wakeups, 1, __ATOMIC_RELAXED);
+		if (write(r->fd, &one, sizeof(one)) != sizeof(one))
+			MsgOut(MSG_ERROR, "ADSringPut(): cannot wake the consumer\n");
+	}
+	return 0;
+}
+
+/**
+ * @brief Consumer side: is a sample ready?
+ */
+int ADSringReady(ADSRing *r)
+{
+	if (r->mode == ADS_RING_SPSC)
+		return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail;
+	return __atomic_load_n(&SLOT(r, r->tail)->seq, __ATOMIC_ACQUIRE)
+		   == r->tail + 1;
+}
+
+/**
+ * @brief Hands up to max samples (all if max <= 0) to func, oldest first,
+ * and frees their slots. Only one thread may drain a ring.
+ * @return the number of samples
+ */
+int ADSringDrain(ADSRing *r, ADSRingFunc func, void *user, int max)
+{
+	ADSRingSlot *slot;
+	uint64_t pos = r->tail, head;
+	int n = 0;
+
+	if (r->mode == ADS_RING_SPSC) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (; pos != head && (max <= 0 || n < max); pos++, n++)
+			func(&SLOT(r, pos)->s, user);
+		__atomic_store_n(&r->tail, pos, __ATOMIC_RELEASE);
+	}
+	else {
+		for (; max <= 0 || n < max; pos++, n++) {
+			slot = SLOT(r, pos);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+				break;
+			func(&slot->s, user);
+			// free for the producers of the next lap
+			__atomic_store_n(&slot->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+		}
+		r->tail = pos;
+	}
+	r->drained += n;
+	return n;
+}
+
+/**
+ * @brief Returns the oldest sample without taking it, or NULL if the ring
+ * is empty. It stays valid until ADSringPop(). Consumer only.
+ */
+const ADSSample *ADSringPeek(ADSRing *r)
+{
+	if (!ADSringReady(r))
+		return NULL;
+	return &SLOT(r, r->tail)->s;
+}
+
+/**
+ * @brief Returns the newest sample of a single producer ring, or NULL if
+ * it is empty or a multi producer ring, which does not know it. The
+ * producer will not touch it before the consumer took it. Consumer only.
+ */
+const ADSSample *ADSringNewest(ADSRing *r)
+{
+	uint64_t head;
+
+	if (r->mode != ADS_RING_SPSC)
+		return NULL;
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	if (head == r->tail)
+		return NULL;
+	return &SLOT(r, head - 1)->s;
+}
+
+/**
+ * @brief Frees the slot of the sample ADSringPeek() returned.
+ */
+void ADSringPop(ADSRing *r)
+{
+	uint64_t pos = r->tail;
+
+	if (r->mode == ADS_RING_SPSC)
+		__atomic_store_n(&r->tail, pos + 1, __ATOMIC_RELEASE);
+	else {
+		__atomic_store_n(&SLOT(r, pos)->seq, pos + r->mask + 1,
+						 __ATOMIC_RELEASE);
+		r->tail = pos + 1;
+	}
+	r->drained++;
+}
+
+/**
+ * @brief Waits up to timeout ms (-1 for ever) until samples are ready.
+ * A producer only writes the eventfd when the consumer sleeps here.
+ * @return 1 if samples are ready, else 0
+ */
+int ADSringWait(ADSRing *r, int timeout)
+{
+	struct pollfd pfd;
+	uint64_t v;
+
+	if (ADSringReady(r))
+		return 1;
+	__atomic_store_n(&r->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!ADSringReady(r)) {
+		pfd.fd = r->fd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, timeout);
+	}
+	__atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+	if (read(r->fd, &v, sizeof(v)) != sizeof(v))
+		v = 0;		// nobody woke us
+	return ADSringReady(r);
+}
+
+void ADSringGetStats(ADSRing *r, ADSRingStats *st)
+{
+	st->puts = __atomic_load_n(&r->puts, __ATOMIC_RELAXED);
+	st->dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	st->oversized = __atomic_load_n(&r->oversized, __ATOMIC_RELAXED);
+	st->wakeups = __atomic_load_n(&r->wakeups, __ATOMIC_RELAXED);
+	st->drained = r->drained;
+}
@@ -0,0 +1,98 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_RING_H__
+#define __ADS_RING_H__
+
+#include <stdint.h>
+
+#define ADS_RING_SPSC	0	// one producer, e.g. the receive thread of one
+							// connection
+#define ADS_RING_MPSC	1	// any number of producers, e.g. the receive
+							// threads of several connections
+#define ADS_RING_LINE	64	// producer and consumer fields are kept apart
+
+/**
+ * A notification sample as it sits in the ring, data inline.
+ */
+typedef struct {
+	uint64_t	timeStamp;		// Windows file time from the device
+	uint32_t	handle;
+	uint32_t	size;			// bytes in data
+	unsigned char data[];
+} ADSSample;
+
+typedef struct {
+	uint64_t	puts;			// samples stored
+	uint64_t	dropped;		// samples lost because the ring was full
+	uint64_t	oversized;		// samples lost because they exceed slotSize
+	uint64_t	drained;		// samples handed to the consumer
+	uint64_t	wakeups;		// times a waiting consumer was woken
+} ADSRingStats;
+
+/**
+ * A bounded ring of preallocated slots, filled without locks by the
+ * producers and drained in batches by one consumer thread. A full ring
+ * drops the newest sample, so producers never wait for the consumer.
+ */
+typedef struct {
+	uint32_t		mask;			// slots - 1
+	uint32_t		slotSize;		// data bytes per slot
+	uint32_t		stride;			// bytes per slot
+	int				mode;			// ADS_RING_SPSC or ADS_RING_MPSC
+	int				fd;				// eventfd, see ADSringWait()
+	unsigned char	*slots;
+
+	// written by the producers
+	uint64_t		head __attribute__((aligned(ADS_RING_LINE)));
+	uint64_t		puts;
+	uint64_t		dropped;
+	uint64_t		oversized;
+	uint64_t		wakeups;
+
+	// written by the consumer
+	uint64_t		tail __attribute__((aligned(ADS_RING_LINE)));
+	uint64_t		drained;
+	int				waiting;		// the consumer sleeps in ADSringWait()
+} ADSRing;
+
+/**
+ * Gets the samples of ADSringDrain(), s is valid only during the call.
+ */
+typedef void (*ADSRingFunc)(const ADSSample *s, void *user);
+
+ADSRing *ADSringNew(int slots, uint32_t slotSize, int mode);
+void ADSringFree(ADSRing *r);
+int ADSringPut(ADSRing *r, uint32_t handle, uint64_t timeStamp,
+			   const void *data, uint32_t size);
+int ADSringDrain(ADSRing *r, ADSRingFunc func, void *user, int max);
+int ADSringReady(ADSRing *r);
+const ADSSample *ADSringPeek(ADSRing *r);
+const ADSSample *ADSringNewest(ADSRing *r);
+void ADSringPop(ADSRing *r);
+int ADSringWait(ADSRing *r, int timeout);
+void ADSringGetStats(ADSRing *r, ADSRingStats *stats);
+
+#endif //__ADS_RING_H__
@@ -0,0 +1,336 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_route.h"
+#include "debugprint.h"
+
+/*
+ * The route file has one device per line, its NetId and where its
+ * AMS/TCP port is, "host[:port]", names resolved when the file is loaded:
+ *
+ *	# NetId			address
+ *	5.12.34.56.1.1	192.168.0.10
+ *	10.0.0.7.1.1	plc7.local:48898
+ *
+ * A file with any bad line is refused as a whole and the table before it
+ * stays. Lookups only read the table in memory, under the read lock; the
+ * file is read, and its names resolved, by ADSrouteLoad() and
+ * ADSrouteReload() on the thread calling them, which only swap the
+ * pointer under the write lock, so they never hold up a lookup for long.
+ * What is connected stays connected, the new routes count from the next
+ * connect on.
+ */
+
+static ADSRouteTable	*routes = NULL;
+static pthread_rwlock_t	routeLock = PTHREAD_RWLOCK_INITIALIZER;	// routes
+
+static pthread_mutex_t	fileLock = PTHREAD_MUTEX_INITIALIZER;	// these two
+static char				*routePath = NULL;	// the file, or NULL
+static int				routeEnv = 0;		// ADS_ROUTES was looked at
+static ADSRouteStats	stats;				// counters atomic
+
+static uint32_t _ADSrouteHash(const AmsNetId *netId)
+{
+	uint32_t h = 2166136261u;	// FNV-1a
+	int i;
+
+	for (i = 0; i < sizeof(AmsNetId); i++)
+		h = (h ^ netId->b[i]) * 16777619u;
+	return h;
+}
+
+static ADSRoute *_ADSrouteSlot(ADSRouteTable *t, const AmsNetId *netId)
+{
+	ADSRoute *s;
+	uint32_t i = _ADSrouteHash(netId);
+
+	for (;; i++) {
+		s = &t->slots[i & t->mask];
+		if (!s->used || memcmp(&s->netId, netId, sizeof(AmsNetId)) == 0)
+			return s;
+	}
+}
+
+/* "a.b.c.d.e.f", 0 or -1 */
+static int _ADSrouteNetId(const char *text, AmsNetId *netId)
+{
+	unsigned int b[6];
+	char extra;
+	int i;
+
+	if (sscanf(text, "%u.%u.%u.%u.%u.%u%c", &b[0], &b[1], &b[2], &b[3],
+			   &b[4], &b[5], &extra) != 6)
+		return -1;
+	for (i = 0; i < 6; i++) {
+		if (b[i] > 255)
+			return -1;
+		netId->b[i] = b[i];
+	}
+	return 0;
+}
+
+/* the table of the file path, or NULL, the ADS error code in *err */
+static ADSRouteTable *_ADSrouteParse(const char *path, int *err)
+{
+	struct { AmsNetId netId; struct sockaddr_in addr; } *list = NULL, *grown;
+	char line[512], netId[64], host[256], extra[2], *hash;
+	int n = 0, room = 0, lineNo = 0, i;
+	uint32_t size = 16;
+	ADSRouteTable *t = NULL;
+	ADSRoute *s;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADSrouteLoad(): cannot open %s: %s\n", path,
+					  strerror(errno)));
+		*err = 0x70C;		// not found
+		return NULL;
+	}
+	*err = 0x741;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineNo++;
+		if ((hash = strchr(line, '#')) != NULL)
+			*hash = 0;
+		i = sscanf(line, "%63s %255s %1s", netId, host, extra);
+		if (i <= 0)
+			continue;			// empty or comment
+		if (n == room) {
+			room = room ? 2 * room : 16;
+			grown = realloc(list, room * sizeof(*list));
+			if (grown == NULL) {
+				*err = 0x70A;
+				goto out;
+			}
+			list = grown;
+		}
+		if (i != 2 || _ADSrouteNetId(netId, &list[n].netId) != 0
+			|| ADSparseAddress(host, ROUTER_PORT, &list[n].addr) != 0) {
+			MsgOut(MSG_ERROR,
+				   MsgStr("ADSrouteLoad(): %s line %d: bad route\n", path,
+						  lineNo));
+			goto out;
+		}
+		n++;
+	}
+
+	while (size < 2 * n)
+		size *= 2;
+	t = (ADSRouteTable *) calloc(1, sizeof(ADSRouteTable)
+								 + size * sizeof(ADSRoute));
+	if (t == NULL) {
+		*err = 0x70A;
+		goto out;
+	}
+	t->mask = size - 1;
+	for (i = 0; i < n; i++) {
+		s = _ADSrouteSlot(t, &list[i].netId);
+		if (s->used) {
+			MsgOut(MSG_ERROR,
+				   MsgStr("ADSrouteLoad(): %s: NetId %u.%u.%u.%u.%u.%u twice\n",
+						  path, s->netId.b[0], s->netId.b[1], s->netId.b[2],
+						  s->netId.b[3], s->netId.b[4], s->netId.b[5]));
+			free(t);
+			t = NULL;
+			goto out;
+		}
+		s->used = 1;
+		s->netId = list[i].netId;
+		s->addr = list[i].addr;
+		t->count++;
+	}
+	*err = 0;
+
+out:
+	free(list);
+	fclose(f);
+	return t;
+}
+
+/* fileLock held: loads path, swaps the table in if it is good */
+static int _ADSrouteLoadLocked(const char *path)
+{
+	ADSRouteTable *t, *old;
+	int err;
+
+	t = _ADSrouteParse(path, &err);
+	if (t == NULL) {
+		__atomic_add_fetch(&stats.errors, 1, __ATOMIC_RELAXED);
+		return err;
+	}
+	pthread_rwlock_wrlock(&routeLock);
+	old = routes;
+	routes = t;
+	pthread_rwlock_unlock(&routeLock);
+	free(old);
+	__atomic_add_fetch(&stats.loads, 1, __ATOMIC_RELAXED);
+	MsgOut(MSG_ROUTING,
+		   MsgStr("ADSrouteLoad(): %d routes from %s\n", t->count, path));
+	return 0;
+}
+
+/**
+ * @brief Takes the routes from the file path from now on, and again on
+ * ADSrouteReload(); NULL drops the table, all devices are then found by
+ * the IP address in their NetId. It reads the file and resolves the
+ * names in it, so it may block for a while.
+ * Without a call the file named by the environment variable ADS_ROUTES
+ * is used, if set, see ADSrouteLoadEnv().
+ * @return 0 or an ADS error code, then the table before stays
+ */
+int ADSrouteLoad(const char *path)
+{
+	ADSRouteTable *old;
+	char *copy;
+	int rc = 0;
+
+	pthread_mutex_lock(&fileLock);
+	__atomic_store_n(&routeEnv, 1, __ATOMIC_RELEASE);
+	if (path == NULL) {
+		free(routePath);
+		routePath = NULL;
+		pthread_rwlock_wrlock(&routeLock);
+		old = routes;
+		routes = NULL;
+		pthread_rwlock_unlock(&routeLock);
+		free(old);
+	}
+	else if ((copy = strdup(path)) == NULL)
+		rc = 0x70A;
+	else {
+		rc = _ADSrouteLoadLocked(copy);
+		if (rc == 0) {
+			free(routePath);
+			routePath = copy;
+		}
+		else
+			free(copy);
+	}
+	pthread_mutex_unlock(&fileLock);
+	return rc;
+}
+
+/**
+ * @brief Loads the route file again, changed or not, e.g. on SIGHUP.
+ * Like ADSrouteLoad() it may block, call it off any I/O loop.
+ * @return 0 or an ADS error code, then the table before stays
+ */
+int ADSrouteReload(void)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&fileLock);
+	if (routePath != NULL)
+		rc = _ADSrouteLoadLocked(routePath);
+	pthread_mutex_unlock(&fileLock);
+	return rc;
+}
+
+/**
+ * @brief Loads the file named by ADS_ROUTES, if set, unless a table was
+ * loaded before; the first lookup does it otherwise. Call it at start
+ * where lookups must not block, as in the router.
+ * @return 0 or an ADS error code
+ */
+int ADSrouteLoadEnv(void)
+{
+	const char *env;
+	int rc = 0;
+
+	if (__atomic_load_n(&routeEnv, __ATOMIC_ACQUIRE))
+		return 0;
+	pthread_mutex_lock(&fileLock);
+	if (!routeEnv) {
+		env = getenv("ADS_ROUTES");
+		if (env != NULL && *env && (routePath = strdup(env)) != NULL
+			&& (rc = _ADSrouteLoadLocked(routePath)) != 0) {
+			free(routePath);
+			routePath = NULL;
+		}
+		__atomic_store_n(&routeEnv, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&fileLock);
+	return rc;
+}
+
+/**
+ * @brief Looks netId up in the route table in memory.
+ * @return 0 and its address in *addr, or -1 if it has no route
+ */
+int ADSrouteFind(const AmsNetId *netId, struct sockaddr_in *addr)
+{
+	ADSRoute *s;
+	int rc = -1;
+
+	ADSrouteLoadEnv();
+	pthread_rwlock_rdlock(&routeLock);
+	if (routes != NULL) {
+		s = _ADSrouteSlot(routes, netId);
+		if (s->used) {
+			*addr = s->addr;
+			rc = 0;
+		}
+	}
+	pthread_rwlock_unlock(&routeLock);
+	__atomic_add_fetch(rc == 0 ? &stats.hits : &stats.misses, 1,
+					   __ATOMIC_RELAXED);
+	return rc;
+}
+
+/**
+ * @brief Where to connect to for the device netId: its route, or else
+ * the IP address in the first four bytes of its NetId, on ROUTER_PORT.
+ */
+void ADSrouteAddress(const AmsNetId *netId, struct sockaddr_in *addr)
+{
+	if (ADSrouteFind(netId, addr) == 0)
+		return;
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(ROUTER_PORT);
+	memcpy(&addr->sin_addr.s_addr, netId->b, 4);	// network order already
+}
+
+void ADSrouteGetStats(ADSRouteStats *st)
+{
+	st->loads = __atomic_load_n(&stats.loads, __ATOMIC_RELAXED);
+	st->errors = __atomic_load_n(&stats.errors, __ATOMIC_RELAXED);
+	st->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+	st->misses = __atomic_load_n(&stats.misses, __ATOMIC_RELAXED);
+	pthread_rwlock_rdlock(&routeLock);
+	st->routes = routes != NULL ? routes->count : 0;
+	pthread_rwlock_unlock(&routeLock);
+}
@@ -0,0 +1,67 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_ROUTE_H__
+#define __ADS_ROUTE_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/**
+ * Where a device is: its NetId and the address of its AMS/TCP port.
+ */
+typedef struct {
+	AmsNetId			netId;
+	uint8_t				used;			// slot taken
+	struct sockaddr_in	addr;
+} ADSRoute;
+
+/**
+ * The routes of one version of the file, hashed by NetId with linear
+ * probing, never more than half full. It does not change once loaded;
+ * a reload builds a new one and swaps it in.
+ */
+typedef struct {
+	uint32_t			mask;			// slots - 1
+	int					count;			// routes
+	ADSRoute			slots[];
+} ADSRouteTable;
+
+typedef struct {
+	int					routes;			// in the table now
+	uint64_t			loads;			// successful (re)loads
+	uint64_t			errors;			// loads refused, the table stayed
+	uint64_t			hits;			// lookups found in the table
+	uint64_t			misses;			// lookups that fell back to the IP
+} ADSRouteStats;
+
+int ADSrouteLoad(const char *path);
+int ADSrouteReload(void);
+int ADSrouteLoadEnv(void);
+int ADSrouteFind(const AmsNetId *netId, struct sockaddr_in *addr);
+void ADSrouteAddress(const AmsNetId *netId, struct sockaddr_in *addr);
+void ADSrouteGetStats(ADSRouteStats *stats);
+
+#endif //__ADS_ROUTE_H__
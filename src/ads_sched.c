@@ -0,0 +1,715 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_image.h"
+#include "ads_sched.h"
+#include "debugprint.h"
+
+// what one sum read request can carry: 12 bytes per span in the request
+#define ADS_SUM_WRITE_MAX	(MAXDATALEN - sizeof(AMS_TCPheader) \
+							 - sizeof(AMSheader) - 16)
+
+static int64_t _nowNs(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void _ADSschedWake(ADSScheduler *s)
+{
+	char c = 0;
+
+	if (s->wake[1] > 0 && write(s->wake[1], &c, 1) != 1)
+		MsgOut(MSG_ERROR, "ADSsched: cannot wake the scheduler thread\n");
+}
+
+ADSScheduler *ADSschedNew(void)
+{
+	ADSScheduler *s = (ADSScheduler *) calloc(1, sizeof(ADSScheduler));
+
+	if (s == NULL)
+		return NULL;
+	s->mergeGap = 32;
+	s->timerFd = -1;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->idle, NULL);
+	return s;
+}
+
+void ADSschedFree(ADSScheduler *s)
+{
+	ADSPollItem *it;
+	ADSPollTarget *t;
+	ADSPollBatch *b;
+
+	if (s == NULL)
+		return;
+	ADSschedStop(s);
+	while ((it = s->items) != NULL) {
+		s->items = it->next;
+		free(it);
+	}
+	while ((t = s->targets) != NULL) {
+		s->targets = t->next;
+		free(t);
+	}
+	while ((b = s->freeBatches) != NULL) {
+		s->freeBatches = b->next;
+		free(b->items);
+		free(b);
+	}
+	free(s->due);
+	pthread_cond_destroy(&s->idle);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+/**
+ * @brief Adds an area to be read every periodMs milliseconds.
+ * Starts the asynchronous engine of dc. func gets the data of every read.
+ * @param pId receives the id for ADSschedRemove(), may be NULL
+ * @return 0 or an ADS error code
+ */
+int ADSschedAdd(ADSScheduler *s, ADSConnection *dc, uint32_t indexGroup,
+				uint32_t indexOffset, uint32_t length, int periodMs,
+				ADSPollFunc func, void *user, int *pId)
+{
+	ADSPollItem *it;
+	ADSPollTarget *t;
+	int64_t now;
+	int rc;
+
+	if (func == NULL || periodMs <= 0)
+		return 0x741;	// invalid parameter
+	if (length == 0 || length > ADS_MAX_READ_CHUNK)
+		return 0x705;	// parameter size not correct
+
+	rc = ADSasyncStart(dc);
+	if (rc != 0)
+		return rc;
+
+	it = (ADSPollItem *) calloc(1, sizeof(ADSPollItem));
+	if (it == NULL)
+		return 0x70A;	// no memory
+	it->indexGroup = indexGroup;
+	it->indexOffset = indexOffset;
+	it->length = length;
+	it->period = periodMs * 1000000LL;
+	it->func = func;
+	it->user = user;
+
+	pthread_mutex_lock(&s->lock);
+	for (t = s->targets; t != NULL && t->dc != dc; t = t->next)
+		;
+	if (t == NULL) {
+		t = (ADSPollTarget *) calloc(1, sizeof(ADSPollTarget));
+		if (t == NULL) {
+			pthread_mutex_unlock(&s->lock);
+			free(it);
+			return 0x70A;
+		}
+		t->dc = dc;
+		t->next = s->targets;
+		s->targets = t;
+	}
+	it->target = t;
+	it->id = ++s->lastId;
+
+	// align to the epoch, items with related periods fall due together
+	now = _nowNs();
+	if (s->epoch == 0)
+		s->epoch = now;
+	it->due = s->epoch
+		+ (now - s->epoch + it->period - 1) / it->period * it->period;
+
+	it->next = s->items;
+	s->items = it;
+	if (pId != NULL)
+		*pId = it->id;
+	pthread_mutex_unlock(&s->lock);
+
+	_ADSschedWake(s);
+	MsgOut(MSG_TRACE,
+		   MsgStr("ADSschedAdd(): item %d, 0x%x:%u, %u bytes every %d ms\n",
+				  it->id, indexGroup, indexOffset, length, periodMs));
+	return 0;
+}
+
+static void _ADSschedUnlink(ADSScheduler *s, ADSPollItem *it)
+{
+	ADSPollItem **pp = &s->items;
+
+	while (*pp != it)
+		pp = &(*pp)->next;
+	*pp = it->next;
+	free(it);
+}
+
+/**
+ * @brief Removes an item. If a read of it is on the way, its callback may
+ * still be called once.
+ */
+int ADSschedRemove(ADSScheduler *s, int id)
+{
+	ADSPollItem *it;
+
+	pthread_mutex_lock(&s->lock);
+	for (it = s->items; it != NULL; it = it->next)
+		if (it->id == id && !it->removed)
+			break;
+	if (it == NULL) {
+		pthread_mutex_unlock(&s->lock);
+		return 0x741;
+	}
+	if (it->inflight)
+		it->removed = 1;	// freed when the read comes back
+	else
+		_ADSschedUnlink(s, it);
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+}
+
+static ADSPollBatch *_ADSschedGetBatch(ADSScheduler *s, ADSPollTarget *t)
+{
+	ADSPollBatch *b;
+
+	pthread_mutex_lock(&s->lock);
+	b = s->freeBatches;
+	if (b != NULL)
+		s->freeBatches = b->next;
+	pthread_mutex_unlock(&s->lock);
+	if (b == NULL) {
+		b = (ADSPollBatch *) calloc(1, sizeof(ADSPollBatch));
+		if (b == NULL)
+			return NULL;
+		b->s = s;
+	}
+	b->target = t;
+	b->nSpans = 0;
+	b->nItems = 0;
+	b->readLen = 0;
+	return b;
+}
+
+static int _ADSschedAddItem(ADSPollBatch *b, ADSPollItem *it)
+{
+	ADSPollItem **items;
+
+	if (b->nItems == b->maxItems) {
+		items = (ADSPollItem **) realloc(b->items,
+				(b->maxItems + 32) * sizeof(ADSPollItem *));
+		if (items == NULL)
+			return 0x70A;
+		b->items = items;
+		b->maxItems += 32;
+	}
+	b->items[b->nItems++] = it;
+	return 0;
+}
+
+/*
+ * Delivers the result to the items of the batch and recycles it.
+ * data: the data of all spans one after the other, codes: the error code
+ * of every span of a sum read, both NULL if err is set.
+ */
+static void _ADSschedDeliver(ADSPollBatch *b, int err,
+							 const unsigned char *data, const uint32_t *codes)
+{
+	ADSScheduler *s = b->s;
+	uint32_t start[ADS_SCHED_MAX_SPANS];
+	uint32_t off = 0;
+	ADSPollItem *it;
+	int i, code, errors = 0;
+
+	for (i = 0; i < b->nSpans; i++) {
+		start[i] = off;
+		off += b->span[i].length;
+	}
+	for (i = 0; i < b->nItems; i++) {
+		it = b->items[i];
+		code = err ? err : (codes ? (int) codes[it->span] : 0);
+		if (code != 0)
+			it->func(it->user, code, NULL, 0);
+		else
+			it->func(it->user, 0, data + start[it->span] + it->spanOffset,
+					 it->length);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	for (i = 0; i < b->nItems; i++) {
+		it = b->items[i];
+		if (err != 0 || (codes != NULL && codes[it->span] != 0)) {
+			it->stats.errors++;
+			errors++;
+		}
+		else
+			it->stats.polls++;
+		it->inflight = 0;
+		if (it->removed)
+			_ADSschedUnlink(s, it);
+	}
+	s->stats.polls += b->nItems - errors;
+	s->stats.errors += errors;
+	b->next = s->freeBatches;
+	s->freeBatches = b;
+	if (--s->batches == 0)
+		pthread_cond_broadcast(&s->idle);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void _ADSschedSubmit(ADSPollBatch *b);
+
+static void _ADSschedFail(ADSScheduler *s, ADSPollItem *it, int err)
+{
+	it->func(it->user, err, NULL, 0);
+	pthread_mutex_lock(&s->lock);
+	it->stats.errors++;
+	s->stats.errors++;
+	it->inflight = 0;
+	if (it->removed)
+		_ADSschedUnlink(s, it);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * The device does not know sum reads: send every span of the batch on
+ * its own.
+ */
+static void _ADSschedSplit(ADSPollBatch *b)
+{
+	ADSScheduler *s = b->s;
+	ADSPollBatch *n;
+	ADSPollItem *it;
+	int i, k;
+
+	for (k = 0; k < b->nSpans; k++) {
+		n = _ADSschedGetBatch(s, b->target);
+		if (n != NULL) {
+			n->span[0] = b->span[k];
+			n->nSpans = 1;
+			n->readLen = b->span[k].length;
+		}
+		for (i = 0; i < b->nItems; i++) {
+			it = b->items[i];
+			if (it->span != k)
+				continue;
+			if (n == NULL || _ADSschedAddItem(n, it) != 0)
+				_ADSschedFail(s, it, 0x70A);
+			else
+				it->span = 0;	// k > 0 from here on, no confusion
+		}
+		if (n == NULL)
+			continue;
+		pthread_mutex_lock(&s->lock);
+		if (n->nItems == 0) {
+			n->next = s->freeBatches;
+			s->freeBatches = n;
+			n = NULL;
+		}
+		else
+			s->batches++;
+		pthread_mutex_unlock(&s->lock);
+		if (n != NULL)
+			_ADSschedSubmit(n);
+	}
+	b->nItems = 0;
+	_ADSschedDeliver(b, 0, NULL, NULL);
+}
+
+static void _ADSschedDone(ADSRequest *rq, ADSpacket *answer)
+{
+	ADSPollBatch *b = (ADSPollBatch *) rq->user;
+	ADSreadWriteResponse *rw;
+	ADSreadResponse *rr;
+	int err = rq->result;
+
+	if (answer == NULL || err != 0) {
+		_ADSschedDeliver(b, err ? err : 0x1, NULL, NULL);
+		return;
+	}
+	if (b->sum) {
+		rw = (ADSreadWriteResponse *) answer->data;
+		err = rw->result;
+		if (err == 0x701 || err == 0x702) {		// service not supported,
+			MsgOut(MSG_ERROR,					// invalid index group
+				   MsgStr("ADSsched: sum read refused (0x%x), "
+						  "falling back to single reads\n", err));
+			b->target->noSum = 1;
+			_ADSschedSplit(b);
+			return;
+		}
+		if (err == 0 && rw->length < 4 * b->nSpans + b->readLen)
+			err = 0x705;
+		if (err != 0)
+			_ADSschedDeliver(b, err, NULL, NULL);
+		else
+			_ADSschedDeliver(b, 0, (unsigned char *) rw->data + 4 * b->nSpans,
+							 (uint32_t *) rw->data);
+	}
+	else {
+		rr = (ADSreadResponse *) answer->data;
+		err = rr->result;
+		if (err == 0 && rr->length < b->readLen)
+			err = 0x705;
+		_ADSschedDeliver(b, err, (unsigned char *) rr->data, NULL);
+	}
+}
+
+/*
+ * Sends a batch as plain read if it has one span, else as sum read.
+ */
+static void _ADSschedSubmit(ADSPollBatch *b)
+{
+	ADSConnection *dc = b->target->dc;
+	ADSpacket *p = (ADSpacket *) b->packet;
+	ADSreadWriteRequest *rw;
+	ADSreadRequest *rq;
+	int rc, i;
+
+	_ADSsetupAmsHeader(dc, &p->amsHeader);
+	if (b->nSpans == 1) {
+		b->sum = 0;
+		p->amsHeader.commandId = cmdADSread;
+		p->amsHeader.dataLength = sizeof(ADSreadRequest);
+		rq = (ADSreadRequest *) p->data;
+		rq->indexGroup = b->span[0].indexGroup;
+		rq->indexOffset = b->span[0].indexOffset;
+		rq->length = b->span[0].length;
+	}
+	else {
+		b->sum = 1;
+		p->amsHeader.commandId = cmdADSreadWrite;
+		p->amsHeader.dataLength = 16 + b->nSpans * sizeof(ADSreadRequest);
+		rw = (ADSreadWriteRequest *) p->data;
+		rw->indexGroup = ADSIGRP_SUMUP_READ;
+		rw->indexOffset = b->nSpans;
+		rw->readLength = 4 * b->nSpans + b->readLen;
+		rw->writeLength = b->nSpans * sizeof(ADSreadRequest);
+		rq = (ADSreadRequest *) rw->data;
+		for (i = 0; i < b->nSpans; i++) {
+			rq[i].indexGroup = b->span[i].indexGroup;
+			rq[i].indexOffset = b->span[i].indexOffset;
+			rq[i].length = b->span[i].length;
+		}
+	}
+	p->adsHeader.length = sizeof(AMSheader) + p->amsHeader.dataLength;
+	p->adsHeader.reserved = 0;
+
+	b->rq.packet = p;
+	b->rq.done = _ADSschedDone;
+	b->rq.user = b;
+
+	pthread_mutex_lock(&b->s->lock);
+	b->s->stats.requests++;
+	if (b->sum)
+		b->s->stats.sumReads++;
+	pthread_mutex_unlock(&b->s->lock);
+
+	rc = ADSasyncSubmit(dc, &b->rq);
+	if (rc != 0) {
+		b->rq.result = rc;
+		_ADSschedDone(&b->rq, NULL);
+	}
+}
+
+/*
+ * Does a span of len more bytes fit into the batch?
+ */
+static int _ADSschedFits(ADSPollBatch *b, uint32_t len)
+{
+	if (b->nSpans == 0)
+		return 1;
+	if (b->target->noSum || b->nSpans == ADS_SCHED_MAX_SPANS)
+		return 0;
+	return 4 * (b->nSpans + 1) + b->readLen + len <= ADS_MAX_READ_CHUNK
+		&& (b->nSpans + 1) * sizeof(ADSreadRequest) <= ADS_SUM_WRITE_MAX;
+}
+
+/*
+ * Merges the due items of one target, sorted by index group and offset,
+ * into spans and sends them in as few requests as possible.
+ */
+static void _ADSschedSend(ADSScheduler *s, ADSPollItem **items, int n)
+{
+	ADSPollBatch *b = NULL;
+	ADSPollSpan sp;
+	uint32_t end;
+	int i = 0, j, k;
+
+	while (i < n) {
+		sp.indexGroup = items[i]->indexGroup;
+		sp.indexOffset = items[i]->indexOffset;
+		sp.length = items[i]->length;
+		for (j = i + 1; j < n; j++) {
+			if (items[j]->indexGroup != sp.indexGroup
+				|| items[j]->indexOffset > sp.indexOffset + sp.length
+										   + s->mergeGap)
+				break;
+			end = items[j]->indexOffset + items[j]->length;
+			if (end > sp.indexOffset + sp.length) {
+				if (end - sp.indexOffset > ADS_MAX_READ_CHUNK)
+					break;
+				sp.length = end - sp.indexOffset;
+			}
+		}
+
+		if (b != NULL && !_ADSschedFits(b, sp.length)) {
+			_ADSschedSubmit(b);
+			b = NULL;
+		}
+		if (b == NULL) {
+			b = _ADSschedGetBatch(s, items[i]->target);
+			if (b == NULL) {
+				for (k = i; k < n; k++)
+					_ADSschedFail(s, items[k], 0x70A);
+				return;
+			}
+			pthread_mutex_lock(&s->lock);
+			s->batches++;
+			pthread_mutex_unlock(&s->lock);
+		}
+		for (k = i; k < j; k++) {
+			items[k]->span = b->nSpans;
+			items[k]->spanOffset = items[k]->indexOffset - sp.indexOffset;
+			if (_ADSschedAddItem(b, items[k]) != 0)
+				_ADSschedFail(s, items[k], 0x70A);
+		}
+		b->span[b->nSpans++] = sp;
+		b->readLen += sp.length;
+		i = j;
+	}
+	if (b != NULL)
+		_ADSschedSubmit(b);
+}
+
+static int _ADSschedCompare(const void *a, const void *b)
+{
+	const ADSPollItem *x = *(ADSPollItem * const *) a;
+	const ADSPollItem *y = *(ADSPollItem * const *) b;
+
+	if (x->target != y->target)
+		return x->target < y->target ? -1 : 1;
+	if (x->indexGroup != y->indexGroup)
+		return x->indexGroup < y->indexGroup ? -1 : 1;
+	if (x->indexOffset != y->indexOffset)
+		return x->indexOffset < y->indexOffset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sends the reads of all items due now.
+ * Returns the time the next item falls due, 0 if there are no items.
+ */
+static int64_t _ADSschedRun(ADSScheduler *s)
+{
+	ADSPollItem *it, **due;
+	int64_t now, next = 0, missed;
+	int n = 0, i, j;
+
+	pthread_mutex_lock(&s->lock);
+	now = _nowNs();
+	s->stats.wakeups++;
+	for (it = s->items; it != NULL; it = it->next) {
+		if (it->removed)
+			continue;
+		if (it->due <= now + ADS_SCHED_SLACK) {
+			if (it->inflight) {
+				it->stats.overruns++;
+				s->stats.overruns++;
+			}
+			else {
+				if (n == s->maxDue) {
+					due = (ADSPollItem **) realloc(s->due,
+							(s->maxDue + 64) * sizeof(ADSPollItem *));
+					if (due == NULL)
+						break;
+					s->due = due;
+					s->maxDue += 64;
+				}
+				it->inflight = 1;
+				s->due[n++] = it;
+			}
+			it->due += it->period;
+			if (it->due <= now) {
+				missed = (now - it->due) / it->period + 1;
+				it->due += missed * it->period;
+				it->stats.skipped += missed;
+				s->stats.skipped += missed;
+			}
+		}
+		if (next == 0 || it->due < next)
+			next = it->due;
+	}
+	if (it != NULL)		// out of memory, try again soon
+		next = now + 1000000;
+	pthread_mutex_unlock(&s->lock);
+
+	qsort(s->due, n, sizeof(ADSPollItem *), _ADSschedCompare);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && s->due[j]->target == s->due[i]->target; j++)
+			;
+		_ADSschedSend(s, s->due + i, j - i);
+	}
+	return next;
+}
+
+static void *_ADSschedThread(void *arg)
+{
+	ADSScheduler *s = (ADSScheduler *) arg;
+	struct itimerspec its;
+	struct pollfd fds[2];
+	uint64_t expirations;
+	int64_t next;
+	char c;
+
+	fds[0].fd = s->timerFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = s->wake[0];
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		next = _ADSschedRun(s);
+		memset(&its, 0, sizeof(its));
+		if (next != 0) {
+			its.it_value.tv_sec = next / 1000000000LL;
+			its.it_value.tv_nsec = next % 1000000000LL;
+		}
+		timerfd_settime(s->timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			MsgOut(MSG_ERROR,
+				   MsgStr("ADSsched: poll() failed: %s\n", strerror(errno)));
+			break;
+		}
+		if (fds[1].revents) {
+			if (read(s->wake[0], &c, 1) != 1)
+				break;
+			pthread_mutex_lock(&s->lock);
+			if (!s->running) {
+				pthread_mutex_unlock(&s->lock);
+				break;
+			}
+			pthread_mutex_unlock(&s->lock);
+		}
+		if (fds[0].revents
+			&& read(s->timerFd, &expirations, sizeof(expirations)) < 0
+			&& errno != EAGAIN)
+			break;
+	}
+	return NULL;
+}
+
+int ADSschedStart(ADSScheduler *s)
+{
+	if (s->running)
+		return 0;
+	s->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (s->timerFd < 0) {
+		MsgOut(MSG_ERROR, "ADSschedStart(): timerfd_create() failed\n");
+		return 0x1;
+	}
+	if (pipe(s->wake) != 0) {
+		close(s->timerFd);
+		s->timerFd = -1;
+		return 0x1;
+	}
+	s->running = 1;
+	if (pthread_create(&s->thread, NULL, _ADSschedThread, s) != 0) {
+		s->running = 0;
+		close(s->timerFd);
+		close(s->wake[0]);
+		close(s->wake[1]);
+		s->timerFd = -1;
+		s->wake[1] = 0;
+		MsgOut(MSG_ERROR, "ADSschedStart(): pthread_create() failed\n");
+		return 0x1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Stops the scheduler and waits for the reads on the way.
+ */
+int ADSschedStop(ADSScheduler *s)
+{
+	pthread_mutex_lock(&s->lock);
+	if (!s->running) {
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+	s->running = 0;
+	pthread_mutex_unlock(&s->lock);
+
+	_ADSschedWake(s);
+	pthread_join(s->thread, NULL);
+
+	pthread_mutex_lock(&s->lock);
+	while (s->batches > 0)
+		pthread_cond_wait(&s->idle, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+
+	close(s->timerFd);
+	close(s->wake[0]);
+	close(s->wake[1]);
+	s->timerFd = -1;
+	s->wake[1] = 0;
+	return 0;
+}
+
+void ADSschedGetStats(ADSScheduler *s, ADSSchedStats *stats)
+{
+	pthread_mutex_lock(&s->lock);
+	*stats = s->stats;
+	pthread_mutex_unlock(&s->lock);
+}
+
+int ADSschedGetItemStats(ADSScheduler *s, int id, ADSPollStats *stats)
+{
+	ADSPollItem *it;
+
+	pthread_mutex_lock(&s->lock);
+	for (it = s->items; it != NULL && it->id != id; it = it->next)
+		;
+	if (it != NULL)
+		*stats = it->stats;
+	pthread_mutex_unlock(&s->lock);
+	return it != NULL ? 0 : 0x741;
+}
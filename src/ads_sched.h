@@ -0,0 +1,151 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_SCHED_H__
+#define __ADS_SCHED_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ads_async.h"
+
+#define ADS_SCHED_MAX_SPANS		256		// reads packed into one sum read
+#define ADS_SCHED_SLACK			200000	// ns; items due this soon are read now
+
+/**
+ * Called from the receive thread of the connection with the fresh data of
+ * an item, or with result != 0 and no data; from the scheduler thread if
+ * the read could not be sent at all. data is valid only during the call.
+ * Must not call the synchronous functions of the same connection.
+ */
+typedef void (*ADSPollFunc)(void *user, int result, const void *data,
+							uint32_t length);
+
+typedef struct {
+	uint64_t	polls;			// data delivered
+	uint64_t	errors;			// errors delivered
+	uint64_t	overruns;		// due while the last read was still on the way
+	uint64_t	skipped;		// cycles missed because the scheduler was late
+} ADSPollStats;
+
+typedef struct _ADSPollTarget {
+	ADSConnection	*dc;
+	int				noSum;			// the device refused ADSIGRP_SUMUP_READ
+	struct _ADSPollTarget *next;
+} ADSPollTarget;
+
+typedef struct _ADSPollItem {
+	int				id;
+	ADSPollTarget	*target;
+	uint32_t		indexGroup;
+	uint32_t		indexOffset;
+	uint32_t		length;
+	int64_t			period;			// ns
+	int64_t			due;			// CLOCK_MONOTONIC ns of the next read
+	ADSPollFunc		func;
+	void			*user;
+	int				inflight;		// a read of this item is on the way
+	int				removed;		// free it when the read comes back
+	int				span;			// index of the span in the batch
+	uint32_t		spanOffset;		// where the item starts in its span
+	ADSPollStats	stats;
+	struct _ADSPollItem *next;
+} ADSPollItem;
+
+typedef struct {
+	uint32_t	indexGroup;
+	uint32_t	indexOffset;
+	uint32_t	length;
+} ADSPollSpan;
+
+typedef struct _ADSScheduler ADSScheduler;
+
+/**
+ * One request on the way: a plain read of one span or a sum read of many.
+ */
+typedef struct _ADSPollBatch {
+	ADSRequest		rq;
+	ADSScheduler	*s;
+	ADSPollTarget	*target;
+	int				sum;			// sent as ADSIGRP_SUMUP_READ
+	int				nSpans;
+	uint32_t		readLen;		// bytes the answer will bring
+	ADSPollSpan		span[ADS_SCHED_MAX_SPANS];
+	ADSPollItem		**items;
+	int				nItems;
+	int				maxItems;
+	struct _ADSPollBatch *next;		// free list
+	unsigned char	packet[MAXDATALEN];
+} ADSPollBatch;
+
+typedef struct {
+	uint64_t	wakeups;
+	uint64_t	requests;		// plain and sum reads sent
+	uint64_t	sumReads;
+	uint64_t	polls;			// item reads delivered
+	uint64_t	errors;
+	uint64_t	overruns;
+	uint64_t	skipped;
+} ADSSchedStats;
+
+/**
+ * Multi-rate poller: every item is read with its own period, aligned to a
+ * common epoch so that items with related periods fall due together. The
+ * items due at one wakeup are grouped per connection, neighbouring ones
+ * merged into spans and the spans packed into ADSIGRP_SUMUP_READ requests,
+ * which the asynchronous engine of the connection sends without waiting.
+ */
+struct _ADSScheduler {
+	uint32_t		mergeGap;		// merge items at most this many bytes apart,
+									// set before ADSschedStart()
+	int				timerFd;
+	int				wake[2];
+	pthread_t		thread;
+	int				running;
+	pthread_mutex_t	lock;			// guards everything below
+	ADSPollItem		*items;
+	int				lastId;
+	int64_t			epoch;
+	ADSPollTarget	*targets;
+	ADSPollBatch	*freeBatches;
+	int				batches;		// on the way
+	pthread_cond_t	idle;			// signalled when batches drops to 0
+	ADSPollItem		**due;			// scratch of the scheduler thread
+	int				maxDue;
+	ADSSchedStats	stats;
+};
+
+ADSScheduler *ADSschedNew(void);
+void ADSschedFree(ADSScheduler *s);
+int ADSschedAdd(ADSScheduler *s, ADSConnection *dc, uint32_t indexGroup,
+				uint32_t indexOffset, uint32_t length, int periodMs,
+				ADSPollFunc func, void *user, int *pId);
+int ADSschedRemove(ADSScheduler *s, int id);
+int ADSschedStart(ADSScheduler *s);
+int ADSschedStop(ADSScheduler *s);
+void ADSschedGetStats(ADSScheduler *s, ADSSchedStats *stats);
+int ADSschedGetItemStats(ADSScheduler *s, int id, ADSPollStats *stats);
+
+#endif //__ADS_SCHED_H__
@@ -0,0 +1,768 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * A library for ADS devices of our own, simulators and bridges: handlers
+ * for commands and for ranges of index groups, see ADSserverOn() and
+ * ADSserverOnGroups(). One thread, the one of ADSserverRun(), runs an
+ * event loop around epoll with all clients, every socket non blocking;
+ * complete requests go to a pool of workers, their answers come back to
+ * the loop, which sends them. A client with ADS_SERVER_PENDING requests
+ * in the workers is not read until some are answered, so a slow handler
+ * holds up its clients but never makes the server grow.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_server.h"
+#include "debugprint.h"
+
+#define ADS_SERVER_EVENTS	64		// epoll events per round
+#define ADS_SERVER_IOV		16		// frames per writev
+#define ADS_SERVER_CMDDATA	MAXDATALEN	// room for the answer of a command
+#define ADS_SERVER_LISTEN	ADS_SERVER_CONNS		// epoll keys besides the
+#define ADS_SERVER_WAKE		(ADS_SERVER_CONNS + 1)	// slots of the clients
+
+#define SRV_TCP(f)	((AMS_TCPheader *)(f)->data)
+#define SRV_AMS(f)	((AMSheader *)((f)->data + sizeof(AMS_TCPheader)))
+#define SRV_DATA(f)	((f)->data + sizeof(AMS_TCPheader) + sizeof(AMSheader))
+#define SRV_HEAD	(sizeof(AMS_TCPheader) + sizeof(AMSheader))
+
+static int _ADSserverNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void _ADSserverWatch(ADSServer *s, int fd, uint64_t key,
+							uint32_t *events, uint32_t want)
+{
+	struct epoll_event ev;
+
+	if (*events == want)
+		return;
+	ev.events = want;
+	ev.data.u64 = key;
+	if (epoll_ctl(s->epfd, *events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd,
+				  &ev) != 0)
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADS server: epoll_ctl() failed: %s\n",
+					  strerror(errno)));
+	*events = want;
+}
+
+/*
+ * What a client is watched for: requests unless paused, then only for it
+ * going away; and room to send.
+ */
+static void _ADSserverRewatch(ADSServer *s, int slot)
+{
+	ADSServerConn *c = s->conns[slot];
+
+	_ADSserverWatch(s, c->fd, slot, &c->events,
+					(c->pending < ADS_SERVER_PENDING ? EPOLLIN : EPOLLRDHUP)
+					| (c->txFirst != NULL ? EPOLLOUT : 0));
+}
+
+/* the handler of a group, NULL if none */
+static ADSServerGroups *_ADSserverGroup(ADSServer *s, uint32_t group)
+{
+	int lo = 0, hi = s->nGroups - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (group < s->groups[mid].first)
+			hi = mid - 1;
+		else if (group > s->groups[mid].last)
+			lo = mid + 1;
+		else
+			return &s->groups[mid];
+	}
+	return NULL;
+}
+
+/* the built-in answers, for devices that do not give their own */
+static int _ADSserverDevInfo(ADSServerRequest *rq, void *user)
+{
+	AdsVersion v = { 1, 0, 0 };
+
+	memcpy(rq->out, &v, sizeof(v));
+	memset(rq->out + sizeof(v), 0, 16);
+	strcpy((char *) rq->out + sizeof(v), "libads");
+	rq->outLength = sizeof(v) + 16;
+	return 0;
+}
+
+static int _ADSserverState(ADSServerRequest *rq, void *user)
+{
+	uint16_t state[2] = { ADSSTATE_RUN, 0 };
+
+	memcpy(rq->out, state, sizeof(state));
+	rq->outLength = sizeof(state);
+	return 0;
+}
+
+/*
+ * The answer to the request q, from its handler. Returns NULL if there
+ * is no memory for it.
+ */
+static ADSServerFrame *_ADSserverHandle(ADSServer *s, ADSServerFrame *q)
+{
+	AMSheader *h = SRV_AMS(q);
+	unsigned char *d = SRV_DATA(q);
+	uint32_t avail = SRV_TCP(q)->length - sizeof(AMSheader), room = 0;
+	uint32_t rw[4], head = 4, result;
+	ADSServerHandler handler = NULL;
+	ADSServerGroups *g;
+	ADSServerRequest rq;
+	ADSServerFrame *a;
+	void *user = NULL;
+
+	if (h->dataLength < avail)
+		avail = h->dataLength;
+	memset(&rq, 0, sizeof(rq));
+	rq.header = *h;
+	result = 0x705;					// ADSERR_DEVICE_INVALIDSIZE
+	switch (h->commandId) {
+	case cmdADSread:
+	case cmdADSwrite:
+	case cmdADSreadWrite:
+		// group, offset, then the length to read and, or, to write
+		memset(rw, 0, sizeof(rw));
+		if (avail < 12 || (h->commandId == cmdADSreadWrite && avail < 16))
+			break;
+		memcpy(rw, d, h->commandId == cmdADSreadWrite ? 16 : 12);
+		rq.indexGroup = rw[0];
+		rq.indexOffset = rw[1];
+		if (h->commandId == cmdADSwrite) {
+			rq.length = rw[2];
+			rq.data = d + 12;
+		}
+		else {
+			room = rw[2];
+			head = 8;
+		}
+		if (h->commandId == cmdADSreadWrite) {
+			rq.length = rw[3];
+			rq.data = d + 16;
+		}
+		if (room > ADS_SERVER_MAXDATA
+			|| (rq.data != NULL && rq.length > avail - (rq.data - d)))
+			break;
+		result = 0;
+		if ((handler = s->commands[h->commandId]) != NULL)
+			user = s->commandUser[h->commandId];
+		else if ((g = _ADSserverGroup(s, rq.indexGroup)) != NULL) {
+			handler = g->handler;
+			user = g->user;
+		}
+		else
+			result = 0x702;			// ADSERR_DEVICE_INVALIDGRP
+		break;
+	default:
+		result = 0;
+		rq.data = d;
+		rq.length = avail;
+		room = ADS_SERVER_CMDDATA;
+		if (h->commandId <= cmdADSreadWrite
+			&& s->commands[h->commandId] != NULL) {
+			handler = s->commands[h->commandId];
+			user = s->commandUser[h->commandId];
+		}
+		else if (h->commandId == cmdADSreadDevInfo)
+			handler = _ADSserverDevInfo;
+		else if (h->commandId == cmdADSreadState)
+			handler = _ADSserverState;
+		else
+			result = 0x701;			// ADSERR_DEVICE_SRVNOTSUPP
+	}
+
+	a = (ADSServerFrame *) malloc(sizeof(ADSServerFrame) + SRV_HEAD + head
+								  + room);
+	if (a == NULL)
+		return NULL;
+	a->next = NULL;
+	a->conn = q->conn;
+	a->serial = q->serial;
+	a->off = 0;
+	rq.out = SRV_DATA(a) + head;
+	rq.outLength = room;
+	if (handler != NULL) {
+		result = handler(&rq, user);
+		if (rq.outLength > room)
+			rq.outLength = room;
+	}
+	else if (result == 0x701 || result == 0x702)
+		__atomic_add_fetch(&s->stats.unhandled, 1, __ATOMIC_RELAXED);
+	if (result != 0) {
+		__atomic_add_fetch(&s->stats.errors, 1, __ATOMIC_RELAXED);
+		rq.outLength = 0;
+	}
+	if (h->commandId == cmdADSwrite)
+		rq.outLength = 0;
+	memcpy(SRV_DATA(a), &result, 4);
+	if (head == 8)
+		memcpy(SRV_DATA(a) + 4, &rq.outLength, 4);
+
+	SRV_TCP(a)->reserved = 0;
+	SRV_TCP(a)->length = sizeof(AMSheader) + head + rq.outLength;
+	SRV_AMS(a)->targetId = h->sourceId;
+	SRV_AMS(a)->targetPort = h->sourcePort;
+	SRV_AMS(a)->sourceId = h->targetId;
+	SRV_AMS(a)->sourcePort = h->targetPort;
+	SRV_AMS(a)->commandId = h->commandId;
+	SRV_AMS(a)->stateFlags = sfAMSresponse | sfAMScommand;
+	SRV_AMS(a)->dataLength = head + rq.outLength;
+	SRV_AMS(a)->errorCode = 0;
+	SRV_AMS(a)->invokeId = h->invokeId;
+	a->len = SRV_HEAD + head + rq.outLength;
+	return a;
+}
+
+static void *_ADSserverWorker(void *arg)
+{
+	ADSServer *s = (ADSServer *) arg;
+	ADSServerFrame *q, *a;
+	uint64_t one = 1;
+	int wake;
+
+	pthread_mutex_lock(&s->lock);
+	while (s->running) {
+		if ((q = s->jobFirst) == NULL) {
+			pthread_cond_wait(&s->cond, &s->lock);
+			continue;
+		}
+		s->jobFirst = q->next;
+		if (s->jobFirst == NULL)
+			s->jobLast = NULL;
+		pthread_mutex_unlock(&s->lock);
+
+		a = _ADSserverHandle(s, q);
+		if (a != NULL)
+			free(q);
+		else {
+			a = q;					// no answer, but the loop counts it
+			a->len = 0;
+			a->next = NULL;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		wake = s->doneFirst == NULL;
+		if (s->doneLast != NULL)
+			s->doneLast->next = a;
+		else
+			s->doneFirst = a;
+		s->doneLast = a;
+		if (wake && write(s->wakeFd, &one, sizeof(one)) < 0
+			&& errno != EAGAIN)
+			MsgOut(MSG_ERROR, "ADS server: cannot wake the loop\n");
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/* closed once the events of this round are handled */
+static void _ADSserverKill(ADSServer *s, int slot)
+{
+	s->conns[slot]->dead = 1;
+}
+
+static void _ADSserverClose(ADSServer *s, int slot)
+{
+	ADSServerConn *c = s->conns[slot];
+	ADSServerFrame *f;
+
+	MsgOut(MSG_ROUTING, MsgStr("ADS server: client %d gone\n", slot));
+	close(c->fd);					// leaves the epoll set as well
+	while ((f = c->txFirst) != NULL) {
+		c->txFirst = f->next;
+		free(f);
+	}
+	free(c->rx);
+	free(c);
+	s->conns[slot] = NULL;
+	s->stats.connections--;
+}
+
+static void _ADSserverFlush(ADSServer *s, int slot)
+{
+	ADSServerConn *c = s->conns[slot];
+	struct iovec iov[ADS_SERVER_IOV];
+	struct msghdr msg;
+	ADSServerFrame *f;
+	ssize_t n;
+	int i;
+
+	while (c->txFirst != NULL) {
+		for (i = 0, f = c->txFirst; f != NULL && i < ADS_SERVER_IOV;
+			 f = f->next, i++) {
+			iov[i].iov_base = f->data + f->off;
+			iov[i].iov_len = f->len - f->off;
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = i;
+		n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			_ADSserverKill(s, slot);
+			return;
+		}
+		while (n > 0) {
+			f = c->txFirst;
+			if (n < f->len - f->off) {
+				f->off += n;
+				break;
+			}
+			n -= f->len - f->off;
+			c->txFirst = f->next;
+			free(f);
+		}
+		if (c->txFirst == NULL)
+			c->txLast = NULL;
+	}
+	_ADSserverRewatch(s, slot);
+}
+
+/* the answer a to its client, if that is still there */
+static void _ADSserverAnswer(ADSServer *s, ADSServerFrame *a, int fromWorker)
+{
+	ADSServerConn *c = s->conns[a->conn];
+
+	if (c == NULL || c->serial != a->serial) {
+		free(a);
+		return;
+	}
+	if (fromWorker)
+		c->pending--;
+	if (c->dead || a->len == 0) {
+		free(a);					// len 0: no memory for it
+		return;
+	}
+	s->stats.responses++;
+	if (c->txLast != NULL)
+		c->txLast->next = a;
+	else
+		c->txFirst = a;
+	c->txLast = a;
+	if (c->txFirst == a)
+		_ADSserverFlush(s, a->conn);
+}
+
+/*
+ * Takes the complete requests out of the receive buffer of the client in
+ * slot, to the workers or, without, answers them at once. Stops at
+ * ADS_SERVER_PENDING in the workers. Returns -1 if it is to be closed.
+ */
+static int _ADSserverParse(ADSServer *s, int slot)
+{
+	ADSServerConn *c = s->conns[slot];
+	AMS_TCPheader *h;
+	ADSServerFrame *q, *a;
+	uint32_t off = 0, len;
+
+	while (c->pending < ADS_SERVER_PENDING
+		   && c->rxLen - off >= sizeof(AMS_TCPheader)) {
+		h = (AMS_TCPheader *)(c->rx + off);
+		if (h->length < sizeof(AMSheader)
+			|| h->length > ADS_SERVER_MAXFRAME - sizeof(AMS_TCPheader)) {
+			MsgOut(MSG_ERROR, "ADS server: invalid AMS length\n");
+			return -1;
+		}
+		len = sizeof(AMS_TCPheader) + h->length;
+		if (c->rxLen - off < len)
+			break;
+		q = NULL;
+		if (!(((AMSheader *)(h + 1))->stateFlags & sfAMSresponse)) {
+			q = (ADSServerFrame *) malloc(sizeof(ADSServerFrame) + len);
+			if (q == NULL)
+				return -1;
+			q->next = NULL;
+			q->conn = slot;
+			q->serial = c->serial;
+			q->len = len;
+			memcpy(q->data, c->rx + off, len);
+			s->stats.requests++;
+		}
+		off += len;
+		if (q == NULL)
+			continue;				// answers are nothing for us
+		if (s->workers == 0) {
+			a = _ADSserverHandle(s, q);
+			free(q);
+			if (a == NULL)
+				return -1;
+			_ADSserverAnswer(s, a, 0);
+			continue;
+		}
+		c->pending++;
+		pthread_mutex_lock(&s->lock);
+		if (s->jobLast != NULL)
+			s->jobLast->next = q;
+		else
+			s->jobFirst = q;
+		s->jobLast = q;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		if (c->pending == ADS_SERVER_PENDING)
+			s->stats.paused++;
+	}
+	memmove(c->rx, c->rx + off, c->rxLen - off);
+	c->rxLen -= off;
+	return 0;
+}
+
+static void _ADSserverRead(ADSServer *s, int slot)
+{
+	ADSServerConn *c = s->conns[slot];
+	ssize_t n;
+
+	if (c->rxLen == ADS_SERVER_MAXFRAME)
+		return;						// paused, full of requests
+	n = recv(c->fd, c->rx + c->rxLen, ADS_SERVER_MAXFRAME - c->rxLen, 0);
+	if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+		_ADSserverKill(s, slot);
+		return;
+	}
+	if (n > 0)
+		c->rxLen += n;
+	if (_ADSserverParse(s, slot) != 0)
+		_ADSserverKill(s, slot);
+	else if (!c->dead)
+		_ADSserverRewatch(s, slot);
+}
+
+/* the answers of the workers; clients that were paused go on */
+static void _ADSserverWoken(ADSServer *s)
+{
+	ADSServerFrame *a, *next;
+	ADSServerConn *c;
+	uint64_t n;
+	int slot, paused;
+
+	if (read(s->wakeFd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		return;
+	pthread_mutex_lock(&s->lock);
+	a = s->doneFirst;
+	s->doneFirst = s->doneLast = NULL;
+	pthread_mutex_unlock(&s->lock);
+	for (; a != NULL; a = next) {
+		next = a->next;
+		a->next = NULL;
+		slot = a->conn;
+		c = s->conns[slot];
+		paused = c != NULL && c->serial == a->serial
+			&& c->pending == ADS_SERVER_PENDING;
+		_ADSserverAnswer(s, a, 1);
+		if (!paused || c->dead)
+			continue;
+		// what it sent meanwhile
+		if (_ADSserverParse(s, slot) != 0)
+			_ADSserverKill(s, slot);
+		else
+			_ADSserverRewatch(s, slot);
+	}
+}
+
+static void _ADSserverAccept(ADSServer *s)
+{
+	ADSServerConn *c;
+	int fd, i, opt = 1;
+
+	while ((fd = accept(s->listenFd, NULL, NULL)) >= 0) {
+		for (i = 0; i < ADS_SERVER_CONNS; i++)
+			if (s->conns[(s->nextConn + i) % ADS_SERVER_CONNS] == NULL)
+				break;
+		c = NULL;
+		if (i < ADS_SERVER_CONNS
+			&& (c = (ADSServerConn *) calloc(1, sizeof(*c))) != NULL
+			&& (c->rx = (unsigned char *) malloc(ADS_SERVER_MAXFRAME))
+			   == NULL) {
+			free(c);
+			c = NULL;
+		}
+		if (c == NULL || _ADSserverNonBlocking(fd) != 0) {
+			MsgOut(MSG_ERROR, "ADS server: no room for another client\n");
+			if (c != NULL) {
+				free(c->rx);
+				free(c);
+			}
+			close(fd);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+		i = (s->nextConn + i) % ADS_SERVER_CONNS;
+		s->nextConn = i + 1;
+		c->fd = fd;
+		c->serial = ++s->nextSerial;
+		s->conns[i] = c;
+		s->stats.accepted++;
+		s->stats.connections++;
+		_ADSserverRewatch(s, i);
+		MsgOut(MSG_ROUTING, MsgStr("ADS server: client %d\n", i));
+	}
+}
+
+/**
+ * @brief Creates a server listening on address, "host[:port]", port
+ * 48898 if none, with workers threads for the handlers; without, the
+ * thread of ADSserverRun() runs them.
+ * @return the server or NULL
+ */
+ADSServer *ADSserverNew(const char *address, int workers)
+{
+	struct sockaddr_in addr;
+	uint32_t events = 0;
+	ADSServer *s;
+	int opt = 1;
+
+	if (workers < 0 || workers > ADS_SERVER_WORKERS
+		|| ADSparseAddress(address, ROUTER_PORT, &addr) != 0) {
+		MsgOut(MSG_ERROR, MsgStr("ADS server: bad address %s\n", address));
+		return NULL;
+	}
+	s = (ADSServer *) calloc(1, sizeof(ADSServer));
+	if (s == NULL)
+		return NULL;
+	s->workers = workers;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->epfd = epoll_create1(EPOLL_CLOEXEC);
+	s->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	s->listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s->epfd < 0 || s->wakeFd < 0 || s->listenFd < 0) {
+		ADSserverFree(s);
+		return NULL;
+	}
+	setsockopt(s->listenFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	if (bind(s->listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+		|| listen(s->listenFd, 64) != 0
+		|| _ADSserverNonBlocking(s->listenFd) != 0) {
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADS server: cannot listen on %s: %s\n", address,
+					  strerror(errno)));
+		ADSserverFree(s);
+		return NULL;
+	}
+	_ADSserverWatch(s, s->listenFd, ADS_SERVER_LISTEN, &events, EPOLLIN);
+	events = 0;
+	_ADSserverWatch(s, s->wakeFd, ADS_SERVER_WAKE, &events, EPOLLIN);
+	return s;
+}
+
+/**
+ * @brief Lets handler answer every request with commandId, before
+ * ADSserverRun(); for reads, writes and readWrites before the handlers
+ * of the index groups. Without one the server answers readDevInfo and
+ * readState itself, the others with ADSERR_DEVICE_SRVNOTSUPP.
+ * @return 0 or an ADS error code
+ */
+int ADSserverOn(ADSServer *s, uint16_t commandId, ADSServerHandler handler,
+				void *user)
+{
+	if (commandId > cmdADSreadWrite || commandId == cmdADSinvalid)
+		return 0x741;
+	s->commands[commandId] = handler;
+	s->commandUser[commandId] = user;
+	return 0;
+}
+
+/**
+ * @brief Lets handler answer the reads, writes and readWrites of the index
+ * groups first .. last, before ADSserverRun(). The ranges must not
+ * overlap; a group of none is answered with ADSERR_DEVICE_INVALIDGRP.
+ * @return 0 or an ADS error code
+ */
+int ADSserverOnGroups(ADSServer *s, uint32_t first, uint32_t last,
+					  ADSServerHandler handler, void *user)
+{
+	int i;
+
+	if (first > last || handler == NULL)
+		return 0x741;
+	if (s->nGroups == ADS_SERVER_GROUPS)
+		return 0x70A;
+	for (i = s->nGroups; i > 0 && s->groups[i - 1].first > last; i--)
+		;
+	if (i > 0 && s->groups[i - 1].last >= first)
+		return 0x741;				// overlaps
+	memmove(&s->groups[i + 1], &s->groups[i],
+			(s->nGroups - i) * sizeof(ADSServerGroups));
+	s->groups[i].first = first;
+	s->groups[i].last = last;
+	s->groups[i].handler = handler;
+	s->groups[i].user = user;
+	s->nGroups++;
+	return 0;
+}
+
+/* the workers go, with what they had not done yet */
+static void _ADSserverStopWorkers(ADSServer *s, int started)
+{
+	ADSServerFrame *f;
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	s->running = 0;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	for (i = 0; i < started; i++)
+		pthread_join(s->threads[i], NULL);
+	while ((f = s->jobFirst) != NULL) {
+		s->jobFirst = f->next;
+		free(f);
+	}
+	while ((f = s->doneFirst) != NULL) {
+		s->doneFirst = f->next;
+		free(f);
+	}
+	s->jobLast = s->doneLast = NULL;
+}
+
+/**
+ * @brief Serves the clients until ADSserverStop().
+ * @return 0 or an ADS error code
+ */
+int ADSserverRun(ADSServer *s)
+{
+	struct epoll_event ev[ADS_SERVER_EVENTS];
+	sigset_t all, old;
+	int i, n, slot, started, rc = 0;
+
+	s->running = 1;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);	// signals are for this one
+	for (started = 0; started < s->workers; started++)
+		if (pthread_create(&s->threads[started], NULL, _ADSserverWorker,
+						   s) != 0) {
+			MsgOut(MSG_ERROR, "ADS server: cannot start the workers\n");
+			rc = 0x1;
+			break;
+		}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	while (rc == 0 && !s->stop) {
+		n = epoll_wait(s->epfd, ev, ADS_SERVER_EVENTS, 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			MsgOut(MSG_ERROR,
+				   MsgStr("ADS server: epoll_wait() failed: %s\n",
+						  strerror(errno)));
+			rc = 0x1;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			slot = (int) ev[i].data.u64;
+			if (slot == ADS_SERVER_LISTEN)
+				_ADSserverAccept(s);
+			else if (slot == ADS_SERVER_WAKE)
+				_ADSserverWoken(s);
+			else if (s->conns[slot] == NULL || s->conns[slot]->dead)
+				continue;
+			else if (ev[i].events & EPOLLIN)
+				_ADSserverRead(s, slot);
+			else if (ev[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				_ADSserverKill(s, slot);
+			if (slot < ADS_SERVER_CONNS && s->conns[slot] != NULL
+				&& !s->conns[slot]->dead && (ev[i].events & EPOLLOUT))
+				_ADSserverFlush(s, slot);
+		}
+		for (slot = 0; slot < ADS_SERVER_CONNS; slot++)
+			if (s->conns[slot] != NULL && s->conns[slot]->dead)
+				_ADSserverClose(s, slot);
+	}
+	_ADSserverStopWorkers(s, started);
+	return rc;
+}
+
+/**
+ * @brief Makes ADSserverRun() return, may be called from a signal handler
+ * or another thread.
+ */
+void ADSserverStop(ADSServer *s)
+{
+	uint64_t one = 1;
+	ssize_t n;
+
+	s->stop = 1;
+	n = write(s->wakeFd, &one, sizeof(one));	// else within a second
+	(void) n;
+}
+
+/**
+ * @brief Closes the clients and frees s, after ADSserverRun() returned.
+ */
+void ADSserverFree(ADSServer *s)
+{
+	int i;
+
+	if (s == NULL)
+		return;
+	for (i = 0; i < ADS_SERVER_CONNS; i++)
+		if (s->conns[i] != NULL)
+			_ADSserverClose(s, i);
+	if (s->listenFd >= 0)
+		close(s->listenFd);
+	if (s->wakeFd >= 0)
+		close(s->wakeFd);
+	if (s->epfd >= 0)
+		close(s->epfd);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+/**
+ * @brief The statistics of s; call it on the thread of ADSserverRun(),
+ * or while that does not run.
+ */
+void ADSserverGetStats(ADSServer *s, ADSServerStats *stats)
+{
+	*stats = s->stats;
+	stats->errors = __atomic_load_n(&s->stats.errors, __ATOMIC_RELAXED);
+	stats->unhandled = __atomic_load_n(&s->stats.unhandled,
+									   __ATOMIC_RELAXED);
+}
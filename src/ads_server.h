@@ -0,0 +1,151 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_SERVER_H__
+#define __ADS_SERVER_H__
+
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+
+#define ADS_SERVER_CONNS	1024			// clients at the same time
+#define ADS_SERVER_GROUPS	64				// index group ranges with handlers
+#define ADS_SERVER_WORKERS	64				// most worker threads
+#define ADS_SERVER_PENDING	64				// requests of a client in the
+											// workers, then it is not read
+#define ADS_SERVER_MAXFRAME	(8 * MAXDATALEN)	// biggest packet accepted
+#define ADS_SERVER_MAXDATA	(ADS_SERVER_MAXFRAME - sizeof(AMS_TCPheader) \
+							 - sizeof(AMSheader) - 8)	// biggest answer
+
+/**
+ * A request as its handler sees it, and its answer. For reads, writes and
+ * readWrites the server parses the data: indexGroup, indexOffset, the data
+ * to write in data and room for what is read in out, outLength the bytes
+ * asked for. Any other command has all of its data in data, out is for
+ * what comes after the result in its answer. The handler sets outLength
+ * to what it put into out.
+ */
+typedef struct {
+	AMSheader		header;			// of the request, see targetPort
+	uint32_t		indexGroup;
+	uint32_t		indexOffset;
+	const unsigned char *data;		// to write
+	uint32_t		length;			// bytes in data
+	unsigned char	*out;			// the answer
+	uint32_t		outLength;		// room in out, then bytes in it
+} ADSServerRequest;
+
+/**
+ * Called on a worker thread, or on the one of ADSserverRun() without
+ * workers, with user as given at registration.
+ * Returns the result of the answer, 0 or an ADS error code.
+ */
+typedef int (*ADSServerHandler)(ADSServerRequest *rq, void *user);
+
+typedef struct {
+	uint32_t		first;			// index groups first .. last
+	uint32_t		last;
+	ADSServerHandler handler;
+	void			*user;
+} ADSServerGroups;
+
+typedef struct {
+	uint64_t		accepted;		// connections
+	uint64_t		requests;
+	uint64_t		responses;
+	uint64_t		errors;			// answered with a result other than 0
+	uint64_t		unhandled;		// of them, no handler for it
+	uint64_t		paused;			// a client was not read, its requests
+									// waited for the workers
+	int				connections;	// now
+} ADSServerStats;
+
+/**
+ * A request on its way to a worker, or its answer on the way back: the
+ * packet, and the client it is from or for, which may be gone by then.
+ */
+typedef struct _ADSServerFrame {
+	struct _ADSServerFrame *next;
+	int				conn;			// slot of the client
+	uint32_t		serial;			// of the client in the slot
+	uint32_t		len;			// bytes in data, 0: no answer
+	uint32_t		off;			// bytes of it sent already
+	unsigned char	data[];
+} ADSServerFrame;
+
+/**
+ * A client: a non blocking socket, the packets not complete yet and the
+ * answers not sent yet.
+ */
+typedef struct {
+	int				fd;
+	uint32_t		serial;
+	uint32_t		events;			// registered with epoll
+	int				dead;			// to be closed after this round
+	unsigned char	*rx;
+	uint32_t		rxLen;
+	ADSServerFrame	*txFirst, *txLast;
+	int				pending;		// requests in the workers
+} ADSServerConn;
+
+/**
+ * An ADS device of its own: one thread runs an event loop around epoll
+ * with all clients, the handlers run on a pool of workers. Requests go
+ * to the workers through jobs, the answers come back through done, an
+ * eventfd wakes the loop.
+ */
+typedef struct _ADSServer {
+	int				listenFd;
+	int				epfd;
+	int				wakeFd;			// eventfd, answers in done
+	ADSServerHandler commands[cmdADSreadWrite + 1];	// by commandId
+	void			*commandUser[cmdADSreadWrite + 1];
+	ADSServerGroups	groups[ADS_SERVER_GROUPS];	// sorted, not overlapping
+	int				nGroups;
+	ADSServerConn	*conns[ADS_SERVER_CONNS];
+	int				nextConn;		// where the search for a free one starts
+	uint32_t		nextSerial;
+	int				workers;
+	pthread_t		threads[ADS_SERVER_WORKERS];
+	pthread_mutex_t	lock;			// guards everything below
+	pthread_cond_t	cond;			// jobs came, or stop
+	ADSServerFrame	*jobFirst, *jobLast;
+	ADSServerFrame	*doneFirst, *doneLast;
+	int				running;		// the workers
+	volatile sig_atomic_t stop;
+	ADSServerStats	stats;
+} ADSServer;
+
+ADSServer *ADSserverNew(const char *address, int workers);
+int ADSserverOn(ADSServer *s, uint16_t commandId, ADSServerHandler handler,
+				void *user);
+int ADSserverOnGroups(ADSServer *s, uint32_t first, uint32_t last,
+					  ADSServerHandler handler, void *user);
+int ADSserverRun(ADSServer *s);
+void ADSserverStop(ADSServer *s);
+void ADSserverFree(ADSServer *s);
+void ADSserverGetStats(ADSServer *s, ADSServerStats *stats);
+
+#endif //__ADS_SERVER_H__
@@ -0,0 +1,202 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_shape.h"
+#include "debugprint.h"
+
+// shapers are never freed, a connection may hold on to one; the head
+// is read atomically to see whether there are any without the lock
+static ADSShaper *shapers = NULL;
+static pthread_mutex_t shapersLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* shapersLock held */
+static ADSShaper *_ADSshapeFindLocked(AmsNetId *netId, int port)
+{
+	ADSShaper *s;
+
+	for (s = shapers; s != NULL; s = s->next)
+		if (s->addr.port == port
+			&& memcmp(&s->addr.netId, netId, sizeof(AmsNetId)) == 0)
+			break;
+	return s;
+}
+
+static ADSShaper *_ADSshapeFind(AmsNetId *netId, int port)
+{
+	ADSShaper *s;
+
+	pthread_mutex_lock(&shapersLock);
+	s = _ADSshapeFindLocked(netId, port);
+	pthread_mutex_unlock(&shapersLock);
+	return s;
+}
+
+/**
+ * @brief Sets the budget for all requests to a device.
+ * @param requestsPerSec 0 for no limit
+ * @param bytesPerSec 0 for no limit; counts the request packet and the
+ * data it reads
+ * @param burstMs the buckets hold this much of the budget, at least one
+ * request
+ * @param policy ADS_SHAPE_QUEUE or ADS_SHAPE_FAIL
+ * @return 0 or an ADS error code
+ */
+int ADSshapeSet(AmsAddr *addr, double requestsPerSec, double bytesPerSec,
+				int burstMs, int policy)
+{
+	ADSShaper *s;
+
+	if (addr == NULL || requestsPerSec < 0 || bytesPerSec < 0 || burstMs < 0
+		|| (policy != ADS_SHAPE_QUEUE && policy != ADS_SHAPE_FAIL))
+		return 0x741;
+
+	pthread_mutex_lock(&shapersLock);
+	s = _ADSshapeFindLocked(&addr->netId, addr->port);
+	if (s == NULL) {
+		s = (ADSShaper *) calloc(1, sizeof(ADSShaper));
+		if (s == NULL) {
+			pthread_mutex_unlock(&shapersLock);
+			return 0x70A;
+		}
+		s->addr = *addr;
+		pthread_mutex_init(&s->lock, NULL);
+		s->next = shapers;
+		__atomic_store_n(&shapers, s, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&shapersLock);
+
+	pthread_mutex_lock(&s->lock);
+	s->policy = policy;
+	s->rate = requestsPerSec;
+	s->depth = requestsPerSec * burstMs / 1000.0;
+	if (s->depth < 1)
+		s->depth = 1;
+	s->tokens = s->depth;
+	s->byteRate = bytesPerSec;
+	s->byteDepth = bytesPerSec * burstMs / 1000.0;
+	if (s->byteDepth < 2 * MAXDATALEN)		// the biggest request fits
+		s->byteDepth = 2 * MAXDATALEN;
+	s->byteTokens = s->byteDepth;
+	s->last = 0;
+	pthread_mutex_unlock(&s->lock);
+
+	MsgOut(MSG_TRACE,
+		   MsgStr("ADSshapeSet(): port %d, %.1f requests/s, %.1f bytes/s, "
+				  "burst %d ms\n", addr->port, requestsPerSec, bytesPerSec,
+				  burstMs));
+	return 0;
+}
+
+int ADSshapeGetStats(AmsAddr *addr, ADSShapeStats *stats)
+{
+	ADSShaper *s = _ADSshapeFind(&addr->netId, addr->port);
+
+	memset(stats, 0, sizeof(ADSShapeStats));
+	if (s == NULL)
+		return 0x741;
+	pthread_mutex_lock(&s->lock);
+	*stats = s->stats;
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+}
+
+/*
+ * Bytes a request costs: the packet itself and the data it asks for.
+ */
+static double _ADSshapeCost(ADSpacket *p)
+{
+	double bytes = sizeof(AMS_TCPheader) + p->adsHeader.length;
+
+	if (p->amsHeader.commandId == cmdADSread)
+		bytes += ((ADSreadRequest *) p->data)->length;
+	else if (p->amsHeader.commandId == cmdADSreadWrite)
+		bytes += ((ADSreadWriteRequest *) p->data)->readLength;
+	return bytes;
+}
+
+/*
+ * Takes the tokens for a request to netId:port.
+ * Returns 0 and in *notBefore the time (CLOCK_MONOTONIC ns) the request may
+ * be sent, 0 for at once; or ADS_SHAPE_ERROR if it is over budget and the
+ * policy says fail.
+ */
+int _ADSshapeAdmit(AmsNetId *netId, int port, ADSpacket *p, int64_t now,
+				   int64_t *notBefore)
+{
+	ADSShaper *s;
+	double bytes, wait = 0, w;
+
+	*notBefore = 0;
+	if (__atomic_load_n(&shapers, __ATOMIC_ACQUIRE) == NULL
+		|| (s = _ADSshapeFind(netId, port)) == NULL)
+		return 0;
+	bytes = _ADSshapeCost(p);
+
+	pthread_mutex_lock(&s->lock);
+	if (s->last != 0 && now > s->last) {
+		s->tokens += s->rate * (now - s->last) / 1e9;
+		if (s->tokens > s->depth)
+			s->tokens = s->depth;
+		s->byteTokens += s->byteRate * (now - s->last) / 1e9;
+		if (s->byteTokens > s->byteDepth)
+			s->byteTokens = s->byteDepth;
+	}
+	if (now > s->last)
+		s->last = now;
+
+	// seconds until both buckets hold enough
+	if (s->rate > 0 && s->tokens < 1)
+		wait = (1 - s->tokens) / s->rate;
+	if (s->byteRate > 0 && s->byteTokens < bytes) {
+		w = (bytes - s->byteTokens) / s->byteRate;
+		if (w > wait)
+			wait = w;
+	}
+	if (wait > 0 && s->policy == ADS_SHAPE_FAIL) {
+		s->stats.rejected++;
+		pthread_mutex_unlock(&s->lock);
+		return ADS_SHAPE_ERROR;
+	}
+	if (s->rate > 0)
+		s->tokens -= 1;
+	if (s->byteRate > 0)
+		s->byteTokens -= bytes;
+	if (wait > 0) {
+		*notBefore = now + (int64_t)(wait * 1e9);
+		s->stats.delayed++;
+		s->stats.delay += (int64_t)(wait * 1e9);
+	}
+	else
+		s->stats.passed++;
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+}
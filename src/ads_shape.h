@@ -0,0 +1,78 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_SHAPE_H__
+#define __ADS_SHAPE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * What to do with a request over budget
+ */
+#define ADS_SHAPE_QUEUE		0	// delay it until the budget allows
+#define ADS_SHAPE_FAIL		1	// fail it at once with ADS_SHAPE_ERROR
+
+#define ADS_SHAPE_ERROR		0x502	// router: mailbox full
+
+typedef struct {
+	uint64_t	passed;			// sent at once
+	uint64_t	delayed;
+	uint64_t	rejected;
+	int64_t		delay;			// ns, sum of all delays
+} ADSShapeStats;
+
+/**
+ * Token buckets of one target device (AmsNetId and port), shared by all
+ * connections to it. One bucket counts requests, the other bytes on the
+ * wire both ways. Over budget requests take tokens in advance, so queued
+ * ones go out in order of arrival at exactly the configured rate.
+ */
+typedef struct _ADSShaper {
+	AmsAddr			addr;
+	pthread_mutex_t	lock;
+	int				policy;
+	double			rate;			// requests per second, 0 = no limit
+	double			depth;			// requests the bucket holds
+	double			tokens;
+	double			byteRate;		// bytes per second, 0 = no limit
+	double			byteDepth;
+	double			byteTokens;
+	int64_t			last;			// ns, last refill
+	ADSShapeStats	stats;
+	struct _ADSShaper *next;
+} ADSShaper;
+
+int ADSshapeSet(AmsAddr *addr, double requestsPerSec, double bytesPerSec,
+				int burstMs, int policy);
+int ADSshapeGetStats(AmsAddr *addr, ADSShapeStats *stats);
+
+/**
+	Prototypes, used by ads_async.c
+ */
+int _ADSshapeAdmit(AmsNetId *netId, int port, ADSpacket *p, int64_t now,
+				   int64_t *notBefore);
+
+#endif //__ADS_SHAPE_H__
@@ -0,0 +1,496 @@
+#define _GNU_SOURCE		// memfd_create()
+
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_io.h"
+#include "ads_shm.h"
+#include "debugprint.h"
+
+#define ADS_SHM_SEALS	(F_SEAL_SHRINK | F_SEAL_GROW)	// the router wants
+
+/*
+ * The client creates the shared memory and both eventfds and hands them
+ * to the router over a unix stream socket, which stays open: when one
+ * side goes away the other sees the socket shut down. The memory holds
+ * two rings, the first one from the client to the router:
+ *
+ *	ADSShmRing, ringSize bytes | ADSShmRing, ringSize bytes
+ *
+ * It is a memfd sealed against shrinking and growing; the router takes
+ * no other, a client cutting it short could otherwise kill the router
+ * with SIGBUS.
+ *
+ * Positions only grow, head - tail is what waits in a ring. A producer
+ * wakes the consumer only if it set waiting, and a consumer the producer
+ * only if it set full; both check again after setting the flag, so a
+ * wakeup is never lost and an idle link costs no system call at all.
+ */
+
+typedef struct {
+	uint32_t	magic;				// ADS_SHM_MAGIC
+	uint32_t	ringSize;
+} ADSShmHello;
+
+#define RING_BYTES(size)	(sizeof(ADSShmRing) + (size))
+
+static void _ADSshmWake(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADS shm: cannot wake the peer: %s\n", strerror(errno)));
+}
+
+/* the epoll set of ctl and wake, and the rings in l->map; 0 or -1 */
+static int _ADSshmSetup(ADSShmLink *l, uint32_t ringSize, int client)
+{
+	struct epoll_event ev;
+	ADSShmRing *first, *second;
+
+	first = (ADSShmRing *) l->map;
+	second = (ADSShmRing *)((char *) l->map + RING_BYTES(ringSize));
+	l->tx = client ? first : second;
+	l->rx = client ? second : first;
+	l->size = ringSize;
+
+	l->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (l->fd < 0)
+		return -1;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (epoll_ctl(l->fd, EPOLL_CTL_ADD, l->ctl, &ev) != 0
+		|| epoll_ctl(l->fd, EPOLL_CTL_ADD, l->wake, &ev) != 0)
+		return -1;
+	return 0;
+}
+
+static ADSShmLink *_ADSshmNew(void)
+{
+	ADSShmLink *l = (ADSShmLink *) calloc(1, sizeof(ADSShmLink));
+
+	if (l != NULL)
+		l->fd = l->ctl = l->wake = l->peer = -1;
+	return l;
+}
+
+/**
+ * @brief Connects to the router listening on the unix socket path, with
+ * rings of ringSize bytes each way.
+ * @return the link or NULL, the ADS error code in *adsError
+ */
+ADSShmLink *ADSshmConnect(const char *path, uint32_t ringSize, int *adsError)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	struct pollfd pfd;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} cbuf;
+	ADSShmHello hello;
+	ADSShmLink *l;
+	ADSShmRing *r;
+	int32_t status;
+	int i, mem = -1, fds[3];
+
+	*adsError = 0x741;
+	if (strlen(path) >= sizeof(addr.sun_path) || ringSize < 8 * MAXDATALEN
+		|| (ringSize & (ringSize - 1)) != 0)
+		return NULL;
+	*adsError = 0x70A;
+	l = _ADSshmNew();
+	if (l == NULL)
+		return NULL;
+	*adsError = 0x1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	l->ctl = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (l->ctl < 0
+		|| connect(l->ctl, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		MsgOut(MSG_ERROR,
+			   MsgStr("ADSshmConnect(): cannot connect to %s: %s\n", path,
+					  strerror(errno)));
+		goto fail;
+	}
+
+	l->mapLen = 2 * RING_BYTES(ringSize);
+	mem = memfd_create("libads", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	// sealed to its size, the router would die of SIGBUS if it shrank
+	if (mem < 0 || ftruncate(mem, l->mapLen) != 0
+		|| fcntl(mem, F_ADD_SEALS, ADS_SHM_SEALS | F_SEAL_SEAL) != 0)
+		goto fail;
+	l->map = mmap(NULL, l->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, mem, 0);
+	if (l->map == MAP_FAILED) {
+		l->map = NULL;
+		goto fail;
+	}
+	for (i = 0; i < 2; i++) {
+		r = (ADSShmRing *)((char *) l->map + i * RING_BYTES(ringSize));
+		r->size = ringSize;
+		r->waiting = 1;		// no consumer has looked yet
+	}
+	l->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	l->peer = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (l->wake < 0 || l->peer < 0 || _ADSshmSetup(l, ringSize, 1) != 0)
+		goto fail;
+
+	// the router's wake is our peer and the other way round
+	fds[0] = mem;
+	fds[1] = l->peer;
+	fds[2] = l->wake;
+	hello.magic = ADS_SHM_MAGIC;
+	hello.ringSize = ringSize;
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	if (sendmsg(l->ctl, &msg, MSG_NOSIGNAL) != sizeof(hello))
+		goto fail;
+	close(mem);
+	mem = -1;
+
+	pfd.fd = l->ctl;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 5000) != 1
+		|| recv(l->ctl, &status, sizeof(status), 0) != sizeof(status)
+		|| status != 0) {
+		MsgOut(MSG_ERROR, "ADSshmConnect(): the router refused the link\n");
+		goto fail;
+	}
+	MsgOut(MSG_SOCKET, MsgStr("ADSshmConnect() connected to %s\n", path));
+	*adsError = 0;
+	return l;
+
+fail:
+	if (mem >= 0)
+		close(mem);
+	ADSshmClose(l);
+	return NULL;
+}
+
+/**
+ * @brief The router's side of ADSshmConnect(): takes the memory and the
+ * eventfds the client sent over ctl, which becomes part of the link.
+ * @return the link, or NULL with errno EAGAIN if they are not there yet,
+ * or another errno; then ctl is to be closed
+ */
+ADSShmLink *ADSshmAccept(int ctl)
+{
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	struct stat st;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} cbuf;
+	ADSShmHello hello;
+	ADSShmLink *l;
+	int32_t status = 1;
+	int fds[3] = { -1, -1, -1 }, seals;
+	ssize_t n;
+
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+	n = recvmsg(ctl, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (n < 0)
+		return NULL;
+	cm = CMSG_FIRSTHDR(&msg);
+	if (cm != NULL && cm->cmsg_level == SOL_SOCKET
+		&& cm->cmsg_type == SCM_RIGHTS && cm->cmsg_len == CMSG_LEN(sizeof(fds)))
+		memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+	l = _ADSshmNew();
+	if (l == NULL) {
+		errno = ENOMEM;
+		goto refuse;
+	}
+	errno = EPROTO;
+	if (n != sizeof(hello) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+		|| fds[0] < 0 || hello.magic != ADS_SHM_MAGIC
+		|| hello.ringSize < 8 * MAXDATALEN
+		|| (hello.ringSize & (hello.ringSize - 1)) != 0
+		|| (seals = fcntl(fds[0], F_GET_SEALS)) < 0
+		|| (seals & ADS_SHM_SEALS) != ADS_SHM_SEALS
+		|| fstat(fds[0], &st) != 0
+		|| st.st_size != 2 * RING_BYTES(hello.ringSize))
+		goto refuse;
+	l->mapLen = st.st_size;
+	l->map = mmap(NULL, l->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED,
+				  fds[0], 0);
+	if (l->map == MAP_FAILED) {
+		l->map = NULL;
+		goto refuse;
+	}
+	close(fds[0]);
+	l->ctl = ctl;
+	l->wake = fds[1];
+	l->peer = fds[2];
+	fds[0] = fds[1] = fds[2] = -1;		// the link's now
+	if (_ADSshmSetup(l, hello.ringSize, 0) != 0) {
+		l->ctl = -1;					// but ctl stays the caller's
+		goto refuse;
+	}
+	status = 0;
+	if (send(ctl, &status, sizeof(status), MSG_NOSIGNAL) != sizeof(status)) {
+		l->ctl = -1;
+		ADSshmClose(l);
+		return NULL;
+	}
+	return l;
+
+refuse:
+	if (send(ctl, &status, sizeof(status), MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+		MsgOut(MSG_ERROR, "ADSshmAccept(): cannot refuse the link\n");
+	for (n = 0; n < 3; n++)
+		if (fds[n] >= 0)
+			close(fds[n]);
+	if (l != NULL) {
+		n = errno;
+		ADSshmClose(l);
+		errno = n;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Unmaps the memory and closes all descriptors of the link.
+ */
+void ADSshmClose(ADSShmLink *l)
+{
+	if (l == NULL)
+		return;
+	if (l->map != NULL)
+		munmap(l->map, l->mapLen);
+	if (l->fd >= 0)
+		close(l->fd);
+	if (l->ctl >= 0)
+		close(l->ctl);
+	if (l->wake >= 0)
+		close(l->wake);
+	if (l->peer >= 0)
+		close(l->peer);
+	free(l);
+}
+
+/**
+ * @brief Puts len bytes into the ring towards the peer, all or nothing.
+ * @return 1, 0 if there is no room yet, the peer wakes us when it made
+ * some, -1 if len does not fit at all
+ */
+int ADSshmPut(ADSShmLink *l, const void *data, uint32_t len)
+{
+	ADSShmRing *r = l->tx;
+	uint64_t head = r->head, tail;
+	uint32_t off, n;
+
+	if (len > l->size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (l->size - (head - tail) < len) {
+		__atomic_store_n(&r->full, 1, __ATOMIC_SEQ_CST);
+		tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+		if (l->size - (head - tail) < len)
+			return 0;
+		__atomic_store_n(&r->full, 0, __ATOMIC_RELAXED);
+	}
+	off = head & (l->size - 1);
+	n = len < l->size - off ? len : l->size - off;
+	memcpy(r->data + off, data, n);
+	memcpy(r->data, (const char *) data + n, len - n);
+	__atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->waiting, __ATOMIC_RELAXED))
+		_ADSshmWake(l->peer);
+	return 1;
+}
+
+/**
+ * @brief Takes up to len bytes out of the ring from the peer.
+ * @return bytes taken, 0 if it is empty, then the peer wakes us when it
+ * puts something, -1 if the ring is corrupt
+ */
+int ADSshmGet(ADSShmLink *l, void *data, uint32_t len)
+{
+	ADSShmRing *r = l->rx;
+	uint64_t tail = r->tail, head;
+	uint32_t off, n;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		__atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+		head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+		if (head == tail)
+			return 0;
+	}
+	if (r->waiting)
+		__atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+	if (head - tail > l->size) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (len > head - tail)
+		len = head - tail;
+	off = tail & (l->size - 1);
+	n = len < l->size - off ? len : l->size - off;
+	memcpy(data, r->data + off, n);
+	memcpy((char *) data + n, r->data, len - n);
+	__atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->full, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&r->full, 0, __ATOMIC_RELAXED);
+		_ADSshmWake(l->peer);
+	}
+	return len;
+}
+
+/* 0 while the peer is there; it never writes ctl after the hello */
+static int _ADSshmGone(ADSShmLink *l)
+{
+	char c;
+	ssize_t n;
+
+	n = recv(l->ctl, &c, 1, MSG_DONTWAIT | MSG_PEEK);
+	return n >= 0 || (errno != EAGAIN && errno != EINTR);
+}
+
+/**
+ * @brief Sends len bytes, waiting up to timeout ms (0: for ever) for room.
+ * The peer's wakeups go to whoever polls l->fd, so this one sleeps.
+ * @return len or -1, errno set
+ */
+int ADSshmSend(ADSShmLink *l, const void *data, uint32_t len, int timeout)
+{
+	struct timespec t = { 0, 20000 };	// 20 us, doubled up to 1 ms
+	long slept = 0;
+	int rc;
+
+	while ((rc = ADSshmPut(l, data, len)) == 0) {
+		if (_ADSshmGone(l)) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (timeout > 0 && slept / 1000000 >= timeout) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		nanosleep(&t, NULL);
+		slept += t.tv_nsec;
+		if (t.tv_nsec < 1000000)
+			t.tv_nsec *= 2;
+	}
+	return rc < 0 ? -1 : (int) len;
+}
+
+/**
+ * @brief Receives like recv() on a non blocking socket: bytes read, 0 if
+ * the peer is gone, -1 with errno EAGAIN if there is nothing yet; poll
+ * l->fd for more. l->fd stays readable while the ring holds data.
+ */
+int ADSshmRecv(ADSShmLink *l, void *data, uint32_t len)
+{
+	uint64_t count;
+	int n;
+
+	n = ADSshmGet(l, data, len);
+	if (n == 0) {
+		if (read(l->wake, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			return -1;
+		n = ADSshmGet(l, data, len);
+		if (n == 0) {
+			if (_ADSshmGone(l))
+				return 0;
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	if (n > 0 && __atomic_load_n(&l->rx->head, __ATOMIC_ACQUIRE)
+				 != l->rx->tail)
+		_ADSshmWake(l->wake);	// more than fitted, come back
+	return n;
+}
+
+static int _ADSshmTxSend(ADSInterface *di, const void *buffer, int len)
+{
+	return ADSshmSend((ADSShmLink *) di->link, buffer, len, di->timeout);
+}
+
+static int _ADSshmTxRecv(ADSInterface *di, void *buffer, int len)
+{
+	return ADSshmRecv((ADSShmLink *) di->link, buffer, len);
+}
+
+static void _ADSshmTxClose(ADSInterface *di)
+{
+	ADSshmClose((ADSShmLink *) di->link);
+	di->link = NULL;
+}
+
+/**
+ * Interfaces to the local router over shared memory: sd is the fd of the
+ * link, link the link. Nothing is pending, l->fd stays readable instead.
+ */
+const ADSTransport ADSshmTransport = {
+	"shm", _ADSshmTxSend, _ADSshmTxRecv, _ADSshmTxClose, NULL
+};
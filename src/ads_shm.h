@@ -0,0 +1,85 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_SHM_H__
+#define __ADS_SHM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ads_io.h"
+
+#define ADS_SHM_PREFIX		"shm:"				// router address prefix
+#define ADS_SHM_PATH		"/tmp/adsrouter.shm"	// default socket of the router
+#define ADS_SHM_RINGSIZE	(512 * 1024)		// bytes per direction, power of 2
+#define ADS_SHM_MAGIC		0x4d485341			// "ASHM"
+#define ADS_SHM_LINE		64					// keeps the two sides apart
+
+/**
+ * One direction of a link: a byte ring carrying the AMS/TCP stream, one
+ * producer, one consumer, in memory shared by the two processes.
+ */
+typedef struct {
+	uint32_t		size;			// bytes in data, a power of 2
+
+	// written by the producer
+	uint64_t		head __attribute__((aligned(ADS_SHM_LINE)));
+	int				full;			// the producer waits for room
+
+	// written by the consumer
+	uint64_t		tail __attribute__((aligned(ADS_SHM_LINE)));
+	int				waiting;		// the consumer waits for data
+
+	unsigned char	data[] __attribute__((aligned(ADS_SHM_LINE)));
+} ADSShmRing;
+
+/**
+ * A client process and the router, talking through two rings. Each side
+ * is woken through its own eventfd, only when it said it waits; the unix
+ * socket the fds came over tells when the other side is gone. fd is what
+ * to poll, an epoll set of both.
+ */
+typedef struct _ADSShmLink {
+	int				fd;				// epoll set of ctl and wake
+	int				ctl;			// unix stream socket to the peer
+	int				wake;			// eventfd, the peer wakes us
+	int				peer;			// eventfd, we wake the peer
+	void			*map;
+	size_t			mapLen;
+	uint32_t		size;			// of each ring, ours, not the peer's
+	ADSShmRing		*tx, *rx;
+} ADSShmLink;
+
+ADSShmLink *ADSshmConnect(const char *path, uint32_t ringSize, int *adsError);
+ADSShmLink *ADSshmAccept(int ctl);
+void ADSshmClose(ADSShmLink *l);
+int ADSshmPut(ADSShmLink *l, const void *data, uint32_t len);
+int ADSshmGet(ADSShmLink *l, void *data, uint32_t len);
+int ADSshmSend(ADSShmLink *l, const void *data, uint32_t len, int timeout);
+int ADSshmRecv(ADSShmLink *l, void *data, uint32_t len);
+
+extern const ADSTransport ADSshmTransport;
+
+#endif //__ADS_SHM_H__
@@ -0,0 +1,554 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_wqueue.h"
+#include "ads_cache.h"
+#include "debugprint.h"
+
+// biggest span: it has to fit a sum write with its 12 byte address
+#define ADS_WQ_CHUNK	(MAXDATALEN - sizeof(AMS_TCPheader) \
+						 - sizeof(AMSheader) - 16 - 12)
+// what a sum write request can carry
+#define ADS_WQ_SUM_MAX	(MAXDATALEN - sizeof(AMS_TCPheader) \
+						 - sizeof(AMSheader) - 16)
+
+/**
+ * One request on the way: a plain write of one span or a sum write of
+ * several.
+ */
+typedef struct {
+	ADSRequest		rq;
+	ADSWriteFlush	*f;
+	int				first;			// spans f->spans[first .. first+n-1]
+	int				n;
+	int				sum;
+	ADSpacket		packet;
+} ADSWriteBatch;
+
+static unsigned int _ADSwqueueHash(uint32_t indexGroup, uint32_t indexOffset)
+{
+	return (indexGroup * 31 + indexOffset) & (ADS_WQUEUE_HASH - 1);
+}
+
+static void *_ADSwqueueThread(void *arg);
+
+/**
+ * @brief Creates the write queue of a connection and starts its engine.
+ * @param flushTime ms a put waits for more puts before the queue is sent;
+ * 0 means the queue is only sent by ADSwqueueFlush().
+ */
+ADSWriteQueue *ADSwqueueNew(ADSConnection *dc, int flushTime)
+{
+	ADSWriteQueue *q;
+
+	if (flushTime < 0 || ADSasyncStart(dc) != 0)
+		return NULL;
+	q = (ADSWriteQueue *) calloc(1, sizeof(ADSWriteQueue));
+	if (q == NULL)
+		return NULL;
+	q->dc = dc;
+	q->flushTime = flushTime;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	if (flushTime > 0) {
+		q->running = 1;
+		if (pthread_create(&q->thread, NULL, _ADSwqueueThread, q) != 0) {
+			MsgOut(MSG_ERROR, "ADSwqueueNew(): pthread_create() failed\n");
+			pthread_cond_destroy(&q->cond);
+			pthread_mutex_destroy(&q->lock);
+			free(q);
+			return NULL;
+		}
+	}
+	return q;
+}
+
+/**
+ * @brief Sends what is pending, waits for it and frees the queue.
+ */
+void ADSwqueueFree(ADSWriteQueue *q)
+{
+	if (q == NULL)
+		return;
+	pthread_mutex_lock(&q->lock);
+	if (q->running) {
+		q->running = 0;
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+		pthread_join(q->thread, NULL);
+	}
+	else
+		pthread_mutex_unlock(&q->lock);
+	ADSwqueueDrain(q);
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
+
+/**
+ * @brief Queues a write. If a write to the same address and length is
+ * pending, its data is replaced and both complete together.
+ * @param done may be NULL
+ * @return 0 or an ADS error code
+ */
+int ADSwqueuePut(ADSWriteQueue *q, uint32_t indexGroup, uint32_t indexOffset,
+				 uint32_t length, const void *data, ADSWriteDone done,
+				 void *user)
+{
+	ADSWriteWaiter *wt = NULL;
+	ADSWrite *w;
+	unsigned int h;
+
+	if (length == 0 || length > ADS_WQ_CHUNK)
+		return 0x705;	// parameter size not correct
+	if (data == NULL)
+		return 0x741;
+	if (done != NULL) {
+		wt = (ADSWriteWaiter *) malloc(sizeof(ADSWriteWaiter));
+		if (wt == NULL)
+			return 0x70A;
+		wt->done = done;
+		wt->user = user;
+	}
+
+	h = _ADSwqueueHash(indexGroup, indexOffset);
+	pthread_mutex_lock(&q->lock);
+	for (w = q->hash[h]; w != NULL; w = w->hnext)
+		if (w->indexGroup == indexGroup && w->indexOffset == indexOffset
+			&& w->length == length)
+			break;
+	if (w != NULL)
+		q->stats.coalesced++;
+	else {
+		w = (ADSWrite *) malloc(sizeof(ADSWrite) + length);
+		if (w == NULL) {
+			pthread_mutex_unlock(&q->lock);
+			free(wt);
+			return 0x70A;
+		}
+		w->indexGroup = indexGroup;
+		w->indexOffset = indexOffset;
+		w->length = length;
+		w->data = (unsigned char *)(w + 1);
+		w->waiters = NULL;
+		w->hnext = q->hash[h];
+		q->hash[h] = w;
+		if (q->nPending++ == 0)
+			pthread_cond_broadcast(&q->cond);	// starts the flush timer
+	}
+	memcpy(w->data, data, length);
+	w->seq = ++q->seq;
+	if (wt != NULL) {
+		wt->next = w->waiters;
+		w->waiters = wt;
+	}
+	q->stats.puts++;
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+/*
+ * Reports the result to the waiters of every write of the flush and
+ * frees it. Called when the last request of the flush came back.
+ */
+static void _ADSwqueueRelease(ADSWriteFlush *f)
+{
+	ADSWriteQueue *q = f->q;
+	ADSWriteWaiter *wt;
+	ADSWrite *w;
+	int i, k, result, errors = 0;
+
+	if (__atomic_sub_fetch(&f->pending, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	for (i = 0; i < f->nWrites; i++) {
+		w = f->writes[i];
+		result = f->result;
+		for (k = w->firstSpan; k <= w->lastSpan && result == 0; k++)
+			result = f->spans[k].result;
+		if (result != 0)
+			errors++;
+		while ((wt = w->waiters) != NULL) {
+			w->waiters = wt->next;
+			wt->done(wt->user, result);
+			free(wt);
+		}
+		free(w);
+	}
+	free(f->writes);
+	free(f->spans);
+	free(f->image);
+	free(f);
+
+	pthread_mutex_lock(&q->lock);
+	q->stats.errors += errors;
+	q->flushing--;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void _ADSwqueueSubmit(ADSWriteFlush *f, int first, int n);
+
+static void _ADSwqueueDone(ADSRequest *rq, ADSpacket *answer)
+{
+	ADSWriteBatch *b = (ADSWriteBatch *) rq->user;
+	ADSWriteFlush *f = b->f;
+	ADSreadWriteResponse *rw;
+	uint32_t *codes;
+	int err = rq->result, k;
+
+	if (answer == NULL && err == 0)
+		err = 0x1;
+	if (err == 0 && b->sum) {
+		rw = (ADSreadWriteResponse *) answer->data;
+		err = rw->result;
+		if (err == 0x701 || err == 0x702) {		// service not supported,
+			MsgOut(MSG_ERROR,					// invalid index group
+				   MsgStr("ADSwqueue: sum write refused (0x%x), "
+						  "falling back to single writes\n", err));
+			f->q->noSum = 1;
+			for (k = 0; k < b->n; k++)
+				_ADSwqueueSubmit(f, b->first + k, 1);
+			free(b);
+			_ADSwqueueRelease(f);
+			return;
+		}
+		if (err == 0 && rw->length < 4 * b->n)
+			err = 0x705;
+		if (err == 0) {
+			codes = (uint32_t *) rw->data;
+			for (k = 0; k < b->n; k++)
+				f->spans[b->first + k].result = codes[k];
+		}
+	}
+	else if (err == 0)
+		err = ((ADSwriteResponse *) answer->data)->result;
+
+	if (err != 0)
+		for (k = 0; k < b->n; k++)
+			f->spans[b->first + k].result = err;
+	for (k = 0; k < b->n; k++)
+		_ADScacheInvalidate(f->q->dc, ADS_CACHE_READ,
+							f->spans[b->first + k].indexGroup,
+							f->spans[b->first + k].indexOffset,
+							f->spans[b->first + k].length);
+	free(b);
+	_ADSwqueueRelease(f);
+}
+
+/*
+ * Sends spans first .. first+n-1 as plain write if n is 1, else as sum
+ * write.
+ */
+static void _ADSwqueueSubmit(ADSWriteFlush *f, int first, int n)
+{
+	ADSWriteQueue *q = f->q;
+	ADSWriteSpan *sp = f->spans + first;
+	ADSreadRequest *addr;
+	uint32_t *rw;
+	ADSWriteBatch *b;
+	ADSpacket *p;
+	unsigned char *d;
+	uint32_t bytes = 0;
+	int rc, k;
+
+	b = (ADSWriteBatch *) malloc(sizeof(ADSWriteBatch));
+	if (b == NULL) {
+		for (k = 0; k < n; k++)
+			sp[k].result = 0x70A;
+		return;
+	}
+	b->f = f;
+	b->first = first;
+	b->n = n;
+	b->sum = n > 1;
+
+	p = &b->packet;
+	_ADSsetupAmsHeader(q->dc, &p->amsHeader);
+	if (!b->sum) {
+		// an ADSwriteRequest, the data right after the address
+		p->amsHeader.commandId = cmdADSwrite;
+		addr = (ADSreadRequest *) p->data;
+		addr->indexGroup = sp->indexGroup;
+		addr->indexOffset = sp->indexOffset;
+		addr->length = sp->length;
+		memcpy(addr + 1, f->image + sp->imageOffset, sp->length);
+		bytes = sp->length;
+		p->amsHeader.dataLength = 12 + sp->length;
+	}
+	else {
+		// an ADSreadWriteRequest: its 16 byte header, the addresses, the data
+		p->amsHeader.commandId = cmdADSreadWrite;
+		rw = (uint32_t *) p->data;
+		addr = (ADSreadRequest *)(rw + 4);
+		d = (unsigned char *)(addr + n);
+		for (k = 0; k < n; k++) {
+			addr[k].indexGroup = sp[k].indexGroup;
+			addr[k].indexOffset = sp[k].indexOffset;
+			addr[k].length = sp[k].length;
+			memcpy(d + bytes, f->image + sp[k].imageOffset, sp[k].length);
+			bytes += sp[k].length;
+		}
+		rw[0] = ADSIGRP_SUMUP_WRITE;
+		rw[1] = n;								// index offset: count
+		rw[2] = 4 * n;							// read length
+		rw[3] = n * sizeof(ADSreadRequest) + bytes;	// write length
+		p->amsHeader.dataLength = 16 + rw[3];
+	}
+	p->adsHeader.length = sizeof(AMSheader) + p->amsHeader.dataLength;
+	p->adsHeader.reserved = 0;
+
+	b->rq.packet = p;
+	b->rq.done = _ADSwqueueDone;
+	b->rq.user = b;
+
+	pthread_mutex_lock(&q->lock);
+	q->stats.requests++;
+	if (b->sum)
+		q->stats.sumWrites++;
+	q->stats.bytes += bytes;
+	pthread_mutex_unlock(&q->lock);
+
+	__atomic_add_fetch(&f->pending, 1, __ATOMIC_ACQ_REL);
+	rc = ADSasyncSubmit(q->dc, &b->rq);
+	if (rc != 0) {
+		b->rq.result = rc;
+		_ADSwqueueDone(&b->rq, NULL);
+	}
+}
+
+static int _ADSwqueueByAddress(const void *a, const void *b)
+{
+	const ADSWrite *x = *(ADSWrite * const *) a;
+	const ADSWrite *y = *(ADSWrite * const *) b;
+
+	if (x->indexGroup != y->indexGroup)
+		return x->indexGroup < y->indexGroup ? -1 : 1;
+	if (x->indexOffset != y->indexOffset)
+		return x->indexOffset < y->indexOffset ? -1 : 1;
+	return 0;
+}
+
+static int _ADSwqueueBySeq(const void *a, const void *b)
+{
+	const ADSWrite *x = *(ADSWrite * const *) a;
+	const ADSWrite *y = *(ADSWrite * const *) b;
+
+	return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+/*
+ * Merges the writes of a flush into contiguous runs, paints them into the
+ * image in the order of the puts so the later one wins where they
+ * overlap, and cuts the runs into spans.
+ */
+static int _ADSwqueueBuild(ADSWriteFlush *f)
+{
+	ADSWrite **w = f->writes, *x;
+	uint32_t start, end, total = 0, off, len;
+	int i, j, k, maxSpans;
+
+	qsort(w, f->nWrites, sizeof(ADSWrite *), _ADSwqueueByAddress);
+
+	// the runs and where the writes go in the image
+	maxSpans = 0;
+	for (i = 0; i < f->nWrites; i = j) {
+		start = w[i]->indexOffset;
+		end = start + w[i]->length;
+		for (j = i + 1; j < f->nWrites && w[j]->indexGroup == w[i]->indexGroup
+			 && w[j]->indexOffset <= end; j++)
+			if (w[j]->indexOffset + w[j]->length > end)
+				end = w[j]->indexOffset + w[j]->length;
+		for (k = i; k < j; k++)
+			w[k]->imageOffset = total + w[k]->indexOffset - start;
+		total += end - start;
+		maxSpans += (end - start + ADS_WQ_CHUNK - 1) / ADS_WQ_CHUNK;
+	}
+
+	f->image = (unsigned char *) malloc(total);
+	f->spans = (ADSWriteSpan *) calloc(maxSpans, sizeof(ADSWriteSpan));
+	if (f->image == NULL || f->spans == NULL)
+		return 0x70A;
+
+	// cut the runs into spans, still sorted by address
+	for (i = 0; i < f->nWrites; i = j) {
+		start = w[i]->indexOffset;
+		end = start + w[i]->length;
+		for (j = i + 1; j < f->nWrites && w[j]->indexGroup == w[i]->indexGroup
+			 && w[j]->indexOffset <= end; j++)
+			if (w[j]->indexOffset + w[j]->length > end)
+				end = w[j]->indexOffset + w[j]->length;
+		for (off = 0; off < end - start; off += len) {
+			len = end - start - off;
+			if (len > ADS_WQ_CHUNK)
+				len = ADS_WQ_CHUNK;
+			f->spans[f->nSpans].indexGroup = w[i]->indexGroup;
+			f->spans[f->nSpans].indexOffset = start + off;
+			f->spans[f->nSpans].length = len;
+			f->spans[f->nSpans].imageOffset = w[i]->imageOffset + off;
+			f->nSpans++;
+		}
+		// the spans each write of the run ends up in
+		for (k = i; k < j; k++) {
+			x = w[k];
+			x->firstSpan = f->nSpans - 1;
+			while (f->spans[x->firstSpan].imageOffset > x->imageOffset)
+				x->firstSpan--;
+			x->lastSpan = x->firstSpan;
+			while (f->spans[x->lastSpan].imageOffset
+				   + f->spans[x->lastSpan].length < x->imageOffset + x->length)
+				x->lastSpan++;
+		}
+	}
+
+	qsort(w, f->nWrites, sizeof(ADSWrite *), _ADSwqueueBySeq);
+	for (i = 0; i < f->nWrites; i++)
+		memcpy(f->image + w[i]->imageOffset, w[i]->data, w[i]->length);
+	return 0;
+}
+
+/**
+ * @brief Sends all pending writes now, without waiting for the answers.
+ * @return 0 or an ADS error code; the writes got it as result then.
+ */
+int ADSwqueueFlush(ADSWriteQueue *q)
+{
+	ADSWriteFlush *f;
+	ADSWrite *w;
+	uint32_t bytes;
+	int i, n, rc;
+
+	f = (ADSWriteFlush *) calloc(1, sizeof(ADSWriteFlush));
+	if (f == NULL)
+		return 0x70A;
+	f->q = q;
+	pthread_mutex_lock(&q->lock);
+	if (q->nPending == 0) {
+		pthread_mutex_unlock(&q->lock);
+		free(f);
+		return 0;
+	}
+	f->writes = (ADSWrite **) malloc(q->nPending * sizeof(ADSWrite *));
+	if (f->writes == NULL) {
+		pthread_mutex_unlock(&q->lock);
+		free(f);
+		return 0x70A;
+	}
+	for (i = 0; i < ADS_WQUEUE_HASH; i++) {
+		for (w = q->hash[i]; w != NULL; w = w->hnext)
+			f->writes[f->nWrites++] = w;
+		q->hash[i] = NULL;
+	}
+	q->nPending = 0;
+	q->flushing++;
+	q->stats.flushes++;
+	pthread_mutex_unlock(&q->lock);
+
+	// one reference for us until all requests are sent
+	f->pending = 1;
+	rc = _ADSwqueueBuild(f);
+	if (rc != 0) {
+		MsgOut(MSG_ERROR, "ADSwqueueFlush(): out of memory\n");
+		f->result = rc;
+		_ADSwqueueRelease(f);
+		return rc;
+	}
+
+	for (i = 0; i < f->nSpans; i += n) {
+		bytes = f->spans[i].length;
+		for (n = 1; i + n < f->nSpans && !q->noSum; n++) {
+			bytes += f->spans[i + n].length;
+			if ((n + 1) * sizeof(ADSreadRequest) + bytes > ADS_WQ_SUM_MAX)
+				break;
+		}
+		_ADSwqueueSubmit(f, i, n);
+	}
+	_ADSwqueueRelease(f);
+	return 0;
+}
+
+/**
+ * @brief Flushes and waits until every write flushed so far is done.
+ * Must not be called from a completion callback.
+ */
+int ADSwqueueDrain(ADSWriteQueue *q)
+{
+	int rc = ADSwqueueFlush(q);
+
+	pthread_mutex_lock(&q->lock);
+	while (q->flushing > 0)
+		pthread_cond_wait(&q->cond, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+	return rc;
+}
+
+void ADSwqueueGetStats(ADSWriteQueue *q, ADSWriteQueueStats *stats)
+{
+	pthread_mutex_lock(&q->lock);
+	*stats = q->stats;
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Sends the queue flushTime ms after the first put into an empty queue,
+ * so a burst of puts goes out together.
+ */
+static void *_ADSwqueueThread(void *arg)
+{
+	ADSWriteQueue *q = (ADSWriteQueue *) arg;
+	struct timespec t;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->running) {
+		if (q->nPending == 0) {
+			pthread_cond_wait(&q->cond, &q->lock);
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &t);
+		t.tv_sec += q->flushTime / 1000;
+		t.tv_nsec += (q->flushTime % 1000) * 1000000L;
+		if (t.tv_nsec >= 1000000000L) {
+			t.tv_sec++;
+			t.tv_nsec -= 1000000000L;
+		}
+		while (q->running
+			   && pthread_cond_timedwait(&q->cond, &q->lock, &t) != ETIMEDOUT)
+			;
+		pthread_mutex_unlock(&q->lock);
+		ADSwqueueFlush(q);
+		pthread_mutex_lock(&q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
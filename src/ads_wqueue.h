@@ -0,0 +1,131 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ADS_WQUEUE_H__
+#define __ADS_WQUEUE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ads_async.h"
+
+#define ADS_WQUEUE_HASH		256		// buckets of the pending writes
+
+/**
+ * Called from the receive thread when the write, or the newer one that
+ * replaced it, went to the device; or failed. Must not call the
+ * synchronous functions of the same connection.
+ */
+typedef void (*ADSWriteDone)(void *user, int result);
+
+typedef struct _ADSWriteWaiter {
+	ADSWriteDone	done;
+	void			*user;
+	struct _ADSWriteWaiter *next;
+} ADSWriteWaiter;
+
+/**
+ * The latest value for one address, and everybody waiting for it.
+ */
+typedef struct _ADSWrite {
+	uint32_t		indexGroup;
+	uint32_t		indexOffset;
+	uint32_t		length;
+	uint64_t		seq;			// order of the puts, the later one wins
+	unsigned char	*data;
+	ADSWriteWaiter	*waiters;
+	int				firstSpan;		// spans of the flush carrying it
+	int				lastSpan;
+	uint32_t		imageOffset;
+	struct _ADSWrite *hnext;
+} ADSWrite;
+
+typedef struct {
+	uint32_t	indexGroup;
+	uint32_t	indexOffset;
+	uint32_t	length;
+	uint32_t	imageOffset;	// where the data is in the flush image
+	int			result;
+} ADSWriteSpan;
+
+typedef struct _ADSWriteQueue ADSWriteQueue;
+
+/**
+ * All writes taken by one flush: merged into contiguous runs in image,
+ * cut into spans that fit a packet.
+ */
+typedef struct {
+	ADSWriteQueue	*q;
+	ADSWrite		**writes;
+	int				nWrites;
+	unsigned char	*image;
+	ADSWriteSpan	*spans;
+	int				nSpans;
+	int				pending;		// requests on the way
+	int				result;			// set if the flush failed as a whole
+} ADSWriteFlush;
+
+typedef struct {
+	uint64_t	puts;
+	uint64_t	coalesced;		// puts replaced by a later one before a flush
+	uint64_t	flushes;
+	uint64_t	requests;		// plain and sum writes sent
+	uint64_t	sumWrites;
+	uint64_t	bytes;			// data bytes sent
+	uint64_t	errors;			// writes completed with an error
+} ADSWriteQueueStats;
+
+/**
+ * Write coalescing queue of one connection. Puts to an address that has
+ * a write pending replace its value, so a burst of writes sends only the
+ * last one. A flush merges the pending writes into contiguous ranges and
+ * sends them as ADSIGRP_SUMUP_WRITE requests through the asynchronous
+ * engine; every put still gets its completion.
+ */
+struct _ADSWriteQueue {
+	ADSConnection	*dc;
+	int				flushTime;		// ms a put may wait for more, 0: manual
+	int				noSum;			// the device refused ADSIGRP_SUMUP_WRITE
+	pthread_t		thread;
+	int				running;
+	pthread_mutex_t	lock;			// guards everything below
+	pthread_cond_t	cond;
+	ADSWrite		*hash[ADS_WQUEUE_HASH];
+	int				nPending;
+	uint64_t		seq;
+	int				flushing;		// flushes on the way
+	ADSWriteQueueStats stats;
+};
+
+ADSWriteQueue *ADSwqueueNew(ADSConnection *dc, int flushTime);
+void ADSwqueueFree(ADSWriteQueue *q);
+int ADSwqueuePut(ADSWriteQueue *q, uint32_t indexGroup, uint32_t indexOffset,
+				 uint32_t length, const void *data, ADSWriteDone done,
+				 void *user);
+int ADSwqueueFlush(ADSWriteQueue *q);
+int ADSwqueueDrain(ADSWriteQueue *q);
+void ADSwqueueGetStats(ADSWriteQueue *q, ADSWriteQueueStats *stats);
+
+#endif //__ADS_WQUEUE_H__
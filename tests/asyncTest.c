@@ -0,0 +1,222 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Runs the request engine against a server on the loopback: a request
+ * the device answers too late expires with 0x15, synchronous or not, and
+ * its late answer is a stray that does not confuse the next one. Errors
+ * of the device come back as they are, requests the shaper refuses fail
+ * with 0x502, a link that fails ends the requests on the way with 0x50a
+ * and later ones at once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_async.h"
+#include "ads_connect.h"
+#include "ads_server.h"
+#include "ads_shape.h"
+#include "testUtil.h"
+
+#define ADDRESS		"127.0.0.1:48993"
+#define TIMEOUT		100				// ms, of the interface
+#define LATE		(3 * TIMEOUT)	// ms a read of 0x4021 takes
+
+static int value = 1234;
+
+static int handle(ADSServerRequest *rq, void *user)
+{
+	switch (rq->indexGroup) {
+	case 0x4021:
+		usleep(LATE * 1000);
+		break;
+	case 0x4022:
+		return 0x706;				// ADSERR_DEVICE_INVALIDDATA
+	}
+	if (rq->header.commandId == cmdADSwrite && rq->length == 4)
+		memcpy(&value, rq->data, 4);
+	else if (rq->header.commandId == cmdADSread && rq->outLength == 4)
+		memcpy(rq->out, &value, 4);
+	else
+		return 0x705;
+	return 0;
+}
+
+static long long ms(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000LL
+		+ (b->tv_nsec - a->tv_nsec) / 1000000;
+}
+
+static pthread_mutex_t doneLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+static int doneResult = -1, doneAnswer, doneDevice;
+
+static void done(ADSRequest *rq, ADSpacket *answer)
+{
+	pthread_mutex_lock(&doneLock);
+	doneResult = rq->result;
+	doneAnswer = answer != NULL;
+	if (answer != NULL)
+		doneDevice = ((ADSreadResponse *) answer->data)->result;
+	pthread_cond_signal(&doneCond);
+	pthread_mutex_unlock(&doneLock);
+}
+
+/* an asynchronous read of group, the result it is done with */
+static int submit(ADSConnection *dc, uint32_t group, int *answered)
+{
+	struct {
+		ADSpacket		p;
+		unsigned char	room[64];
+	} q;
+	ADSreadRequest *rd = (ADSreadRequest *) q.p.data;
+	ADSRequest rq;
+	int rc;
+
+	memset(&q, 0, sizeof(q));
+	memset(&rq, 0, sizeof(rq));
+	_ADSsetupAmsHeader(dc, &q.p.amsHeader);
+	q.p.amsHeader.commandId = cmdADSread;
+	q.p.amsHeader.dataLength = sizeof(ADSreadRequest);
+	q.p.adsHeader.length = sizeof(AMSheader) + sizeof(ADSreadRequest);
+	rd->indexGroup = group;
+	rd->length = 4;
+	rq.packet = &q.p;
+	rq.done = done;
+	doneResult = -1;
+	if ((rc = ADSasyncSubmit(dc, &rq)) != 0)
+		return rc;
+	pthread_mutex_lock(&doneLock);
+	while (doneResult == -1)
+		pthread_cond_wait(&doneCond, &doneLock);
+	rc = doneResult;
+	*answered = doneAnswer;
+	pthread_mutex_unlock(&doneLock);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	AmsAddr a = { { { 127, 0, 0, 1, 1, 1 } }, 851 };
+	int errors = 0, e, v, answered;
+	struct timespec t0, t1;
+	ADSEngineStats st;
+	ADSConnection *dc;
+	ADSServer *s;
+	pthread_t t;
+	uint32_t n;
+	void *rc;
+
+	if (routeTo(ADDRESS))
+		return 1;
+	s = ADSserverNew(ADDRESS, 2);
+	if (s == NULL) {
+		printf("cannot listen on %s\n", ADDRESS);
+		return 1;
+	}
+	ADSserverOnGroups(s, 0x4020, 0x4022, handle, NULL);
+	pthread_create(&t, NULL, serve, s);
+
+	dc = ADSsocketConnect(&a, &e);
+	if (dc == NULL || ADSasyncStart(dc) != 0) {
+		printf("cannot connect: 0x%x\n", e);
+		return 1;
+	}
+	dc->iface->timeout = TIMEOUT;
+
+	errors += checkHex("read", ADSreadBytes(dc, 0x4020, 0, 4, &v, &n), 0);
+	errors += checkHex("  its value", v, 1234);
+
+	// too late: expires after TIMEOUT, not when the answer comes
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	errors += checkHex("late read", ADSreadBytes(dc, 0x4021, 0, 4, &v, &n),
+					   0x15);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	errors += checkHex("  expired in time", ms(&t0, &t1) < LATE, 1);
+	v = 5678;
+	errors += checkHex("write meanwhile",
+					   ADSwriteBytes(dc, 0x4020, 0, 4, &v), 0);
+	usleep(LATE * 1000);
+	errors += checkHex("read after the late answer",
+					   ADSreadBytes(dc, 0x4020, 0, 4, &v, &n), 0);
+	errors += checkHex("  its value", v, 5678);
+
+	errors += checkHex("late async read", submit(dc, 0x4021, &answered), 0x15);
+	errors += checkHex("  without answer", answered, 0);
+	usleep(LATE * 1000);
+	errors += checkHex("async read", submit(dc, 0x4020, &answered), 0);
+	errors += checkHex("  with answer", answered, 1);
+	ADSasyncGetStats(dc, &st);
+	errors += checkHex("timeouts", (int) st.timeouts, 2);
+	errors += checkHex("strays", (int) st.strays, 2);
+
+	// errors of the device are passed on
+	errors += checkHex("device error", ADSreadBytes(dc, 0x4022, 0, 4, &v, &n),
+					   0x706);
+	errors += checkHex("invalid group", ADSreadBytes(dc, 0x4030, 0, 4, &v, &n),
+					   0x702);
+	errors += checkHex("device error, async", submit(dc, 0x4022, &answered), 0);
+	errors += checkHex("  in its answer", answered ? doneDevice : -1, 0x706);
+
+	// one request a second, over budget ones are refused
+	ADSshapeSet(&a, 1, 0, 0, ADS_SHAPE_FAIL);
+	errors += checkHex("shaped read",
+					   ADSreadBytes(dc, 0x4020, 0, 4, &v, &n), 0);
+	errors += checkHex("read over budget",
+					   ADSreadBytes(dc, 0x4020, 0, 4, &v, &n), ADS_SHAPE_ERROR);
+	errors += checkHex("async read over budget", submit(dc, 0x4020, &answered),
+					   ADS_SHAPE_ERROR);
+	ADSshapeSet(&a, 0, 0, 0, ADS_SHAPE_QUEUE);
+
+	// the link fails: what is on the way ends, the rest fails at once
+	dc->iface->timeout = 10 * LATE;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ADSserverStop(s);
+	pthread_join(t, &rc);
+	ADSserverFree(s);
+	errors += checkHex("read of a failed link",
+					   ADSreadBytes(dc, 0x4020, 0, 4, &v, &n), 0x50a);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	errors += checkHex("  failed at once", ms(&t0, &t1) < LATE, 1);
+	errors += checkHex("read after it failed",
+					   ADSreadBytes(dc, 0x4020, 0, 4, &v, &n), 0x50a);
+	errors += checkHex("async read of a failed link",
+					   submit(dc, 0x4020, &answered), 0x50a);
+
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
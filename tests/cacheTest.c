@@ -0,0 +1,256 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Runs the read cache against a server on the loopback that counts what
+ * reaches it: nothing is cached until configured, then reads of index
+ * groups with a TTL are answered from the cache until it expires, for all
+ * connections to the device, others are not. Device info and state have
+ * TTLs of their own. Writes drop what they overlap only, a read on the
+ * way during a write is not cached, and the least recently used entries
+ * make room within the budget.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_cache.h"
+#include "ads_connect.h"
+#include "ads_server.h"
+#include "testUtil.h"
+
+#define ADDRESS		"127.0.0.1:48996"
+#define TTL			200					// ms
+#define SLOW		100000				// us a read of 0x4022 takes
+
+static unsigned char mem[3][256];		// index groups 0x4020 .. 0x4022
+static pthread_mutex_t memLock = PTHREAD_MUTEX_INITIALIZER;
+static int reads, infos, states;
+
+static int memory(ADSServerRequest *rq, void *user)
+{
+	unsigned char *m = mem[rq->indexGroup - 0x4020];
+
+	if (rq->indexOffset > sizeof(mem[0])
+		|| rq->length > sizeof(mem[0]) - rq->indexOffset
+		|| rq->outLength > sizeof(mem[0]) - rq->indexOffset)
+		return 0x703;
+	pthread_mutex_lock(&memLock);
+	memcpy(m + rq->indexOffset, rq->data, rq->length);
+	if (rq->header.commandId == cmdADSread) {
+		reads++;
+		memcpy(rq->out, m + rq->indexOffset, rq->outLength);
+	}
+	pthread_mutex_unlock(&memLock);
+	if (rq->header.commandId == cmdADSread && rq->indexGroup == 0x4022)
+		usleep(SLOW);
+	return 0;
+}
+
+static int devInfo(ADSServerRequest *rq, void *user)
+{
+	AdsVersion v = { 1, 2, 3 };
+
+	__atomic_add_fetch(&infos, 1, __ATOMIC_SEQ_CST);
+	memcpy(rq->out, &v, sizeof(v));
+	memset(rq->out + sizeof(v), 0, 16);
+	strcpy((char *) rq->out + sizeof(v), "cacheTest");
+	rq->outLength = sizeof(v) + 16;
+	return 0;
+}
+
+static int state(ADSServerRequest *rq, void *user)
+{
+	uint16_t s[2] = { ADSSTATE_RUN, 0 };
+
+	__atomic_add_fetch(&states, 1, __ATOMIC_SEQ_CST);
+	memcpy(rq->out, s, sizeof(s));
+	rq->outLength = sizeof(s);
+	return 0;
+}
+
+/* reads 4 bytes, returns them, -1 on error */
+static int get(ADSConnection *dc, uint32_t group, uint32_t offset)
+{
+	uint32_t n;
+	int v;
+
+	if (ADSreadBytes(dc, group, offset, 4, &v, &n) != 0 || n != 4)
+		return -1;
+	return v;
+}
+
+/* the reads the device saw since the last call */
+static int seen(void)
+{
+	static int last;
+	int n;
+
+	pthread_mutex_lock(&memLock);
+	n = reads - last;
+	last = reads;
+	pthread_mutex_unlock(&memLock);
+	return n;
+}
+
+static void *slowRead(void *arg)
+{
+	return (void *)(long) get((ADSConnection *) arg, 0x4022, 0);
+}
+
+static int run(ADSConnection *dc, ADSConnection *dc2)
+{
+	AmsAddr addr = { dc->partner, dc->AMSport };
+	unsigned short adsState, devState;
+	ADSCacheStats st;
+	AdsVersion ver;
+	char name[16];
+	pthread_t t;
+	void *rc;
+	int errors = 0, v, i;
+
+	// off until configured
+	get(dc, 0x4020, 0);
+	get(dc, 0x4020, 0);
+	errors += check("off: device reads", seen(), 2);
+
+	ADScacheConfigure(64 * 1024);
+	ADScacheSetGroupTTL(0x4020, 0x4020, TTL);
+	ADScacheSetGroupTTL(0x4022, 0x4022, 10 * TTL);
+	v = 11;
+	ADSwriteBytes(dc, 0x4020, 0, 4, &v);
+	errors += check("ttl: value", get(dc, 0x4020, 0), 11);
+	errors += check("  again", get(dc, 0x4020, 0), 11);
+	errors += check("  other connection", get(dc2, 0x4020, 0), 11);
+	errors += check("  device reads", seen(), 1);
+	get(dc, 0x4021, 0);
+	get(dc, 0x4021, 0);
+	errors += check("no ttl: device reads", seen(), 2);
+	usleep(TTL * 1000 + 50000);
+	get(dc, 0x4020, 0);
+	errors += check("expired: device reads", seen(), 1);
+	ADScacheGetStats(&st);
+	errors += check("  stats expired", (int) st.expired, 1);
+
+	// writes drop what they overlap
+	v = 22;
+	ADSwriteBytes(dc, 0x4020, 100, 4, &v);
+	get(dc, 0x4020, 0);
+	errors += check("write elsewhere: device reads", seen(), 0);
+	ADSwriteBytes(dc2, 0x4020, 2, 4, &v);
+	errors += check("overlapping write: value", get(dc, 0x4020, 0) >> 16, 22);
+	errors += check("  device reads", seen(), 1);
+	ADScacheInvalidate(&addr, 0x4020, 0, 0);
+	get(dc, 0x4020, 0);
+	errors += check("invalidated: device reads", seen(), 1);
+
+	// a write while a read is on the way: its answer may be older
+	v = 33;
+	ADSwriteBytes(dc, 0x4022, 0, 4, &v);
+	pthread_create(&t, NULL, slowRead, dc);
+	usleep(SLOW / 4);
+	v = 44;
+	ADSwriteBytes(dc2, 0x4022, 0, 4, &v);
+	pthread_join(t, &rc);
+	errors += check("read on the way: value", (int)(long) rc, 33);
+	errors += check("  after it", get(dc, 0x4022, 0), 44);
+	errors += check("  device reads", seen(), 2);
+
+	// device info and state
+	ADScacheSetTTL(ADS_CACHE_DEVINFO, 10 * TTL);
+	ADScacheSetTTL(ADS_CACHE_STATE, 10 * TTL);
+	for (i = 0; i < 3; i++) {
+		ADSreadDeviceInfo(dc, name, &ver);
+		ADSreadState(dc, &adsState, &devState);
+	}
+	errors += check("device info: device reads", infos, 1);
+	errors += check("  its version", ver.build, 3);
+	errors += check("state: device reads", states, 1);
+	errors += check("  the state", adsState, ADSSTATE_RUN);
+
+	// room for a few entries only: the oldest go
+	ADScacheConfigure(4 * (sizeof(ADSCacheEntry) + 4));
+	ADScacheGetStats(&st);
+	errors += check("shrunk: entries", st.entries <= 4, 1);
+	for (i = 0; i < 8; i++)
+		get(dc, 0x4020, 4 * i);
+	seen();
+	get(dc, 0x4020, 4 * 7);
+	errors += check("newest: device reads", seen(), 0);
+	get(dc, 0x4020, 0);
+	errors += check("oldest: device reads", seen(), 1);
+	ADScacheGetStats(&st);
+	errors += check("  evicted", st.evictions >= 4, 1);
+
+	ADScacheConfigure(0);
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	AmsAddr a = { { { 127, 0, 0, 1, 1, 1 } }, 851 };
+	int errors = 0, e;
+	ADSConnection *dc, *dc2;
+	ADSServer *s;
+	pthread_t t;
+	void *rc;
+
+	if (routeTo(ADDRESS))
+		return 1;
+	s = ADSserverNew(ADDRESS, 4);
+	if (s == NULL) {
+		printf("cannot listen on %s\n", ADDRESS);
+		return 1;
+	}
+	ADSserverOnGroups(s, 0x4020, 0x4022, memory, NULL);
+	ADSserverOn(s, cmdADSreadDevInfo, devInfo, NULL);
+	ADSserverOn(s, cmdADSreadState, state, NULL);
+	pthread_create(&t, NULL, serve, s);
+
+	dc = ADSsocketConnect(&a, &e);
+	dc2 = ADSsocketConnect(&a, &e);
+	if (dc == NULL || dc2 == NULL) {
+		printf("cannot connect: 0x%x\n", e);
+		return 1;
+	}
+	errors += run(dc, dc2);
+
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	ADSsocketDisconnect(dc2);
+	ADSFreeConnection(dc2);
+	ADSserverStop(s);
+	pthread_join(t, &rc);
+	ADSserverFree(s);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
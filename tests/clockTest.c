@@ -0,0 +1,118 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Feeds the clock model the notification samples of a simulated device
+ * whose clock is behind ours and runs slower, sent every 10 ms and
+ * delayed on the way by a random amount above a least delay. The model
+ * must find the offset and the drift, and start over when the device
+ * clock jumps.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_clock.h"
+#include "testUtil.h"
+
+#define START		1700000000000000000LL	// ns, our time at the start
+#define OFFSET		3250000000LL			// ns, our clock minus the device's
+#define DRIFT		200e-6					// ours runs that much faster
+#define PERIOD		10000000LL				// ns between samples
+#define MINDELAY	500000LL				// ns, least delay on the way
+#define JITTER		3000000					// ns, more delay up to that
+
+static int64_t now = START;
+static int64_t jump = 0;					// ns, the device clock jumped
+
+/* how far the device's clock is behind ours at our time t */
+static int64_t behind(int64_t t)
+{
+	return OFFSET + (int64_t)(DRIFT * (t - START)) - jump;
+}
+
+static uint64_t fileTime(int64_t ns)
+{
+	return ns / 100 + ADS_FILETIME_EPOCH;
+}
+
+/* seconds of samples, a request round trip of twice the least delay each */
+static void run(ADSClock *c, int seconds)
+{
+	int64_t end = now + seconds * 1000000000LL, delay;
+
+	for (; now < end; now += PERIOD) {
+		delay = MINDELAY + rand() % JITTER;
+		_ADSclockRtt(c, 2 * MINDELAY);
+		_ADSclockSample(c, now + delay, fileTime(now - behind(now)));
+	}
+}
+
+/* how far off a device time stamp of now is converted, ns */
+static int64_t error(ADSConnection *dc)
+{
+	return ADSclockToNs(dc, fileTime(now - behind(now))) - now;
+}
+
+int main(void)
+{
+	ADSConnection dc;
+	ADSClock c;
+	ADSClockInfo info;
+	int errors = 0;
+
+	srand(1);
+	memset(&dc, 0, sizeof(dc));
+	memset(&c, 0, sizeof(c));
+	dc.clock = &c;
+	errors += checkRange("error unmeasured, ms", error(&dc) / 1e6,
+						 -OFFSET / 1e6 - 1, -OFFSET / 1e6 + 1);
+
+	run(&c, 1);
+	errors += checkRange("error after 1 s, us", error(&dc) / 1e3, -1000, 1000);
+
+	run(&c, 80);
+	ADSclockGetInfo(&dc, &info);
+	errors += checkRange("drift, ppm", info.drift, DRIFT * 1e6 - 10,
+						 DRIFT * 1e6 + 10);
+	errors += checkRange("error after 81 s, us", error(&dc) / 1e3, -100, 100);
+	errors += checkRange("round trip, us", info.minRtt / 1e3,
+						 2 * MINDELAY / 1e3, 2 * MINDELAY / 1e3);
+
+	// the device clock is set 5 s forward: the model starts over
+	jump = 5000000000LL;
+	run(&c, 20);
+	ADSclockGetInfo(&dc, &info);
+	errors += checkRange("steps", info.steps, 1, 1);
+	errors += checkRange("error after the jump, us", error(&dc) / 1e3,
+						 -1000, 1000);
+
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1,201 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Checks the change detection kernels against a byte by byte reference,
+ * then measures them on a process image sized buffer.
+ * Usage: diffBench [image size in bytes] [changed bytes per cycle]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ads_diff.h"
+
+#define MAXRUNS 4096
+
+static const char *kernelName[] = { "auto", "scalar", "sse2", "avx2" };
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* what the kernels must find: runs merged over up to gap equal bytes */
+static int reference(const unsigned char *a, const unsigned char *b,
+					 uint32_t size, uint32_t gap, ADSChange *out, int maxOut)
+{
+	uint32_t i;
+	int n = 0;
+
+	for (i = 0; i < size; i++) {
+		if (a[i] == b[i])
+			continue;
+		if (n > 0 && (i - (out[n - 1].offset + out[n - 1].length) <= gap
+					  || n == maxOut))
+			out[n - 1].length = i + 1 - out[n - 1].offset;
+		else {
+			out[n].offset = i;
+			out[n].length = 1;
+			n++;
+		}
+	}
+	return n;
+}
+
+static int check(int kind, unsigned char *a, unsigned char *b, uint32_t size)
+{
+	static ADSChange want[MAXRUNS], got[MAXRUNS];
+	uint64_t *mask;
+	uint32_t gap, i, blk;
+	int round, nw, ng, maxOut, bits, errors = 0;
+
+	mask = (uint64_t *) malloc(ADS_DIFF_MASK_WORDS(size) * sizeof(uint64_t));
+	for (round = 0; round < 200; round++) {
+		memcpy(b, a, size);
+		for (i = rand() % 64; i > 0; i--)
+			b[rand() % size] ^= 1 + rand() % 255;
+		gap = rand() % 8;
+		maxOut = 1 + rand() % 40;
+
+		nw = reference(a, b, size, gap, want, maxOut);
+		ng = ADSdiffRanges(a, b, size, gap, got, maxOut);
+		if (nw != ng || memcmp(want, got, nw * sizeof(ADSChange)) != 0) {
+			printf("%s: ranges differ in round %d (%d vs %d runs)\n",
+				   kernelName[kind], round, ng, nw);
+			errors++;
+		}
+
+		bits = ADSdiffMask(a, b, size, mask);
+		for (blk = 0; blk * ADS_DIFF_BLOCK < size; blk++) {
+			uint32_t len = size - blk * ADS_DIFF_BLOCK;
+			int changed, set;
+			if (len > ADS_DIFF_BLOCK)
+				len = ADS_DIFF_BLOCK;
+			changed = memcmp(a + blk * ADS_DIFF_BLOCK,
+							 b + blk * ADS_DIFF_BLOCK, len) != 0;
+			set = (mask[blk / 64] >> (blk % 64)) & 1;
+			if (changed != set) {
+				printf("%s: mask wrong for block %u in round %d\n",
+					   kernelName[kind], blk, round);
+				errors++;
+				break;
+			}
+			bits -= set;
+		}
+		if (bits != 0) {
+			printf("%s: mask count wrong in round %d\n", kernelName[kind], round);
+			errors++;
+		}
+	}
+	free(mask);
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	static ADSChange runs[MAXRUNS];
+	uint32_t size = argc > 1 ? atol(argv[1]) : 4 * 1024 * 1024;
+	uint32_t changes = argc > 2 ? atol(argv[2]) : 100;
+	unsigned char *a, *b;
+	uint64_t *mask;
+	double t, mbs;
+	int kind, sel, loops, i, n = 0, errors = 0;
+	volatile int sink = 0;
+	// through a volatile pointer, so the compiler cannot hoist the compare
+	int (*volatile cmp)(const void *, const void *, size_t) = memcmp;
+
+	srand(1);
+	a = (unsigned char *) malloc(size);
+	b = (unsigned char *) malloc(size);
+	mask = (uint64_t *) malloc(ADS_DIFF_MASK_WORDS(size) * sizeof(uint64_t));
+	for (i = 0; i < size; i++)
+		a[i] = rand();
+
+	/* odd sizes exercise the tails of the vector loops */
+	for (kind = ADS_DIFF_SCALAR; kind <= ADS_DIFF_AVX2; kind++) {
+		if (ADSdiffSelect(kind) != kind)
+			continue;
+		errors += check(kind, a, b, 1021);
+		errors += check(kind, a, b, 77);
+	}
+
+	loops = (int)(2e9 / size) + 1;
+
+	printf("image %u bytes, %u changed bytes, %d loops\n", size, changes, loops);
+
+	/* memcmp stops at the first difference, give it equal buffers */
+	memcpy(b, a, size);
+	t = now();
+	for (i = 0; i < loops; i++)
+		sink += cmp(a, b, size) != 0;
+	t = now() - t;
+	printf("%-10s %10.1f MB/s (full scan, equal/not equal only)\n", "memcmp",
+		   (double)size * loops / t / 1e6);
+	for (i = 0; i < changes; i++)
+		b[rand() % size] ^= 0x55;
+
+	t = now();
+	for (i = 0; i < loops; i++) {
+		uint32_t j;
+		for (j = 0; j < size; j++)	// the byte wise loop we replace
+			if (a[j] != b[j])
+				sink++;
+	}
+	t = now() - t;
+	printf("%-10s %10.1f MB/s\n", "bytewise", (double)size * loops / t / 1e6);
+
+	for (kind = ADS_DIFF_SCALAR; kind <= ADS_DIFF_AVX2; kind++) {
+		sel = ADSdiffSelect(kind);
+		if (sel != kind) {
+			printf("%-10s not supported by this cpu\n", kernelName[kind]);
+			continue;
+		}
+		t = now();
+		for (i = 0; i < loops; i++)
+			n = ADSdiffRanges(a, b, size, 4, runs, MAXRUNS);
+		t = now() - t;
+		mbs = (double)size * loops / t / 1e6;
+		printf("%-10s %10.1f MB/s ranges (%d runs)", kernelName[kind], mbs, n);
+
+		t = now();
+		for (i = 0; i < loops; i++)
+			n = ADSdiffMask(a, b, size, mask);
+		t = now() - t;
+		printf(", %10.1f MB/s mask (%d blocks)\n",
+			   (double)size * loops / t / 1e6, n);
+	}
+
+	free(a);
+	free(b);
+	free(mask);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1,232 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Runs threads reading through one connection against a slow server on
+ * the loopback: reads of the same while one is on the way must get its
+ * answer, its error as well, and the device sees one read; reads of
+ * another offset or length are not shared; a read after a write gets
+ * what was written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_server.h"
+#include "testUtil.h"
+
+#define ADDRESS		"127.0.0.1:48995"
+#define READERS		8
+#define SLOW		100000				// us a read takes
+
+static int value = 1234, reads;
+
+/* 0x4020 reads value at any offset, 0x4021 fails */
+static int slow(ADSServerRequest *rq, void *user)
+{
+	if (rq->header.commandId == cmdADSwrite && rq->length == 4) {
+		memcpy(&value, rq->data, 4);
+		return 0;
+	}
+	if (rq->header.commandId != cmdADSread || rq->outLength < 4)
+		return 0x705;
+	__atomic_add_fetch(&reads, 1, __ATOMIC_SEQ_CST);
+	memset(rq->out, 0, rq->outLength);
+	memcpy(rq->out, &value, 4);
+	usleep(SLOW);
+	return rq->indexGroup == 0x4021 ? 0x706 : 0;
+}
+
+static ADSConnection *dc;
+static pthread_barrier_t start;
+
+typedef struct {
+	uint32_t	indexGroup;
+	uint32_t	indexOffset;
+	uint32_t	length;
+	int			rc;
+	int			value;
+} Read;
+
+static void *reader(void *arg)
+{
+	Read *r = (Read *) arg;
+	unsigned char buf[8];
+	uint32_t n;
+
+	pthread_barrier_wait(&start);
+	r->rc = ADSreadBytes(dc, r->indexGroup, r->indexOffset, r->length, buf,
+						 &n);
+	memcpy(&r->value, buf, 4);
+	return NULL;
+}
+
+/*
+ * READERS threads read at once, offset and length of the i-th from
+ * offset(i) and length(i). Returns the reads the device saw.
+ */
+static int burst(Read *r, uint32_t group, int spread)
+{
+	pthread_t t[READERS];
+	int i, before = __atomic_load_n(&reads, __ATOMIC_SEQ_CST);
+
+	pthread_barrier_init(&start, NULL, READERS);
+	for (i = 0; i < READERS; i++) {
+		r[i].indexGroup = group;
+		r[i].indexOffset = spread == 1 ? 4 * i : 0;
+		r[i].length = spread == 2 ? 4 + 4 * (i & 1) : 4;
+		r[i].rc = -1;
+		pthread_create(&t[i], NULL, reader, &r[i]);
+	}
+	for (i = 0; i < READERS; i++)
+		pthread_join(t[i], NULL);
+	pthread_barrier_destroy(&start);
+	return __atomic_load_n(&reads, __ATOMIC_SEQ_CST) - before;
+}
+
+/*
+ * A read of 0x4020:0 on the way whose answer did not come yet, as the
+ * first reader leaves it in the list of the connection, and its answer.
+ */
+static ADSFlight *sent(void)
+{
+	ADSFlight *f = (ADSFlight *) calloc(1, sizeof(ADSFlight));
+
+	f->indexGroup = 0x4020;
+	f->length = 4;
+	f->refs = 1;
+	pthread_cond_init(&f->cond, NULL);
+	pthread_mutex_lock(&dc->flightLock);
+	f->epoch = dc->epoch;
+	f->next = dc->flights;
+	dc->flights = f;
+	pthread_mutex_unlock(&dc->flightLock);
+	return f;
+}
+
+static void answered(ADSFlight *f, int v)
+{
+	ADSFlight **pp;
+
+	pthread_mutex_lock(&dc->flightLock);
+	for (pp = &dc->flights; *pp != f; pp = &(*pp)->next)
+		;
+	*pp = f->next;
+	f->data = malloc(4);
+	memcpy(f->data, &v, 4);
+	f->nRead = 4;
+	f->done = 1;
+	pthread_cond_broadcast(&f->cond);
+	if (--f->refs == 0) {
+		pthread_cond_destroy(&f->cond);
+		free(f->data);
+		free(f);
+	}
+	pthread_mutex_unlock(&dc->flightLock);
+}
+
+int main(int argc, char **argv)
+{
+	AmsAddr a = { { { 127, 0, 0, 1, 1, 1 } }, 851 };
+	int errors = 0, e, i, bad, v;
+	Read r[READERS];
+	ADSFlight *f;
+	ADSServer *s;
+	pthread_t t, rt;
+	uint32_t n;
+	void *rc;
+
+	if (routeTo(ADDRESS))
+		return 1;
+	s = ADSserverNew(ADDRESS, 4);
+	if (s == NULL) {
+		printf("cannot listen on %s\n", ADDRESS);
+		return 1;
+	}
+	ADSserverOnGroups(s, 0x4020, 0x4021, slow, NULL);
+	pthread_create(&t, NULL, serve, s);
+	dc = ADSsocketConnect(&a, &e);
+	if (dc == NULL) {
+		printf("cannot connect: 0x%x\n", e);
+		return 1;
+	}
+
+	errors += check("same: device reads", burst(r, 0x4020, 0), 1);
+	for (i = bad = 0; i < READERS; i++)
+		bad += r[i].rc != 0 || r[i].value != 1234;
+	errors += check("same: wrong answers", bad, 0);
+
+	errors += check("failing: device reads", burst(r, 0x4021, 0), 1);
+	for (i = bad = 0; i < READERS; i++)
+		bad += r[i].rc != 0x706;
+	errors += check("failing: without its error", bad, 0);
+
+	errors += check("offsets: device reads", burst(r, 0x4020, 1), READERS);
+	errors += check("lengths: device reads", burst(r, 0x4020, 2), 2);
+	for (i = bad = 0; i < READERS; i++)
+		bad += r[i].rc != 0 || r[i].value != 1234;
+	errors += check("lengths: wrong answers", bad, 0);
+
+	v = 5678;
+	errors += check("write", ADSwriteBytes(dc, 0x4020, 0, 4, &v), 0);
+	errors += check("read after it", ADSreadBytes(dc, 0x4020, 0, 4, &v, &n)
+					|| v != 5678, 0);
+
+	// a read that starts after a write must not wait for one sent before
+	f = sent();
+	v = 9012;
+	ADSwriteBytes(dc, 0x4020, 0, 4, &v);
+	i = reads;
+	pthread_barrier_init(&start, NULL, 1);
+	memset(&r[0], 0, sizeof(r[0]));
+	r[0].indexGroup = 0x4020;
+	r[0].length = 4;
+	r[0].rc = -1;
+	pthread_create(&rt, NULL, reader, &r[0]);
+	for (e = 0; e < 100 && __atomic_load_n(&reads, __ATOMIC_SEQ_CST) == i;
+		 e++)
+		usleep(10000);
+	answered(f, 5678);
+	pthread_join(rt, NULL);
+	pthread_barrier_destroy(&start);
+	errors += check("read after a write: value", r[0].value, 9012);
+	errors += check("  device reads", reads - i, 1);
+
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	ADSserverStop(s);
+	pthread_join(t, &rc);
+	ADSserverFree(s);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1,190 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Runs clients of a router subscribing to the same on a device that sends
+ * samples: the device must see one subscription, every client must get
+ * every sample, one coming later the last one at once. When the device
+ * goes away the router closes the clients with subscriptions, and only
+ * those, so they see their notifications end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_notify.h"
+#include "ads_router.h"
+#include "testUtil.h"
+
+#define DEVICE		"127.0.0.1:49004"
+#define ROUTER		"127.0.0.1:49005"
+#define CLIENTS		4						// subscribing from the start
+#define SAMPLES		3
+
+typedef struct {
+	ADSConnection	*dc;
+	ADSNotification	*n;
+	int				samples;
+	int				last;			// value of the last sample
+	int				end;			// why it ended, 0 if it did not
+} Client;
+
+static void got(ADSNotification *n, uint64_t timeStamp, const void *data,
+				uint32_t size)
+{
+	Client *c = (Client *) n->user;
+
+	memcpy(&c->last, data, 4);
+	__atomic_add_fetch(&c->samples, 1, __ATOMIC_SEQ_CST);
+}
+
+static void ended(ADSNotification *n, int err)
+{
+	__atomic_store_n(&((Client *) n->user)->end, err, __ATOMIC_SEQ_CST);
+}
+
+static void *route(void *arg)
+{
+	return (void *)(long) ADSrouterRun((ADSRouter *) arg);
+}
+
+/* connects c through the router and subscribes to 0x4020:0 */
+static int subscribe(Client *c)
+{
+	AdsNotificationAttrib attrib = { 8, ADSTRANS_SERVERCYCLE, 0, { 100000 } };
+	AmsAddr a = { { { 127, 0, 0, 1, 1, 1 } }, 851 };
+	int e;
+
+	memset(c, 0, sizeof(*c));
+	if ((c->dc = ADSsocketConnect(&a, &e)) == NULL)
+		return e;
+	return ADSnotifyAdd(c->dc, 0x4020, 0, &attrib, got, ended, c, &c->n);
+}
+
+/* waits up to a second until every one of n clients in c has got want */
+static int waitAll(Client *c, int n, int want, int *field)
+{
+	int i, k, all = 0;
+	long off = (char *) field - (char *) c;
+
+	for (k = 0; k < 100 && !all; k++) {
+		for (i = 0, all = 1; i < n; i++)
+			if (__atomic_load_n((int *)((char *) &c[i] + off),
+								__ATOMIC_SEQ_CST) < want)
+				all = 0;
+		if (!all)
+			usleep(10000);
+	}
+	return all;
+}
+
+int main(int argc, char **argv)
+{
+	AmsNetId netId = { { 10, 0, 0, 1, 1, 1 } };
+	AmsAddr a = { { { 127, 0, 0, 1, 1, 1 } }, 851 };
+	Client c[CLIENTS + 1];
+	int errors = 0, e, i, rc = 0, samples = 0, last = 0, v[2];
+	ADSConnection *bystander;
+	ADSRouterStats st;
+	TestDevice *dev;
+	ADSRouter *r;
+	pthread_t rt;
+	void *res;
+
+	if (routeTo(DEVICE) || (dev = deviceNew(DEVICE)) == NULL)
+		return 1;
+	r = ADSrouterNew(ROUTER, &netId);
+	if (r == NULL || ADSsetRouter(ROUTER) != 0) {
+		printf("cannot set up the router on %s\n", ROUTER);
+		return 1;
+	}
+	pthread_create(&rt, NULL, route, r);
+
+	for (i = 0; i < CLIENTS; i++)
+		rc |= subscribe(&c[i]);
+	errors += checkHex("subscribe", rc, 0);
+	errors += check("  device subscriptions", dev->adds, 1);
+	ADSrouterGetStats(r, &st);
+	errors += check("  stats subscriptions", st.subscriptions, 1);
+	errors += check("  stats subscribers", st.subscribers, CLIENTS);
+
+	for (i = 1; i <= SAMPLES; i++) {
+		v[0] = i;
+		v[1] = 0;
+		deviceSend(dev, dev->handle, i, v, 8);
+	}
+	waitAll(c, CLIENTS, SAMPLES, &c[0].samples);
+	for (i = 0; i < CLIENTS; i++) {
+		samples += c[i].samples;
+		last += c[i].last == SAMPLES;
+	}
+	errors += check("samples", samples, CLIENTS * SAMPLES);
+	errors += check("  clients with the last", last, CLIENTS);
+	ADSrouterGetStats(r, &st);
+	errors += check("  stats fan out", (int) st.fanout, CLIENTS * SAMPLES);
+
+	errors += checkHex("late subscriber", subscribe(&c[CLIENTS]), 0);
+	errors += check("  device subscriptions", dev->adds, 1);
+	waitAll(&c[CLIENTS], 1, 1, &c[CLIENTS].samples);
+	errors += check("  samples", c[CLIENTS].samples, 1);
+	errors += check("  value", c[CLIENTS].last, SAMPLES);
+
+	// the device goes away, one client without a subscription stays
+	bystander = ADSsocketConnect(&a, &e);
+	deviceFree(dev);
+	errors += check("device gone: ended",
+					waitAll(c, CLIENTS + 1, 1, &c[0].end), 1);
+	for (i = 0; i < 100; i++) {
+		ADSrouterGetStats(r, &st);
+		if (st.clients == 1)
+			break;
+		usleep(10000);
+	}
+	errors += check("  clients left", st.clients, 1);
+	errors += check("  stats subscriptions", st.subscriptions, 0);
+	errors += check("  stats subscribers", st.subscribers, 0);
+
+	for (i = 0; i <= CLIENTS; i++) {
+		ADSnotifyDel(c[i].n);
+		ADSsocketDisconnect(c[i].dc);
+		ADSFreeConnection(c[i].dc);
+	}
+	if (bystander != NULL) {
+		ADSsocketDisconnect(bystander);
+		ADSFreeConnection(bystander);
+	}
+	ADSrouterStop(r);
+	pthread_join(rt, &res);
+	ADSrouterFree(r);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
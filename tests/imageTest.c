@@ -0,0 +1,233 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Mirrors two areas of a server on the loopback, one of them too long for
+ * one read: nothing can be read before the first poll, then reads are
+ * answered from the image. A snapshot that is pinned keeps its data while
+ * the next poll goes on, a failed poll leaves the last snapshot visible.
+ * The change lists of the snapshots name exactly what changed, a full one
+ * ends with an entry up to the end of the image. In the background the
+ * mirror polls at its cycle time, or counts the cycles it skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_image.h"
+#include "ads_server.h"
+#include "testUtil.h"
+
+#define ADDRESS		"127.0.0.1:48998"
+#define BIG			20000			// bytes of 0x4020, three reads
+#define CYCLE		50				// ms
+
+static unsigned char big[BIG], small[64];	// index groups 0x4020, 0x4021
+static pthread_mutex_t memLock = PTHREAD_MUTEX_INITIALIZER;
+static int reads, fail;
+
+static int memory(ADSServerRequest *rq, void *user)
+{
+	unsigned char *m = rq->indexGroup == 0x4020 ? big : small;
+	uint32_t size = rq->indexGroup == 0x4020 ? BIG : sizeof(small);
+
+	if (rq->header.commandId != cmdADSread)
+		return 0x701;
+	if (fail)
+		return 0x706;
+	if (rq->indexOffset > size || rq->outLength > size - rq->indexOffset)
+		return 0x703;
+	pthread_mutex_lock(&memLock);
+	reads++;
+	memcpy(rq->out, m + rq->indexOffset, rq->outLength);
+	pthread_mutex_unlock(&memLock);
+	return 0;
+}
+
+/* sets a byte of the device */
+static void poke(unsigned char *m, uint32_t offset, unsigned char v)
+{
+	pthread_mutex_lock(&memLock);
+	m[offset] = v;
+	pthread_mutex_unlock(&memLock);
+}
+
+static int get(ADSImage *img, uint32_t group, uint32_t offset)
+{
+	unsigned char v;
+	int rc = ADSimageRead(img, group, offset, 1, &v);
+
+	return rc != 0 ? -rc : v;
+}
+
+/* the changes of the newest snapshot, its first ones in c */
+static int changes(ADSImage *img, ADSChange *c, int max)
+{
+	const ADSImageSnapshot *s = ADSimageAcquire(img);
+	int n;
+
+	if (s == NULL)
+		return -1;
+	n = s->nChanges;
+	memcpy(c, s->changes, (n < max ? n : max) * sizeof(ADSChange));
+	ADSimageRelease(img, s);
+	return n;
+}
+
+static int run(ADSConnection *dc)
+{
+	const ADSImageSnapshot *s, *newest;
+	uint32_t group, offset;
+	ADSImageStats st;
+	ADSChange c[8];
+	ADSImage *img;
+	int errors = 0, i;
+
+	img = ADSimageNew(dc, CYCLE);
+	if (img == NULL)
+		return 1;
+	ADSimageAddRange(img, 0x4020, 0, BIG);
+	ADSimageAddRange(img, 0x4021, 16, 32);
+	ADSimageTrackChanges(img, 4, 0);
+
+	errors += checkHex("before a poll", -get(img, 0x4020, 0), 0x707);
+	poke(big, 0, 1);
+	poke(big, BIG - 1, 2);
+	poke(small, 20, 3);
+	errors += checkHex("poll", ADSimagePoll(img), 0);
+	errors += check("  device reads", reads, 4);
+	errors += check("  first byte", get(img, 0x4020, 0), 1);
+	errors += check("  last byte", get(img, 0x4020, BIG - 1), 2);
+	errors += check("  small area", get(img, 0x4021, 20), 3);
+	errors += checkHex("  not mirrored group", -get(img, 0x4022, 0), 0x702);
+	errors += checkHex("  not mirrored offset", -get(img, 0x4021, 8), 0x703);
+	errors += check("  changes", changes(img, c, 8), 2);
+	errors += check("  the small one at", c[1].offset, BIG);
+	errors += check("  its length", c[1].length, 32);
+	ADSimageLocate(img, BIG + 4, &group, &offset);
+	errors += checkHex("located group", group, 0x4021);
+	errors += check("  offset", offset, 20);
+
+	// exactly what changed, never across two ranges
+	poke(big, 100, 4);
+	poke(big, 101, 4);
+	poke(big, BIG - 1, 5);
+	poke(small, 16, 6);
+	ADSimagePoll(img);
+	errors += check("changed", changes(img, c, 8), 3);
+	errors += check("  first at", c[0].offset, 100);
+	errors += check("  its length", c[0].length, 2);
+	errors += check("  last of the big one", c[1].offset, BIG - 1);
+	errors += check("  its length", c[1].length, 1);
+	errors += check("  the small one at", c[2].offset, BIG);
+	errors += check("  its length", c[2].length, 1);
+	ADSimagePoll(img);
+	errors += check("nothing changed", changes(img, c, 8), 0);
+
+	// more than the list holds: the last entry runs to the end
+	for (i = 0; i < 6; i++)
+		poke(big, 1000 * (i + 1), 7);
+	poke(small, 40, 7);
+	ADSimagePoll(img);
+	errors += check("overflow: changes", changes(img, c, 8), 4);
+	errors += check("  last at", c[3].offset, 4000);
+	errors += check("  its length", c[3].length, BIG + 32 - 4000);
+
+	// a pinned snapshot keeps its data while the next poll goes on
+	s = ADSimageAcquire(img);
+	poke(big, 0, 8);
+	ADSimagePoll(img);
+	errors += check("pinned: value", s->data[0], 1);
+	errors += check("  newest", get(img, 0x4020, 0), 8);
+	newest = ADSimageAcquire(img);
+	errors += check("  cycles apart", (int)(newest->cycle - s->cycle), 1);
+	ADSimageRelease(img, newest);
+	ADSimageRelease(img, s);
+
+	// a failed poll: the last snapshot stays
+	fail = 1;
+	poke(big, 0, 9);
+	errors += checkHex("failed poll", ADSimagePoll(img), 0x706);
+	errors += check("  value", get(img, 0x4020, 0), 8);
+	ADSimageGetStats(img, &st);
+	errors += check("  stats errors", (int) st.errors, 1);
+	errors += checkHex("  last error", st.lastError, 0x706);
+	fail = 0;
+
+	// in the background every CYCLE ms
+	i = (int) st.cycles;
+	errors += checkHex("start", ADSimageStart(img), 0);
+	usleep(10 * CYCLE * 1000 + CYCLE * 500);
+	ADSimageStop(img);
+	ADSimageGetStats(img, &st);
+	errors += checkRange("cycles in 10.5", st.cycles + st.skipped - i, 10, 12);
+	errors += check("  value", get(img, 0x4020, 0), 9);
+
+	ADSimageFree(img);
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	AmsAddr a = { { { 127, 0, 0, 1, 1, 1 } }, 851 };
+	int errors = 0, e;
+	ADSConnection *dc;
+	ADSServer *s;
+	pthread_t t;
+	void *rc;
+
+	if (routeTo(ADDRESS))
+		return 1;
+	s = ADSserverNew(ADDRESS, 0);
+	if (s == NULL) {
+		printf("cannot listen on %s\n", ADDRESS);
+		return 1;
+	}
+	ADSserverOnGroups(s, 0x4020, 0x4021, memory, NULL);
+	pthread_create(&t, NULL, serve, s);
+
+	dc = ADSsocketConnect(&a, &e);
+	if (dc == NULL) {
+		printf("cannot connect: 0x%x\n", e);
+		return 1;
+	}
+	errors += run(dc);
+
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	ADSserverStop(s);
+	pthread_join(t, &rc);
+	ADSserverFree(s);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
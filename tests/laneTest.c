@@ -0,0 +1,205 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Saturates the link of a router to a server on the loopback from two
+ * clients at once: one sends reads small enough for the normal lane, the
+ * other bulk reads for the low one, both more than the window holds. The
+ * device must see the bytes of the two in the ratio of the weights of
+ * their lanes while both wait, and never more on the way than the window
+ * and the one request that filled it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_server.h"
+#include "ads_router.h"
+#include "testUtil.h"
+
+#define ADDRESS		"127.0.0.1:49002"		// the server
+#define ROUTER		"127.0.0.1:49003"
+#define REQUESTS	200						// of each client
+#define NORMAL		4000					// bytes a read of the normal lane
+#define BULK		4100					// and of the low lane asks for
+#define SERVE		2000					// us a read takes
+#define SKIP		8						// first reads, before both wait
+
+typedef struct {
+	uint32_t	length;				// of its reads
+	int			errors;
+} Flood;
+
+typedef struct {
+	AMS_TCPheader	tcp;
+	AMSheader		ams;
+	ADSreadRequest	rq;
+} __attribute__((packed)) Read;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t served[2 * REQUESTS];	// lengths, in the order they came
+static int nServed;
+static uint32_t active, maxActive;		// bytes of reads and answers
+
+static int memory(ADSServerRequest *rq, void *user)
+{
+	uint32_t cost = sizeof(Read) + rq->outLength;
+
+	pthread_mutex_lock(&lock);
+	if (nServed < 2 * REQUESTS)
+		served[nServed++] = rq->outLength;
+	active += cost;
+	if (active > maxActive)
+		maxActive = active;
+	pthread_mutex_unlock(&lock);
+	usleep(SERVE);
+	memset(rq->out, 0, rq->outLength);
+	pthread_mutex_lock(&lock);
+	active -= cost;
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+static void *route(void *arg)
+{
+	return (void *)(long) ADSrouterRun((ADSRouter *) arg);
+}
+
+/* REQUESTS reads of f->length at once, then their answers */
+static void *flood(void *arg)
+{
+	Flood *f = (Flood *) arg;
+	AmsNetId device = { { 127, 0, 0, 1, 1, 1 } };
+	struct sockaddr_in addr;
+	unsigned char *answer;
+	AMS_TCPheader tcp;
+	Read p;
+	int fd, i;
+
+	answer = (unsigned char *) malloc(sizeof(AMSheader) + 8 + f->length);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	ADSparseAddress(ROUTER, 0, &addr);
+	if (answer == NULL
+		|| connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		f->errors++;
+		goto out;
+	}
+	memset(&p, 0, sizeof(p));
+	p.tcp.length = sizeof(AMSheader) + sizeof(ADSreadRequest);
+	p.ams.targetId = device;
+	p.ams.targetPort = 851;
+	p.ams.sourceId = device;
+	p.ams.sourceId.b[5] = 2 + (f->length == BULK);
+	p.ams.sourcePort = 40000;
+	p.ams.commandId = cmdADSread;
+	p.ams.stateFlags = sfAMScommand;
+	p.ams.dataLength = sizeof(ADSreadRequest);
+	p.rq.indexGroup = 0x4020;
+	p.rq.length = f->length;
+	for (i = 0; i < REQUESTS; i++) {
+		p.ams.invokeId = i;
+		p.rq.indexOffset = i;		// none is the same, none is shared
+		if (send(fd, &p, sizeof(p), 0) != sizeof(p))
+			f->errors++;
+	}
+	for (i = 0; i < REQUESTS; i++)
+		if (recv(fd, &tcp, sizeof(tcp), MSG_WAITALL) != sizeof(tcp)
+			|| tcp.length != sizeof(AMSheader) + 8 + f->length
+			|| recv(fd, answer, tcp.length, MSG_WAITALL) != tcp.length
+			|| ((AMSheader *) answer)->errorCode != 0) {
+			f->errors++;
+			break;
+		}
+out:
+	close(fd);
+	free(answer);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	AmsNetId netId = { { 10, 0, 0, 1, 1, 1 } };
+	Flood normal = { NORMAL, 0 }, bulk = { BULK, 0 };
+	uint64_t bytes[2] = { 0, 0 };
+	int errors = 0, i, last;
+	ADSRouterStats st;
+	pthread_t t, rt, c[2];
+	ADSServer *s;
+	ADSRouter *r;
+	void *rc;
+
+	if (routeTo(ADDRESS))
+		return 1;
+	s = ADSserverNew(ADDRESS, 8);
+	r = ADSrouterNew(ROUTER, &netId);
+	if (s == NULL || r == NULL) {
+		printf("cannot listen on %s or %s\n", ADDRESS, ROUTER);
+		return 1;
+	}
+	ADSserverOnGroups(s, 0x4020, 0x4020, memory, NULL);
+	pthread_create(&t, NULL, serve, s);
+	pthread_create(&rt, NULL, route, r);
+
+	pthread_create(&c[0], NULL, flood, &normal);
+	pthread_create(&c[1], NULL, flood, &bulk);
+	pthread_join(c[0], &rc);
+	pthread_join(c[1], &rc);
+	errors += check("normal client errors", normal.errors, 0);
+	errors += check("bulk client errors", bulk.errors, 0);
+
+	// while both wait: until the last normal read
+	for (last = nServed - 1; last > 0 && served[last] != NORMAL; last--)
+		;
+	for (i = SKIP; i < last; i++)
+		bytes[served[i] == BULK] += served[i];
+	printf("%d reads while both waited\n", last - SKIP);
+	errors += checkRange("normal to low bytes",
+						 bytes[1] ? (double) bytes[0] / bytes[1] : 0,
+						 3.0, 5.0);
+	errors += checkRange("most bytes on the way", maxActive,
+						 1, ADS_ROUTER_WINDOW + sizeof(Read) + BULK);
+	ADSrouterGetStats(r, &st);
+	errors += check("stats normal lane", (int) st.lanes[ADS_LANE_NORMAL],
+					REQUESTS);
+	errors += check("stats low lane", (int) st.lanes[ADS_LANE_LOW], REQUESTS);
+
+	ADSrouterStop(r);
+	pthread_join(rt, &rc);
+	ADSrouterFree(r);
+	ADSserverStop(s);
+	pthread_join(t, &rc);
+	ADSserverFree(s);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1,189 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Runs a writer replacing the sample of a latest slot as fast as it can
+ * against readers copying it: no reader may see a sample torn by the
+ * writer, or one older than it saw before. Every sample is made of one
+ * number, repeated over a size that depends on it, and has it as time
+ * stamp. A reader falling behind must see the samples it missed counted.
+ * Usage: latestTest [samples]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_latest.h"
+#include "testUtil.h"
+
+#define READERS		2
+#define WORDS		32						// most in a sample
+
+typedef struct {
+	ADSLatest	*l;
+	int			reads;
+	int			torn;				// mixed samples, wrong size or stamp
+	int			older;				// than the one read before
+} Reader;
+
+static int writing;
+
+/* sample i: the number i, 2 to WORDS - 1 times */
+static uint32_t fill(uint32_t *w, uint32_t i)
+{
+	uint32_t k, n = 2 + i % (WORDS - 2);
+
+	for (k = 0; k < n; k++)
+		w[k] = i;
+	return n * 4;
+}
+
+static void *writer(void *arg)
+{
+	ADSLatest *l = (ADSLatest *) arg;
+	uint32_t w[WORDS], i, count = writing;
+
+	for (i = 1; i <= count; i++)
+		ADSlatestPut(l, i, w, fill(w, i));
+	__atomic_store_n(&writing, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	Reader *r = (Reader *) arg;
+	uint32_t w[WORDS], size, k, last = 0;
+	uint64_t timeStamp;
+
+	while (__atomic_load_n(&writing, __ATOMIC_ACQUIRE)) {
+		if (ADSlatestGet(r->l, w, sizeof(w), &size, &timeStamp, NULL) != 0)
+			continue;
+		r->reads++;
+		if (size != 4 * (2 + w[0] % (WORDS - 2)) || timeStamp != w[0])
+			r->torn++;
+		for (k = 1; k < size / 4; k++)
+			if (w[k] != w[0]) {
+				r->torn++;
+				break;
+			}
+		if (w[0] < last)
+			r->older++;
+		last = w[0];
+	}
+	return NULL;
+}
+
+/* what one reader gets, one sample after another */
+static int single(void)
+{
+	ADSLatest *l = ADSlatestNew(WORDS * 4);
+	ADSLatestStats st;
+	uint32_t w[WORDS], size;
+	uint64_t timeStamp, fresh;
+	int errors = 0, i;
+
+	errors += checkHex("empty", ADSlatestGet(l, w, sizeof(w), &size,
+					   &timeStamp, &fresh), 0x1);
+	errors += checkHex("too big", ADSlatestPut(l, 1, w, WORDS * 4 + 1),
+					   0x705);
+	ADSlatestPut(l, 7, w, fill(w, 7));
+	errors += checkHex("small buffer", ADSlatestGet(l, w, 4, &size,
+					   &timeStamp, &fresh), 0x705);
+	memset(w, 0, sizeof(w));
+	errors += checkHex("get", ADSlatestGet(l, w, sizeof(w), &size,
+					   &timeStamp, &fresh), 0);
+	errors += check("  value", w[0], 7);
+	errors += check("  size", size, 4 * 9);
+	errors += check("  time stamp", (int) timeStamp, 7);
+	errors += check("  fresh", (int) fresh, 1);
+	ADSlatestGet(l, w, sizeof(w), &size, &timeStamp, &fresh);
+	errors += check("again: fresh", (int) fresh, 0);
+	for (i = 8; i <= 10; i++)
+		ADSlatestPut(l, i, w, fill(w, i));
+	ADSlatestGet(l, w, sizeof(w), &size, &timeStamp, &fresh);
+	errors += check("three later: value", w[0], 10);
+	errors += check("  fresh", (int) fresh, 3);
+	ADSlatestGetStats(l, &st);
+	errors += check("  stats updates", (int) st.updates, 4);
+	errors += check("  stats dropped", (int) st.dropped, 2);
+	errors += check("  stats reads", (int) st.reads, 3);
+	ADSlatestFree(l);
+	return errors;
+}
+
+/* readers against a writer */
+static int concurrent(int count)
+{
+	ADSLatest *l = ADSlatestNew(WORDS * 4);
+	Reader r[READERS];
+	pthread_t t[READERS + 1];
+	ADSLatestStats st;
+	uint32_t w[WORDS];
+	int errors = 0, i, reads = 0, torn = 0, older = 0;
+
+	memset(r, 0, sizeof(r));
+	writing = count;
+	// the readers find a sample from the start
+	ADSlatestPut(l, 0, w, fill(w, 0));
+	for (i = 0; i < READERS; i++) {
+		r[i].l = l;
+		pthread_create(&t[i], NULL, reader, &r[i]);
+	}
+	pthread_create(&t[READERS], NULL, writer, l);
+	for (i = 0; i <= READERS; i++)
+		pthread_join(t[i], NULL);
+	for (i = 0; i < READERS; i++) {
+		reads += r[i].reads;
+		torn += r[i].torn;
+		older += r[i].older;
+	}
+	printf("%d samples, %d reads\n", count, reads);
+	errors += check("torn", torn, 0);
+	errors += check("older", older, 0);
+	ADSlatestGet(l, w, sizeof(w), NULL, NULL, NULL);
+	errors += check("last value", w[0], count);
+	ADSlatestGetStats(l, &st);
+	errors += check("stats updates", (int) st.updates, count + 1);
+	errors += check("stats reads", (int) st.reads, reads + 1);
+	errors += checkRange("stats dropped", st.dropped, 1, count);
+	ADSlatestFree(l);
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 1000000;
+	int errors = 0;
+
+	errors += single();
+	errors += concurrent(count);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
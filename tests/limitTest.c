@@ -0,0 +1,98 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Runs the adaptive request limit against simulated devices that handle
+ * a given number of requests at once; beyond that the latency grows, far
+ * beyond it they time out. The limit must settle near the capacity of
+ * each device and keep working after the device gets slower.
+ */
+
+#include <stdio.h>
+
+#include "ads_limit.h"
+#include "testUtil.h"
+
+#define BASE_RTT	2000000LL	// 2 ms
+
+static int64_t now;
+
+/*
+ * All requests on the way complete after a latency given by the load,
+ * then the limit decides how many are sent in the next round.
+ */
+static double run(ADSLimit *l, int capacity, int rounds)
+{
+	int64_t rtt;
+	double sum = 0;
+	int r, n, i;
+
+	for (r = 0; r < rounds; r++) {
+		while (ADSlimitAcquire(l))
+			;
+		n = l->inflight;
+		rtt = n > capacity ? BASE_RTT * n / capacity : BASE_RTT;
+		now += rtt;
+		for (i = 0; i < n; i++) {
+			if (n > 4 * capacity)
+				ADSlimitRelease(l, now, 0, 1);	// time out
+			else
+				ADSlimitRelease(l, now, rtt, 0);
+		}
+		if (r >= rounds / 2)
+			sum += l->limit;
+	}
+	return sum / (rounds - rounds / 2);
+}
+
+int main(void)
+{
+	ADSLimit l;
+	int errors = 0, capacity;
+
+	for (capacity = 1; capacity <= 16; capacity *= 4) {
+		char name[32];
+		ADSlimitInit(&l, ADS_LIMIT_INITIAL, ADS_LIMIT_MAX);
+		sprintf(name, "capacity %d: average limit", capacity);
+		errors += checkRange(name, run(&l, capacity, 400), capacity,
+							 capacity * l.tolerance + 1);
+	}
+
+	// a fast device becomes slow: the limit has to come down
+	ADSlimitInit(&l, ADS_LIMIT_INITIAL, ADS_LIMIT_MAX);
+	run(&l, 16, 400);
+	errors += checkRange("capacity 16 -> 2", run(&l, 2, 400), 2,
+						 2 * l.tolerance + 1);
+
+	// time outs alone must halve the limit
+	ADSlimitInit(&l, 16, ADS_LIMIT_MAX);
+	ADSlimitAcquire(&l);
+	ADSlimitRelease(&l, BASE_RTT, 0, 1);
+	errors += checkRange("one time out", l.limit, 8, 8);
+
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
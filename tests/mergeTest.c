@@ -0,0 +1,227 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Merges rings filled with time stamps in order per ring: the merged
+ * stream must be in order, complete while nothing comes too late, and
+ * samples behind the lateness window must be dropped as late. Then
+ * producer threads stamping with the clock feed one ring each.
+ * Usage: mergeTest [samples per producer]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_merge.h"
+
+#define INPUTS	4
+#define MS		10000ULL	// file time units
+
+typedef struct {
+	ADSRing		*r;
+	uint32_t	handle;
+	int			count;
+} Producer;
+
+typedef struct {
+	uint64_t	last;
+	uint64_t	received;
+	uint64_t	sum;			// of the time stamps, to check completeness
+	int			errors;
+} Consumer;
+
+static int running;
+
+static uint64_t fileTime(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	return (uint64_t) t.tv_sec * 10000000 + t.tv_nsec / 100;
+}
+
+static void consume(const ADSSample *s, int input, void *user)
+{
+	Consumer *c = (Consumer *) user;
+
+	if (s->timeStamp < c->last || s->handle != input)
+		c->errors++;
+	c->last = s->timeStamp;
+	c->received++;
+	c->sum += s->timeStamp;
+}
+
+/* everything is there before the merge runs: the sorted union comes out */
+static int ordered(void)
+{
+	ADSRing *r[INPUTS];
+	ADSMerge *m;
+	ADSMergeStats st;
+	Consumer c;
+	uint64_t ts[INPUTS] = { 0 }, sum = 0;
+	int i, k, errors = 0;
+
+	m = ADSmergeNew(INPUTS, 10);
+	for (i = 0; i < INPUTS; i++) {
+		r[i] = ADSringNew(4096, 8, ADS_RING_SPSC);
+		ADSmergeAddInput(m, r[i]);
+		for (k = 0; k < 3000; k++) {
+			ts[i] += rand() % 1000;
+			ADSringPut(r[i], i, ts[i], &k, sizeof(k));
+			sum += ts[i];
+		}
+	}
+	memset(&c, 0, sizeof(c));
+	ADSmergeDrain(m, consume, &c, 0);
+	ADSmergeFlush(m, consume, &c);
+	ADSmergeGetStats(m, &st);
+	if (c.errors || c.received != INPUTS * 3000 || c.sum != sum || st.late) {
+		printf("ordered: %d out of order, %llu of %d received\n", c.errors,
+			   (unsigned long long) c.received, INPUTS * 3000);
+		errors++;
+	}
+	ADSmergeFree(m);
+	for (i = 0; i < INPUTS; i++)
+		ADSringFree(r[i]);
+	return errors;
+}
+
+/* a quiet input holds samples back for the window only */
+static int window(void)
+{
+	ADSRing *a, *b;
+	ADSMerge *m;
+	ADSMergeStats st;
+	Consumer c;
+	uint64_t t;
+	int errors = 0;
+
+	m = ADSmergeNew(2, 50);
+	a = ADSringNew(256, 8, ADS_RING_SPSC);
+	b = ADSringNew(256, 8, ADS_RING_SPSC);
+	ADSmergeAddInput(m, a);
+	ADSmergeAddInput(m, b);
+	memset(&c, 0, sizeof(c));
+	for (t = 0; t <= 100; t += 10)
+		ADSringPut(a, 0, t * MS, &t, sizeof(t));
+	if (ADSmergeDrain(m, consume, &c, 0) != 6)		// 0 to 50 ms
+		errors++;
+	t = 30;
+	ADSringPut(b, 1, t * MS, &t, sizeof(t));		// too late
+	t = 65;
+	ADSringPut(b, 1, t * MS, &t, sizeof(t));
+	ADSmergeAdvance(m, 200 * MS);
+	if (ADSmergeDrain(m, consume, &c, 0) != 6)		// 60 to 100 ms
+		errors++;
+	ADSmergeGetStats(m, &st);
+	if (c.errors || c.received != 12 || st.late != 1 || st.ready != 0) {
+		printf("window: %d out of order, %llu received, %llu late\n",
+			   c.errors, (unsigned long long) c.received,
+			   (unsigned long long) st.late);
+		errors++;
+	}
+	ADSmergeFree(m);
+	ADSringFree(a);
+	ADSringFree(b);
+	if (errors)
+		printf("window wrong\n");
+	return errors;
+}
+
+static void *produce(void *arg)
+{
+	Producer *p = (Producer *) arg;
+	uint64_t ts;
+	int i;
+
+	for (i = 0; i < p->count; i++) {
+		ts = fileTime();
+		while (ADSringPut(p->r, p->handle, ts, &i, sizeof(i)) == 0x502)
+			sched_yield();
+	}
+	__atomic_sub_fetch(&running, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int threads(int count)
+{
+	pthread_t t[INPUTS];
+	Producer p[INPUTS];
+	ADSMerge *m;
+	ADSMergeStats st;
+	Consumer c;
+	int i, errors = 0;
+
+	m = ADSmergeNew(INPUTS, 100);
+	memset(&c, 0, sizeof(c));
+	running = INPUTS;
+	for (i = 0; i < INPUTS; i++) {
+		p[i].r = ADSringNew(1024, 8, ADS_RING_SPSC);
+		p[i].handle = i;
+		p[i].count = count;
+		ADSmergeAddInput(m, p[i].r);
+	}
+	for (i = 0; i < INPUTS; i++)
+		pthread_create(&t[i], NULL, produce, &p[i]);
+	while (__atomic_load_n(&running, __ATOMIC_ACQUIRE) > 0) {
+		ADSmergeAdvance(m, fileTime());
+		if (ADSmergeDrain(m, consume, &c, 256) == 0)
+			ADSmergeWait(m, 1);
+	}
+	for (i = 0; i < INPUTS; i++)
+		pthread_join(t[i], NULL);
+	ADSmergeFlush(m, consume, &c);
+	ADSmergeGetStats(m, &st);
+	printf("%d producers: %llu merged, %llu late\n", INPUTS,
+		   (unsigned long long) st.merged, (unsigned long long) st.late);
+	if (c.errors || c.received + st.late != (uint64_t) INPUTS * count) {
+		printf("  %d out of order\n", c.errors);
+		errors++;
+	}
+	ADSmergeFree(m);
+	for (i = 0; i < INPUTS; i++)
+		ADSringFree(p[i].r);
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 200000;
+	int errors = 0;
+
+	srand(1);
+	errors += ordered();
+	errors += window();
+	errors += threads(count);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
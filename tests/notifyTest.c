@@ -0,0 +1,537 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Runs notifications against a server on the loopback that hands out
+ * device handles and counts them. The server sends no samples, they are
+ * handed to the connection as its receive thread would. Subscriptions
+ * within the area of another with the same attributes must share its
+ * handle and each get its own slice of the samples, those at the same
+ * time must wait for the one handle being asked for. One joining an on
+ * change handle late must get the last sample from the receive thread.
+ * Then a device that sends samples takes the place of the server: they
+ * come in on the receive thread and go into a ring, each tagged with the
+ * subscription it is for, until the ring is full. A latest slot must hold
+ * only the newest one and count those nobody read. A sample pointing into
+ * the receive buffer must keep its bytes as long as it is retained, while
+ * more samples come in.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_async.h"
+#include "ads_latest.h"
+#include "ads_notify.h"
+#include "ads_ring.h"
+#include "ads_server.h"
+#include "testUtil.h"
+
+#define ADDRESS		"127.0.0.1:49000"
+#define DEVICE		"127.0.0.1:49001"		// the one that sends samples
+#define SLOTS		8						// of the ring
+#define THREADS		4						// subscribing at the same time
+#define SLOW		100000					// us a subscription of 0x4021
+											// takes
+
+static int adds, dels;
+static uint32_t handle;					// of the last subscription
+
+typedef struct {
+	int				samples;
+	uint32_t		size;
+	unsigned char	last[16];
+} Got;
+
+typedef struct {
+	ADSConnection	*dc;
+	ADSNotification	*n;
+	Got				got;
+	int				rc;
+} Subscriber;
+
+static int addNote(ADSServerRequest *rq, void *user)
+{
+	ADSaddDeviceNotificationRequest a;
+
+	memcpy(&a, rq->data, sizeof(a));
+	if (a.indexGroup == 0x4021)
+		usleep(SLOW);
+	__atomic_add_fetch(&adds, 1, __ATOMIC_SEQ_CST);
+	*(uint32_t *) rq->out = __atomic_add_fetch(&handle, 1, __ATOMIC_SEQ_CST);
+	rq->outLength = 4;
+	return 0;
+}
+
+static int delNote(ADSServerRequest *rq, void *user)
+{
+	__atomic_add_fetch(&dels, 1, __ATOMIC_SEQ_CST);
+	rq->outLength = 0;
+	return 0;
+}
+
+static void got(ADSNotification *n, uint64_t timeStamp, const void *data,
+				uint32_t size)
+{
+	Got *g = (Got *) n->user;
+
+	memcpy(g->last, data, size < sizeof(g->last) ? size : sizeof(g->last));
+	g->size = size;
+	__atomic_add_fetch(&g->samples, 1, __ATOMIC_SEQ_CST);
+}
+
+/* the samples g got, after waiting up to a second for want of them */
+static int samples(Got *g, int want)
+{
+	int i;
+
+	for (i = 0; i < 100 && __atomic_load_n(&g->samples, __ATOMIC_SEQ_CST)
+		 < want; i++)
+		usleep(10000);
+	return __atomic_load_n(&g->samples, __ATOMIC_SEQ_CST);
+}
+
+/* the int at offset of the last sample g got */
+static int value(Got *g, uint32_t offset)
+{
+	int v;
+
+	memcpy(&v, g->last + offset, 4);
+	return v;
+}
+
+/* a sample of count ints for device handle h, as the device would send it */
+static void sample(ADSConnection *dc, uint32_t h, const int *v, int count)
+{
+	static ADSpacket p;
+	unsigned char *d = (unsigned char *) p.data;
+	uint32_t size = count * 4;
+	uint32_t u[] = { 24 + size, 1, 1, h, size };
+	uint64_t timeStamp = 1;
+
+	memcpy(d, u, 8);
+	memcpy(d + 8, &timeStamp, 8);
+	memcpy(d + 16, u + 2, 12);
+	memcpy(d + 28, v, size);
+	p.amsHeader.commandId = cmdADSdevNotify;
+	p.amsHeader.dataLength = 28 + size;
+	p.adsHeader.length = sizeof(AMSheader) + p.amsHeader.dataLength;
+	_ADSnotifyDispatch(dc, &p, NULL);
+}
+
+/* subscribes n to 0x4020 at offset, its samples go to g */
+static int add(ADSConnection *dc, uint32_t offset,
+			   AdsNotificationAttrib *attrib, Got *g, ADSNotification **n)
+{
+	memset(g, 0, sizeof(*g));
+	return ADSnotifyAdd(dc, 0x4020, offset, attrib, got, NULL, g, n);
+}
+
+static void *subscribe(void *arg)
+{
+	AdsNotificationAttrib attrib = { 16, ADSTRANS_SERVERCYCLE, 0, { 100000 } };
+	Subscriber *s = (Subscriber *) arg;
+
+	s->rc = ADSnotifyAdd(s->dc, 0x4021, 0, &attrib, got, NULL, &s->got,
+						 &s->n);
+	return NULL;
+}
+
+/*
+ * Cyclic: a is the whole area, b and c are slices of it, d reaches beyond
+ * it and e runs at another cycle, both need handles of their own.
+ */
+static int slices(ADSConnection *dc)
+{
+	AdsNotificationAttrib attrib = { 16, ADSTRANS_SERVERCYCLE, 0, { 100000 } };
+	AdsNotificationAttrib other = attrib;
+	ADSNotification *a, *b, *c, *d, *e;
+	Got ga, gb, gc, gd, ge;
+	ADSNotifyStats st;
+	int errors = 0, v[] = { 1, 2, 3, 4 }, h;
+
+	errors += checkHex("subscribe a", add(dc, 0, &attrib, &ga, &a), 0);
+	h = handle;
+	attrib.cbLength = 4;
+	errors += checkHex("  b", add(dc, 4, &attrib, &gb, &b), 0);
+	attrib.cbLength = 8;
+	errors += checkHex("  c", add(dc, 8, &attrib, &gc, &c), 0);
+	errors += check("  device handles", adds, 1);
+	errors += checkHex("  d", add(dc, 12, &attrib, &gd, &d), 0);
+	other.cbLength = 4;
+	other.nCycleTime *= 2;
+	errors += checkHex("  e", add(dc, 0, &other, &ge, &e), 0);
+	errors += check("  device handles", adds, 3);
+	ADSnotifyGetStats(dc, &st);
+	errors += check("  stats feeds", st.feeds, 3);
+	errors += check("  stats subscriptions", st.subscriptions, 5);
+
+	sample(dc, h, v, 4);
+	errors += check("sample: a", ga.samples, 1);
+	errors += check("  its size", ga.size, 16);
+	errors += check("  its last int", value(&ga, 12), 4);
+	errors += check("  b", gb.samples, 1);
+	errors += check("  its size", gb.size, 4);
+	errors += check("  its int", value(&gb, 0), 2);
+	errors += check("  c", gc.samples, 1);
+	errors += check("  its size", gc.size, 8);
+	errors += check("  its ints", value(&gc, 0) * 10 + value(&gc, 4), 34);
+	errors += check("  d", gd.samples, 0);
+	errors += check("  e", ge.samples, 0);
+	v[1] = 5;
+	sample(dc, h, v, 4);
+	errors += check("next sample: b", gb.samples, 2);
+	errors += check("  its int", value(&gb, 0), 5);
+	errors += check("  c, cyclic", gc.samples, 2);
+	ADSnotifyGetStats(dc, &st);
+	errors += check("  stats samples", (int) st.samples, 6);
+
+	ADSnotifyDel(a);
+	ADSnotifyDel(c);
+	errors += check("a and c ended: device ends", dels, 0);
+	ADSnotifyGetStats(dc, &st);
+	errors += check("  stats subscriptions", st.subscriptions, 3);
+	sample(dc, h, v, 4);
+	errors += check("  b", gb.samples, 3);
+	ADSnotifyDel(b);
+	ADSnotifyDel(d);
+	ADSnotifyDel(e);
+	errors += check("all ended: device ends", dels, 3);
+	ADSnotifyGetStats(dc, &st);
+	errors += check("  stats feeds", st.feeds, 0);
+	return errors;
+}
+
+/*
+ * On change: b joins after the first sample, it gets that one from the
+ * receive thread, the device would not send it again. Then each gets
+ * only the samples where its slice changed.
+ */
+static int onChange(ADSConnection *dc)
+{
+	AdsNotificationAttrib attrib = { 8, ADSTRANS_SERVERONCHA, 0, { 0 } };
+	ADSNotification *a, *b;
+	Got ga, gb;
+	int errors = 0, v[] = { 6, 7 }, h, start = adds;
+
+	errors += checkHex("on change: a", add(dc, 32, &attrib, &ga, &a), 0);
+	h = handle;
+	sample(dc, h, v, 2);
+	sample(dc, h, v, 2);
+	errors += check("  a, same twice", ga.samples, 1);
+	attrib.cbLength = 4;
+	errors += checkHex("  b late", add(dc, 36, &attrib, &gb, &b), 0);
+	errors += check("  device handles", adds - start, 1);
+	errors += check("  b replayed", samples(&gb, 1), 1);
+	errors += check("  its int", value(&gb, 0), 7);
+	errors += check("  a", ga.samples, 1);
+	v[0] = 8;
+	sample(dc, h, v, 2);
+	errors += check("first changed: a", ga.samples, 2);
+	errors += check("  b", gb.samples, 1);
+	v[1] = 9;
+	sample(dc, h, v, 2);
+	errors += check("second changed: a", ga.samples, 3);
+	errors += check("  b", gb.samples, 2);
+	errors += check("  its int", value(&gb, 0), 9);
+	ADSnotifyDel(a);
+	ADSnotifyDel(b);
+	return errors;
+}
+
+/* subscriptions at the same time wait for the one handle asked for */
+static int together(ADSConnection *dc)
+{
+	Subscriber s[THREADS];
+	pthread_t t[THREADS];
+	ADSNotifyStats st;
+	int errors = 0, i, rc = 0, start = adds;
+	void *r;
+
+	memset(s, 0, sizeof(s));
+	for (i = 0; i < THREADS; i++) {
+		s[i].dc = dc;
+		pthread_create(&t[i], NULL, subscribe, &s[i]);
+	}
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(t[i], &r);
+		rc |= s[i].rc;
+	}
+	errors += checkHex("together: subscribe", rc, 0);
+	errors += check("  device handles", adds - start, 1);
+	ADSnotifyGetStats(dc, &st);
+	errors += check("  stats feeds", st.feeds, 1);
+	errors += check("  stats subscriptions", st.subscriptions, THREADS);
+	for (i = 0; i < THREADS; i++)
+		if (s[i].rc == 0)
+			ADSnotifyDel(s[i].n);
+	return errors;
+}
+
+typedef struct {
+	int			n[2];				// samples of a and b
+	int			last[2];
+	uint64_t	timeStamp;			// of the last one
+	int			order;				// samples older than the one before
+} Drained;
+
+static void drained(const ADSSample *s, void *user)
+{
+	Drained *d = (Drained *) user;
+	int i = s->size == 4;
+
+	d->n[i]++;
+	memcpy(&d->last[i], s->data + (i ? 0 : 4), 4);
+	if (s->timeStamp < d->timeStamp)
+		d->order++;
+	d->timeStamp = s->timeStamp;
+}
+
+/* drains r until it got want samples, or a second passed without one */
+static int drain(ADSRing *r, Drained *d, int want)
+{
+	int got = 0;
+
+	memset(d, 0, sizeof(*d));
+	while (got < want && ADSringWait(r, 1000))
+		got += ADSringDrain(r, drained, d, 0);
+	return got;
+}
+
+/*
+ * a, the whole 8 bytes, and b, its second half, share a device handle and
+ * one ring. Samples come from the device through the connection.
+ */
+static int ring(ADSConnection *dc, TestDevice *dev)
+{
+	AdsNotificationAttrib attrib = { 8, ADSTRANS_SERVERCYCLE, 0, { 100000 } };
+	ADSNotification *a, *b;
+	ADSRingStats st;
+	Drained d;
+	ADSRing *r;
+	int errors = 0, i, v[2];
+
+	if ((r = ADSringNew(SLOTS, 8, ADS_RING_SPSC)) == NULL)
+		return 1;
+	errors += checkHex("ring: a", ADSnotifyAddRing(dc, 0x4020, 0, &attrib, r,
+					   NULL, NULL, &a), 0);
+	attrib.cbLength = 4;
+	errors += checkHex("  b", ADSnotifyAddRing(dc, 0x4020, 4, &attrib, r,
+					   NULL, NULL, &b), 0);
+	errors += check("  device handles", dev->adds, 1);
+	for (i = 1; i <= 3; i++) {
+		v[0] = i;
+		v[1] = 100 + i;
+		deviceSend(dev, dev->handle, i, v, 8);
+	}
+	errors += check("  drained", drain(r, &d, 6), 6);
+	errors += check("  of a", d.n[0], 3);
+	errors += check("  its last", d.last[0], 103);
+	errors += check("  of b", d.n[1], 3);
+	errors += check("  its last", d.last[1], 103);
+	errors += check("  out of order", d.order, 0);
+
+	// nobody drains: the newest ones are dropped
+	for (i = 4; i <= SLOTS; i++)
+		deviceSend(dev, dev->handle, i, v, 8);
+	for (i = 0; i < 100; i++) {
+		ADSringGetStats(r, &st);
+		if (st.puts + st.dropped == 2 * SLOTS)
+			break;
+		usleep(10000);
+	}
+	errors += check("full: dropped", (int) st.dropped, SLOTS - 6);
+	errors += check("  drained", drain(r, &d, SLOTS), SLOTS);
+	errors += check("  out of order", d.order, 0);
+	ADSnotifyDel(a);
+	ADSnotifyDel(b);
+	errors += check("  device ends", dev->dels, 1);
+	ADSringFree(r);
+	return errors;
+}
+
+/* samples from the device into a latest slot nobody reads for a while */
+static int latest(ADSConnection *dc, TestDevice *dev)
+{
+	AdsNotificationAttrib attrib = { 8, ADSTRANS_SERVERCYCLE, 0, { 100000 } };
+	ADSNotification *n;
+	ADSLatestStats st;
+	ADSLatest *l;
+	uint64_t timeStamp, fresh;
+	uint32_t size;
+	int errors = 0, i, v[2];
+
+	if ((l = ADSlatestNew(8)) == NULL)
+		return 1;
+	errors += checkHex("latest", ADSnotifyAddLatest(dc, 0x4020, 16, &attrib,
+					   l, NULL, NULL, &n), 0);
+	for (i = 1; i <= 5; i++) {
+		v[0] = i;
+		v[1] = 10 * i;
+		deviceSend(dev, dev->handle, i, v, 8);
+	}
+	for (i = 0; i < 100; i++) {
+		ADSlatestGetStats(l, &st);
+		if (st.updates == 5)
+			break;
+		usleep(10000);
+	}
+	errors += checkHex("  get", ADSlatestGet(l, v, sizeof(v), &size,
+					   &timeStamp, &fresh), 0);
+	errors += check("  value", v[1], 50);
+	errors += check("  time stamp", (int) timeStamp, 5);
+	errors += check("  fresh", (int) fresh, 5);
+	ADSlatestGetStats(l, &st);
+	errors += check("  stats dropped", (int) st.dropped, 4);
+	ADSnotifyDel(n);
+	ADSlatestFree(l);
+	return errors;
+}
+
+typedef struct {
+	int				samples;
+	int				wrong;			// samples with other than was sent
+	ADSSampleRef	held;			// the first one, retained
+} Refs;
+
+/* sample i has i and 1000 + i, time stamp i */
+static void referred(ADSNotification *n, const ADSSampleRef *s)
+{
+	Refs *r = (Refs *) n->user;
+	int v[2], i = r->samples + 1;
+
+	memcpy(v, s->data, sizeof(v));
+	if (s->size != 8 || s->timeStamp != i || v[0] != i || v[1] != 1000 + i)
+		r->wrong++;
+	if (i == 1) {
+		ADSrxRetain(s->buffer);
+		r->held = *s;
+	}
+	__atomic_store_n(&r->samples, i, __ATOMIC_SEQ_CST);
+}
+
+/* waits up to a second for want samples */
+static void awaitRefs(Refs *r, int want)
+{
+	int i;
+
+	for (i = 0; i < 100 && __atomic_load_n(&r->samples, __ATOMIC_SEQ_CST)
+		 < want; i++)
+		usleep(10000);
+}
+
+/* the first sample is kept beyond its callback while more packets come */
+static int retained(ADSConnection *dc, TestDevice *dev)
+{
+	AdsNotificationAttrib attrib = { 8, ADSTRANS_SERVERCYCLE, 0, { 100000 } };
+	ADSNotification *n;
+	Refs r;
+	int errors = 0, i, v[2];
+
+	memset(&r, 0, sizeof(r));
+	errors += checkHex("ref", ADSnotifyAddRef(dc, 0x4020, 24, &attrib,
+					   referred, NULL, &r, &n), 0);
+	// the first one alone, the others come into the buffer after it
+	for (i = 1; i <= 100; i++) {
+		v[0] = i;
+		v[1] = 1000 + i;
+		deviceSend(dev, dev->handle, i, v, 8);
+		if (i == 1)
+			awaitRefs(&r, 1);
+	}
+	awaitRefs(&r, 100);
+	errors += check("  samples", r.samples, 100);
+	errors += check("  wrong", r.wrong, 0);
+	memcpy(v, r.held.data, sizeof(v));
+	errors += check("  held first", v[0], 1);
+	errors += check("  its second int", v[1], 1001);
+	// the engine went on with a fresh buffer and let go of this one
+	errors += check("  its references",
+					__atomic_load_n(&r.held.buffer->refs, __ATOMIC_SEQ_CST),
+					1);
+	ADSrxRelease(r.held.buffer);
+	ADSnotifyDel(n);
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	AmsAddr a = { { { 127, 0, 0, 1, 1, 1 } }, 851 };
+	int errors = 0, e;
+	ADSConnection *dc;
+	TestDevice *dev;
+	ADSServer *s;
+	pthread_t t;
+	void *rc;
+
+	if (routeTo(ADDRESS))
+		return 1;
+	s = ADSserverNew(ADDRESS, 2);
+	if (s == NULL) {
+		printf("cannot listen on %s\n", ADDRESS);
+		return 1;
+	}
+	ADSserverOn(s, cmdADSaddDeviceNotification, addNote, NULL);
+	ADSserverOn(s, cmdADSdeleteDeviceNotification, delNote, NULL);
+	pthread_create(&t, NULL, serve, s);
+
+	dc = ADSsocketConnect(&a, &e);
+	if (dc == NULL) {
+		printf("cannot connect: 0x%x\n", e);
+		return 1;
+	}
+	errors += slices(dc);
+	errors += onChange(dc);
+	errors += together(dc);
+
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	ADSserverStop(s);
+	pthread_join(t, &rc);
+	ADSserverFree(s);
+
+	if (routeTo(DEVICE) || (dev = deviceNew(DEVICE)) == NULL)
+		return 1;
+	dc = ADSsocketConnect(&a, &e);
+	if (dc == NULL) {
+		printf("cannot connect: 0x%x\n", e);
+		return 1;
+	}
+	errors += ring(dc, dev);
+	errors += latest(dc, dev);
+	errors += retained(dc, dev);
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	deviceFree(dev);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1,181 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Runs producers against one consumer on a single and a multi producer
+ * ring: every sample must arrive once, in order per producer, with its
+ * data intact. The producers retry when the ring is full, so nothing may
+ * be lost; a ring nobody drains must drop.
+ * Usage: ringTest [samples per producer]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_ring.h"
+
+#define PRODUCERS	4
+
+typedef struct {
+	ADSRing		*r;
+	uint32_t	handle;
+	int			count;
+} Producer;
+
+typedef struct {
+	uint64_t	next[PRODUCERS];	// least sequence number expected
+	uint64_t	received;
+	int			errors;
+} Consumer;
+
+static int running;
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* sample i of a producer: 8 to 31 bytes counting up from i */
+static int put(ADSRing *r, uint32_t handle, uint64_t i)
+{
+	unsigned char data[32];
+	int k;
+
+	for (k = 0; k < sizeof(data); k++)
+		data[k] = (unsigned char)(i + k);
+	return ADSringPut(r, handle, i, data, 8 + i % 24);
+}
+
+static void *produce(void *arg)
+{
+	Producer *p = (Producer *) arg;
+	uint64_t i;
+
+	for (i = 0; i < p->count; i++)
+		while (put(p->r, p->handle, i) == 0x502)
+			sched_yield();
+	__atomic_sub_fetch(&running, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void consume(const ADSSample *s, void *user)
+{
+	Consumer *c = (Consumer *) user;
+	int k;
+
+	c->received++;
+	if (s->handle >= PRODUCERS || s->timeStamp < c->next[s->handle]
+		|| s->size != 8 + s->timeStamp % 24) {
+		c->errors++;
+		return;
+	}
+	c->next[s->handle] = s->timeStamp + 1;
+	for (k = 0; k < s->size; k++)
+		if (s->data[k] != (unsigned char)(s->timeStamp + k)) {
+			c->errors++;
+			break;
+		}
+}
+
+static int run(int mode, int producers, int count)
+{
+	pthread_t t[PRODUCERS];
+	Producer p[PRODUCERS];
+	Consumer c;
+	ADSRingStats st;
+	ADSRing *r;
+	double t0;
+	int i, errors = 0;
+
+	r = ADSringNew(1024, 32, mode);
+	memset(&c, 0, sizeof(c));
+	running = producers;
+	t0 = now();
+	for (i = 0; i < producers; i++) {
+		p[i].r = r;
+		p[i].handle = i;
+		p[i].count = count;
+		pthread_create(&t[i], NULL, produce, &p[i]);
+	}
+	while (__atomic_load_n(&running, __ATOMIC_ACQUIRE) > 0)
+		if (ADSringDrain(r, consume, &c, 256) == 0)
+			ADSringWait(r, 1);
+	ADSringDrain(r, consume, &c, 0);
+	t0 = now() - t0;
+	for (i = 0; i < producers; i++)
+		pthread_join(t[i], NULL);
+
+	if (ADSringPut(r, 0, 0, &c, 33) != 0x705)
+		errors++;
+	ADSringGetStats(r, &st);
+	printf("%s, %d producers: %.1f M samples/s, %llu full, %llu wakeups\n",
+		   mode == ADS_RING_SPSC ? "spsc" : "mpsc", producers,
+		   (double) producers * count / t0 / 1e6,
+		   (unsigned long long) st.dropped, (unsigned long long) st.wakeups);
+	if (c.errors || c.received != (uint64_t) producers * count
+		|| st.puts != c.received || st.drained != st.puts
+		|| st.oversized != 1) {
+		printf("  %d samples wrong, %llu received\n", c.errors,
+			   (unsigned long long) c.received);
+		errors++;
+	}
+	ADSringFree(r);
+
+	// nobody drains: the newest samples are dropped
+	r = ADSringNew(16, 32, mode);
+	for (i = 0; i < 20; i++)
+		put(r, 0, i);
+	memset(&c, 0, sizeof(c));
+	ADSringGetStats(r, &st);
+	if (st.puts != 16 || st.dropped != 4
+		|| ADSringDrain(r, consume, &c, 0) != 16 || c.next[0] != 16
+		|| c.errors) {
+		printf("  full ring wrong\n");
+		errors++;
+	}
+	ADSringFree(r);
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 1000000;
+	int errors = 0;
+
+	errors += run(ADS_RING_SPSC, 1, count);
+	errors += run(ADS_RING_MPSC, 1, count);
+	errors += run(ADS_RING_MPSC, PRODUCERS, count);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
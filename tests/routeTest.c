@@ -0,0 +1,186 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Reloads the route table over and over while readers look every device
+ * up: each lookup must find the route of the table before or of the one
+ * after, never none or a mix. The two versions of the file move all
+ * devices to other ports, one device is only in the first, one only in
+ * the second. A bad file must leave the table as it was.
+ * Usage: routeTest [reloads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_route.h"
+#include "testUtil.h"
+
+#define DEVICES		200						// in both versions
+#define READERS		4
+#define OLD			1000					// ports of the first version
+#define NEW			2000					// and of the second
+
+typedef struct {
+	int			lookups;
+	int			wrong;				// no route, or one of neither version
+	int			oldOnly, newOnly;	// found, the device only in one version
+} Reader;
+
+static char path[] = "/tmp/routeTestXXXXXX";
+static int reading;
+
+/* device i, the last two only in one version */
+static void netId(int i, AmsNetId *id)
+{
+	AmsNetId d = { { 10, 0, i >> 8, i & 0xff, 1, 1 } };
+
+	*id = d;
+}
+
+/* writes version base, OLD or NEW, of the route file; 0 or -1 */
+static int version(int base)
+{
+	FILE *f = fopen(path, "w");
+	int i;
+
+	if (f == NULL)
+		return -1;
+	fprintf(f, "# version %d\n", base);
+	for (i = 0; i < DEVICES; i++)
+		fprintf(f, "10.0.%d.%d.1.1\t127.0.0.1:%d\n", i >> 8, i & 0xff,
+				base + i);
+	i = base == OLD ? DEVICES : DEVICES + 1;
+	fprintf(f, "10.0.%d.%d.1.1\t127.0.0.1:%d\n", i >> 8, i & 0xff, base + i);
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+static void *reader(void *arg)
+{
+	Reader *r = (Reader *) arg;
+	struct sockaddr_in a;
+	AmsNetId id;
+	int i, port;
+
+	while (__atomic_load_n(&reading, __ATOMIC_ACQUIRE))
+		for (i = 0; i < DEVICES + 2; i++) {
+			netId(i, &id);
+			r->lookups++;
+			if (ADSrouteFind(&id, &a) != 0) {
+				if (i < DEVICES)
+					r->wrong++;
+				continue;
+			}
+			port = ntohs(a.sin_port);
+			if (port != OLD + i && port != NEW + i)
+				r->wrong++;
+			if (i == DEVICES && port != OLD + i)
+				r->wrong++;
+			if (i == DEVICES + 1 && port != NEW + i)
+				r->wrong++;
+			r->oldOnly += i == DEVICES;
+			r->newOnly += i == DEVICES + 1;
+		}
+	return NULL;
+}
+
+/* the port of device i, -1 if it has no route */
+static int port(int i)
+{
+	struct sockaddr_in a;
+	AmsNetId id;
+
+	netId(i, &id);
+	return ADSrouteFind(&id, &a) == 0 ? ntohs(a.sin_port) : -1;
+}
+
+int main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 200;
+	int errors = 0, fd, i, rc = 0;
+	int lookups = 0, wrong = 0, oldOnly = 0, newOnly = 0;
+	pthread_t t[READERS];
+	Reader r[READERS];
+	ADSRouteStats st;
+	FILE *f;
+
+	fd = mkstemp(path);
+	if (fd < 0 || version(OLD) != 0 || ADSrouteLoad(path) != 0) {
+		printf("cannot load %s\n", path);
+		return 1;
+	}
+	close(fd);
+	errors += check("first version", port(7), OLD + 7);
+	errors += check("  only in it", port(DEVICES), OLD + DEVICES);
+	errors += check("  not in it", port(DEVICES + 1), -1);
+
+	memset(r, 0, sizeof(r));
+	reading = 1;
+	for (i = 0; i < READERS; i++)
+		pthread_create(&t[i], NULL, reader, &r[i]);
+	for (i = 0; i < count; i++)
+		rc |= version(i % 2 ? OLD : NEW) || ADSrouteReload();
+	__atomic_store_n(&reading, 0, __ATOMIC_RELEASE);
+	for (i = 0; i < READERS; i++) {
+		pthread_join(t[i], NULL);
+		lookups += r[i].lookups;
+		wrong += r[i].wrong;
+		oldOnly += r[i].oldOnly;
+		newOnly += r[i].newOnly;
+	}
+	printf("%d reloads, %d lookups\n", count, lookups);
+	errors += check("reloads failed", rc, 0);
+	errors += check("wrong routes", wrong, 0);
+	errors += check("found only in the first", oldOnly > 0, 1);
+	errors += check("found only in the second", newOnly > 0, 1);
+
+	version(NEW);
+	ADSrouteReload();
+	errors += check("second version", port(7), NEW + 7);
+	errors += check("  only in the first", port(DEVICES), -1);
+	errors += check("  only in it", port(DEVICES + 1), NEW + DEVICES + 1);
+	ADSrouteGetStats(&st);
+	errors += check("  stats routes", st.routes, DEVICES + 1);
+	errors += check("  stats loads", (int) st.loads, count + 2);
+
+	// a line with more than NetId and address
+	f = fopen(path, "a");
+	fprintf(f, "10.0.9.9.1.1\t127.0.0.1:9 extra\n");
+	fclose(f);
+	errors += checkHex("bad file", ADSrouteReload(), 0x741);
+	errors += check("  kept", port(7), NEW + 7);
+	ADSrouteGetStats(&st);
+	errors += check("  stats errors", (int) st.errors, 1);
+	unlink(path);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1,615 @@
+#define _GNU_SOURCE		// memfd_create()
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Runs a router with two I/O threads in front of a server on the loopback,
+ * clients talk to the server through the router only. Clients on
+ * connections of their own must read back what they wrote, and pipelining
+ * clients using the same invokeIds must each get their own answers. Reads
+ * of the same while one is on the way must be answered by that one, but
+ * not across a write. A client with more requests on the way than its
+ * limit gets the rest refused with 0x502. Clients in shared memory and on
+ * the unix socket must get the same as those on TCP, shared memory that
+ * may shrink must be refused. At last the server goes away:
+ * a read on the way fails, a subscriber is closed, and when the server is
+ * back the router connects to it again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_notify.h"
+#include "ads_server.h"
+#include "ads_shm.h"
+#include "ads_router.h"
+#include "testUtil.h"
+
+#define ADDRESS		"127.0.0.1:48991"		// the server
+#define ROUTER		"127.0.0.1:48992"
+#define SHM			"/tmp/routerTest.shm"	// sockets of the local clients
+#define UNIX		"/tmp/routerTest.unix"
+#define CLIENTS		16
+#define LOOPS		200
+#define PIPES		4						// pipelining clients
+#define PENDING		16						// their limit in the router
+#define SHARED		8						// clients reading the same
+#define SLOW		100000					// us a read of 0x4021 takes
+
+static unsigned char mem[CLIENTS * 4 + PIPES * 4];
+static pthread_mutex_t memLock = PTHREAD_MUTEX_INITIALIZER;
+static int slowValue, slowReads;
+static pthread_barrier_t sharedStart;
+
+static int memory(ADSServerRequest *rq, void *user)
+{
+	if (rq->indexOffset > sizeof(mem)
+		|| rq->length > sizeof(mem) - rq->indexOffset
+		|| rq->outLength > sizeof(mem) - rq->indexOffset)
+		return 0x703;
+	pthread_mutex_lock(&memLock);
+	if (rq->header.commandId == cmdADSreadWrite)
+		memcpy(rq->out, mem + rq->indexOffset, rq->outLength);
+	memcpy(mem + rq->indexOffset, rq->data, rq->length);
+	if (rq->header.commandId == cmdADSread)
+		memcpy(rq->out, mem + rq->indexOffset, rq->outLength);
+	pthread_mutex_unlock(&memLock);
+	return 0;
+}
+
+/* one value at any offset, reads take SLOW after they looked at it */
+static int slow(ADSServerRequest *rq, void *user)
+{
+	if (rq->header.commandId == cmdADSwrite && rq->length == 4) {
+		__atomic_store_n(&slowValue, *(int *) rq->data, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+	if (rq->header.commandId != cmdADSread || rq->outLength != 4)
+		return 0x705;
+	__atomic_add_fetch(&slowReads, 1, __ATOMIC_SEQ_CST);
+	*(int *) rq->out = __atomic_load_n(&slowValue, __ATOMIC_SEQ_CST);
+	usleep(SLOW);
+	return 0;
+}
+
+/* notification handles, the device never sends a sample */
+static int addNote(ADSServerRequest *rq, void *user)
+{
+	static uint32_t handle;
+
+	*(uint32_t *) rq->out = __atomic_add_fetch(&handle, 1, __ATOMIC_SEQ_CST);
+	rq->outLength = 4;
+	return 0;
+}
+
+static int delNote(ADSServerRequest *rq, void *user)
+{
+	rq->outLength = 0;
+	return 0;
+}
+
+static void *route(void *arg)
+{
+	return (void *)(long) ADSrouterRun((ADSRouter *) arg);
+}
+
+static ADSServer *server(void)
+{
+	ADSServer *s = ADSserverNew(ADDRESS, 4);
+
+	if (s == NULL) {
+		printf("cannot listen on %s\n", ADDRESS);
+		return NULL;
+	}
+	ADSserverOnGroups(s, 0x4020, 0x4020, memory, NULL);
+	ADSserverOnGroups(s, 0x4021, 0x4021, slow, NULL);
+	ADSserverOn(s, cmdADSaddDeviceNotification, addNote, NULL);
+	ADSserverOn(s, cmdADSdeleteDeviceNotification, delNote, NULL);
+	return s;
+}
+
+static ADSConnection *connectDevice(void)
+{
+	AmsAddr a = { { { 127, 0, 0, 1, 1, 1 } }, 851 };
+	ADSConnection *dc;
+	int e;
+
+	dc = ADSsocketConnect(&a, &e);
+	if (dc == NULL)
+		printf("cannot connect through the router: 0x%x\n", e);
+	return dc;
+}
+
+static void *client(void *arg)
+{
+	int id = (int)(long) arg, i, v, w, old, errors = 0;
+	uint32_t n;
+	ADSConnection *dc;
+
+	if ((dc = connectDevice()) == NULL)
+		return (void *) 1L;
+	for (i = 0; i < LOOPS; i++) {
+		v = id * 100000 + i;
+		if (ADSwriteBytes(dc, 0x4020, id * 4, 4, &v) != 0
+			|| ADSreadBytes(dc, 0x4020, id * 4, 4, &w, &n) != 0
+			|| w != v || n != 4)
+			errors++;
+		w = -v;
+		if (ADSreadWriteBytes(dc, 0x4020, id * 4, 4, &old, 4, &w, &n) != 0
+			|| old != v)
+			errors++;
+	}
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	if (errors)
+		printf("client %d: %d errors\n", id, errors);
+	return (void *)(long) errors;
+}
+
+/*
+ * Sends count reads with invokeIds 0 .. count - 1 to the router before it
+ * reads any answer, each answer must come once. Reads of 0x4020 must give
+ * what is at offset; of 0x4021 each one reads at an offset of its own so
+ * none is shared. Returns the number of errors, refused counts the answers
+ * with 0x502.
+ */
+static long pipeline(int id, uint32_t group, uint32_t offset, int count,
+					 int *refused)
+{
+	struct {
+		AMS_TCPheader	tcp;
+		AMSheader		ams;
+		ADSreadRequest	rq;
+	} __attribute__((packed)) p;
+	struct {
+		AMS_TCPheader	tcp;
+		AMSheader		ams;
+		uint32_t		result;
+		uint32_t		length;
+		int				value;
+	} __attribute__((packed)) a;
+	AmsNetId device = { { 127, 0, 0, 1, 1, 1 } };
+	unsigned char seen[256];
+	struct sockaddr_in addr;
+	long errors = 0;
+	int fd, i, expect;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	ADSparseAddress(ROUTER, 0, &addr);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		close(fd);
+		return 1;
+	}
+	memset(&p, 0, sizeof(p));
+	memset(seen, 0, sizeof(seen));
+	p.tcp.length = sizeof(AMSheader) + sizeof(ADSreadRequest);
+	p.ams.targetId = device;
+	p.ams.targetPort = 851;
+	p.ams.sourceId = device;
+	p.ams.sourceId.b[5] = 2 + id;
+	p.ams.sourcePort = 40000 + id;
+	p.ams.commandId = cmdADSread;
+	p.ams.stateFlags = sfAMScommand;
+	p.ams.dataLength = sizeof(ADSreadRequest);
+	p.rq.indexGroup = group;
+	p.rq.length = 4;
+	for (i = 0; i < count; i++) {
+		p.ams.invokeId = i;
+		p.rq.indexOffset = group == 0x4021 ? i * 4 : offset;
+		if (send(fd, &p, sizeof(p), 0) != sizeof(p))
+			errors++;
+	}
+	pthread_mutex_lock(&memLock);
+	memcpy(&expect, mem + offset, 4);
+	pthread_mutex_unlock(&memLock);
+	if (refused != NULL)
+		*refused = 0;
+	for (i = 0; i < count; i++) {
+		if (recv(fd, &a, sizeof(AMS_TCPheader) + sizeof(AMSheader),
+				 MSG_WAITALL) != sizeof(AMS_TCPheader) + sizeof(AMSheader)
+			|| a.ams.invokeId >= count || seen[a.ams.invokeId]++
+			|| memcmp(&a.ams.targetId, &p.ams.sourceId, sizeof(AmsNetId))
+			|| a.ams.targetPort != p.ams.sourcePort) {
+			errors++;
+			break;
+		}
+		if (a.ams.errorCode == 0x502 && a.ams.dataLength == 0
+			&& refused != NULL) {
+			(*refused)++;
+			continue;
+		}
+		if (a.ams.errorCode != 0 || a.ams.dataLength != 12
+			|| recv(fd, &a.result, 12, MSG_WAITALL) != 12
+			|| a.result != 0 || a.length != 4
+			|| (group == 0x4020 && a.value != expect)) {
+			errors++;
+			break;
+		}
+	}
+	close(fd);
+	return errors;
+}
+
+static void *pipes(void *arg)
+{
+	int id = (int)(long) arg;
+	long errors = pipeline(id, 0x4020, (CLIENTS + id) * 4, PENDING, NULL);
+
+	if (errors)
+		printf("pipe %d: %ld errors\n", id, errors);
+	return (void *) errors;
+}
+
+static void *shared(void *arg)
+{
+	ADSConnection *dc = (ADSConnection *) arg;
+	uint32_t n;
+	int v;
+
+	pthread_barrier_wait(&sharedStart);
+	if (ADSreadBytes(dc, 0x4021, 0, 4, &v, &n) != 0 || n != 4)
+		return (void *)(long) -1;
+	return (void *)(long) v;
+}
+
+/* clients on their own connections and pipelining ones at the same time */
+static int roundTrip(void)
+{
+	pthread_t c[CLIENTS + PIPES];
+	void *rc;
+	long errors = 0;
+	int i, v;
+
+	for (i = 0; i < PIPES; i++) {
+		v = 1000 + i;
+		memcpy(mem + (CLIENTS + i) * 4, &v, 4);
+	}
+	for (i = 0; i < CLIENTS; i++)
+		pthread_create(&c[i], NULL, client, (void *)(long) i);
+	for (i = 0; i < PIPES; i++)
+		pthread_create(&c[CLIENTS + i], NULL, pipes, (void *)(long) i);
+	for (i = 0; i < CLIENTS + PIPES; i++) {
+		pthread_join(c[i], &rc);
+		errors += (long) rc;
+	}
+	printf("round trip: %ld errors\n", errors);
+	return errors != 0;
+}
+
+/*
+ * SHARED clients read the same at once, the device must see one read;
+ * then a read on the way while another client writes must not answer a
+ * read that comes after the write.
+ */
+static int coalesce(ADSRouter *r)
+{
+	ADSConnection *dc[SHARED];
+	ADSRouterStats before, after;
+	pthread_t t[SHARED];
+	uint32_t n;
+	void *rc;
+	int i, v, errors = 0, reads;
+
+	for (i = 0; i < SHARED; i++)
+		if ((dc[i] = connectDevice()) == NULL)
+			return 1;
+	v = 7;
+	if (ADSwriteBytes(dc[0], 0x4021, 0, 4, &v) != 0)
+		errors++;
+	ADSrouterGetStats(r, &before);
+	reads = __atomic_load_n(&slowReads, __ATOMIC_SEQ_CST);
+	pthread_barrier_init(&sharedStart, NULL, SHARED);
+	for (i = 0; i < SHARED; i++)
+		pthread_create(&t[i], NULL, shared, dc[i]);
+	for (i = 0; i < SHARED; i++) {
+		pthread_join(t[i], &rc);
+		if ((long) rc != 7)
+			errors++;
+	}
+	pthread_barrier_destroy(&sharedStart);
+	ADSrouterGetStats(r, &after);
+	reads = __atomic_load_n(&slowReads, __ATOMIC_SEQ_CST) - reads;
+	printf("coalesce: %d clients, %d reads at the device, %llu coalesced\n",
+		   SHARED, reads,
+		   (unsigned long long)(after.coalesced - before.coalesced));
+	if (reads >= SHARED || reads + (after.coalesced - before.coalesced)
+		!= SHARED)
+		errors++;
+
+	// dc[0] reads 7, dc[1] writes 8 meanwhile, dc[2] must read 8
+	pthread_barrier_init(&sharedStart, NULL, 1);
+	pthread_create(&t[0], NULL, shared, dc[0]);
+	usleep(SLOW / 4);
+	v = 8;
+	if (ADSwriteBytes(dc[1], 0x4021, 0, 4, &v) != 0
+		|| ADSreadBytes(dc[2], 0x4021, 0, 4, &v, &n) != 0 || v != 8)
+		errors++;
+	pthread_join(t[0], &rc);
+	if ((long) rc != 7)
+		errors++;
+	pthread_barrier_destroy(&sharedStart);
+	for (i = 0; i < SHARED; i++) {
+		ADSsocketDisconnect(dc[i]);
+		ADSFreeConnection(dc[i]);
+	}
+	printf("coalesce: %d errors\n", errors);
+	return errors != 0;
+}
+
+/* twice the limit of slow reads at once, the second half is refused */
+static int limit(ADSRouter *r)
+{
+	ADSRouterStats before, after;
+	int refused, errors = 0;
+
+	ADSrouterGetStats(r, &before);
+	if (pipeline(PIPES, 0x4021, 0, 2 * PENDING, &refused) != 0)
+		errors++;
+	ADSrouterGetStats(r, &after);
+	printf("limit: %d of %d refused, %llu rejected\n", refused, 2 * PENDING,
+		   (unsigned long long)(after.rejected - before.rejected));
+	if (refused != PENDING || after.rejected - before.rejected != PENDING)
+		errors++;
+	return errors != 0;
+}
+
+/*
+ * Hands the router shared memory as ADSshmConnect() does, but not sealed:
+ * the client could shrink it under the router. Returns the status the
+ * router answers with, -1 if none.
+ */
+static int unsealed(void)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	struct pollfd pfd;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} cbuf;
+	uint32_t hello[] = { ADS_SHM_MAGIC, ADS_SHM_RINGSIZE };
+	int32_t status = -1;
+	int fd, fds[3];
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, SHM);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	fds[0] = memfd_create("routerTest", 0);
+	fds[1] = eventfd(0, EFD_NONBLOCK);
+	fds[2] = eventfd(0, EFD_NONBLOCK);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+		|| ftruncate(fds[0], 2 * (sizeof(ADSShmRing) + ADS_SHM_RINGSIZE))
+		   != 0)
+		goto out;
+	iov.iov_base = hello;
+	iov.iov_len = sizeof(hello);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(hello) || poll(&pfd, 1, 5000)
+		!= 1 || recv(fd, &status, sizeof(status), 0) != sizeof(status))
+		status = -1;
+out:
+	close(fd);
+	close(fds[0]);
+	close(fds[1]);
+	close(fds[2]);
+	return status;
+}
+
+/* a client of the router at via writes, reads back and swaps a value */
+static int through(const char *via, int v)
+{
+	ADSConnection *dc;
+	uint32_t n;
+	int w, old, errors = 0;
+
+	if (ADSsetRouter(via) != 0 || (dc = connectDevice()) == NULL)
+		return 1;
+	w = -v;
+	if (ADSwriteBytes(dc, 0x4020, 0, 4, &v) != 0
+		|| ADSreadBytes(dc, 0x4020, 0, 4, &old, &n) != 0 || old != v
+		|| ADSreadWriteBytes(dc, 0x4020, 0, 4, &old, 4, &w, &n) != 0
+		|| old != v || ADSreadBytes(dc, 0x4020, 0, 4, &old, &n) != 0
+		|| old != w)
+		errors++;
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	return errors;
+}
+
+/* clients in shared memory and on the unix socket, then on TCP again */
+static int transports(void)
+{
+	int errors = 0, status;
+
+	status = unsealed();
+	errors += through(ADS_SHM_PREFIX SHM, 11);
+	errors += through(ADS_UNIX_PREFIX UNIX, 12);
+	errors += through(ROUTER, 13);
+	printf("transports: unsealed memory refused with %d, %d errors\n",
+		   status, errors);
+	if (status <= 0)
+		errors++;
+	return errors != 0;
+}
+
+static void *lostRead(void *arg)
+{
+	ADSConnection *dc = (ADSConnection *) arg;
+	uint32_t n;
+	int v;
+
+	return (void *)(long) ADSreadBytes(dc, 0x4021, 0, 4, &v, &n);
+}
+
+static void ended(ADSNotification *n, int err)
+{
+	__atomic_store_n((int *) n->user, err, __ATOMIC_SEQ_CST);
+}
+
+static void sample(ADSNotification *n, uint64_t timeStamp, const void *data,
+				   uint32_t size)
+{
+}
+
+/*
+ * The server goes away with a read on the way and a subscriber, both
+ * must hear of it long before a request would expire. Then the server
+ * comes back on a new thread, *s and *t, and is used again.
+ */
+static int linkLoss(ADSServer **s, pthread_t *t)
+{
+	AdsNotificationAttrib attrib = { 4, ADSTRANS_SERVERONCHA, 0, { 0 } };
+	ADSConnection *reader, *sub, *dc;
+	ADSNotification *n;
+	pthread_t lost;
+	time_t start;
+	void *rc;
+	uint32_t got;
+	int errors = 0, end = 0, i, v;
+
+	if ((reader = connectDevice()) == NULL || (sub = connectDevice()) == NULL)
+		return 1;
+	if (ADSnotifyAdd(sub, 0x4020, 0, &attrib, sample, ended, &end, &n) != 0)
+		errors++;
+	pthread_create(&lost, NULL, lostRead, reader);
+	usleep(SLOW / 4);
+	start = time(NULL);
+	ADSserverStop(*s);
+	pthread_join(*t, &rc);
+	ADSserverFree(*s);
+	pthread_join(lost, &rc);
+	if (rc == NULL)
+		errors++;
+	for (i = 0; i < 100 && __atomic_load_n(&end, __ATOMIC_SEQ_CST) == 0; i++)
+		usleep(10000);
+	printf("link loss: read failed with 0x%lx, subscriber ended with 0x%x "
+		   "after %lds\n", (long) rc, end, (long)(time(NULL) - start));
+	if (end == 0 || time(NULL) - start >= ADS_ROUTER_TIMEOUT)
+		errors++;
+	ADSsocketDisconnect(reader);
+	ADSFreeConnection(reader);
+	ADSsocketDisconnect(sub);
+	ADSFreeConnection(sub);
+
+	if ((*s = server()) == NULL)
+		return 1;
+	pthread_create(t, NULL, serve, *s);
+	sleep(ADS_ROUTER_RETRY + 1);
+	if ((dc = connectDevice()) == NULL)
+		return 1;
+	v = 42;
+	if (ADSwriteBytes(dc, 0x4020, 0, 4, &v) != 0
+		|| ADSreadBytes(dc, 0x4020, 0, 4, &v, &got) != 0 || v != 42)
+		errors++;
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	printf("link loss: %d errors\n", errors);
+	return errors != 0;
+}
+
+int main(int argc, char **argv)
+{
+	ADSRouterLimits limits = { PENDING, ADS_ROUTER_LINKQUEUE,
+							   ADS_ROUTER_CLIENTTX };
+	AmsNetId netId = { { 10, 0, 0, 1, 1, 1 } };
+	int errors = 0;
+	ADSRouterStats st;
+	pthread_t t, rt;
+	ADSServer *s;
+	ADSRouter *r;
+	void *rc;
+
+	if (routeTo(ADDRESS))
+		return 1;
+	if ((s = server()) == NULL)
+		return 1;
+	r = ADSrouterNew(ROUTER, &netId);
+	if (r == NULL || ADSrouterThreads(r, 2) != 0
+		|| ADSrouterSetLimits(r, &limits) != 0
+		|| ADSrouterListenShm(r, SHM) != 0
+		|| ADSrouterListenUnix(r, UNIX) != 0
+		|| ADSsetRouter(ROUTER) != 0) {
+		printf("cannot set up the router on %s\n", ROUTER);
+		return 1;
+	}
+	pthread_create(&t, NULL, serve, s);
+	pthread_create(&rt, NULL, route, r);
+
+	errors += roundTrip();
+	errors += coalesce(r);
+	errors += limit(r);
+	errors += transports();
+	errors += linkLoss(&s, &t);
+
+	ADSrouterStop(r);
+	pthread_join(rt, &rc);
+	ADSrouterGetStats(r, &st);
+	printf("router: %llu requests, %llu responses, %llu failed, "
+		   "%llu expired, %llu strays\n",
+		   (unsigned long long) st.requests,
+		   (unsigned long long) st.responses,
+		   (unsigned long long) st.failed,
+		   (unsigned long long) st.expired,
+		   (unsigned long long) st.strays);
+	if (rc != NULL || st.expired != 0)
+		errors++;
+	ADSrouterFree(r);
+	ADSserverStop(s);
+	pthread_join(t, &rc);
+	ADSserverFree(s);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
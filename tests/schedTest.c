@@ -0,0 +1,251 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Runs the polling scheduler against a server on the loopback that counts
+ * what reaches it. Items are read at their periods; the ones due together
+ * go out in one sum read, neighbours merged into one span, and each gets
+ * its slice or the error of its own span. A device without sum reads gets
+ * single reads from then on. Items still on the way when they fall due
+ * again count as overruns.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_sched.h"
+#include "ads_server.h"
+#include "testUtil.h"
+
+#define ADDRESS		"127.0.0.1:48999"
+#define PERIOD		20				// ms
+#define SLOW		(3 * PERIOD)	// ms a read of 0x4022 takes
+
+static unsigned char mem[256];		// index group 0x4020
+static int plain, merged, sums, minSpans = 1000, maxSpans, noSum;
+
+static int memory(ADSServerRequest *rq, void *user)
+{
+	if (rq->header.commandId != cmdADSread)
+		return 0x701;
+	if (rq->indexGroup == 0x4022) {
+		usleep(SLOW * 1000);
+		return 0;
+	}
+	if (rq->indexOffset > sizeof(mem)
+		|| rq->outLength > sizeof(mem) - rq->indexOffset)
+		return 0x703;
+	__atomic_add_fetch(&plain, 1, __ATOMIC_SEQ_CST);
+	if (rq->indexOffset == 0 && rq->outLength == 12)
+		__atomic_add_fetch(&merged, 1, __ATOMIC_SEQ_CST);
+	memcpy(rq->out, mem + rq->indexOffset, rq->outLength);
+	return 0;
+}
+
+/* the addresses in, a result for each, then their data */
+static int sum(ADSServerRequest *rq, void *user)
+{
+	const ADSreadRequest *a = (const ADSreadRequest *) rq->data;
+	uint32_t *codes = (uint32_t *) rq->out;
+	unsigned char *d = rq->out + 4 * rq->indexOffset;
+	uint32_t i, n = rq->indexOffset;
+
+	if (noSum)
+		return 0x701;
+	if (rq->header.commandId != cmdADSreadWrite
+		|| rq->length != n * sizeof(*a))
+		return 0x705;
+	__atomic_add_fetch(&sums, 1, __ATOMIC_SEQ_CST);
+	if ((int) n < minSpans)
+		minSpans = n;
+	if ((int) n > maxSpans)
+		maxSpans = n;
+	for (i = 0; i < n; i++) {
+		if (a[i].indexGroup == 0x4020
+			&& a[i].indexOffset + a[i].length <= sizeof(mem)) {
+			codes[i] = 0;
+			memcpy(d, mem + a[i].indexOffset, a[i].length);
+		}
+		else {
+			codes[i] = 0x702;
+			memset(d, 0, a[i].length);
+		}
+		d += a[i].length;
+	}
+	rq->outLength = d - rq->out;
+	return 0;
+}
+
+typedef struct {
+	int		polls;
+	int		errors;
+	int		lastError;
+	int		bad;				// data not what the device has
+	uint32_t offset;
+} Item;
+
+static void polled(void *user, int result, const void *data, uint32_t length)
+{
+	Item *it = (Item *) user;
+
+	if (result != 0) {
+		it->errors++;
+		it->lastError = result;
+		return;
+	}
+	it->polls++;
+	if (it->offset < sizeof(mem)
+		&& memcmp(data, mem + it->offset, length) != 0)
+		it->bad++;
+}
+
+/* runs s for ms milliseconds */
+static void runFor(ADSScheduler *s, int ms)
+{
+	plain = merged = sums = 0;
+	ADSschedStart(s);
+	usleep(ms * 1000);
+	ADSschedStop(s);
+}
+
+static int run(ADSConnection *dc)
+{
+	Item a = { 0 }, b = { 0 }, c = { 0 }, d = { 0 }, e = { 0 };
+	int errors = 0, id[5], i, bad;
+	ADSSchedStats st;
+	ADSPollStats ps;
+	ADSScheduler *s;
+
+	for (i = 0; i < (int) sizeof(mem); i++)
+		mem[i] = i;
+	s = ADSschedNew();
+	if (s == NULL)
+		return 1;
+	a.offset = 0;
+	b.offset = 8;
+	c.offset = 200;
+	d.offset = sizeof(mem);
+	ADSschedAdd(s, dc, 0x4020, 0, 4, PERIOD, polled, &a, &id[0]);
+	ADSschedAdd(s, dc, 0x4020, 8, 4, PERIOD, polled, &b, &id[1]);
+	ADSschedAdd(s, dc, 0x4020, 200, 4, 2 * PERIOD, polled, &c, &id[2]);
+	ADSschedAdd(s, dc, 0x4021, 0, 4, 2 * PERIOD, polled, &d, &id[3]);
+
+	// every PERIOD a and b in one span, every other with c and d as well
+	runFor(s, 20 * PERIOD + PERIOD / 2);
+	errors += checkRange("period: polls", a.polls, 19, 22);
+	errors += checkRange("  twice the period", c.polls, 9, 12);
+	errors += check("  wrong data", a.bad + b.bad + c.bad, 0);
+	errors += checkRange("sum reads", sums, 9, 12);
+	errors += check("  least spans", minSpans, 3);
+	errors += check("  most spans", maxSpans, 3);
+	errors += checkRange("plain reads", plain, 9, 12);
+	// the first one is of a only: b added after it falls due a period later
+	errors += checkRange("  of a and b merged", merged, plain - 1, plain);
+	errors += check("error of its span", d.polls, 0);
+	errors += checkRange("  times", d.errors, 9, 12);
+	errors += checkHex("  which", d.lastError, 0x702);
+	errors += check("  others failed", a.errors + b.errors + c.errors, 0);
+	ADSschedGetStats(s, &st);
+	errors += check("stats requests", (int) st.requests, sums + plain);
+	errors += check("  sum reads", (int) st.sumReads, sums);
+	errors += check("  polls", (int) st.polls, a.polls + b.polls + c.polls);
+	errors += check("  errors", (int) st.errors, d.errors);
+	ADSschedGetItemStats(s, id[0], &ps);
+	errors += check("item stats polls", (int) ps.polls, a.polls);
+	ADSschedGetItemStats(s, id[3], &ps);
+	errors += check("  errors", (int) ps.errors, d.errors);
+
+	// the device refuses sum reads: single ones
+	noSum = 1;
+	a.polls = c.polls = d.errors = 0;
+	runFor(s, 10 * PERIOD + PERIOD / 2);
+	errors += check("no sum: sum reads", sums, 0);
+	errors += checkRange("  polls", a.polls, 9, 12);
+	errors += checkRange("  twice the period", c.polls, 4, 7);
+	errors += checkRange("  errors", d.errors, 4, 7);
+	errors += check("  wrong data", a.bad + b.bad + c.bad, 0);
+	noSum = 0;
+
+	// a read taking longer than the period
+	for (i = bad = 0; i < 4; i++)
+		bad += ADSschedRemove(s, id[i]) != 0;
+	errors += check("removed all but", bad, 0);
+	errors += checkHex("  again", ADSschedRemove(s, id[0]), 0x741);
+	e.offset = sizeof(mem);
+	ADSschedAdd(s, dc, 0x4022, 0, 4, PERIOD, polled, &e, &id[4]);
+	runFor(s, 10 * PERIOD + PERIOD / 2);
+	ADSschedGetItemStats(s, id[4], &ps);
+	errors += checkRange("slow: polls", e.polls, 3, 5);
+	errors += checkRange("  overruns", (int) ps.overruns, 5, 8);
+	errors += check("  other reads", plain + sums, 0);
+
+	ADSschedFree(s);
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	AmsAddr a = { { { 127, 0, 0, 1, 1, 1 } }, 851 };
+	int errors = 0, e;
+	ADSConnection *dc;
+	ADSServer *s;
+	pthread_t t;
+	void *rc;
+
+	if (routeTo(ADDRESS))
+		return 1;
+	s = ADSserverNew(ADDRESS, 2);
+	if (s == NULL) {
+		printf("cannot listen on %s\n", ADDRESS);
+		return 1;
+	}
+	ADSserverOnGroups(s, 0x4020, 0x4020, memory, NULL);
+	ADSserverOnGroups(s, 0x4022, 0x4022, memory, NULL);
+	ADSserverOnGroups(s, ADSIGRP_SUMUP_READ, ADSIGRP_SUMUP_READ, sum, NULL);
+	pthread_create(&t, NULL, serve, s);
+
+	dc = ADSsocketConnect(&a, &e);
+	if (dc == NULL) {
+		printf("cannot connect: 0x%x\n", e);
+		return 1;
+	}
+	errors += run(dc);
+
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	ADSserverStop(s);
+	pthread_join(t, &rc);
+	ADSserverFree(s);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1,210 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.  
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Runs clients against a server on the loopback, each on a connection of
+ * its own: what one writes it must read back, a readWrite gives the data
+ * before it, a group without handler fails. Then the same with a slow
+ * handler, so the workers fall behind and the clients get paused.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_server.h"
+#include "testUtil.h"
+
+#define ADDRESS		"127.0.0.1:48990"
+#define CLIENTS		32
+#define LOOPS		200
+#define FLOOD		(4 * ADS_SERVER_PENDING)	// reads sent at once
+
+static unsigned char mem[CLIENTS * 4];
+static pthread_mutex_t memLock = PTHREAD_MUTEX_INITIALIZER;
+static int slow;
+
+static int memory(ADSServerRequest *rq, void *user)
+{
+	if (rq->indexOffset > sizeof(mem)
+		|| rq->length > sizeof(mem) - rq->indexOffset
+		|| rq->outLength > sizeof(mem) - rq->indexOffset)
+		return 0x703;
+	if (slow)
+		usleep(1000);
+	pthread_mutex_lock(&memLock);
+	if (rq->header.commandId == cmdADSreadWrite)
+		memcpy(rq->out, mem + rq->indexOffset, rq->outLength);
+	memcpy(mem + rq->indexOffset, rq->data, rq->length);
+	if (rq->header.commandId == cmdADSread)
+		memcpy(rq->out, mem + rq->indexOffset, rq->outLength);
+	pthread_mutex_unlock(&memLock);
+	return 0;
+}
+
+static void *client(void *arg)
+{
+	AmsAddr a = { { { 127, 0, 0, 1, 1, 1 } }, 851 };
+	int id = (int)(long) arg, i, v, w, old, errors = 0, e;
+	uint32_t n;
+	ADSConnection *dc;
+
+	dc = ADSsocketConnect(&a, &e);
+	if (dc == NULL) {
+		printf("client %d: cannot connect: 0x%x\n", id, e);
+		return (void *) 1L;
+	}
+	for (i = 0; i < LOOPS; i++) {
+		v = id * 100000 + i;
+		if (ADSwriteBytes(dc, 0x4020, id * 4, 4, &v) != 0
+			|| ADSreadBytes(dc, 0x4020, id * 4, 4, &w, &n) != 0
+			|| w != v || n != 4)
+			errors++;
+		w = -v;
+		if (ADSreadWriteBytes(dc, 0x4020, id * 4, 4, &old, 4, &w, &n) != 0
+			|| old != v)
+			errors++;
+	}
+	if (ADSreadBytes(dc, 0x4021, 0, 4, &w, &n) != 0x702)
+		errors++;
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	if (errors)
+		printf("client %d: %d errors\n", id, errors);
+	return (void *)(long) errors;
+}
+
+/*
+ * Sends FLOOD reads before it reads any answer, more than the server
+ * takes from a client at once; all of them must be answered.
+ */
+static void *flood(void *arg)
+{
+	struct {
+		AMS_TCPheader	tcp;
+		AMSheader		ams;
+		ADSreadRequest	rq;
+	} __attribute__((packed)) p;
+	unsigned char seen[FLOOD], answer[sizeof(AMS_TCPheader)
+									 + sizeof(AMSheader) + 12];
+	struct sockaddr_in addr;
+	AMSheader *h = (AMSheader *)(answer + sizeof(AMS_TCPheader));
+	long errors = 0;
+	int fd, i;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	ADSparseAddress(ADDRESS, 0, &addr);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		close(fd);
+		return (void *) 1L;
+	}
+	memset(&p, 0, sizeof(p));
+	memset(seen, 0, sizeof(seen));
+	p.tcp.length = sizeof(AMSheader) + sizeof(ADSreadRequest);
+	p.ams.targetPort = 851;
+	p.ams.commandId = cmdADSread;
+	p.ams.stateFlags = sfAMScommand;
+	p.ams.dataLength = sizeof(ADSreadRequest);
+	p.rq.indexGroup = 0x4020;
+	p.rq.length = 4;
+	for (i = 0; i < FLOOD; i++) {
+		p.ams.invokeId = i;
+		if (send(fd, &p, sizeof(p), 0) != sizeof(p))
+			errors++;
+	}
+	for (i = 0; i < FLOOD; i++) {
+		if (recv(fd, answer, sizeof(answer), MSG_WAITALL) != sizeof(answer)
+			|| h->invokeId >= FLOOD || seen[h->invokeId]++) {
+			errors++;
+			break;
+		}
+	}
+	close(fd);
+	if (errors)
+		printf("flood: %ld errors\n", errors);
+	return (void *) errors;
+}
+
+static int run(int workers)
+{
+	pthread_t t, c[CLIENTS + 1];
+	ADSServerStats st;
+	ADSServer *s;
+	void *rc;
+	long errors = 0;
+	int i;
+
+	s = ADSserverNew(ADDRESS, workers);
+	if (s == NULL) {
+		printf("cannot listen on %s\n", ADDRESS);
+		return 1;
+	}
+	ADSserverOnGroups(s, 0x4020, 0x4020, memory, NULL);
+	pthread_create(&t, NULL, serve, s);
+	for (i = 0; i < CLIENTS; i++)
+		pthread_create(&c[i], NULL, client, (void *)(long) i);
+	pthread_create(&c[CLIENTS], NULL, flood, NULL);
+	for (i = 0; i <= CLIENTS; i++) {
+		pthread_join(c[i], &rc);
+		errors += (long) rc;
+	}
+	ADSserverStop(s);
+	pthread_join(t, &rc);
+	ADSserverGetStats(s, &st);
+	printf("%2d workers%s: %llu requests, %llu errors, %llu unhandled, "
+		   "%llu paused\n", workers, slow ? ", slow" : "",
+		   (unsigned long long) st.requests, (unsigned long long) st.errors,
+		   (unsigned long long) st.unhandled,
+		   (unsigned long long) st.paused);
+	if (rc != NULL || st.requests != st.responses
+		|| st.unhandled != CLIENTS)
+		errors++;
+	ADSserverFree(s);
+	return errors != 0;
+}
+
+int main(int argc, char **argv)
+{
+	int errors = 0;
+
+	if (routeTo(ADDRESS))
+		return 1;
+	errors += run(0);
+	errors += run(4);
+	slow = 1;
+	errors += run(2);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
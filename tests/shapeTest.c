@@ -0,0 +1,141 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Runs the token buckets of a device on a simulated clock: a burst passes
+ * at once, the rest is queued at exactly the rate, an idle bucket fills
+ * up to its depth only. With the fail policy requests over budget are
+ * refused instead. Big reads are held back by the byte budget, other
+ * devices and ports are not shaped at all.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_shape.h"
+#include "testUtil.h"
+
+#define MS			1000000LL	// ns
+#define START		(1000 * MS)
+
+static struct {
+	ADSpacket		p;
+	unsigned char	room[sizeof(ADSreadRequest)];
+} q;
+
+static AmsAddr device = { { { 10, 1, 2, 3, 1, 1 } }, 851 };
+
+/* admits a read of length bytes at now, its delay in ms or -1 if refused */
+static double admit(AmsAddr *a, uint32_t length, int64_t now)
+{
+	ADSreadRequest *rd = (ADSreadRequest *) q.p.data;
+	int64_t notBefore;
+
+	q.p.amsHeader.commandId = cmdADSread;
+	q.p.amsHeader.dataLength = sizeof(ADSreadRequest);
+	q.p.adsHeader.length = sizeof(AMSheader) + sizeof(ADSreadRequest);
+	rd->length = length;
+	if (_ADSshapeAdmit(&a->netId, a->port, &q.p, now, &notBefore) != 0)
+		return -1;
+	return notBefore == 0 ? 0 : (double)(notBefore - now) / MS;
+}
+
+int main(void)
+{
+	AmsAddr other = device;
+	ADSShapeStats st;
+	int errors = 0, i, at = 0, refused = 0;
+	double d, last = 0;
+
+	errors += checkRange("no shaper", admit(&device, 4, START), 0, 0);
+
+	// 100 requests/s, 10 of them at once
+	ADSshapeSet(&device, 100, 0, 100, ADS_SHAPE_QUEUE);
+	for (i = 0; i < 50; i++) {
+		d = admit(&device, 4, START);
+		if (d == 0)
+			at++;
+		else if (d - last < 9.99 || d - last > 10.01)
+			errors += checkRange("  queued 10 ms apart", d - last, 10, 10);
+		last = d;
+	}
+	errors += checkRange("burst passed", at, 10, 10);
+	errors += checkRange("last of 50 queued, ms", last, 400, 400);
+
+	// idle for long: back to the depth, no more
+	at = 0;
+	for (i = 0; i < 20; i++)
+		if (admit(&device, 4, START + 10000 * MS) == 0)
+			at++;
+	errors += checkRange("passed after idle", at, 10, 10);
+	ADSshapeGetStats(&device, &st);
+	errors += checkRange("stats passed", st.passed, 20, 20);
+	errors += checkRange("stats delayed", st.delayed, 50, 50);
+
+	// the fail policy refuses instead of queueing
+	ADSshapeSet(&device, 100, 0, 100, ADS_SHAPE_FAIL);
+	for (i = 0; i < 20; i++)
+		if (admit(&device, 4, START) < 0)
+			refused++;
+	errors += checkRange("refused", refused, 10, 10);
+	errors += checkRange("passes 10 ms later",
+						 admit(&device, 4, START + 10 * MS), 0, 0);
+	errors += checkRange("not the one after",
+						 admit(&device, 4, START + 10 * MS), -1, -1);
+	ADSshapeGetStats(&device, &st);
+	errors += checkRange("stats rejected", st.rejected, 11, 11);
+
+	// 100000 bytes/s: once the bucket is empty big reads wait for theirs,
+	// a read of 1000 bytes costs 1050 with its packet
+	ADSshapeSet(&device, 0, 100000, 0, ADS_SHAPE_QUEUE);
+	for (i = 0, d = 0; i < 100 && d == 0; i++)
+		d = admit(&device, 1000, START);
+	errors += checkRange("big reads at once", i - 1, 2 * MAXDATALEN / 1050,
+						 2 * MAXDATALEN / 1050);
+	last = admit(&device, 1000, START);
+	errors += checkRange("next big read later, ms", last - d, 10.49, 10.51);
+	errors += checkRange("small read after it, ms",
+						 admit(&device, 4, START) - last, 0.53, 0.55);
+
+	// not for another port or device
+	other.port = 852;
+	errors += checkRange("other port", admit(&other, 1000, START), 0, 0);
+	other = device;
+	other.netId.b[3] = 4;
+	errors += checkRange("other device", admit(&other, 1000, START), 0, 0);
+
+	// no limit at all
+	ADSshapeSet(&device, 0, 0, 0, ADS_SHAPE_QUEUE);
+	for (i = 0, d = 0; i < 1000; i++)
+		d += admit(&device, 1000, START);
+	errors += checkRange("unlimited", d, 0, 0);
+
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1,248 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+ * Runs variables kept current by notifications against a server on the
+ * loopback that counts what reaches it. The server sends no samples, they
+ * are handed to the connection as its receive thread would: once one came
+ * reads of the variable or parts of it, from any connection to the device,
+ * are answered from it. A write makes them go to the device until the next
+ * sample or a read of the whole variable, and so does the end of the
+ * subscription or the link.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_cache.h"
+#include "ads_connect.h"
+#include "ads_notify.h"
+#include "ads_server.h"
+#include "testUtil.h"
+
+#define ADDRESS		"127.0.0.1:48997"
+
+static int mem[64];						// index group 0x4020
+static pthread_mutex_t memLock = PTHREAD_MUTEX_INITIALIZER;
+static int reads, adds, dels;
+static uint32_t handle;					// of the last subscription
+
+static int memory(ADSServerRequest *rq, void *user)
+{
+	unsigned char *m = (unsigned char *) mem;
+
+	if (rq->indexOffset > sizeof(mem)
+		|| rq->length > sizeof(mem) - rq->indexOffset
+		|| rq->outLength > sizeof(mem) - rq->indexOffset)
+		return 0x703;
+	pthread_mutex_lock(&memLock);
+	memcpy(m + rq->indexOffset, rq->data, rq->length);
+	if (rq->header.commandId == cmdADSread) {
+		reads++;
+		memcpy(rq->out, m + rq->indexOffset, rq->outLength);
+	}
+	pthread_mutex_unlock(&memLock);
+	return 0;
+}
+
+static int addNote(ADSServerRequest *rq, void *user)
+{
+	__atomic_add_fetch(&adds, 1, __ATOMIC_SEQ_CST);
+	*(uint32_t *) rq->out = __atomic_add_fetch(&handle, 1, __ATOMIC_SEQ_CST);
+	rq->outLength = 4;
+	return 0;
+}
+
+static int delNote(ADSServerRequest *rq, void *user)
+{
+	__atomic_add_fetch(&dels, 1, __ATOMIC_SEQ_CST);
+	rq->outLength = 0;
+	return 0;
+}
+
+/* reads 4 bytes, returns them, -1 on error */
+static int get(ADSConnection *dc, uint32_t offset)
+{
+	uint32_t n;
+	int v;
+
+	if (ADSreadBytes(dc, 0x4020, offset, 4, &v, &n) != 0 || n != 4)
+		return -1;
+	return v;
+}
+
+/* the reads the device saw since the last call */
+static int seen(void)
+{
+	static int last;
+	int n;
+
+	pthread_mutex_lock(&memLock);
+	n = reads - last;
+	last = reads;
+	pthread_mutex_unlock(&memLock);
+	return n;
+}
+
+/* a sample of the 8 bytes at 0x4020:0, as the device would send it */
+static void sample(ADSConnection *dc, int a, int b)
+{
+	static ADSpacket p;
+	unsigned char *d = (unsigned char *) p.data;
+	uint32_t u[] = { 32, 1, 0, 0, 1, handle, 8 };
+	uint64_t timeStamp = 1;
+
+	memcpy(d, u, 8);
+	memcpy(d + 8, &timeStamp, 8);
+	memcpy(d + 16, u + 4, 12);
+	memcpy(d + 28, &a, 4);
+	memcpy(d + 32, &b, 4);
+	p.amsHeader.commandId = cmdADSdevNotify;
+	p.amsHeader.dataLength = 36;
+	p.adsHeader.length = sizeof(AMSheader) + 36;
+	_ADSnotifyDispatch(dc, &p, NULL);
+}
+
+static int run(ADSConnection *dc, ADSConnection *dc2)
+{
+	ADSCacheStats st;
+	uint32_t n;
+	int errors = 0, v[2];
+
+	errors += check("subscribe", ADScacheSubscribe(dc, 0x4020, 0, 8, 10), 0);
+	errors += check("  again", ADScacheSubscribe(dc, 0x4020, 0, 8, 10), 0);
+	errors += check("  device subscriptions", adds, 1);
+	ADScacheGetStats(&st);
+	errors += check("  stats subscriptions", st.subscriptions, 1);
+
+	// nothing to answer from before the first sample
+	get(dc, 4);
+	errors += check("no sample: device reads", seen(), 1);
+	sample(dc, 100, 200);
+	errors += check("sample: value", get(dc, 0), 100);
+	errors += check("  its second half", get(dc, 4), 200);
+	errors += check("  other connection", get(dc2, 0), 100);
+	errors += check("  device reads", seen(), 0);
+	sample(dc, 300, 200);
+	errors += check("next sample: value", get(dc, 0), 300);
+	errors += check("  device reads", seen(), 0);
+	ADScacheGetStats(&st);
+	errors += check("  stats samples", (int) st.samples, 2);
+	errors += check("  stats push hits", (int) st.pushHits, 4);
+
+	// a write: the sample is older than the device now
+	v[0] = 555;
+	ADSwriteBytes(dc2, 0x4020, 0, 4, v);
+	errors += check("write: value", get(dc, 0), 555);
+	errors += check("  device reads", seen(), 1);
+	sample(dc, 555, 200);
+	get(dc, 0);
+	errors += check("sample after it: device reads", seen(), 0);
+	v[0] = 666;
+	ADSwriteBytes(dc, 0x4020, 4, 4, v);
+	ADSreadBytes(dc, 0x4020, 0, 8, v, &n);
+	errors += check("whole read after a write", v[1], 666);
+	errors += check("  answers the next", get(dc2, 4), 666);
+	errors += check("  device reads", seen(), 1);
+
+	// not kept current any more
+	errors += check("unsubscribe", ADScacheUnsubscribe(dc, 0x4020, 0, 8), 0);
+	errors += check("  device unsubscriptions", dels, 1);
+	errors += check("  again", ADScacheUnsubscribe(dc, 0x4020, 0, 8), 0x741);
+	get(dc, 0);
+	errors += check("  device reads", seen(), 1);
+	ADScacheGetStats(&st);
+	errors += check("  stats subscriptions", st.subscriptions, 0);
+
+	errors += check("subscribe anew", ADScacheSubscribe(dc, 0x4020, 0, 8, 10),
+					0);
+	errors += check("  device subscriptions", adds, 2);
+	sample(dc, 777, 200);
+	errors += check("  value", get(dc, 0), 777);
+	errors += check("  device reads", seen(), 0);
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	AmsAddr a = { { { 127, 0, 0, 1, 1, 1 } }, 851 };
+	int errors = 0, e, i, v;
+	ADSConnection *dc, *dc2;
+	ADSCacheStats st;
+	uint64_t hits;
+	ADSServer *s;
+	pthread_t t;
+	uint32_t n;
+	void *rc;
+
+	if (routeTo(ADDRESS))
+		return 1;
+	s = ADSserverNew(ADDRESS, 2);
+	if (s == NULL) {
+		printf("cannot listen on %s\n", ADDRESS);
+		return 1;
+	}
+	ADSserverOnGroups(s, 0x4020, 0x4020, memory, NULL);
+	ADSserverOn(s, cmdADSaddDeviceNotification, addNote, NULL);
+	ADSserverOn(s, cmdADSdeleteDeviceNotification, delNote, NULL);
+	pthread_create(&t, NULL, serve, s);
+
+	dc = ADSsocketConnect(&a, &e);
+	dc2 = ADSsocketConnect(&a, &e);
+	if (dc == NULL || dc2 == NULL) {
+		printf("cannot connect: 0x%x\n", e);
+		return 1;
+	}
+	errors += run(dc, dc2);
+
+	// the link fails: the last sample is not handed out any more
+	ADSserverStop(s);
+	pthread_join(t, &rc);
+	ADSserverFree(s);
+	for (i = 0; i < 100 && get(dc, 0) == 777; i++)
+		usleep(10000);
+	ADScacheGetStats(&st);
+	hits = st.pushHits;
+	errors += check("link failed: read",
+					ADSreadBytes(dc, 0x4020, 0, 4, &v, &n), 0x50a);
+	ADScacheGetStats(&st);
+	errors += check("  push hits", (int)(st.pushHits - hits), 0);
+	errors += check("unsubscribe", ADScacheUnsubscribe(dc, 0x4020, 0, 8), 0);
+
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	ADSsocketDisconnect(dc2);
+	ADSFreeConnection(dc2);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1,253 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_route.h"
+#include "ads_server.h"
+#include "testUtil.h"
+
+static int _checked(int failed)
+{
+	if (failed)
+		printf("  FAILED\n");
+	return failed;
+}
+
+/* 1 if got is not want */
+int check(const char *name, int got, int want)
+{
+	printf("%-32s %11d (%d)\n", name, got, want);
+	return _checked(got != want);
+}
+
+/* the same for ADS error codes */
+int checkHex(const char *name, int got, int want)
+{
+	printf("%-32s 0x%x (0x%x)\n", name, got, want);
+	return _checked(got != want);
+}
+
+/* 1 if got is not within lo .. hi */
+int checkRange(const char *name, double got, double lo, double hi)
+{
+	printf("%-32s %11.1f (%.1f..%.1f)\n", name, got, lo, hi);
+	return _checked(got < lo || got > hi);
+}
+
+/*
+ * Routes TEST_NETID to address, a server on the loopback. The route file
+ * is gone again when this returns, the routes are kept in memory.
+ * Returns 0, or 1 and says why.
+ */
+int routeTo(const char *address)
+{
+	char path[] = "/tmp/testRouteXXXXXX", line[64];
+	int fd = mkstemp(path), rc;
+
+	snprintf(line, sizeof(line), TEST_NETID " %s\n", address);
+	rc = fd < 0 || write(fd, line, strlen(line)) < 0 || ADSrouteLoad(path);
+	if (fd >= 0) {
+		close(fd);
+		unlink(path);
+	}
+	if (rc)
+		printf("cannot set up the route to %s\n", address);
+	return rc != 0;
+}
+
+/* runs server until ADSserverStop(), for pthread_create() */
+void *serve(void *server)
+{
+	return (void *)(long) ADSserverRun((ADSServer *) server);
+}
+
+/* reads exactly length bytes, 0 or -1 */
+static int _readAll(int fd, void *buffer, uint32_t length)
+{
+	unsigned char *b = (unsigned char *) buffer;
+	ssize_t n;
+
+	while (length > 0) {
+		n = read(fd, b, length);
+		if (n <= 0)
+			return -1;
+		b += n;
+		length -= n;
+	}
+	return 0;
+}
+
+/* d->lock held: writes the whole packet p to the client, 0 or -1 */
+static int _deviceWrite(TestDevice *d, ADSpacket *p)
+{
+	uint32_t length = sizeof(AMS_TCPheader) + p->adsHeader.length;
+
+	return d->fd < 0 || write(d->fd, p, length) != length ? -1 : 0;
+}
+
+/* the answer to the request p, in place */
+static void _deviceAnswer(TestDevice *d, ADSpacket *p)
+{
+	AMSheader *h = &p->amsHeader;
+	AmsNetId id = h->targetId;
+	unsigned short port = h->targetPort;
+	uint32_t u[2] = { 0, 0 };
+
+	pthread_mutex_lock(&d->lock);
+	if (h->commandId == cmdADSaddDeviceNotification) {
+		d->adds++;
+		d->sub = *h;
+		u[1] = ++d->handle;
+		h->dataLength = 8;
+	}
+	else if (h->commandId == cmdADSdeleteDeviceNotification) {
+		d->dels++;
+		h->dataLength = 4;
+	}
+	else {
+		u[0] = 0x701;
+		h->dataLength = 4;
+	}
+	h->targetId = h->sourceId;
+	h->targetPort = h->sourcePort;
+	h->sourceId = id;
+	h->sourcePort = port;
+	h->stateFlags |= sfAMSresponse;
+	h->errorCode = 0;
+	memcpy(p->data, u, h->dataLength);
+	p->adsHeader.length = sizeof(AMSheader) + h->dataLength;
+	_deviceWrite(d, p);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void *_deviceRun(void *arg)
+{
+	TestDevice *d = (TestDevice *) arg;
+	ADSpacket p;
+	int fd;
+
+	while ((fd = accept(d->listenFd, NULL, NULL)) >= 0) {
+		pthread_mutex_lock(&d->lock);
+		d->fd = fd;
+		pthread_mutex_unlock(&d->lock);
+		while (_readAll(fd, &p.adsHeader, sizeof(AMS_TCPheader)) == 0
+			   && p.adsHeader.length >= sizeof(AMSheader)
+			   && p.adsHeader.length <= sizeof(AMSheader) + MAXDATALEN
+			   && _readAll(fd, &p.amsHeader, p.adsHeader.length) == 0)
+			_deviceAnswer(d, &p);
+		pthread_mutex_lock(&d->lock);
+		d->fd = -1;
+		pthread_mutex_unlock(&d->lock);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* a device listening on address, or NULL and says why */
+TestDevice *deviceNew(const char *address)
+{
+	TestDevice *d = (TestDevice *) calloc(1, sizeof(TestDevice));
+	struct sockaddr_in addr;
+	int opt = 1;
+
+	if (d == NULL || ADSparseAddress(address, ROUTER_PORT, &addr) != 0) {
+		free(d);
+		return NULL;
+	}
+	d->fd = -1;
+	d->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(d->listenFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	if (d->listenFd < 0
+		|| bind(d->listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+		|| listen(d->listenFd, 4) != 0) {
+		printf("cannot listen on %s\n", address);
+		if (d->listenFd >= 0)
+			close(d->listenFd);
+		free(d);
+		return NULL;
+	}
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_create(&d->thread, NULL, _deviceRun, d);
+	return d;
+}
+
+/*
+ * Sends a sample of handle in a notification of its own, to where the
+ * last subscription came from. Returns 0, or -1 if there is no client.
+ */
+int deviceSend(TestDevice *d, uint32_t handle, uint64_t timeStamp,
+			   const void *data, uint32_t size)
+{
+	ADSpacket p;
+	unsigned char *b = (unsigned char *) p.data;
+	uint32_t u[] = { 24 + size, 1, 1, handle, size };
+	int rc;
+
+	if (size > MAXDATALEN - 28)
+		return -1;
+	pthread_mutex_lock(&d->lock);
+	p.amsHeader.targetId = d->sub.sourceId;
+	p.amsHeader.targetPort = d->sub.sourcePort;
+	p.amsHeader.sourceId = d->sub.targetId;
+	p.amsHeader.sourcePort = d->sub.targetPort;
+	p.amsHeader.commandId = cmdADSdevNotify;
+	p.amsHeader.stateFlags = sfAMScommand;
+	p.amsHeader.dataLength = 28 + size;
+	p.amsHeader.errorCode = 0;
+	p.amsHeader.invokeId = 0;
+	p.adsHeader.reserved = 0;
+	p.adsHeader.length = sizeof(AMSheader) + p.amsHeader.dataLength;
+	memcpy(b, u, 8);
+	memcpy(b + 8, &timeStamp, 8);
+	memcpy(b + 16, u + 2, 12);
+	memcpy(b + 28, data, size);
+	rc = _deviceWrite(d, &p);
+	pthread_mutex_unlock(&d->lock);
+	return rc;
+}
+
+/* drops the client and stops listening */
+void deviceFree(TestDevice *d)
+{
+	shutdown(d->listenFd, SHUT_RDWR);
+	pthread_mutex_lock(&d->lock);
+	if (d->fd >= 0)
+		shutdown(d->fd, SHUT_RDWR);
+	pthread_mutex_unlock(&d->lock);
+	pthread_join(d->thread, NULL);
+	close(d->listenFd);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
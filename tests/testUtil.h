@@ -0,0 +1,69 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * What the tests share: checks that print what they got and what they
+ * want, the setup of a server on the loopback and a device that sends
+ * samples.
+ */
+
+#ifndef __TEST_UTIL_H__
+#define __TEST_UTIL_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+
+#define TEST_NETID	"127.0.0.1.1.1"		// the device the tests talk to
+
+/*
+ * A device that sends notification samples, which an ADSServer does not.
+ * It answers subscriptions with the handles 1, 2, .., their ends with 0
+ * and anything else with 0x701. Clients come one at a time.
+ */
+typedef struct {
+	int				listenFd;
+	int				fd;				// the client, -1 if none
+	pthread_t		thread;
+	pthread_mutex_t	lock;			// guards what follows and writes to fd
+	AMSheader		sub;			// of the last subscription, samples go
+									// back to where it came from
+	int				adds, dels;
+	uint32_t		handle;			// given out last
+} TestDevice;
+
+int check(const char *name, int got, int want);
+int checkHex(const char *name, int got, int want);
+int checkRange(const char *name, double got, double lo, double hi);
+int routeTo(const char *address);
+void *serve(void *server);
+TestDevice *deviceNew(const char *address);
+int deviceSend(TestDevice *d, uint32_t handle, uint64_t timeStamp,
+			   const void *data, uint32_t size);
+void deviceFree(TestDevice *d);
+
+#endif //__TEST_UTIL_H__
@@ -0,0 +1,252 @@
+/*
+ Implementation of BECKHOFF's ADS protocol.
+ ADS = Automation Device Specification
+ Implemented according to specifications given in TwinCAT Information System
+ May 2011.
+ TwinCAT, ADS and maybe other terms used herein are registered trademarks of
+ BECKHOFF Company. www.beckhoff.de
+
+ Copyright (C) Luis Matos (gass@otiliamatos.ath.cx) 2013.
+
+ This file is part of libads.
+ Libads is free software: you can redistribute it and/or modify
+ it under the terms of the Lesser GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ libads is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ Lesser GNU General Public License for more details.
+
+ You should have received a copy of the Lesser GNU General Public License
+ along with libads.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Runs a write queue against a server on the loopback that counts what
+ * reaches it: a burst of puts to one address sends the last one only,
+ * every put is told; of overlapping puts the later one wins; puts to
+ * places apart go out in one sum write, or as single writes once the
+ * device refuses those; an error reaches the puts it concerns only; and
+ * with a flush time nobody has to flush.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "AdsDEF.h"
+#include "ads.h"
+#include "ads_connect.h"
+#include "ads_server.h"
+#include "ads_wqueue.h"
+#include "testUtil.h"
+
+#define ADDRESS		"127.0.0.1:48994"
+#define BURST		100
+#define BAD			0x1000			// offsets from here on are refused
+
+static unsigned char mem[BAD];
+static int writes, sums, noSum;
+
+static int store(uint32_t offset, const unsigned char *data, uint32_t length)
+{
+	if (offset >= BAD || length > BAD - offset)
+		return 0x703;
+	memcpy(mem + offset, data, length);
+	return 0;
+}
+
+static int memory(ADSServerRequest *rq, void *user)
+{
+	if (rq->header.commandId != cmdADSwrite)
+		return 0x701;
+	__atomic_add_fetch(&writes, 1, __ATOMIC_SEQ_CST);
+	return store(rq->indexOffset, rq->data, rq->length);
+}
+
+/* the addresses, then their data; a result for each */
+static int sum(ADSServerRequest *rq, void *user)
+{
+	const ADSreadRequest *a = (const ADSreadRequest *) rq->data;
+	const unsigned char *d = rq->data + rq->indexOffset * sizeof(*a);
+	uint32_t *codes = (uint32_t *) rq->out;
+	uint32_t i;
+
+	if (noSum)
+		return 0x701;
+	if (rq->header.commandId != cmdADSreadWrite
+		|| rq->outLength != 4 * rq->indexOffset)
+		return 0x705;
+	__atomic_add_fetch(&sums, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < rq->indexOffset; i++) {
+		codes[i] = a[i].indexGroup == 0x4020
+			? store(a[i].indexOffset, d, a[i].length) : 0x702;
+		d += a[i].length;
+	}
+	return 0;
+}
+
+static int results[BURST], told;
+
+static void done(void *user, int result)
+{
+	results[(long) user] = result;
+	__atomic_add_fetch(&told, 1, __ATOMIC_SEQ_CST);
+}
+
+static void reset(void)
+{
+	int i;
+
+	for (i = 0; i < BURST; i++)
+		results[i] = -1;
+	told = writes = sums = 0;
+}
+
+static uint32_t at(uint32_t offset)
+{
+	uint32_t v;
+
+	memcpy(&v, mem + offset, 4);
+	return v;
+}
+
+static int run(ADSConnection *dc)
+{
+	ADSWriteQueueStats st;
+	ADSWriteQueue *q;
+	uint32_t v, big[4] = { 1, 2, 3, 4 };
+	int errors = 0, i, bad;
+
+	q = ADSwqueueNew(dc, 0);
+	if (q == NULL)
+		return 1;
+
+	// last writer wins, everybody is told
+	reset();
+	for (i = 0; i < BURST; i++) {
+		v = 1000 + i;
+		ADSwqueuePut(q, 0x4020, 0, 4, &v, done, (void *)(long) i);
+	}
+	ADSwqueueDrain(q);
+	errors += check("burst: requests", writes + sums, 1);
+	errors += check("burst: value", at(0), 1000 + BURST - 1);
+	errors += check("burst: told", told, BURST);
+	for (i = bad = 0; i < BURST; i++)
+		bad += results[i] != 0;
+	errors += check("burst: failed", bad, 0);
+	ADSwqueueGetStats(q, &st);
+	errors += check("burst: coalesced", (int) st.coalesced, BURST - 1);
+
+	// overlapping puts are merged, the later one wins where they overlap
+	reset();
+	v = 0xBBBBBBBB;
+	ADSwqueuePut(q, 0x4020, 20, 16, big, NULL, NULL);
+	ADSwqueuePut(q, 0x4020, 24, 4, &v, NULL, NULL);
+	v = 0xCCCCCCCC;
+	ADSwqueuePut(q, 0x4020, 32, 4, &v, NULL, NULL);
+	ADSwqueuePut(q, 0x4020, 28, 8, big, NULL, NULL);
+	ADSwqueueDrain(q);
+	errors += check("overlap: requests", writes + sums, 1);
+	errors += check("overlap: plain write", writes, 1);
+	errors += check("overlap: first", at(20), 1);
+	errors += check("overlap: later put", at(24), 0xBBBBBBBB);
+	errors += check("overlap: latest put", at(28), 1);
+	errors += check("overlap: its second", at(32), 2);
+
+	// apart: one sum write, an error for the one refused only
+	reset();
+	for (i = 0; i < 4; i++) {
+		v = 2000 + i;
+		ADSwqueuePut(q, 0x4020, 100 * i, 4, &v, done, (void *)(long) i);
+	}
+	ADSwqueuePut(q, 0x4020, BAD, 4, &v, done, (void *)(long) 4);
+	ADSwqueueDrain(q);
+	errors += check("apart: sum writes", sums, 1);
+	errors += check("apart: plain writes", writes, 0);
+	errors += check("apart: value", at(300), 2003);
+	for (i = bad = 0; i < 4; i++)
+		bad += results[i] != 0;
+	errors += check("apart: failed", bad, 0);
+	errors += check("apart: refused one", results[4], 0x703);
+
+	// the device does not know sum writes: single ones from now on
+	reset();
+	noSum = 1;
+	for (i = 0; i < 4; i++) {
+		v = 3000 + i;
+		ADSwqueuePut(q, 0x4020, 100 * i, 4, &v, done, (void *)(long) i);
+	}
+	ADSwqueueDrain(q);
+	errors += check("no sum: plain writes", writes, 4);
+	errors += check("no sum: value", at(300), 3003);
+	for (i = bad = 0; i < 4; i++)
+		bad += results[i] != 0;
+	errors += check("no sum: failed", bad, 0);
+	reset();
+	ADSwqueuePut(q, 0x4020, 0, 4, &v, NULL, NULL);
+	ADSwqueuePut(q, 0x4020, 100, 4, &v, NULL, NULL);
+	ADSwqueueDrain(q);
+	errors += check("no sum: not tried again", writes, 2);
+	noSum = 0;
+	ADSwqueueFree(q);
+
+	// with a flush time the queue goes out by itself
+	q = ADSwqueueNew(dc, 20);
+	if (q == NULL)
+		return errors + 1;
+	reset();
+	for (i = 0; i < 10; i++) {
+		v = 4000 + i;
+		ADSwqueuePut(q, 0x4020, 4 * i, 4, &v, done, (void *)(long) i);
+	}
+	for (i = 0; i < 100 && __atomic_load_n(&told, __ATOMIC_SEQ_CST) < 10; i++)
+		usleep(10000);
+	errors += check("timed: told", told, 10);
+	errors += check("timed: requests", writes + sums, 1);
+	errors += check("timed: value", at(36), 4009);
+	ADSwqueueFree(q);
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	AmsAddr a = { { { 127, 0, 0, 1, 1, 1 } }, 851 };
+	int errors = 0, e;
+	ADSConnection *dc;
+	ADSServer *s;
+	pthread_t t;
+	void *rc;
+
+	if (routeTo(ADDRESS))
+		return 1;
+	s = ADSserverNew(ADDRESS, 0);
+	if (s == NULL) {
+		printf("cannot listen on %s\n", ADDRESS);
+		return 1;
+	}
+	ADSserverOnGroups(s, 0x4020, 0x4020, memory, NULL);
+	ADSserverOnGroups(s, ADSIGRP_SUMUP_WRITE, ADSIGRP_SUMUP_WRITE, sum, NULL);
+	pthread_create(&t, NULL, serve, s);
+
+	dc = ADSsocketConnect(&a, &e);
+	if (dc == NULL) {
+		printf("cannot connect: 0x%x\n", e);
+		return 1;
+	}
+	errors += run(dc);
+
+	ADSsocketDisconnect(dc);
+	ADSFreeConnection(dc);
+	ADSserverStop(s);
+	pthread_join(t, &rc);
+	ADSserverFree(s);
+	if (errors)
+		printf("%d ERRORS\n", errors);
+	return errors != 0;
+}